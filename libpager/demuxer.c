@@ -19,6 +19,7 @@
 #include <error.h>
 #include <mach/mig_errors.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory_object_S.h"
@@ -28,27 +29,50 @@
 /*
   Worker pool for the server functions.
 
-  A single thread receives messages from the port bucket and puts them
-  into a queue.  A fixed number of consumers actually execute the
-  server functions and send the reply.
+  A single thread receives messages from the port bucket and hands
+  each one to a worker, which executes the server function and sends
+  the reply.
 
   The requests to an object O have to be processed in the order they
-  were received.  To this end, each worker has a local queue and a
-  tag.  If a thread processes a request to O, it sets its tag to a
-  unique identifier representing O.  If another thread now dequeues a
-  second request to O, it enqueues it to the first workers queue.
-
-  At least one worker thread is necessary.
+  were received.  To this end, each object belongs to one worker,
+  chosen by hashing its port, and each worker handles its requests in
+  order.  The receiving thread adds requests to the worker's queue
+  without locking (see struct mpsc_queue), and wakes the worker only
+  if it has gone to sleep for want of work.
+
+  Workers are started as the first request for one of their objects
+  arrives, up to pager_max_workers, and are never stopped.
+
+  REQUESTS->pending counts requests handed to workers and not yet
+  finished.  While the workers are inhibited, new requests are held
+  back on REQUESTS->held instead, and pager_inhibit_workers waits for
+  pending to drop to zero.  REQUESTS->lock is only taken to inhibit or
+  resume the workers, to hold requests back, and to start a worker.
 */
-#define WORKER_COUNT 1
+#define DEFAULT_MAX_WORKERS 8
+
+/* The most workers pager_start_workers may run for one bucket.  If
+   zero, the LIBPAGER_WORKERS environment variable, or else
+   DEFAULT_MAX_WORKERS.  */
+int pager_max_workers;
 
 /* An request contains the message received from the port set.  */
 struct request
 {
   struct item item;
   mig_routine_t routine;
+  mach_msg_size_t size;	/* room for the message */
 };
 
+/* Requests are recycled through a pool rather than malloc'd and freed
+   every time.  Pooled requests all have room for a message of
+   REQUEST_POOL_MSG_SIZE bytes, which covers every memory object
+   request (OOL data comes by reference).  Anything bigger is malloc'd
+   to fit and freed after use.  At most about REQUEST_POOL_MAX are
+   kept.  */
+#define REQUEST_POOL_MSG_SIZE	512
+#define REQUEST_POOL_MAX	64
+
 /* A struct request object is immediately followed by the received
    message.  */
 static inline mach_msg_header_t *
@@ -61,29 +85,147 @@ request_inp (const struct request *r)
 struct worker
 {
   struct pager_requests *requests;	/* our pagers request queue */
-  struct queue queue;	/* other workers may delegate requests to us */
-  unsigned long tag;	/* tag of the object we are working on */
+  struct mpsc_queue queue;	/* requests to the objects that hash to us */
+  int started;		/* set under REQUESTS->lock */
+  int sleeping;		/* waiting on WAKEUP for QUEUE to fill */
+  pthread_mutex_t lock;	/* only for sleeping and waking */
+  pthread_cond_t wakeup;
 };
 
-/* This is the queue for incoming requests.  A single thread receives
-   messages from the port set, looks the service routine up, and
-   enqueues the request here.  */
+/* The workers for a port bucket.  A single thread receives messages
+   from the port set, looks the service routine up, and hands the
+   request to the worker for its object.  */
 struct pager_requests
 {
   struct port_bucket *bucket;
-  /* Normally, both queues are the same.  However, when the workers are
-     inhibited, a new queue_in is created, but queue_out is left as the
-     old value, so the workers drain queue_out but do not receive new
-     requests.  */
-  struct queue *queue_in;	/* the queue to add to */
-  struct queue *queue_out;	/* the queue to take from */
-  int asleep;
-  pthread_cond_t wakeup;
+  int inhibited;	/* set and cleared under LOCK */
+  int pending;		/* requests given to workers and not finished */
+  struct queue held;	/* requests received while inhibited */
   pthread_cond_t inhibit_wakeup;
   pthread_mutex_t lock;
-  struct worker workers[WORKER_COUNT];
+  struct item *pool;	/* stack of free requests, see REQUEST_POOL_MSG_SIZE */
+  int pool_size;	/* about how many requests are in POOL */
+  struct item *cache;	/* free requests for the receiving thread alone */
+  int max_workers;	/* size of WORKERS */
+  struct worker *workers;
 };
 
+static void *worker_func (void *arg);
+
+/* Get a request with room for a message of SIZE bytes, from the pool
+   if we can.  Only called by the receiving thread, which takes the
+   whole pool at once when its own cache runs dry, so the pool never
+   has more than one thread taking from it.  */
+static struct request *
+alloc_request (struct pager_requests *requests, mach_msg_size_t size)
+{
+  struct request *r;
+
+  if (size <= REQUEST_POOL_MSG_SIZE)
+    {
+      if (requests->cache == NULL)
+	requests->cache = __atomic_exchange_n (&requests->pool, NULL,
+					       __ATOMIC_ACQUIRE);
+      r = (struct request *) requests->cache;
+      if (r != NULL)
+	{
+	  requests->cache = r->item.next;
+	  __atomic_sub_fetch (&requests->pool_size, 1, __ATOMIC_RELAXED);
+	  return r;
+	}
+      size = REQUEST_POOL_MSG_SIZE;
+    }
+
+  r = malloc (sizeof *r + size);
+  if (r != NULL)
+    r->size = size;
+  return r;
+}
+
+/* Return R, which may be NULL, to the pool, or free it.  */
+static void
+release_request (struct pager_requests *requests, struct request *r)
+{
+  if (r == NULL)
+    return;
+
+  if (r->size == REQUEST_POOL_MSG_SIZE
+      && __atomic_load_n (&requests->pool_size, __ATOMIC_RELAXED) < REQUEST_POOL_MAX)
+    {
+      struct item *top = __atomic_load_n (&requests->pool, __ATOMIC_RELAXED);
+
+      __atomic_add_fetch (&requests->pool_size, 1, __ATOMIC_RELAXED);
+      do
+	r->item.next = top;
+      while (! __atomic_compare_exchange_n (&requests->pool, &top, &r->item, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+  else
+    free (r);
+}
+
+/* The worker that handles requests to the object R was sent to.  */
+static struct worker *
+request_worker (struct pager_requests *requests, const struct request *r)
+{
+  unsigned long h = (unsigned long) request_inp (r)->msgh_local_port;
+
+  return &requests->workers[(h * 2654435761UL) % requests->max_workers];
+}
+
+/* Start worker W if it isn't running yet.  Call with REQUESTS->lock
+   held.  */
+static error_t
+start_worker (struct worker *w)
+{
+  pthread_t t;
+  error_t err;
+
+  if (w->started)
+    return 0;
+
+  err = pthread_create (&t, NULL, &worker_func, w);
+  if (err)
+    return err;
+  pthread_detach (t);
+
+  __atomic_store_n (&w->started, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Give R to worker W, and wake W if it's asleep.  The caller has
+   counted R in REQUESTS->pending.  */
+static void
+give_request (struct worker *w, struct request *r)
+{
+  mpsc_queue_enqueue (&w->queue, &r->item);
+
+  /* Pairs with the fence in worker_func: either we see that W is
+     going to sleep, or W sees R before it does.  */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n (&w->sleeping, __ATOMIC_RELAXED))
+    {
+      pthread_mutex_lock (&w->lock);
+      pthread_cond_signal (&w->wakeup);
+      pthread_mutex_unlock (&w->lock);
+    }
+}
+
+/* Count one fewer pending request, and if that was the last one and
+   the workers are being inhibited, tell pager_inhibit_workers.  */
+static void
+request_finished (struct pager_requests *requests)
+{
+  if (__atomic_sub_fetch (&requests->pending, 1, __ATOMIC_SEQ_CST) == 0
+      && __atomic_load_n (&requests->inhibited, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&requests->lock);
+      pthread_cond_broadcast (&requests->inhibit_wakeup);
+      pthread_mutex_unlock (&requests->lock);
+    }
+}
+
 void _pager_dead_name_notify(mach_msg_header_t *inp, mach_msg_header_t *reply);
 
 static mig_routine_t _pager_dead_name_notify_routine(mach_msg_header_t *inp)
@@ -111,7 +253,7 @@ pager_demuxer (struct pager_requests *requests,
   mach_msg_size_t padded_size = (inp->msgh_size + MASK) & ~MASK;
 #undef MASK
 
-  struct request *r = malloc (sizeof *r + padded_size);
+  struct request *r = alloc_request (requests, padded_size);
   if (r == NULL)
     {
       err = ENOMEM;
@@ -121,15 +263,41 @@ pager_demuxer (struct pager_requests *requests,
   r->routine = routine;
   memcpy (request_inp (r), inp, inp->msgh_size);
 
-  pthread_mutex_lock (&requests->lock);
+  struct worker *w = request_worker (requests, r);
 
-  queue_enqueue (requests->queue_in, &r->item);
+  if (! __atomic_load_n (&w->started, __ATOMIC_ACQUIRE))
+    {
+      pthread_mutex_lock (&requests->lock);
+      err = start_worker (w);
+      pthread_mutex_unlock (&requests->lock);
+      if (err)
+	{
+	  release_request (requests, r);
+	  goto out;
+	}
+    }
 
-  /* Awake worker, but only if not inhibited.  */
-  if (requests->asleep > 0 && requests->queue_in == requests->queue_out)
-      pthread_cond_signal (&requests->wakeup);
+  /* Count the request before looking at INHIBITED, so that
+     pager_inhibit_workers, which sets INHIBITED before looking at
+     PENDING, either waits for it or makes us hold it back.  */
+  __atomic_add_fetch (&requests->pending, 1, __ATOMIC_SEQ_CST);
 
-  pthread_mutex_unlock (&requests->lock);
+  if (__atomic_load_n (&requests->inhibited, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&requests->lock);
+      if (requests->inhibited)
+	{
+	  queue_enqueue (&requests->held, &r->item);
+	  if (__atomic_sub_fetch (&requests->pending, 1, __ATOMIC_SEQ_CST) == 0)
+	    pthread_cond_broadcast (&requests->inhibit_wakeup);
+	  pthread_mutex_unlock (&requests->lock);
+	  err = MIG_NO_REPLY;
+	  goto out;
+	}
+      pthread_mutex_unlock (&requests->lock);
+    }
+
+  give_request (w, r);
 
   /* A worker thread will reply.  */
   err = MIG_NO_REPLY;
@@ -170,123 +338,105 @@ mig_reply_setup (
 #undef OutP
 }
 
-/* Consumes requests from the queue.  */
-static void *
-worker_func (void *arg)
+/* Execute request R and send the reply.  */
+static void
+service_request (struct request *r)
 {
-  struct worker *self = (struct worker *) arg;
-  struct pager_requests *requests = self->requests;
-  struct request *r = NULL;
+  mach_msg_return_t mr;
   mig_reply_header_t reply_msg;
 
-  while (1)
-    {
-      int i;
-      mach_msg_return_t mr;
-
-      /* Free previous message.  */
-      free (r);
+  mig_reply_setup (request_inp (r), (mach_msg_header_t *) &reply_msg);
 
-      pthread_mutex_lock (&requests->lock);
-
-      /* First, look in our queue for more requests to the object we
-	 have been working on lately.  Some other thread might have
-	 delegated them to us.  */
-      r = queue_dequeue (&self->queue);
-      if (r != NULL)
-	goto got_one;
-
-      /* Nope.  Clear our tag and...  */
-      self->tag = 0;
+  /* Call the server routine.  */
+  (*r->routine) (request_inp (r), (mach_msg_header_t *) &reply_msg);
 
-    get_request_locked:
-      /* ... get a request from the global queue instead.  */
-      while ((r = queue_dequeue (requests->queue_out)) == NULL)
-	{
-	  requests->asleep += 1;
-	  if (requests->asleep == WORKER_COUNT)
-	    pthread_cond_broadcast (&requests->inhibit_wakeup);
-	  pthread_cond_wait (&requests->wakeup, &requests->lock);
-	  requests->asleep -= 1;
-	}
+  /* What follows is basically the second part of
+     mach_msg_server_timeout.  */
+  mig_reply_header_t *request = (mig_reply_header_t *) request_inp (r);
+  mig_reply_header_t *reply = &reply_msg;
 
-      for (i = 0; i < WORKER_COUNT; i++)
-	if (requests->workers[i].tag
-	    == (unsigned long) request_inp (r)->msgh_local_port)
-	  {
-	    /* Some other thread is working on that object.  Delegate
-	       the request to that worker.  */
-	    queue_enqueue (&requests->workers[i].queue, &r->item);
-	    goto get_request_locked;
-	  }
+  switch (reply->RetCode)
+    {
+    case KERN_SUCCESS:
+      /* Hunky dory.  */
+      break;
+
+    case MIG_NO_REPLY:
+      /* The server function wanted no reply sent.  */
+      return;
+
+    default:
+      /* Some error; destroy the request message to release any
+	 port rights or VM it holds.  Don't destroy the reply port
+	 right, so we can send an error message.  */
+      request->Head.msgh_remote_port = MACH_PORT_NULL;
+      mach_msg_destroy (&request->Head);
+      break;
+    }
 
-      /* Claim responsibility for this object by setting our tag.  */
-      self->tag = (unsigned long) request_inp (r)->msgh_local_port;
+  if (reply->Head.msgh_remote_port == MACH_PORT_NULL)
+    {
+      /* No reply port, so destroy the reply.  */
+      if (reply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX)
+	mach_msg_destroy (&reply->Head);
+      return;
+    }
 
-    got_one:
-      pthread_mutex_unlock (&requests->lock);
+  /* Send the reply.  */
+  mr = mach_msg (&reply->Head,
+		 MACH_SEND_MSG,
+		 reply->Head.msgh_size,
+		 0,
+		 MACH_PORT_NULL,
+		 0,
+		 MACH_PORT_NULL);
 
-      mig_reply_setup (request_inp (r), (mach_msg_header_t *) &reply_msg);
+  switch (mr)
+    {
+    case MACH_SEND_INVALID_DEST:
+      /* The reply can't be delivered, so destroy it.  This error
+	 indicates only that the requester went away, so we
+	 continue and get the next request.  */
+      mach_msg_destroy (&reply->Head);
+      break;
+
+    default:
+      /* Some other form of lossage; there is not much we can
+	 do here.  */
+      error (0, mr, "mach_msg");
+    }
+}
 
-      /* Call the server routine.  */
-      (*r->routine) (request_inp (r), (mach_msg_header_t *) &reply_msg);
+/* Consumes requests from the worker's queue.  */
+static void *
+worker_func (void *arg)
+{
+  struct worker *self = (struct worker *) arg;
+  struct pager_requests *requests = self->requests;
+  struct request *r;
 
-      /* What follows is basically the second part of
-	 mach_msg_server_timeout.  */
-      mig_reply_header_t *request = (mig_reply_header_t *) request_inp (r);
-      mig_reply_header_t *reply = &reply_msg;
+  while (1)
+    {
+      r = mpsc_queue_dequeue (&self->queue);
 
-      switch (reply->RetCode)
+      if (r == NULL)
 	{
-	case KERN_SUCCESS:
-	  /* Hunky dory.  */
-	  break;
-
-	case MIG_NO_REPLY:
-	  /* The server function wanted no reply sent.
-	     Loop for another request.	*/
-	  continue;
-
-	default:
-	  /* Some error; destroy the request message to release any
-	     port rights or VM it holds.  Don't destroy the reply port
-	     right, so we can send an error message.  */
-	  request->Head.msgh_remote_port = MACH_PORT_NULL;
-	  mach_msg_destroy (&request->Head);
-	  break;
-	}
+	  pthread_mutex_lock (&self->lock);
+	  __atomic_store_n (&self->sleeping, 1, __ATOMIC_RELAXED);
 
-      if (reply->Head.msgh_remote_port == MACH_PORT_NULL)
-	{
-	  /* No reply port, so destroy the reply.  */
-	  if (reply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX)
-	    mach_msg_destroy (&reply->Head);
-	  continue;
-	}
+	  /* Pairs with the fence in give_request.  */
+	  __atomic_thread_fence (__ATOMIC_SEQ_CST);
 
-      /* Send the reply.  */
-      mr = mach_msg (&reply->Head,
-		     MACH_SEND_MSG,
-		     reply->Head.msgh_size,
-		     0,
-		     MACH_PORT_NULL,
-		     0,
-		     MACH_PORT_NULL);
+	  while ((r = mpsc_queue_dequeue (&self->queue)) == NULL)
+	    pthread_cond_wait (&self->wakeup, &self->lock);
 
-      switch (mr)
-	{
-	case MACH_SEND_INVALID_DEST:
-	  /* The reply can't be delivered, so destroy it.  This error
-	     indicates only that the requester went away, so we
-	     continue and get the next request.  */
-	  mach_msg_destroy (&reply->Head);
-	  break;
-
-	default:
-	  /* Some other form of lossage; there is not much we can
-	     do here.  */
-	  error (0, mr, "mach_msg");
+	  __atomic_store_n (&self->sleeping, 0, __ATOMIC_RELAXED);
+	  pthread_mutex_unlock (&self->lock);
 	}
+
+      service_request (r);
+      release_request (requests, r);
+      request_finished (requests);
     }
 
   /* Not reached.  */
@@ -333,19 +483,42 @@ pager_start_workers (struct port_bucket *pager_bucket,
     }
 
   requests->bucket = pager_bucket;
-  requests->asleep = 0;
+  requests->inhibited = 0;
+  requests->pending = 0;
+  queue_init (&requests->held);
+
+  requests->pool = NULL;
+  requests->pool_size = 0;
+  requests->cache = NULL;
 
-  requests->queue_in = malloc (sizeof *requests->queue_in);
-  if (requests->queue_in == NULL)
+  requests->max_workers = pager_max_workers;
+  if (requests->max_workers <= 0)
+    {
+      const char *s = getenv ("LIBPAGER_WORKERS");
+      requests->max_workers = s ? atoi (s) : 0;
+    }
+  if (requests->max_workers <= 0)
+    requests->max_workers = DEFAULT_MAX_WORKERS;
+
+  requests->workers = malloc (requests->max_workers * sizeof *requests->workers);
+  if (requests->workers == NULL)
     {
       err = ENOMEM;
       goto done;
     }
-  queue_init (requests->queue_in);
-  /* Until the workers are inhibited, both queues are the same.  */
-  requests->queue_out = requests->queue_in;
 
-  pthread_cond_init (&requests->wakeup, NULL);
+  for (i = 0; i < requests->max_workers; i++)
+    {
+      struct worker *w = &requests->workers[i];
+
+      w->requests = requests;
+      mpsc_queue_init (&w->queue);
+      w->started = 0;
+      w->sleeping = 0;
+      pthread_mutex_init (&w->lock, NULL);
+      pthread_cond_init (&w->wakeup, NULL);
+    }
+
   pthread_cond_init (&requests->inhibit_wakeup, NULL);
   pthread_mutex_init (&requests->lock, NULL);
 
@@ -355,18 +528,6 @@ pager_start_workers (struct port_bucket *pager_bucket,
     goto done;
   pthread_detach (t);
 
-  for (i = 0; i < WORKER_COUNT; i++)
-    {
-      requests->workers[i].requests = requests;
-      requests->workers[i].tag = 0;
-      queue_init (&requests->workers[i].queue);
-
-      err = pthread_create (&t, NULL, &worker_func, &requests->workers[i]);
-      if (err)
-	goto done;
-      pthread_detach (t);
-    }
-
 done:
   if (err)
     *out_requests = NULL;
@@ -379,55 +540,46 @@ done:
 error_t
 pager_inhibit_workers (struct pager_requests *requests)
 {
-  error_t err = 0;
-
   pthread_mutex_lock (&requests->lock);
 
   /* Check the workers are not already inhibited.  */
-  assert (requests->queue_out == requests->queue_in);
+  assert (! requests->inhibited);
 
-  /* Any new paging requests will go into a new queue.  */
-  struct queue *new_queue = malloc (sizeof *new_queue);
-  if (new_queue == NULL)
-    {
-      err = ENOMEM;
-      goto done_locked;
-    }
-  queue_init (new_queue);
-  requests->queue_in = new_queue;
-
-  /* Wait until all the workers are asleep and the queue has been
-     drained. All individual worker queues must have been drained, as
-     they are populated while the relevant worker is still running, and
-     it will always drain its personal queue before sleeping.
-     Check that the queue is empty, since it's possible that a request
-     came in, was queued and a worker was signalled but the lock was
-     acquired here before the worker woke up.  */
-  while (requests->asleep < WORKER_COUNT || !queue_empty(requests->queue_out))
+  /* Any new paging requests will be held back.  */
+  __atomic_store_n (&requests->inhibited, 1, __ATOMIC_SEQ_CST);
+
+  /* Wait until every request already given to a worker has finished.
+     A request the receiving thread is giving to a worker right now
+     has been counted in PENDING, unless it saw INHIBITED and will be
+     held back instead.  */
+  while (__atomic_load_n (&requests->pending, __ATOMIC_SEQ_CST) > 0)
     pthread_cond_wait (&requests->inhibit_wakeup, &requests->lock);
 
-done_locked:
   pthread_mutex_unlock (&requests->lock);
-  return err;
+  return 0;
 }
 
 void
 pager_resume_workers (struct pager_requests *requests)
 {
+  struct request *r;
+
   pthread_mutex_lock (&requests->lock);
 
   /* Check the workers are inhibited.  */
-  assert (requests->queue_out != requests->queue_in);
-  assert (requests->asleep == WORKER_COUNT);
-  assert (queue_empty(requests->queue_out));
+  assert (requests->inhibited);
+  assert (requests->pending == 0);
 
-  /* The queue has been drained and will no longer be used.  */
-  free (requests->queue_out);
-  requests->queue_out = requests->queue_in;
+  /* Hand out the requests held back, before any new ones, which the
+     receiving thread can't give out until we clear INHIBITED.  Their
+     workers were started when they arrived.  */
+  while ((r = queue_dequeue (&requests->held)) != NULL)
+    {
+      __atomic_add_fetch (&requests->pending, 1, __ATOMIC_SEQ_CST);
+      give_request (request_worker (requests, r), r);
+    }
 
-  /* We need to wake up all workers, as there could be multiple requests
-     in the new queue.  */
-  pthread_cond_broadcast (&requests->wakeup);
+  __atomic_store_n (&requests->inhibited, 0, __ATOMIC_SEQ_CST);
 
   pthread_mutex_unlock (&requests->lock);
 }
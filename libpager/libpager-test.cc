@@ -146,6 +146,10 @@ void translator_complete_all_operations(void)
 
 const int num_pages = 20;
 
+const int readahead_max = 32;   /* libpager's largest read-ahead window, in pages */
+
+const int max_writers = 4;      /* libpager's writer threads per pager */
+
 int buffer_write_count[num_pages];
 
 class client {
@@ -158,6 +162,7 @@ public:
     vm_prot_t access;
     boolean_t precious;
     boolean_t request_outstanding = false;
+    boolean_t readahead_allowed = false;
   };
 
   class : public std::vector<page>
@@ -178,6 +183,19 @@ public:
 
   size_t page_size = __vm_page_size;
 
+  std::vector<int> supplies;  /* number of pages in each m_o_data_supply, in order */
+  std::vector<int> errors;    /* pages reported by m_o_data_error, in order */
+
+  void allow_readahead(int end_page)
+  {
+    /* libpager may read ahead into absent pages following a request */
+    for (int page = end_page + 1; (page <= end_page + readahead_max) && (page < num_pages); page ++) {
+      if (pageptrs[page].ptr == nullptr) {
+        pageptrs[page].readahead_allowed = true;
+      }
+    }
+  }
+
   void request_read_access(int start_page, int end_page)
   {
     /* ASSERT: page absent in client */
@@ -186,6 +204,7 @@ public:
       assert(! pageptrs[page].request_outstanding);
       pageptrs[page].request_outstanding = true;
     }
+    allow_readahead(end_page);
     /* sends m_o_data_request */
     mach_call(memory_object_data_request(memobj, memory_control,
                                          start_page * page_size, (end_page - start_page + 1) * page_size,
@@ -200,6 +219,7 @@ public:
       assert(! pageptrs[page].request_outstanding);
       pageptrs[page].request_outstanding = true;
     }
+    allow_readahead(end_page);
     /* sends m_o_data_request */
     mach_call(memory_object_data_request(memobj, memory_control,
                                          start_page * page_size, (end_page - start_page + 1) * page_size,
@@ -226,6 +246,15 @@ public:
     }
   }
 
+  void wait_for_supplies(int count)
+  {
+    std::unique_lock<std::mutex> client_lock(lock);
+
+    while (supplies.size() < count) {
+      cv.wait(client_lock);
+    }
+  }
+
   void wait_for_page_absent(int page)
   {
     std::unique_lock<std::mutex> client_lock(lock);
@@ -319,6 +348,31 @@ public:
     }
   }
 
+  void return_pages(int start_page, int end_page, int dirty, int kcopy)
+  {
+    /* gather the pages into one region and return them in a single m_o_data_return */
+    vm_size_t length = (end_page - start_page + 1) * page_size;
+    vm_address_t data;
+
+    mach_call(vm_allocate(mach_task_self(), &data, length, TRUE));
+
+    for (int page = start_page; page <= end_page; page ++) {
+      assert(pageptrs[page].ptr != nullptr);
+      (*((int *) (pageptrs[page].ptr))) ++;
+      buffer_write_count[page] ++;
+      memcpy((char *) data + (page - start_page) * page_size, pageptrs[page].ptr, page_size);
+    }
+
+    mach_call(memory_object_data_return(memobj, memory_control, start_page * page_size,
+                                        data, length, dirty, kcopy));
+
+    if (! kcopy) {
+      for (int page = start_page; page <= end_page; page ++) {
+        pageptrs[page].ptr = nullptr;
+      }
+    }
+  }
+
   kern_return_t service_message(bool block = true)
   {
     machMessage msg;
@@ -349,16 +403,25 @@ public:
 
       /* data_supply - save pointers, read/write and precious (reply if requested) */
 
+      supplies.push_back(msg[1].data_size() / page_size);
+
       for (int i = 0; i < msg[1].data_size() / page_size; i ++) {
         int page = msg[0][0] / page_size + i;
+
+        /* ASSERT: page inside the object */
+        assert(page < num_pages);
+
+        /* ASSERT: page requested, or read ahead just past a request */
+        assert(pageptrs[page].request_outstanding || pageptrs[page].readahead_allowed);
+
         /* ASSERT: page absent in client */
         assert(pageptrs[page].ptr == nullptr);
-        assert(pageptrs[page].request_outstanding);
 
         pageptrs[page].ptr = (char *) msg[1].data() + i * page_size;
         pageptrs[page].access = msg[2][0];
         pageptrs[page].precious = msg[2][0];
         pageptrs[page].request_outstanding = false;
+        pageptrs[page].readahead_allowed = false;
       }
 
       cv.notify_all();
@@ -401,7 +464,19 @@ public:
     case 2090: /* memory_object_data_error */
       printf("m_o_data_error: offset = %d, size = %d, reason = 0x%x\n",
              msg[0][0], msg[1][0], msg[2][0]);
-      /* data_error - ?? */
+      /* data_error - the request for these pages is over */
+      assert(msg[0][0] % page_size == 0);
+      assert(msg[1][0] % page_size == 0);
+
+      for (int i = 0; i < msg[1][0] / page_size; i ++) {
+        int page = msg[0][0] / page_size + i;
+        errors.push_back(page);
+        pageptrs[page].request_outstanding = false;
+        pageptrs[page].readahead_allowed = false;
+      }
+
+      cv.notify_all();
+
       break;
 
     default:
@@ -504,6 +579,43 @@ const int BUFFER_SIZE = (num_pages * 4096);
 
 char buffer[BUFFER_SIZE];
 
+/* When range_callbacks is false, pager_read_pages and pager_write_pages
+ * decline with EOPNOTSUPP, and libpager falls back to reading and
+ * writing a page at a time.  main() runs the tests both ways.
+ */
+
+bool range_callbacks = false;
+
+/* reads of this page fail with EIO, to test partial errors */
+
+int failing_page = -1;
+
+/* While hold_writes is set, writes wait for it to be cleared, so that a
+ * test can keep libpager's writer threads busy.  held_writes counts
+ * them.  write_ranges records each call to pager_write_pages as its
+ * first page and number of pages.
+ */
+
+std::mutex writes_lock;
+std::condition_variable writes_cv;
+bool hold_writes = false;
+int held_writes = 0;
+std::vector<std::pair<int, int>> write_ranges;
+
+void translator_hold_write(void)
+{
+  std::unique_lock<std::mutex> lock(writes_lock);
+
+  if (hold_writes) {
+    held_writes ++;
+    writes_cv.notify_all();
+    while (hold_writes) {
+      writes_cv.wait(lock);
+    }
+    held_writes --;
+  }
+}
+
 error_t pager_read_page (struct user_pager_info *PAGER,
           vm_offset_t PAGE, vm_address_t *BUF, int *WRITE_LOCK)
 {
@@ -516,13 +628,13 @@ error_t pager_read_page (struct user_pager_info *PAGER,
 
   translator_suspend_operation();
 
-  /* libpager only calls pager_report_extent() from pager_flush(),
-   * pager_return(), and pager_sync().  It doesn't check the extent
-   * prior to pager_read_page(), so we must check for overflow here
-   * and return an error.
+  /* libpager calls pager_report_extent() from pager_flush(),
+   * pager_return(), and pager_sync(), and to limit read-ahead.  It
+   * doesn't check the extent prior to pager_read_page(), so we must
+   * check for overflow here and return an error.
    */
 
-  if (PAGE + __vm_page_size > BUFFER_SIZE) {
+  if ((PAGE + __vm_page_size > BUFFER_SIZE) || (PAGE / __vm_page_size == failing_page)) {
     return EIO;
   }
 
@@ -550,6 +662,7 @@ error_t pager_write_page (struct user_pager_info *PAGER,
   */
 
   translator_suspend_operation();
+  translator_hold_write();
 
   if (PAGE + __vm_page_size > BUFFER_SIZE) {
     return EIO;
@@ -563,6 +676,85 @@ error_t pager_write_page (struct user_pager_info *PAGER,
   return ESUCCESS;
 }
 
+error_t pager_read_pages (struct user_pager_info *PAGER,
+          vm_offset_t START, vm_size_t NPAGES, vm_address_t *BUF,
+          int *WRITE_LOCK, error_t *ERRORS)
+{
+  /*
+     For pager PAGER, read NPAGES pages from offset START into a single
+     region.  Set '*BUF' to be its address, and for each page, set
+     'WRITE_LOCK[i]' if it must be provided read-only and 'ERRORS[i]' to
+     the result of reading it.
+  */
+
+  translator_suspend_operation();
+
+  if (! range_callbacks) {
+    return EOPNOTSUPP;
+  }
+
+  void * buf;
+  posix_memalign(&buf, __vm_page_size, NPAGES * __vm_page_size);
+
+  for (int i = 0; i < NPAGES; i ++) {
+    vm_offset_t PAGE = START + i * __vm_page_size;
+
+    WRITE_LOCK[i] = TRUE;
+
+    if ((PAGE + __vm_page_size > BUFFER_SIZE) || (PAGE / __vm_page_size == failing_page)) {
+      ERRORS[i] = EIO;
+    } else {
+      memcpy((char *) buf + i * __vm_page_size, buffer + PAGE, __vm_page_size);
+      ERRORS[i] = ESUCCESS;
+    }
+  }
+
+  *BUF = (vm_address_t) buf;
+
+  return ESUCCESS;
+}
+
+error_t pager_write_pages (struct user_pager_info *PAGER,
+          vm_offset_t START, vm_size_t NPAGES, vm_address_t BUF,
+          error_t *ERRORS)
+{
+  /*
+     For pager PAGER, synchronously write NPAGES pages from BUF to
+     offset START, and set 'ERRORS[i]' to the result of writing each
+     page.  BUF still belongs to libpager.
+  */
+
+  translator_suspend_operation();
+
+  {
+    std::unique_lock<std::mutex> lock(writes_lock);
+    write_ranges.emplace_back(START / __vm_page_size, NPAGES);
+  }
+
+  if (! range_callbacks) {
+    return EOPNOTSUPP;
+  }
+
+  translator_hold_write();
+
+  for (int i = 0; i < NPAGES; i ++) {
+    vm_offset_t PAGE = START + i * __vm_page_size;
+    void * page_buf = (char *) BUF + i * __vm_page_size;
+
+    if (PAGE + __vm_page_size > BUFFER_SIZE) {
+      ERRORS[i] = EIO;
+      continue;
+    }
+
+    printf("pager_write_pages() page%d[0]=%d\n", PAGE / __vm_page_size, *(int *)page_buf);
+    assert (*(int *)page_buf >= *(int *)(buffer + PAGE));
+    memcpy(buffer + PAGE, page_buf, __vm_page_size);
+    ERRORS[i] = ESUCCESS;
+  }
+
+  return ESUCCESS;
+}
+
 error_t pager_unlock_page (struct user_pager_info *PAGER,
           vm_offset_t ADDRESS)
 {
@@ -812,6 +1004,167 @@ void test_bug3_asynchronous(mach_port_t memobj)
   cl.request_write_access(1);
 }
 
+void test_readahead_asynchronous(mach_port_t memobj)
+{
+  client cl(memobj);  /* creating the client does the m_o_init / m_o_ready exchange */
+
+  /* Fault the object in a page at a time, the way a kernel does,
+   * skipping over whatever libpager read ahead for us.  The first
+   * request opens no window, each sequential one after it doubles the
+   * window from 4 pages, and the window stops at the end of the object.
+   * A read-only request comes back in one supply along with its
+   * read-ahead, so wait for each supply before looking for the next
+   * absent page.  Run this on a fresh pager, so that no page is busy.
+   */
+
+  int page = 0;
+  int requests = 0;
+
+  while (page < num_pages) {
+    cl.request_read_access(page);
+    cl.wait_for_supplies(++ requests);
+
+    std::unique_lock<std::mutex> client_lock(cl.lock);
+    while ((page < num_pages) && (cl.pageptrs[page].ptr != nullptr)) {
+      page ++;
+    }
+  }
+
+  std::vector<int> expected = { 1, 1 + 4, 1 + 8, num_pages - 15 };
+
+  std::unique_lock<std::mutex> client_lock(cl.lock);
+  assert(cl.supplies == expected);
+}
+
+void test_partial_read_asynchronous(mach_port_t memobj)
+{
+  client cl(memobj);  /* creating the client does the m_o_init / m_o_ready exchange */
+
+  /* Read four pages, one of which fails.  With range callbacks, the
+   * read of all four returns a partial error, and the good pages on
+   * either side of the bad one must still arrive.  The client's first
+   * request opens no read-ahead window.  Pages still being written
+   * back from an earlier test are read one at a time once the write
+   * finishes, so don't count on how the supplies are split.
+   */
+
+  failing_page = 5;
+
+  cl.request_read_access(4, 7);
+
+  cl.wait_for_all_pages();
+
+  failing_page = -1;
+
+  std::vector<int> expected = { 5 };
+
+  std::unique_lock<std::mutex> client_lock(cl.lock);
+
+  assert(cl.pageptrs[4].ptr != nullptr);
+  assert(cl.pageptrs[5].ptr == nullptr);
+  assert(cl.pageptrs[6].ptr != nullptr);
+  assert(cl.pageptrs[7].ptr != nullptr);
+  assert(cl.errors == expected);
+}
+
+void test_multipage_asynchronous(mach_port_t memobj)
+{
+  client cl(memobj);  /* creating the client does the m_o_init / m_o_ready exchange */
+
+  /* one m_o_data_request for eight pages */
+  cl.request_write_access(2, 9);
+
+  cl.wait_for_all_pages();
+
+  for (int page = 2; page <= 9; page ++) {
+    assert(cl.pageptrs[page].ptr != nullptr);
+  }
+
+  /* one m_o_data_return for all eight; main() checks that the
+   * writes landed once the pager has shut down
+   */
+  cl.return_pages(2, 9, 1, 0);
+
+  /* and read the middle of them back */
+  cl.request_read_access(4, 7);
+
+  cl.wait_for_all_pages();
+
+  for (int page = 4; page <= 7; page ++) {
+    assert(cl.pageptrs[page].ptr != nullptr);
+  }
+}
+
+void test_clustering_asynchronous(mach_port_t memobj)
+{
+  client cl(memobj);  /* creating the client does the m_o_init / m_o_ready exchange */
+
+  /* Holding every page means none of them is still being written */
+  cl.request_write_access(0, num_pages - 1);
+
+  cl.wait_for_all_pages();
+
+  /* Keep every writer thread busy with a page of its own, so that
+   * nothing is written while we return the pages we want clustered.
+   */
+
+  {
+    std::unique_lock<std::mutex> lock(writes_lock);
+    hold_writes = true;
+    write_ranges.clear();
+  }
+
+  for (int i = 0; i < max_writers; i ++) {
+    cl.return_page(2 * i, 1, 0);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(writes_lock);
+    while (held_writes < max_writers) {
+      writes_cv.wait(lock);
+    }
+  }
+
+  /* four adjacent dirty pages, each in its own m_o_data_return */
+
+  for (int page = 10; page <= 13; page ++) {
+    cl.return_page(page, 1, 0);
+  }
+
+  /* libpager handles an object's messages in order, so once a second
+   * client's m_o_init has been answered, the returns are all queued
+   */
+
+  {
+    client cl2(memobj);
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(writes_lock);
+    hold_writes = false;
+    writes_cv.notify_all();
+  }
+
+  /* reading the pages back waits for their write to finish */
+
+  cl.request_read_access(10, 13);
+
+  cl.wait_for_all_pages();
+
+  std::vector<std::pair<int, int>> expected = { { 10, 4 } };
+
+  {
+    std::unique_lock<std::mutex> lock(writes_lock);
+    assert(write_ranges == expected);
+  }
+
+  for (int page = 10; page <= 13; page ++) {
+    int buffer_count = * (int *) (buffer + page * __vm_page_size);
+    assert(buffer_write_count[page] == buffer_count);
+    assert(* (int *) cl.pageptrs[page].ptr == buffer_count);
+  }
+}
+
 void random_test_asynchronous(mach_port_t memobj)
 {
   client cl(memobj);  /* creating the client does the m_o_init / m_o_ready exchange */
@@ -947,19 +1300,34 @@ main (int argc, char **argv)
     boolean_t MAY_CACHE = TRUE;
     boolean_t NOTIFY_ON_EVICT = TRUE;
 
-    pager = pager_create(NULL, bucket, MAY_CACHE, MEMORY_OBJECT_COPY_DELAY, NOTIFY_ON_EVICT);
+    /* run the tests on a fresh pager without range callbacks, then with them */
+
+    for (bool ranges: { false, true }) {
+
+      range_callbacks = ranges;
+
+      pager = pager_create(NULL, bucket, MAY_CACHE, MEMORY_OBJECT_COPY_DELAY, NOTIFY_ON_EVICT);
 
-    mach_port_t memobj = pager_get_port(pager);
+      mach_port_t memobj = pager_get_port(pager);
 
-    test_bug1_asynchronous(memobj);
+      test_readahead_asynchronous(memobj);
 
-    test_bug3_asynchronous(memobj);
+      test_bug1_asynchronous(memobj);
 
-    random_test_asynchronous(memobj);
-    random_test_asynchronous(memobj);
-    random_test_asynchronous(memobj);
+      test_bug3_asynchronous(memobj);
 
-    pager_shutdown(pager);
+      test_partial_read_asynchronous(memobj);
+
+      test_multipage_asynchronous(memobj);
+
+      test_clustering_asynchronous(memobj);
+
+      random_test_asynchronous(memobj);
+      random_test_asynchronous(memobj);
+      random_test_asynchronous(memobj);
+
+      pager_shutdown(pager);
+    }
 
     for (int page = 0; page < num_pages; page ++) {
       int buffer_count = * (int *) (buffer + page * __vm_page_size);
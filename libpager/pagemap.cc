@@ -11,12 +11,16 @@
    TODO:
    - pagemap[] is statically allocated
    - update NOTES to reflect code factorization
-   - handle multi page operations
 */
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "pager.h"
 #include "pagemap.h"
@@ -29,19 +33,135 @@ extern "C" {
 #include <mach/memory_object_user.h>
 }
 
-// 1. create an empty pagemap entry
-// 2. initialize it into pagemap_set (which copies it)
-// 3. extract a pointer to the copy inside pagemap_set
+// pagemap_set starts out empty; an empty page is kept inline.
 
-// pagemap_entry::data empty_page;
-// std::set<pagemap_entry::data> pagemap_entry::pagemap_set {empty_page};
+std::set<pagemap_entry::data> pagemap_set;
+std::mutex pagemap_set_mutex;
 
-// 1. create pagemap_set and initialize it with a single empty pagemap entry
-// 2. extract a pointer to that entry and save it as empty_page_ptr
+static_assert(sizeof(mach_port_t) <= 4, "inline pagemap entries keep a port in 32 bits");
 
-std::set<pagemap_entry::data> pagemap_set {pagemap_entry::data()};
-std::mutex pagemap_set_mutex;
-const pagemap_entry::data * empty_page_ptr = &* pagemap_set.begin();
+// "tmp = pagemap[n]" - load a page's state into a pagemap_entry_data.
+//
+// Assigning into the same long-lived pagemap_entry_data each time lets
+// its ACCESSLIST and WAITLIST reuse the memory they already have.
+
+pagemap_entry_data & pagemap_entry_data::operator= (const pagemap_ref & ref)
+{
+  const pagemap_entry & entry = ref.entry;
+
+  if (! entry.is_inline()) {
+    return *this = *entry.out_of_line();
+  }
+
+  PAGINGOUT = (entry.word & pagemap_entry::PAGINGOUT) != 0;
+  WRITE_ACCESS_GRANTED = (entry.word & pagemap_entry::WRITE_ACCESS_GRANTED) != 0;
+  INVALID = (entry.word & pagemap_entry::INVALID) != 0;
+  ERROR = KERN_SUCCESS;
+
+  WAITLIST.clear();
+
+  switch (entry.kind()) {
+  case pagemap_entry::NO_CLIENTS:
+    ACCESSLIST.clear();
+    break;
+
+  case pagemap_entry::ONE_CLIENT:
+    ACCESSLIST = {entry.value()};
+    break;
+
+  case pagemap_entry::SHARED:
+    {
+      uint32_t bitmap = entry.value();
+
+      for (auto it = ACCESSLIST.begin(); it != ACCESSLIST.end(); ) {
+        int i = ref.map.shared_client_index(*it);
+        if ((i == -1) || ! (bitmap & (1u << i))) {
+          it = ACCESSLIST.erase(it);
+        } else {
+          it ++;
+        }
+      }
+      for (int i = 0; i < pagemap_vector::max_shared_clients; i ++) {
+        if (bitmap & (1u << i)) {
+          ACCESSLIST.insert(ref.map.shared_clients[i]);
+        }
+      }
+    }
+    break;
+
+  case pagemap_entry::ONE_WAITER:
+    ACCESSLIST.clear();
+    WAITLIST.emplace_back(entry.value(), (entry.word & pagemap_entry::WRITE_ACCESS_REQUESTED) != 0);
+    break;
+  }
+
+  return *this;
+}
+
+// "pagemap[n] = tmp" - store a page's state, inline if we can,
+// otherwise in pagemap_set (see pagemap_ref in pagemap.h)
+
+void pagemap_ref::operator= (pagemap_entry_data & data)
+{
+  if ((data.ERROR == KERN_SUCCESS) && (data.WAITLIST.empty() || (data.WAITLIST.size() == 1 && data.ACCESSLIST.empty()))) {
+
+    uint64_t word = pagemap_entry::INLINE;
+
+    if (data.PAGINGOUT) word |= pagemap_entry::PAGINGOUT;
+    if (data.WRITE_ACCESS_GRANTED) word |= pagemap_entry::WRITE_ACCESS_GRANTED;
+    if (data.INVALID) word |= pagemap_entry::INVALID;
+
+    if (! data.WAITLIST.empty()) {
+      word |= (uint64_t) pagemap_entry::ONE_WAITER << pagemap_entry::KIND_SHIFT;
+      word |= (uint64_t) data.WAITLIST[0].client << pagemap_entry::VALUE_SHIFT;
+      if (data.WAITLIST[0].write_access_requested) {
+        word |= pagemap_entry::WRITE_ACCESS_REQUESTED;
+      }
+      entry.word = word;
+      return;
+    }
+
+    if (data.ACCESSLIST.empty()) {
+      entry.word = word;
+      return;
+    }
+
+    if (data.ACCESSLIST.size() == 1) {
+      word |= (uint64_t) pagemap_entry::ONE_CLIENT << pagemap_entry::KIND_SHIFT;
+      word |= (uint64_t) *data.ACCESSLIST.begin() << pagemap_entry::VALUE_SHIFT;
+      entry.word = word;
+      return;
+    }
+
+    uint32_t bitmap = 0;
+    bool fits = true;
+
+    for (auto client: data.ACCESSLIST) {
+      int i = map.add_shared_client(client);
+      if (i == -1) {
+        fits = false;
+        break;
+      }
+      bitmap |= 1u << i;
+    }
+
+    if (fits) {
+      word |= (uint64_t) pagemap_entry::SHARED << pagemap_entry::KIND_SHIFT;
+      word |= (uint64_t) bitmap << pagemap_entry::VALUE_SHIFT;
+      entry.word = word;
+      return;
+    }
+  }
+
+  // std::set's insert() returns a std::pair, the first item of
+  // which is an iterator that we dereference (*) to get a
+  // reference, then take its address (&) to get a pointer.
+  //
+  // https://stackoverflow.com/a/2160319/1493790
+
+  std::unique_lock<std::mutex> lock(pagemap_set_mutex);
+  entry.word = (uintptr_t) &* pagemap_set.insert(std::move(data)).first;
+}
 
 std::ostream& operator<< (std::ostream &out, const pagemap_entry::data &entry)
 {
@@ -123,6 +243,141 @@ void pager::service_WAITLIST(vm_offset_t offset, vm_offset_t data, bool allow_wr
   }
 }
 
+/* read_pages() and write_pages() - call with pager unlocked
+ *
+ * Read or write the WANTED pages among the NPAGES at OFFSET.  Each run
+ * of consecutive wanted pages goes to the translator's pager_read_pages
+ * or pager_write_pages in one call, if it has them and doesn't decline
+ * with EOPNOTSUPP, otherwise each page goes to pager_read_page or
+ * pager_write_page.
+ *
+ * read_pages() leaves each page that was read successfully at
+ * BUFFER[i].  Pages read as part of a run are slices of one region,
+ * and the slices of failed pages are deallocated here.
+ */
+
+void pager::read_pages(vm_offset_t OFFSET, vm_size_t npages, const bool * wanted,
+                       vm_address_t * buffer, int * write_lock, kern_return_t * err)
+{
+  vm_size_t i = 0;
+
+  while (i < npages) {
+    if (! wanted[i]) {
+      i ++;
+      continue;
+    }
+
+    vm_size_t run = 1;
+    while ((i + run < npages) && wanted[i + run]) {
+      run ++;
+    }
+
+    kern_return_t ret = EOPNOTSUPP;
+
+    if (pager_read_pages && (run > 1)) {
+      vm_address_t data;
+      std::vector<error_t> errors(run);
+      ret = pager_read_pages(upi, OFFSET + i * page_size, run, &data, &write_lock[i], errors.data());
+
+      for (vm_size_t j = i; (ret != EOPNOTSUPP) && (j < i + run); j ++) {
+        if (ret != KERN_SUCCESS) {
+          err[j] = ret;
+        } else if ((err[j] = errors[j - i]) == KERN_SUCCESS) {
+          buffer[j] = data + (j - i) * page_size;
+        } else {
+          mach_call(vm_deallocate(mach_task_self(), data + (j - i) * page_size, page_size));
+        }
+      }
+    }
+
+    if (ret == EOPNOTSUPP) {
+      for (vm_size_t j = i; j < i + run; j ++) {
+        err[j] = pager_read_page(upi, OFFSET + j * page_size, &buffer[j], &write_lock[j]);
+      }
+    }
+
+    i += run;
+  }
+}
+
+void pager::write_pages(vm_offset_t OFFSET, vm_size_t npages, const bool * wanted,
+                        vm_address_t data, kern_return_t * err)
+{
+  vm_size_t i = 0;
+
+  while (i < npages) {
+    if (! wanted[i]) {
+      i ++;
+      continue;
+    }
+
+    vm_size_t run = 1;
+    while ((i + run < npages) && wanted[i + run]) {
+      run ++;
+    }
+
+    kern_return_t ret = EOPNOTSUPP;
+
+    if (pager_write_pages && (run > 1)) {
+      std::vector<error_t> errors(run);
+      ret = pager_write_pages(upi, OFFSET + i * page_size, run, data + i * page_size, errors.data());
+
+      for (vm_size_t j = i; (ret != EOPNOTSUPP) && (j < i + run); j ++) {
+        err[j] = (ret != KERN_SUCCESS) ? ret : errors[j - i];
+      }
+    }
+
+    if (ret == EOPNOTSUPP) {
+      for (vm_size_t j = i; j < i + run; j ++) {
+        err[j] = pager_write_page(upi, OFFSET + j * page_size, data + j * page_size);
+      }
+    }
+
+    i += run;
+  }
+}
+
+/* supply_pages
+ *
+ * Assumes that pager is locked, and that CLIENT is the only client
+ * waiting on each of the NPAGES pages at OFFSET, with nothing on their
+ * ACCESSLISTs.  BUFFER holds the pages as left by read_pages().  If
+ * they aren't already consecutive slices of one region, we copy them
+ * into one.  Either way, the client gets them in a single
+ * memory_object_data_supply.
+ */
+
+void pager::supply_pages(memory_object_control_t client, vm_offset_t OFFSET, vm_size_t npages,
+                         vm_address_t * buffer, bool allow_write_access)
+{
+  vm_address_t data = buffer[0];
+
+  for (vm_size_t i = 1; i < npages; i ++) {
+    if (buffer[i] != data + i * page_size) {
+      mach_call(vm_allocate(mach_task_self(), &data, npages * page_size, TRUE));
+
+      for (vm_size_t j = 0; j < npages; j ++) {
+        memcpy((void *) (data + j * page_size), (void *) buffer[j], page_size);
+        mach_call(vm_deallocate(mach_task_self(), buffer[j], page_size));
+      }
+      break;
+    }
+  }
+
+  mach_call(memory_object_data_supply(client, OFFSET, data, npages * page_size, true,
+                                      allow_write_access ? 0 : VM_PROT_WRITE, PRECIOUS, 0));
+
+  vm_offset_t page = OFFSET / page_size;
+  for (vm_size_t i = 0; i < npages; i ++, page ++) {
+    tmp_pagemap_entry = pagemap[page];
+    tmp_pagemap_entry.set_ERROR(KERN_SUCCESS);
+    tmp_pagemap_entry.add_client_to_ACCESSLIST(client);
+    tmp_pagemap_entry.pop_first_WAITLIST_client();
+    tmp_pagemap_entry.set_WRITE_ACCESS_GRANTED(allow_write_access);
+    pagemap[page] = tmp_pagemap_entry;
+  }
+}
+
 // send_error_to_WAITLIST()
 //
 // assumes that pager is locked and tmp_pagemap_entry is loaded
@@ -162,102 +417,304 @@ void pager::finalize_unlock(vm_offset_t OFFSET, kern_return_t ERROR)
   }
 }
 
+/* readahead_pages() - call with pager lock held
+ *
+ * The kernel requests pages one at a time, so a client reading through
+ * an object sequentially pays a round trip per page.  We track where
+ * each client's last request ended (last_end) and how far we read ahead
+ * of it (next).  A request starting anywhere in between is sequential,
+ * and doubles the read-ahead window, from readahead_min up to
+ * readahead_max pages.  Any other request closes the window.
+ *
+ * Returns the number of pages following the request to read ahead.
+ */
+
+vm_size_t pager::readahead_pages(memory_object_control_t client, vm_offset_t OFFSET, vm_size_t LENGTH)
+{
+  vm_offset_t end = OFFSET + LENGTH;
+  auto it = readahead.find(client);
+
+  if (it == readahead.end()) {
+    readahead.emplace(client, readahead_state(end));
+    return 0;
+  }
+
+  auto & ra = it->second;
+
+  if ((OFFSET >= ra.last_end) && (OFFSET <= ra.next)) {
+    ra.window = ra.window ? std::min(2 * ra.window, readahead_max) : readahead_min;
+  } else {
+    ra.window = 0;
+  }
+
+  vm_size_t pages = 0;
+
+  if (end < extent) {
+    pages = std::min(ra.window, (extent - end + page_size - 1) / page_size);
+  }
+
+  ra.last_end = end;
+  ra.next = end + pages * page_size;
+
+  return pages;
+}
+
+/* data_request() handles a contiguous range of pages in one pass.
+ *
+ * Each page goes through the single page logic, which either queues
+ * the client on its WAITLIST to wait for something else, or marks the
+ * page for a PAGEIN.  Pages the client already has that are needed by
+ * someone else are marked LOCK_COMPLETED, and handled at the end just
+ * as if a flush of them had completed.
+ *
+ * If the client seems to be reading sequentially, idle pages following
+ * the request are marked READAHEAD and queued for the client just
+ * like the ones it asked for, but read-only (see readahead_pages).
+ *
+ * The pages are then read with the pager unlocked, and each run of
+ * consecutive pages whose only waiter is the requesting client is
+ * supplied back to it with a single memory_object_data_supply.  Other
+ * pages are serviced one at a time by service_WAITLIST.
+ */
+
 void pager::data_request(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFSET,
                          vm_offset_t LENGTH, vm_prot_t DESIRED_ACCESS)
 {
   std::unique_lock<std::mutex> pager_lock(lock);
 
-  assert(LENGTH == page_size);
+  assert(LENGTH % page_size == 0);
   assert(OFFSET % page_size == 0);
 
   if (terminating) return;
 
-  // fprintf(stderr, "data_request(MEMORY_CONTROL=%d, OFFSET=%d) page_size=%d\n", MEMORY_CONTROL, OFFSET, page_size);
-  // fprintf(stderr, "PAGINGOUT = %d\n", pagemap[OFFSET / page_size]->get_PAGINGOUT());
+  // fprintf(stderr, "data_request(MEMORY_CONTROL=%d, OFFSET=%d, LENGTH=%d) page_size=%d\n", MEMORY_CONTROL, OFFSET, LENGTH, page_size);
 
-  tmp_pagemap_entry = pagemap[OFFSET / page_size];
+  vm_size_t npages = LENGTH / page_size;
+  vm_size_t total = npages + readahead_pages(MEMORY_CONTROL, OFFSET, LENGTH);
 
-  for (auto ne = NEXTERROR.cbegin(); ne != NEXTERROR.cend(); ne ++) {
-    if ((ne->client == MEMORY_CONTROL) && (ne->offset == OFFSET)) {
-      mach_call(memory_object_data_error(MEMORY_CONTROL, OFFSET, LENGTH, ne->error));
-      tmp_pagemap_entry.set_ERROR(ne->error);
-      NEXTERROR.erase(ne);
-      return;
+  std::vector<uint8_t> operation(total);
+  const int PAGEIN = 1;
+  const int LOCK_COMPLETED = 2;
+  const int READAHEAD = 3;
+
+  bool any_pagein_required = false;
+  bool any_lock_completed_required = false;
+
+  vm_offset_t page = OFFSET / page_size;
+  for (vm_size_t i = 0; i < npages; i ++, page ++) {
+
+    operation[i] = 0;
+
+    tmp_pagemap_entry = pagemap[page];
+
+    bool nexterror_sent = false;
+
+    for (auto ne = NEXTERROR.cbegin(); ne != NEXTERROR.cend(); ne ++) {
+      if ((ne->client == MEMORY_CONTROL) && (ne->offset == page * page_size)) {
+        mach_call(memory_object_data_error(MEMORY_CONTROL, page * page_size, page_size, ne->error));
+        tmp_pagemap_entry.set_ERROR(ne->error);
+        NEXTERROR.erase(ne);
+        nexterror_sent = true;
+        break;
+      }
     }
-  }
 
-  if (tmp_pagemap_entry.get_PAGINGOUT()) {
-    if (tmp_pagemap_entry.is_WAITLIST_empty() && ! tmp_pagemap_entry.is_ACCESSLIST_empty()) {
-      for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
-        internal_flush_request(client, OFFSET);
+    if (nexterror_sent) {
+      continue;
+    }
+
+    if (tmp_pagemap_entry.get_PAGINGOUT()) {
+      if (tmp_pagemap_entry.is_WAITLIST_empty() && ! tmp_pagemap_entry.is_ACCESSLIST_empty()) {
+        for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
+          internal_flush_request(client, page * page_size);
+        }
+      }
+      tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
+      pagemap[page] = tmp_pagemap_entry;
+      continue;
+    }
+
+    if (tmp_pagemap_entry.is_client_on_ACCESSLIST(MEMORY_CONTROL)) {
+      if (! tmp_pagemap_entry.is_WAITLIST_empty()) {
+        tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
+        pagemap[page] = tmp_pagemap_entry;
+        operation[i] = LOCK_COMPLETED;
+        any_lock_completed_required = true;
+        continue;
+      } else {
+        tmp_pagemap_entry.remove_client_from_ACCESSLIST(MEMORY_CONTROL);
+        tmp_pagemap_entry.set_WRITE_ACCESS_GRANTED(false);
       }
     }
-    tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
-    pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-    return;
-  }
 
-  if (tmp_pagemap_entry.is_client_on_ACCESSLIST(MEMORY_CONTROL)) {
     if (! tmp_pagemap_entry.is_WAITLIST_empty()) {
       tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
-      pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-      internal_lock_completed(MEMORY_CONTROL, OFFSET, page_size, pager_lock);
-      return;
-    } else {
-      tmp_pagemap_entry.remove_client_from_ACCESSLIST(MEMORY_CONTROL);
-      tmp_pagemap_entry.set_WRITE_ACCESS_GRANTED(false);
+      pagemap[page] = tmp_pagemap_entry;
+      continue;
+    }
+
+    if (tmp_pagemap_entry.get_WRITE_ACCESS_GRANTED()) {
+      tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
+      for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
+        internal_flush_request(client, page * page_size);
+      }
+      pagemap[page] = tmp_pagemap_entry;
+      continue;
+    }
+
+    if ((DESIRED_ACCESS & VM_PROT_WRITE) && ! tmp_pagemap_entry.is_ACCESSLIST_empty()) {
+      tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
+      for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
+        internal_flush_request(client, page * page_size);
+      }
+      pagemap[page] = tmp_pagemap_entry;
+      continue;
+    }
+
+    if (tmp_pagemap_entry.get_INVALID()) {
+      mach_call(memory_object_data_error(MEMORY_CONTROL, page * page_size, page_size, tmp_pagemap_entry.get_ERROR()));
     }
-  }
 
-  if (! tmp_pagemap_entry.is_WAITLIST_empty()) {
     tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
-    pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-    return;
+    pagemap[page] = tmp_pagemap_entry;
+
+    operation[i] = PAGEIN;
+    any_pagein_required = true;
   }
 
-  if (tmp_pagemap_entry.get_WRITE_ACCESS_GRANTED()) {
-    tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
-    for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
-      internal_flush_request(client, OFFSET);
+  // Read ahead only into pages that nobody has or is waiting for.
+
+  for (vm_size_t i = npages; i < total; i ++, page ++) {
+
+    operation[i] = 0;
+
+    if (! pagemap[page]->is_ACCESSLIST_empty() || ! pagemap[page]->is_WAITLIST_empty()
+        || pagemap[page]->get_PAGINGOUT() || pagemap[page]->get_INVALID()) {
+      continue;
     }
-    pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-    return;
+
+    tmp_pagemap_entry = pagemap[page];
+    tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, false);
+    pagemap[page] = tmp_pagemap_entry;
+
+    operation[i] = READAHEAD;
+    any_pagein_required = true;
   }
 
-  if ((DESIRED_ACCESS & VM_PROT_WRITE) && ! tmp_pagemap_entry.is_ACCESSLIST_empty()) {
-    tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
-    for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
-      internal_flush_request(client, OFFSET);
+  if (any_pagein_required) {
+
+    pager_lock.unlock();
+
+    std::vector<vm_address_t> buffer(total);
+    std::vector<int> write_lock(total);
+    std::vector<kern_return_t> err(total);
+
+    std::unique_ptr<bool[]> do_read(new bool[total]());
+
+    for (vm_size_t i = 0; i < total; i ++) {
+      do_read[i] = (operation[i] == PAGEIN) || (operation[i] == READAHEAD);
     }
-    pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-    return;
-  }
 
-  if (tmp_pagemap_entry.get_INVALID()) {
-    mach_call(memory_object_data_error(MEMORY_CONTROL, OFFSET, LENGTH, tmp_pagemap_entry.get_ERROR()));
-  }
+    read_pages(OFFSET, total, do_read.get(), buffer.data(), write_lock.data(), err.data());
 
-  tmp_pagemap_entry.add_client_to_WAITLIST(MEMORY_CONTROL, DESIRED_ACCESS & VM_PROT_WRITE);
+    // Keep our idea of the object's size current, so that we don't
+    // read ahead past its end.
 
-  pagemap[OFFSET / page_size] = tmp_pagemap_entry;
-  pager_lock.unlock();
+    vm_address_t extent_offset;
+    vm_size_t extent_size;
 
-  vm_address_t buffer;
-  int write_lock;
+    if (pager_report_extent(upi, &extent_offset, &extent_size) != KERN_SUCCESS) {
+      extent_offset = 0;
+      extent_size = 0;
+    }
 
-  kern_return_t err = pager_read_page(upi, OFFSET, &buffer, &write_lock);
+    pager_lock.lock();
 
-  pager_lock.lock();
-  tmp_pagemap_entry = pagemap[OFFSET / page_size];
+    extent = extent_offset + extent_size;
 
-  tmp_pagemap_entry.set_ERROR(err);
-  if (err != KERN_SUCCESS) {
-    send_error_to_WAITLIST(OFFSET);
-  } else {
-    service_WAITLIST(OFFSET, buffer, !write_lock, true);
+    // A run of pages can go back in one data_supply if the requesting
+    // client is still the only one waiting on each of them, and they
+    // all get the same lock value.  Read-ahead pages are supplied
+    // read-only, so they can only join a run of requested pages if
+    // the client asked for read access alone.
+
+    auto sole_waiter = [this, MEMORY_CONTROL] (vm_offset_t page) -> bool
+      {
+        return pagemap[page]->is_ACCESSLIST_empty()
+          && (pagemap[page]->WAITLIST_num_clients() == 1)
+          && (pagemap[page]->first_WAITLIST_client().client == MEMORY_CONTROL);
+      };
+
+    auto same_supply = [&operation, DESIRED_ACCESS] (vm_size_t first, vm_size_t next) -> bool
+      {
+        return (operation[next] == operation[first])
+          || ((operation[first] == PAGEIN) && (operation[next] == READAHEAD)
+              && ! (DESIRED_ACCESS & VM_PROT_WRITE));
+      };
+
+    page = OFFSET / page_size;
+    vm_size_t i = 0;
+
+    while (i < total) {
+      if ((operation[i] != PAGEIN) && (operation[i] != READAHEAD)) {
+        i ++;
+        continue;
+      }
+
+      vm_size_t run = 0;
+
+      while (! terminating && (i + run < total)
+             && same_supply(i, i + run) && (err[i + run] == KERN_SUCCESS)
+             && (write_lock[i + run] == write_lock[i]) && sole_waiter(page + i + run)) {
+        run ++;
+      }
+
+      if (run > 1) {
+        supply_pages(MEMORY_CONTROL, (page + i) * page_size, run, &buffer[i],
+                     (operation[i] == PAGEIN) && (DESIRED_ACCESS & VM_PROT_WRITE) && ! write_lock[i]);
+        i += run;
+        continue;
+      }
+
+      tmp_pagemap_entry = pagemap[page + i];
+      if ((operation[i] == READAHEAD) && (err[i] != KERN_SUCCESS)) {
+        // Nobody asked for this page, so don't report the error
+        // unless someone has queued up behind us for it since.
+        tmp_pagemap_entry.pop_first_WAITLIST_client();
+        if (! tmp_pagemap_entry.is_WAITLIST_empty()) {
+          tmp_pagemap_entry.set_ERROR(err[i]);
+          send_error_to_WAITLIST((page + i) * page_size);
+        }
+      } else if (err[i] != KERN_SUCCESS) {
+        tmp_pagemap_entry.set_ERROR(err[i]);
+        send_error_to_WAITLIST((page + i) * page_size);
+      } else {
+        tmp_pagemap_entry.set_ERROR(err[i]);
+        service_WAITLIST((page + i) * page_size, buffer[i], !write_lock[i], true);
+      }
+      pagemap[page + i] = tmp_pagemap_entry;
+      i ++;
+    }
   }
 
-  pagemap[OFFSET / page_size] = tmp_pagemap_entry;
+  // Pages that the client already had, but other clients are waiting
+  // for.  Handle each run of them as a completed flush.
+
+  if (any_lock_completed_required) {
+    vm_size_t i = 0;
+    while (i < npages) {
+      if (operation[i] != LOCK_COMPLETED) {
+        i ++;
+        continue;
+      }
+      vm_size_t run = 1;
+      while ((i + run < npages) && (operation[i + run] == LOCK_COMPLETED)) {
+        run ++;
+      }
+      internal_lock_completed(MEMORY_CONTROL, OFFSET + i * page_size, run * page_size, pager_lock);
+      i += run;
+    }
+  }
 }
 
 void pager::object_init (mach_port_t control, mach_port_t name, vm_size_t pagesize)
@@ -335,27 +792,26 @@ void pager::drop_client (mach_port_t control, const char * const reason,
 
   bool removed_from_WAITLIST = false;
 
-  for (auto & pm: pagemap) {
-    if (pm->is_client_on_ACCESSLIST(control)) {
-      tmp_pagemap_entry = pm;
+  for (vm_size_t page = 0; page < pagemap.size(); page ++) {
+    if (pagemap[page]->is_client_on_ACCESSLIST(control)) {
+      tmp_pagemap_entry = pagemap[page];
       tmp_pagemap_entry.remove_client_from_ACCESSLIST(control);
       tmp_pagemap_entry.set_WRITE_ACCESS_GRANTED(false);
-      pm = tmp_pagemap_entry;
-    }
-    for (auto wl: pm->WAITLIST_clients()) {
-      if (wl.client == control) {
-        tmp_pagemap_entry = pm;
-        auto wl2 = tmp_pagemap_entry.WAITLIST_clients();
-        wl2.erase(std::remove_if(wl2.begin(), wl2.end(),
-                                 [control](WAITLIST_client & x){return x.client == control;}),
-                  wl2.end());
-        pm = tmp_pagemap_entry;
+      pagemap[page] = tmp_pagemap_entry;
+    }
+    if (! pagemap[page]->is_WAITLIST_empty()) {
+      tmp_pagemap_entry = pagemap[page];
+      auto & wl = tmp_pagemap_entry.WAITLIST_clients();
+      if (std::any_of(wl.begin(), wl.end(), [control](const WAITLIST_client & x){return x.client == control;})) {
+        tmp_pagemap_entry.remove_client_from_WAITLIST(control);
+        pagemap[page] = tmp_pagemap_entry;
         removed_from_WAITLIST = true;
-        break;
       }
     }
   }
 
+  pagemap.forget_client(control);
+
   if (removed_from_WAITLIST) {
     fprintf(stderr, "libpager: warning: dropping client %lu (%s) with outstanding waits\n", control, reason);
   }
@@ -388,6 +844,8 @@ void pager::drop_client (mach_port_t control, const char * const reason,
                                            MACH_MSG_TYPE_MAKE_SEND_ONCE, &old),
             KERN_INVALID_ARGUMENT);
 
+  readahead.erase(control);
+
   clients.erase(control);
 }
 
@@ -465,8 +923,9 @@ void pager::lock_object(vm_offset_t OFFSET, vm_size_t LENGTH, int RETURN, bool F
   vm_offset_t page = OFFSET / page_size;
   for (vm_size_t i = 0; i < npages; i ++, page ++) {
     // std::cerr << pagemap[page];
-    for (auto client: pagemap[page]->ACCESSLIST_clients()) {
-      if (! only_signal_WRITE_clients || pagemap[page]->get_WRITE_ACCESS_GRANTED()) {
+    tmp_pagemap_entry = pagemap[page];
+    for (auto client: tmp_pagemap_entry.ACCESSLIST_clients()) {
+      if (! only_signal_WRITE_clients || tmp_pagemap_entry.get_WRITE_ACCESS_GRANTED()) {
         clients.insert(client);
       }
     }
@@ -493,13 +952,20 @@ void pager::lock_object(vm_offset_t OFFSET, vm_size_t LENGTH, int RETURN, bool F
 
       // we now wait until any outstanding writes to complete
 
-      // find the last data block on WRITEWAIT that overlaps this lock request
-      // and wait for it to finish
+      // WRITEWAIT entries that don't overlap each other can finish in
+      // any order, so wait for the last one that overlaps this lock
+      // request, then look again until none are left
 
-      for (auto iter = WRITEWAIT.rbegin(); iter != WRITEWAIT.rend(); iter ++) {
-        if ((iter->OFFSET <= OFFSET + LENGTH) && (iter->OFFSET + iter->LENGTH >= OFFSET)) {
-          iter->waiting_threads.wait(pager_lock);
-          break;
+      bool write_outstanding = true;
+
+      while (write_outstanding) {
+        write_outstanding = false;
+        for (auto iter = WRITEWAIT.rbegin(); iter != WRITEWAIT.rend(); iter ++) {
+          if ((iter->OFFSET <= OFFSET + LENGTH) && (iter->OFFSET + iter->LENGTH >= OFFSET)) {
+            iter->waiting_threads.wait(pager_lock);
+            write_outstanding = true;
+            break;
+          }
         }
       }
     }
@@ -584,7 +1050,7 @@ void pager::internal_lock_completed(memory_object_control_t MEMORY_CONTROL,
 
   vm_size_t npages = LENGTH / page_size;
 
-  uint8_t * operation = (uint8_t *) alloca(npages);
+  std::vector<uint8_t> operation(npages);
   const int PAGEIN = 1;
   const int UNLOCK = 2;
 
@@ -611,19 +1077,22 @@ void pager::internal_lock_completed(memory_object_control_t MEMORY_CONTROL,
 
   pager_lock.unlock();
 
-  vm_address_t * buffer = (vm_address_t *) alloca(npages * sizeof(vm_address_t));
-  int * write_lock = (int *) alloca(npages * sizeof(int));
-  kern_return_t * err = (kern_return_t *) alloca(npages * sizeof(kern_return_t));
+  std::vector<vm_address_t> buffer(npages);
+  std::vector<int> write_lock(npages);
+  std::vector<kern_return_t> err(npages);
+
+  std::unique_ptr<bool[]> do_read(new bool[npages]());
 
   page = OFFSET / page_size;
   for (vm_size_t i = 0; i < npages; i ++, page ++) {
-    if (operation[i] == PAGEIN) {
-      err[i] = pager_read_page(upi, page * page_size, &buffer[i], &write_lock[i]);
-    } else if (operation[i] == UNLOCK) {
+    do_read[i] = (operation[i] == PAGEIN);
+    if (operation[i] == UNLOCK) {
       err[i] = pager_unlock_page(upi, page * page_size);
     }
   }
 
+  read_pages(OFFSET, npages, do_read.get(), buffer.data(), write_lock.data(), err.data());
+
   pager_lock.lock();
 
   page = OFFSET / page_size;
@@ -692,7 +1161,7 @@ void pager::data_unlock(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
 
   vm_size_t npages = LENGTH / page_size;
 
-  bool * do_unlock = (bool *) alloca(npages * sizeof(bool));
+  std::unique_ptr<bool[]> do_unlock(new bool[npages]());
 
   vm_offset_t page = OFFSET / page_size;
   for (vm_size_t i = 0; i < npages; i ++, page ++) {
@@ -718,7 +1187,7 @@ void pager::data_unlock(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
 
   pager_lock.unlock();
 
-  kern_return_t * err = (kern_return_t *) alloca(npages * sizeof(kern_return_t));
+  std::vector<kern_return_t> err(npages);
 
   page = OFFSET / page_size;
   for (vm_size_t i = 0; i < npages; i ++, page ++) {
@@ -739,59 +1208,248 @@ void pager::data_unlock(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
   }
 }
 
-// call with pager locked
+// next_WRITEWAIT_entry() - call with pager locked
+//
+// Returns the first entry on WRITEWAIT that isn't being written, and
+// doesn't overlap anything queued ahead of it, or WRITEWAIT.end() if
+// there isn't one.
 
-void pager::service_first_WRITEWAIT_entry(std::unique_lock<std::mutex> & pager_lock)
+std::list<WRITEWAIT_entry>::iterator pager::next_WRITEWAIT_entry(void)
 {
-  auto & current = WRITEWAIT.front();
-  vm_size_t npages = current.LENGTH / page_size;
+  return next_WRITEWAIT_entry(WRITEWAIT.end());
+}
 
-  // fprintf(stderr, "service_first_WRITEWAIT_entry(OFFSET=%d, LENGTH=%d)\n", current.OFFSET, current.LENGTH);
+// Likewise, but the first such entry after 'after'
 
-  auto matching_page_count_on_WRITEWAIT = [this] (vm_offset_t page) -> int
-    {
-      int count = 0;
+std::list<WRITEWAIT_entry>::iterator pager::next_WRITEWAIT_entry(std::list<WRITEWAIT_entry>::iterator after)
+{
+  auto it = (after == WRITEWAIT.end()) ? WRITEWAIT.begin() : std::next(after);
 
-      for (auto & next: WRITEWAIT) {
-        if ((next.OFFSET <= page * page_size) && (next.OFFSET + next.LENGTH >= (page + 1) * page_size)) {
-          count ++;
-        }
+  for (; it != WRITEWAIT.end(); it ++) {
+    if (it->WRITING) {
+      continue;
+    }
+
+    bool blocked = false;
+
+    for (auto prev = WRITEWAIT.begin(); prev != it; prev ++) {
+      if ((prev->OFFSET < it->OFFSET + it->LENGTH) && (it->OFFSET < prev->OFFSET + prev->LENGTH)) {
+        blocked = true;
+        break;
+      }
+    }
+
+    if (! blocked) {
+      return it;
+    }
+  }
+
+  return WRITEWAIT.end();
+}
+
+// start_writer() - call with pager locked
+//
+// Starts another writer thread, if there's something for it to do and
+// we're not already at max_writers.  Each writer holds a reference on
+// the pager until it exits.  Also wakes any writer that is waiting for
+// a cluster to fill.
+
+void pager::start_writer(void)
+{
+  WRITEWAIT_grown.notify_all();
+
+  if ((writers < max_writers) && (next_WRITEWAIT_entry() != WRITEWAIT.end())) {
+    writers ++;
+    ports_port_ref(this);
+    std::thread(&pager::writeback, this).detach();
+  }
+}
+
+// writeback() - the writer threads
+//
+// Write out WRITEWAIT entries until there are none we can start.
+//
+// If the translator has pager_write_pages, a writer waits up to
+// writeback_delay milliseconds before it starts, or until a full
+// cluster's worth of pages is waiting, so that the rest of a burst of
+// data_returns can queue up behind the one that started it.  It takes
+// each entry together with whatever entries adjoin it (see
+// cluster_WRITEWAIT), so that pages returned separately can go to
+// pager_write_pages as one range.  Without pager_write_pages there's
+// nothing to cluster, and no reason to wait.
+
+void pager::writeback(void)
+{
+  {
+    std::unique_lock<std::mutex> pager_lock(lock);
+
+    if (pager_write_pages) {
+      WRITEWAIT_grown.wait_for(pager_lock, std::chrono::milliseconds(writeback_delay),
+                               [this] { return WRITEWAIT_pending_pages() >= max_cluster_pages; });
+    }
+
+    for (auto it = next_WRITEWAIT_entry(); it != WRITEWAIT.end(); it = next_WRITEWAIT_entry()) {
+      service_WRITEWAIT_entries(cluster_WRITEWAIT(it), pager_lock);
+    }
+
+    writers --;
+  }
+
+  ports_port_deref(this);
+}
+
+// WRITEWAIT_pending_pages() - call with pager locked
+//
+// The number of pages in WRITEWAIT entries that no writer has taken yet.
+
+vm_size_t pager::WRITEWAIT_pending_pages(void)
+{
+  vm_size_t pages = 0;
+
+  for (auto & next: WRITEWAIT) {
+    if (! next.WRITING) {
+      pages += next.LENGTH / page_size;
+    }
+  }
+
+  return pages;
+}
+
+// WRITEWAIT_count() - call with pager locked
+//
+// The number of WRITEWAIT entries covering a page.  Only the last of
+// them needs to write it.
+
+int pager::WRITEWAIT_count(vm_offset_t page)
+{
+  int count = 0;
+
+  for (auto & next: WRITEWAIT) {
+    if ((next.OFFSET <= page * page_size) && (next.OFFSET + next.LENGTH >= (page + 1) * page_size)) {
+      count ++;
+    }
+  }
+
+  return count;
+}
+
+// cluster_WRITEWAIT() - call with pager locked
+//
+// Starting from entry 'it', collect the entries that extend it into one
+// contiguous range in either direction, up to max_cluster_pages, and
+// that we could start writing now.  They're returned in offset order,
+// and marked WRITING so that no other writer takes them.
+
+std::vector<std::list<WRITEWAIT_entry>::iterator>
+pager::cluster_WRITEWAIT(std::list<WRITEWAIT_entry>::iterator it)
+{
+  std::vector<std::list<WRITEWAIT_entry>::iterator> cluster {it};
+
+  vm_offset_t start = it->OFFSET;
+  vm_offset_t end = it->OFFSET + it->LENGTH;
+
+  it->WRITING = true;
+
+  // Only useful if the translator can write a range at once
+
+  bool extended = (pager_write_pages != NULL);
+
+  while (extended) {
+    extended = false;
+
+    for (auto next = next_WRITEWAIT_entry(); next != WRITEWAIT.end(); next = next_WRITEWAIT_entry(next)) {
+      if ((end - start + next->LENGTH) / page_size > max_cluster_pages) {
+        continue;
       }
+      if (next->OFFSET == end) {
+        cluster.push_back(next);
+        end += next->LENGTH;
+      } else if (next->OFFSET + next->LENGTH == start) {
+        cluster.insert(cluster.begin(), next);
+        start = next->OFFSET;
+      } else {
+        continue;
+      }
+      next->WRITING = true;
+      extended = true;
+      break;
+    }
+  }
 
-      return count;
-    };
+  return cluster;
+}
 
-  bool * do_pageout = (bool *) alloca(npages * sizeof(bool));
+// service_WRITEWAIT_entries() - call with pager locked
+//
+// Write out a cluster of adjoining WRITEWAIT entries, as one range if
+// there's more than one of them, then finish each entry.
+
+void pager::service_WRITEWAIT_entries(const std::vector<std::list<WRITEWAIT_entry>::iterator> & cluster,
+                                      std::unique_lock<std::mutex> & pager_lock)
+{
+  vm_offset_t start = cluster.front()->OFFSET;
+  vm_size_t npages = (cluster.back()->OFFSET + cluster.back()->LENGTH - start) / page_size;
+
+  // fprintf(stderr, "service_WRITEWAIT_entries(OFFSET=%d, LENGTH=%d, entries=%d)\n", start, npages * page_size, cluster.size());
+
+  std::unique_ptr<bool[]> do_pageout(new bool[npages]());
   bool any_pageout_required = false;
 
-  vm_offset_t page = current.OFFSET / page_size;
+  vm_offset_t page = start / page_size;
   for (vm_size_t i = 0; i < npages; i ++, page ++) {
-    do_pageout[i] = (matching_page_count_on_WRITEWAIT(page) == 1);
+    do_pageout[i] = (WRITEWAIT_count(page) == 1);
     if (do_pageout[i]) {
       any_pageout_required = true;
     }
   }
 
-  kern_return_t * err = (kern_return_t *) alloca(npages * sizeof(kern_return_t));
-
-  // fprintf(stderr, "service_first_WRITEWAIT_entry pageout_required=%d\n", any_pageout_required);
+  std::vector<kern_return_t> err(npages);
 
   if (any_pageout_required) {
 
     pager_lock.unlock();
 
-    page = current.OFFSET / page_size;
-    for (vm_size_t i = 0; i < npages; i ++, page ++) {
-      if (do_pageout[i]) {
-        err[i] = pager_write_page(upi, page * page_size, current.DATA + i * page_size);
+    if (cluster.size() == 1) {
+      write_pages(start, npages, do_pageout.get(), cluster.front()->DATA, err.data());
+    } else {
+      vm_address_t data;
+
+      mach_call(vm_allocate(mach_task_self(), &data, npages * page_size, TRUE));
+
+      for (auto & it: cluster) {
+        memcpy((void *) (data + it->OFFSET - start), (void *) it->DATA, it->LENGTH);
       }
+
+      write_pages(start, npages, do_pageout.get(), data, err.data());
+
+      mach_call(vm_deallocate(mach_task_self(), data, npages * page_size));
     }
 
     pager_lock.lock();
 
   }
 
-  bool * do_notify = (bool *) alloca(npages * sizeof(bool));
+  for (auto & it: cluster) {
+    vm_size_t first = (it->OFFSET - start) / page_size;
+    finish_WRITEWAIT_entry(it, do_pageout.get() + first, err.data() + first, pager_lock);
+  }
+}
+
+// finish_WRITEWAIT_entry() - call with pager locked
+//
+// Update the pagemap for an entry whose pages have been written out
+// (or didn't need to be), pass them on to anyone waiting for them,
+// and remove the entry.
+
+void pager::finish_WRITEWAIT_entry(std::list<WRITEWAIT_entry>::iterator it,
+                                   const bool * do_pageout, const kern_return_t * err,
+                                   std::unique_lock<std::mutex> & pager_lock)
+{
+  auto & current = *it;
+  vm_size_t npages = current.LENGTH / page_size;
+  vm_offset_t page;
+
+  std::unique_ptr<bool[]> do_notify(new bool[npages]());
   bool any_notification_required = false;
 
   page = current.OFFSET / page_size;
@@ -805,7 +1463,7 @@ void pager::service_first_WRITEWAIT_entry(std::unique_lock<std::mutex> & pager_l
         tmp_pagemap_entry.set_INVALID(true);
         tmp_pagemap_entry.set_ERROR(err[i]);
       }
-      if (matching_page_count_on_WRITEWAIT(page) == 1) {
+      if (WRITEWAIT_count(page) == 1) {
         tmp_pagemap_entry.set_PAGINGOUT(false);
         if (! current.KERNEL_COPY) {
           if (! tmp_pagemap_entry.is_WAITLIST_empty()) {
@@ -855,8 +1513,7 @@ void pager::service_first_WRITEWAIT_entry(std::unique_lock<std::mutex> & pager_l
   }
 
   current.waiting_threads.notify_all();
-  WRITEWAIT.pop_front();
-  // fprintf(stderr, "service_first_WRITEWAIT_entry pop_front\n");
+  WRITEWAIT.erase(it);
 }
 
 void pager::data_return(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFSET,
@@ -870,8 +1527,8 @@ void pager::data_return(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
 
   vm_size_t npages = LENGTH / page_size;
 
-  bool * do_unlock = (bool *) alloca(npages * sizeof(bool));
-  bool * do_notify = (bool *) alloca(npages * sizeof(bool));
+  std::unique_ptr<bool[]> do_unlock(new bool[npages]());
+  std::unique_ptr<bool[]> do_notify(new bool[npages]());
   bool any_unlocks_or_notifies_required = false;
 
   // fprintf(stderr, "data_return(MEMORY_CONTROL=%d, OFFSET=%d, LENGTH=%d, DIRTY=%d, KCOPY=%d, count=%d)\n",
@@ -919,7 +1576,7 @@ void pager::data_return(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
 
     pager_lock.unlock();
 
-    kern_return_t * err = (kern_return_t *) alloca(npages * sizeof(kern_return_t));
+    std::vector<kern_return_t> err(npages);
 
     page = OFFSET / page_size;
     for (vm_size_t i = 0; i < npages; i ++, page ++) {
@@ -944,14 +1601,8 @@ void pager::data_return(memory_object_control_t MEMORY_CONTROL, vm_offset_t OFFS
   }
 
   if (DIRTY) {
-    if (! WRITEWAIT.empty()) {
-      WRITEWAIT.emplace_back(OFFSET, DATA, LENGTH, KERNEL_COPY);
-    } else {
-      WRITEWAIT.emplace_back(OFFSET, DATA, LENGTH, KERNEL_COPY);
-      while (! WRITEWAIT.empty()) {
-        service_first_WRITEWAIT_entry(pager_lock);
-      }
-    }
+    WRITEWAIT.emplace_back(OFFSET, DATA, LENGTH, KERNEL_COPY);
+    start_writer();
   } else {
     munmap((void *) DATA, LENGTH);
   }
@@ -989,7 +1640,7 @@ pager::~pager()
     }
   }
 
-  if (! WRITEWAIT.empty()) {
+  while (! WRITEWAIT.empty()) {
     WRITEWAIT.back().waiting_threads.wait(pager_lock);
   }
 
@@ -7,9 +7,6 @@
    GNU General Public License version 2 or later (your option)
 
    written in C++11 (uses move semantics)
-
-   TODO:
-   - handle multi page operations
 */
 
 #ifndef _HURD_LIBPAGER_PAGEMAP_
@@ -20,6 +17,8 @@
 #include <list>
 #include <tuple>
 #include <map>
+#include <algorithm>
+#include <stdexcept>
 
 #include <mutex>
 #include <condition_variable>
@@ -38,31 +37,40 @@ extern "C" {
 /* libpager pagemaps are arrays of pagemap_entry's, one for
  * each page in a Mach memory object.
  *
- * A pagemap_entry is a pointer, though a pretty clever one!
+ * A pagemap_entry is a single 64-bit word, though a pretty clever one!
  *
  * The data in a pagemap_entry includes an ACCESSLIST, which is an
  * unsorted set of clients (those who currently have access), and a
  * WAITLIST, which is a sorted list of clients that have requested
  * access, and a few boolean flags.
  *
- * To support an arbitrary number of clients, the data structures are
- * variable length and dynamically allocated.  To reduce memory
- * requirements, pages with identical pagemap data all point to the
- * same structure (an instance of pagemap_entry_data).  The various
- * instances of pagemap_entry_data are tracked in a static std::set
- * (pagemap_tree).  If the state of a page changes, we never change
- * the contents of pagemap_entry_data.  Instead, we change the pointer
- * to point to a different pagemap_entry_data, creating a new one if
- * an identical one doesn't already exist in pagemap_tree.
+ * Almost every page has nobody on its ACCESSLIST, a single client, or
+ * a few clients sharing it read-only, with at most one client waiting
+ * and no error.  Those states are kept in the word itself, with the
+ * clients sharing a page as a bitmap of indices into a small table
+ * kept with the pagemap (pagemap_vector).  Changing a page between
+ * them doesn't touch pagemap_set or take its lock.
+ *
+ * To support an arbitrary number of clients, everything else is kept
+ * out of line, in variable length, dynamically allocated structures.
+ * To reduce memory requirements, pages with identical pagemap data all
+ * point to the same structure (an instance of pagemap_entry_data).
+ * The various instances of pagemap_entry_data are tracked in a static
+ * std::set (pagemap_set).  If the state of a page changes, we never
+ * change the contents of pagemap_entry_data.  Instead, we change the
+ * word, pointing it to a different pagemap_entry_data, creating a new
+ * one if an identical one doesn't already exist in pagemap_set.
  *
  * No attempt is (currently) made to reclaim unused pagemap_entry_data
- * structures; they are simply left unused in the pagemap_tree.
+ * structures; they are simply left unused in the pagemap_set.
  *
  * The code is NOT thread safe; the pager needs to be locked...
  */
 
 /* First, some nested classes culminating in class pagemap_entry_data */
 
+class pagemap_ref;
+
 // ACCESSLISTS's are an unordered set of clients that have access to a page
 
 typedef std::set<mach_port_t> ACCESSLIST_entry;
@@ -109,8 +117,14 @@ class pagemap_entry_data {
   // ERROR is the last error code returned from a backing store operation
   kern_return_t ERROR = KERN_SUCCESS;
 
+  friend class pagemap_ref;
+
 public:
 
+  // Load the state of a page, whether it's kept inline or not.
+
+  pagemap_entry_data & operator= (const pagemap_ref & ref);
+
   bool operator<(const pagemap_entry_data & rhs) const
   {
     return std::tie(ACCESSLIST, WAITLIST, PAGINGOUT, WRITE_ACCESS_GRANTED, INVALID, ERROR)
@@ -157,6 +171,11 @@ public:
     return WAITLIST.empty();
   }
 
+  int WAITLIST_num_clients(void) const
+  {
+    return WAITLIST.size();
+  }
+
   bool is_any_client_waiting_for_write_access(void) const
   {
     for (auto client: WAITLIST) {
@@ -177,6 +196,13 @@ public:
     WAITLIST.emplace_back(client, write_access_requested);
   }
 
+  void remove_client_from_WAITLIST(mach_port_t client)
+  {
+    WAITLIST.erase(std::remove_if(WAITLIST.begin(), WAITLIST.end(),
+                                  [client](const WAITLIST_client & x){return x.client == client;}),
+                   WAITLIST.end());
+  }
+
   void pop_first_WAITLIST_client(void)
   {
     if (WAITLIST.size() == 0) {
@@ -235,28 +261,70 @@ public:
 
 };
 
-// This global set contains all of the pagemap data.
+// This global set contains all of the out of line pagemap data.
 
-// The actual pagemap consists of pointers into this set, which I
+// Pages whose state can't be kept inline point into this set, which I
 // expect to save memory vs keeping separate pagemap_entry_data
 // structures for each page.
 
 // It's global because of C++'s lack of inner class support, which
-// prevents operator=() in class pagemap_entry from knowing which
-// pager its pagemap_entry belongs to.
+// prevents pagemap_ref from knowing which pager its pagemap_entry
+// belongs to.
 
 extern std::set<pagemap_entry_data> pagemap_set;
 extern std::mutex pagemap_set_mutex;
 
-// empty_page_ptr is a pointer to the empty page in pagemap_set,
-// which is the only item in pagemap_set when we initialize.
-
-extern const pagemap_entry_data * empty_page_ptr;
-
 class pagemap_entry
 {
-  // this pointer is the only data in an instance of pagemap_entry
-  const pagemap_entry_data * entry = empty_page_ptr;
+  friend class pagemap_ref;
+  friend class pagemap_entry_view;
+  friend class pagemap_entry_data;
+
+  // If bit 0 of 'word' is clear, it's a pointer into pagemap_set
+  // (which is at least two byte aligned).  If it's set, the page has
+  // an empty WAITLIST, or just one client on it and nothing on its
+  // ACCESSLIST, no ERROR, and these flags:
+
+  static const uint64_t INLINE = 1 << 0;
+  static const uint64_t PAGINGOUT = 1 << 1;
+  static const uint64_t WRITE_ACCESS_GRANTED = 1 << 2;
+  static const uint64_t INVALID = 1 << 3;
+  static const uint64_t WRITE_ACCESS_REQUESTED = 1 << 4;  // by the ONE_WAITER
+
+  // ... and the clients are one of these kinds, described by the top
+  // 32 bits of the word:
+
+  static const int KIND_SHIFT = 5;
+  static const int VALUE_SHIFT = 32;
+
+  enum kind {
+    NO_CLIENTS = 0,     // nobody
+    ONE_CLIENT = 1,     // the port on the ACCESSLIST
+    SHARED = 2,         // bitmap of pagemap_vector::shared_clients on the ACCESSLIST
+    ONE_WAITER = 3      // the port on the WAITLIST
+  };
+
+  uint64_t word = INLINE;
+
+  bool is_inline(void) const
+  {
+    return word & INLINE;
+  }
+
+  int kind(void) const
+  {
+    return (word >> KIND_SHIFT) & 3;
+  }
+
+  uint32_t value(void) const
+  {
+    return word >> VALUE_SHIFT;
+  }
+
+  const pagemap_entry_data * out_of_line(void) const
+  {
+    return (const pagemap_entry_data *) (uintptr_t) word;
+  }
 
 public:
 
@@ -264,102 +332,272 @@ public:
   // of pagemap data using the type "pagemap::data".
 
   typedef pagemap_entry_data data;
+};
+
+
+// public for object_terminate()
+class pagemap_vector
+{
+  std::vector<pagemap_entry> entries;
+
+  // The clients that SHARED entries' bitmaps refer to.  A slot is
+  // taken the first time a client shares a page with someone else,
+  // and freed by forget_client() when it's dropped.  If they're all
+  // taken, pages shared by anybody else are kept out of line.
+
+  static const int max_shared_clients = 32;
 
-  // This method allows direct access to the pagemap data and const
-  // methods, but only for read operations, as it returns a const
-  // pointer.
-
-  const pagemap_entry_data * operator->() {
-    return entry;
-  }
-
-  // This method allows us to copy-assign this pagemap entry to a
-  // pagemap_entry_data structure.
-
-  operator const pagemap_entry_data & () {
-    return * entry;
-  }
-
-  // This operator= is responsible for updating the pointer 'entry' to
-  // reflect changed data.
-  //
-  // WARNING: this is a move!  the rhs can be altered!
-  //
-  // The idea here is to keep around a pagemap_entry_data with
-  // allocated space that can be copy-assigned into without malloc'ing
-  // memory.
-  //
-  // Then, we move-insert it into pagemap_set.
-  //
-  // If the insert failed (because an identical pagemap_entry_data already
-  // exists in pagemap_set), we use the pointer to the existing
-  // entry and leave the temporary alone for the next operation,
-  // which will probably copy-assign into it without a malloc.
-  //
-  // If the insert succeeded, then
-  // "Moved from objects are left in a valid but unspecified state"
-  // https://stackoverflow.com/questions/7930105
-  //
-  // In this case, the next time we copy-assign the temporary, it
-  // will probably allocate memory.
-  //
-  // Once a pager is stable, all required pagemap_entry_data's will
-  // exist in pagemap_set, so the inserts will always fail and leave
-  // the temporary alone, so it will grow to accommodate the largest
-  // pagemap_entry_data's being processed, then won't have to do any
-  // more malloc's.
-  //
-  // i.e, "pagemap[n] = entry" might change entry to an "valid but
-  // unspecified value"
-  //
-  // The idea is to use it like this:
-  //
-  //    pagemap::data tmp;
-  //
-  //    tmp = pagemap[n];
-  //    ... modify tmp ...
-  //    pagemap[n] = tmp;
-  //
-  // A long-lived 'tmp' should avoid lots of memory
-  // allocate/deallocate operations, as the above sequence may (or may
-  // not) leave 'tmp' with allocated data structures.
-  //
-  // std::set's insert() returns a std::pair, the first item of
-  // which is an iterator that we dereference (*) to get a
-  // reference, then take its address (&) to get a pointer.
-  //
-  // https://stackoverflow.com/a/2160319/1493790
-
-  void operator= (pagemap_entry_data & data) {
-    std::unique_lock<std::mutex> lock(pagemap_set_mutex);
-    entry = &* pagemap_set.insert(std::move(data)).first;
+  mach_port_t shared_clients[max_shared_clients];
+
+  friend class pagemap_ref;
+  friend class pagemap_entry_view;
+  friend class pagemap_entry_data;
+
+  int shared_client_index(mach_port_t client) const
+  {
+    for (int i = 0; i < max_shared_clients; i ++) {
+      if (shared_clients[i] == client) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  int add_shared_client(mach_port_t client)
+  {
+    int i = shared_client_index(client);
+
+    if (i == -1) {
+      i = shared_client_index(MACH_PORT_NULL);
+      if (i != -1) {
+        shared_clients[i] = client;
+      }
+    }
+
+    return i;
+  }
+
+  public:
+
+  pagemap_vector()
+  {
+    std::fill(shared_clients, shared_clients + max_shared_clients, MACH_PORT_NULL);
+  }
+
+  vm_size_t size(void) const
+  {
+    return entries.size();
   }
 
+  // Call once CLIENT is on no page's ACCESSLIST.
+
+  void forget_client(mach_port_t client)
+  {
+    int i = shared_client_index(client);
+
+    if (i != -1) {
+      shared_clients[i] = MACH_PORT_NULL;
+    }
+  }
+
+  pagemap_ref operator[](unsigned int n);
 };
 
+// A read-only view of one page's state, with the same const methods
+// as pagemap_entry_data, whether the state is inline or not.
 
-// public for object_terminate()
-class pagemap_vector : public std::vector<pagemap_entry>
+class pagemap_entry_view
 {
-  public:
+  const pagemap_vector & map;
+  const pagemap_entry entry;
+  const pagemap_entry_data * data;
+
+public:
+
+  pagemap_entry_view(const pagemap_vector & map, const pagemap_entry & entry)
+    : map(map), entry(entry), data(entry.is_inline() ? nullptr : entry.out_of_line())
+  { }
+
+  // lets "pagemap[n]->method()" reach the methods below
+
+  const pagemap_entry_view * operator->() const
+  {
+    return this;
+  }
+
+  bool is_ACCESSLIST_empty(void) const
+  {
+    if (data) return data->is_ACCESSLIST_empty();
+    return (entry.kind() == pagemap_entry::NO_CLIENTS) || (entry.kind() == pagemap_entry::ONE_WAITER);
+  }
+
+  int ACCESSLIST_num_clients(void) const
+  {
+    if (data) return data->ACCESSLIST_num_clients();
+    switch (entry.kind()) {
+    case pagemap_entry::ONE_CLIENT:
+      return 1;
+    case pagemap_entry::SHARED:
+      return __builtin_popcount(entry.value());
+    default:
+      return 0;
+    }
+  }
 
-  pagemap_entry & operator[](unsigned int n)
+  bool is_client_on_ACCESSLIST(mach_port_t client) const
   {
-    // fprintf(stderr, "[](%d) size=%d\n", n, size());
-    if (n >= size()) {
-      resize(n+1);
+    if (data) return data->is_client_on_ACCESSLIST(client);
+    switch (entry.kind()) {
+    case pagemap_entry::ONE_CLIENT:
+      return entry.value() == client;
+    case pagemap_entry::SHARED:
+      {
+        int i = map.shared_client_index(client);
+        return (i != -1) && (entry.value() & (1u << i));
+      }
+    default:
+      return false;
     }
-    return std::vector<pagemap_entry>::operator[](n);
   }
+
+  bool is_WAITLIST_empty(void) const
+  {
+    if (data) return data->is_WAITLIST_empty();
+    return entry.kind() != pagemap_entry::ONE_WAITER;
+  }
+
+  int WAITLIST_num_clients(void) const
+  {
+    if (data) return data->WAITLIST_num_clients();
+    return entry.kind() == pagemap_entry::ONE_WAITER ? 1 : 0;
+  }
+
+  bool is_any_client_waiting_for_write_access(void) const
+  {
+    if (data) return data->is_any_client_waiting_for_write_access();
+    return (entry.kind() == pagemap_entry::ONE_WAITER) && (entry.word & pagemap_entry::WRITE_ACCESS_REQUESTED);
+  }
+
+  WAITLIST_client first_WAITLIST_client(void) const
+  {
+    if (data) return data->first_WAITLIST_client();
+    if (entry.kind() != pagemap_entry::ONE_WAITER) {
+      throw std::out_of_range("WAITLIST is empty");
+    }
+    return WAITLIST_client(entry.value(), (entry.word & pagemap_entry::WRITE_ACCESS_REQUESTED) != 0);
+  }
+
+  kern_return_t get_ERROR(void) const
+  {
+    if (data) return data->get_ERROR();
+    return KERN_SUCCESS;
+  }
+
+  bool get_INVALID(void) const
+  {
+    if (data) return data->get_INVALID();
+    return entry.word & pagemap_entry::INVALID;
+  }
+
+  bool get_PAGINGOUT(void) const
+  {
+    if (data) return data->get_PAGINGOUT();
+    return entry.word & pagemap_entry::PAGINGOUT;
+  }
+
+  bool get_WRITE_ACCESS_GRANTED(void) const
+  {
+    if (data) return data->get_WRITE_ACCESS_GRANTED();
+    return entry.word & pagemap_entry::WRITE_ACCESS_GRANTED;
+  }
+};
+
+// pagemap_vector::operator[] returns one of these, which is how
+// "pagemap[n]" gets read and written.
+//
+// The idea is to use it like this:
+//
+//    pagemap::data tmp;
+//
+//    tmp = pagemap[n];
+//    ... modify tmp ...
+//    pagemap[n] = tmp;
+//
+// or "pagemap[n]->method()" to just look at a page.
+//
+// "pagemap[n] = tmp" stores tmp inline if it can.  Otherwise, it
+// move-inserts tmp into pagemap_set, and points the entry at it.
+//
+// WARNING: this is a move!  the rhs can be altered!
+//
+// The idea here is to keep around a pagemap_entry_data with
+// allocated space that can be copy-assigned into without malloc'ing
+// memory.
+//
+// If the insert failed (because an identical pagemap_entry_data already
+// exists in pagemap_set), we use the pointer to the existing
+// entry and leave the temporary alone for the next operation,
+// which will probably copy-assign into it without a malloc.
+//
+// If the insert succeeded, then
+// "Moved from objects are left in a valid but unspecified state"
+// https://stackoverflow.com/questions/7930105
+//
+// In this case, the next time we copy-assign the temporary, it
+// will probably allocate memory.
+//
+// Once a pager is stable, all required pagemap_entry_data's will
+// exist in pagemap_set, so the inserts will always fail and leave
+// the temporary alone, so it will grow to accommodate the largest
+// pagemap_entry_data's being processed, then won't have to do any
+// more malloc's.
+//
+// i.e, "pagemap[n] = entry" might change entry to an "valid but
+// unspecified value"
+//
+// A long-lived 'tmp' should avoid lots of memory
+// allocate/deallocate operations, as the above sequence may (or may
+// not) leave 'tmp' with allocated data structures.
+
+class pagemap_ref
+{
+  pagemap_vector & map;
+  pagemap_entry & entry;
+
+  friend class pagemap_entry_data;
+
+public:
+
+  pagemap_ref(pagemap_vector & map, pagemap_entry & entry)
+    : map(map), entry(entry)
+  { }
+
+  pagemap_entry_view operator->() const
+  {
+    return pagemap_entry_view(map, entry);
+  }
+
+  void operator= (pagemap_entry_data & data);
 };
 
+inline pagemap_ref pagemap_vector::operator[](unsigned int n)
+{
+  // fprintf(stderr, "[](%d) size=%d\n", n, size());
+  if (n >= entries.size()) {
+    entries.resize(n+1);
+  }
+  return pagemap_ref(*this, entries[n]);
+}
+
 /* We might get a page returned multiple times in the time it takes to
  * write it out to disk once, so we queue up our writes in this
  * structure and thus guarantee that pager_write_page() won't overlap
  * on a single page.
  *
- * Currently, our guarantee is stronger: we don't allow overlapping
- * pager_write_page() calls at all, even on distinct pages.
+ * Up to max_writers threads write entries out concurrently (see
+ * pager::writeback).  An entry isn't started until every entry queued
+ * ahead of it that overlaps it has finished, so writes to any one page
+ * still happen one at a time, and in the order the pages came back.
  */
 
 class WRITEWAIT_entry {
@@ -369,6 +607,9 @@ public:
   vm_size_t LENGTH;
   boolean_t KERNEL_COPY;
 
+  // set while a writer thread is writing this entry out
+  bool WRITING = false;
+
   std::condition_variable waiting_threads;
 
   WRITEWAIT_entry(vm_offset_t OFFSET, vm_offset_t DATA, vm_size_t LENGTH, boolean_t KERNEL_COPY)
@@ -432,6 +673,17 @@ struct outstanding_change_request {
   }
 };
 
+/* sequential read-ahead state for one client (see readahead_pages) */
+
+struct readahead_state {
+  vm_offset_t last_end;
+  vm_offset_t next;
+  vm_size_t window = 0;
+
+  readahead_state(vm_offset_t end)
+    : last_end(end), next(end) { }
+};
+
 struct pager {
 
   // libport implements a pseudo class inheritance scheme
@@ -440,6 +692,10 @@ struct pager {
 
   const vm_size_t page_size = vm_page_size;
 
+  // read-ahead window limits, in pages
+  const vm_size_t readahead_min = 4;
+  const vm_size_t readahead_max = 32;
+
   bool may_cache;
   memory_object_copy_strategy_t copy_strategy;
   bool notify_on_evict;
@@ -456,12 +712,26 @@ struct pager {
 
   std::list<WRITEWAIT_entry> WRITEWAIT;
 
+  // writer threads servicing WRITEWAIT, and how many we allow
+  unsigned int writers = 0;
+  const unsigned int max_writers = 4;
+
+  // write-back clustering (see pager::writeback)
+  const unsigned int writeback_delay = 2;   // milliseconds
+  const vm_size_t max_cluster_pages = 64;
+  std::condition_variable WRITEWAIT_grown;
+
   std::list<NEXTERROR_entry> NEXTERROR;
 
   std::map<std::pair<vm_offset_t, vm_size_t>, outstanding_lock> outstanding_locks;
 
   std::set<outstanding_change_request> outstanding_change_requests;
 
+  std::map<mach_port_t, readahead_state> readahead;
+
+  // the end of the object, as of the last pager_report_extent()
+  vm_offset_t extent = 0;
+
   pagemap_vector pagemap;
 
   pagemap_entry::data tmp_pagemap_entry;
@@ -534,11 +804,40 @@ struct pager {
 
   void service_WAITLIST(vm_offset_t offset, vm_offset_t data, bool allow_write_access, bool deallocate);
 
+  void read_pages(vm_offset_t OFFSET, vm_size_t npages, const bool * wanted,
+                  vm_address_t * buffer, int * write_lock, kern_return_t * err);
+
+  void write_pages(vm_offset_t OFFSET, vm_size_t npages, const bool * wanted,
+                   vm_address_t data, kern_return_t * err);
+
+  vm_size_t readahead_pages(memory_object_control_t client, vm_offset_t OFFSET, vm_size_t LENGTH);
+
+  void supply_pages(memory_object_control_t client, vm_offset_t OFFSET, vm_size_t npages,
+                    vm_address_t * buffer, bool allow_write_access);
+
   void send_error_to_WAITLIST(vm_offset_t OFFSET);
 
   void finalize_unlock(vm_offset_t OFFSET, kern_return_t ERROR);
 
-  void service_first_WRITEWAIT_entry(std::unique_lock<std::mutex> & pager_lock);
+  std::list<WRITEWAIT_entry>::iterator next_WRITEWAIT_entry(void);
+
+  std::list<WRITEWAIT_entry>::iterator next_WRITEWAIT_entry(std::list<WRITEWAIT_entry>::iterator after);
+
+  int WRITEWAIT_count(vm_offset_t page);
+  vm_size_t WRITEWAIT_pending_pages(void);
+
+  std::vector<std::list<WRITEWAIT_entry>::iterator> cluster_WRITEWAIT(std::list<WRITEWAIT_entry>::iterator it);
+
+  void service_WRITEWAIT_entries(const std::vector<std::list<WRITEWAIT_entry>::iterator> & cluster,
+                                 std::unique_lock<std::mutex> & pager_lock);
+
+  void finish_WRITEWAIT_entry(std::list<WRITEWAIT_entry>::iterator it,
+                              const bool * do_pageout, const kern_return_t * err,
+                              std::unique_lock<std::mutex> & pager_lock);
+
+  void start_writer(void);
+
+  void writeback(void);
 
 };
 
@@ -31,6 +31,14 @@ struct user_pager_info;
 
 struct pager_requests;
 
+/* The most worker threads pager_start_workers will run for a bucket.
+   Each pager belongs to one worker, chosen by hashing its port, which
+   handles its requests in the order they arrive; a worker is started
+   when the first request for one of its pagers comes in.  If this is
+   zero (the default), the LIBPAGER_WORKERS environment variable is
+   used, or else 8.  Set it before calling pager_start_workers.  */
+extern int pager_max_workers;
+
 /* Start the worker threads libpager uses to service requests. If no
    error is returned, *requests will be a valid pointer, else it will be
    set to NULL.  */
@@ -203,6 +211,35 @@ pager_write_page (struct user_pager_info *pager,
 		  vm_offset_t page,
 		  vm_address_t buf);
 
+/* The user may define this function, to read several pages at once.
+   For pager PAGER, read NPAGES pages from offset START into a single
+   region, and set *BUF to be its address.  For each page I, set
+   WRITE_LOCK[I] if it must be provided read-only, and ERRORS[I] to the
+   result of reading it; the region covers failed pages too.  If an
+   error is returned, nothing was read and *BUF is not set.  Without
+   this function, or if it returns EOPNOTSUPP, libpager calls
+   pager_read_page for each page.  */
+error_t
+pager_read_pages (struct user_pager_info *pager,
+		  vm_offset_t start,
+		  vm_size_t npages,
+		  vm_address_t *buf,
+		  int *write_lock,
+		  error_t *errors) __attribute__ ((weak));
+
+/* The user may define this function, to write several pages at once.
+   For pager PAGER, synchronously write NPAGES pages from BUF to
+   offset START, and set ERRORS[I] to the result of writing page I.
+   BUF still belongs to libpager.  If an error is returned, it applies
+   to every page.  Without this function, or if it returns EOPNOTSUPP,
+   libpager calls pager_write_page for each page.  */
+error_t
+pager_write_pages (struct user_pager_info *pager,
+		   vm_offset_t start,
+		   vm_size_t npages,
+		   vm_address_t buf,
+		   error_t *errors) __attribute__ ((weak));
+
 /* The user must define this function.  A page should be made writable. */
 error_t
 pager_unlock_page (struct user_pager_info *pager,
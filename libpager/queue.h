@@ -67,3 +67,76 @@ queue_empty (struct queue *q)
 {
   return q->head == NULL;
 }
+
+/* A lock-free FIFO queue that any number of threads may add to, but
+   only one thread may take from.  Adding never blocks or retries.
+   Taking can miss an item whose enqueue hasn't finished, so a consumer
+   that finds the queue empty has to be told when items arrive (see
+   demuxer.c).
+
+   This is Dmitry Vyukov's intrusive MPSC queue: items are linked from
+   TAIL (oldest) to HEAD (newest), and STUB stands in whenever the
+   queue would otherwise be empty.  */
+struct mpsc_queue {
+  struct item *head;
+  struct item *tail;
+  struct item stub;
+};
+
+static inline void
+mpsc_queue_init (struct mpsc_queue *q)
+{
+  q->stub.next = NULL;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+}
+
+static inline void
+mpsc_queue_enqueue (struct mpsc_queue *q, struct item *r)
+{
+  struct item *prev;
+
+  __atomic_store_n (&r->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n (&q->head, r, __ATOMIC_ACQ_REL);
+  __atomic_store_n (&prev->next, r, __ATOMIC_RELEASE);
+}
+
+static inline void *
+mpsc_queue_dequeue (struct mpsc_queue *q)
+{
+  struct item *tail = q->tail;
+  struct item *next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &q->stub)
+    {
+      if (next == NULL)
+	return NULL;
+      q->tail = next;
+      tail = next;
+      next = __atomic_load_n (&next->next, __ATOMIC_ACQUIRE);
+    }
+
+  if (next != NULL)
+    {
+      q->tail = next;
+      tail->next = NULL;
+      return tail;
+    }
+
+  /* TAIL is the last item, unless an enqueue is under way.  */
+  if (tail != __atomic_load_n (&q->head, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  /* Put STUB behind it, so that we can take it.  */
+  mpsc_queue_enqueue (q, &q->stub);
+
+  next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL)
+    {
+      q->tail = next;
+      tail->next = NULL;
+      return tail;
+    }
+
+  return NULL;
+}
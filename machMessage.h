@@ -191,7 +191,7 @@ public:
         // XXX should be char *, but that would require a polymorphic
         // return type, which seems way too much trouble for something
         // that's just here for debugging
-        return reinterpret_cast<int32_t>(ptr);
+        return static_cast<int32_t>(reinterpret_cast<intptr_t>(ptr));
 
       default:
         assert(0);
@@ -233,6 +233,31 @@ public:
     return msgptr()->msgt_inline;
   }
 
+  bool is_deallocate(void)
+  {
+    return msgptr()->msgt_deallocate;
+  }
+
+  void set_deallocate(bool deallocate)
+  {
+    msgptr()->msgt_deallocate = deallocate;
+  }
+
+  /* netmsg uses the unused bit in the type descriptor, on the wire
+   * only, to flag OOL data that was sent by reference (--lazy-ool)
+   * and doesn't follow the message.
+   */
+
+  bool is_lazy(void)
+  {
+    return msgptr()->msgt_unused;
+  }
+
+  void set_lazy(bool lazy)
+  {
+    msgptr()->msgt_unused = lazy;
+  }
+
   unsigned int header_size(void)
   {
     return msgptr()->msgt_longform ? sizeof(mach_msg_type_long_t) : sizeof(mach_msg_type_t);
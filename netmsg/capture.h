@@ -0,0 +1,54 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   netmsg capture file format
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   When run with --capture=FILE, netmsg records every message it reads
+   from or writes to the network, exactly as it appears on the wire,
+   so that netmsg-replay can later play the same traffic into another
+   netmsg server.
+
+   The file is a capture_file_header, followed by any number of
+   records, each a capture_record followed by 'length' bytes: the
+   message (msgh_size bytes) and then its OOL data, in the order the
+   OOL descriptors appear in the message.  Records from different
+   threads are never interleaved, but they are only ordered by
+   timestamp within each direction.
+
+   Everything is in the host's byte order, and the message layout is
+   the host's (mach_msg_type_t alignment, OOL pointer size), so a
+   capture can only be replayed between machines of the same
+   architecture.
+*/
+
+#ifndef NETMSG_CAPTURE_H
+#define NETMSG_CAPTURE_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "NMCAPT01"
+
+/* Direction of a captured message, from the capturing netmsg's point of view */
+
+#define CAPTURE_NET_RECEIVE 1   /* read from the network, i.e, sent by the peer */
+#define CAPTURE_NET_SEND    2   /* written to the network */
+
+struct capture_file_header
+{
+  char magic[8];
+  uint32_t record_size;         /* sizeof(struct capture_record) */
+  uint32_t server;              /* nonzero if captured in server mode */
+};
+
+struct capture_record
+{
+  uint64_t timestamp;           /* CLOCK_REALTIME, nanoseconds */
+  uint32_t length;              /* bytes following this record */
+  uint16_t direction;           /* CAPTURE_NET_* */
+  uint16_t session;             /* which network connection, in server mode */
+};
+
+#endif
@@ -0,0 +1,24 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   fsys_S.h - fsys server routines, for the Linux emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   On the Hurd, this file is generated by MIG from fsys.defs.  Here
+   only fsys_getroot is demultiplexed (by fsys_server() in
+   hurd-emul.cc); every other request gets MIG_BAD_ID.
+*/
+
+#ifndef NETMSG_LINUX_FSYS_S_H
+#define NETMSG_LINUX_FSYS_S_H
+
+#include <hurd/fsys.h>
+
+kern_return_t S_fsys_getroot (mach_port_t fsys_t, mach_port_t dotdotnode,
+                              uid_t *uids, size_t nuids, uid_t *gids, size_t ngids,
+                              int flags, retry_type *do_retry, char *retry_name,
+                              mach_port_t *ret, mach_msg_type_name_t *rettype);
+
+#endif
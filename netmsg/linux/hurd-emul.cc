@@ -0,0 +1,658 @@
+/* -*- mode: C++; indent-tabs-mode: nil -*-
+
+   hurd-emul - the Hurd side of running netmsg on Linux
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   Basic usage:
+
+   SERVER:  netmsg-linux -s
+   CLIENT:  netmsg-linux --rpcs=100000 --ool=65536 --clients=4 localhost
+
+   mach-emul.cc provides Mach IPC.  This file provides the handful of
+   Hurd services netmsg expects to find around it, and something to
+   talk to:
+
+   - On the server, file_name_lookup() (called from S_fsys_getroot)
+     returns a send right to a fresh echo port in a fake filesystem
+     task, served by its own thread, which sends every request
+     straight back as its reply, rights, OOL memory and all.
+
+   - On the client, there is no parent filesystem to start us as a
+     translator, so the bootstrap port belongs to a fake parent task.
+     When netmsg calls fsys_startup() on it, the parent takes the
+     control port and starts the loopback workload: each client
+     thread does an fsys_getroot on the control port (which netmsg
+     relays to the server, which looks up an echo port), then times
+     RPCs to it.  When they're all done, we print the results and
+     exit, just like netmsg-bench.
+
+   fsys_startup(), fsys_getroot() and fsys_server() are hand-coded
+   replacements for the MIG stubs, and only have to agree with each
+   other, since both ends of the connection run this code.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <argp.h>
+#include <time.h>
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "../machMessage.h"
+
+extern "C" {
+#include <hurd.h>
+#include <hurd/fsys.h>
+#include "fsys_S.h"
+#include "netmsg-locate_S.h"
+}
+
+/* class msgBuilder
+ *
+ * Lays out a message's typed data the way mach_msg_iterator expects
+ * to find it.
+ */
+
+class msgBuilder
+{
+  machMessage & msg;
+  char * ptr;
+
+public:
+
+  msgBuilder(machMessage & msg, mach_msg_bits_t bits, mach_port_t remote, mach_port_t local, mach_msg_id_t id)
+    : msg(msg), ptr(reinterpret_cast<char *>(msg.msg) + sizeof(mach_msg_header_t))
+  {
+    msg->msgh_bits = bits;
+    msg->msgh_remote_port = remote;
+    msg->msgh_local_port = local;
+    msg->msgh_seqno = 0;
+    msg->msgh_id = id;
+    msg->msgh_size = sizeof(mach_msg_header_t);
+  }
+
+  void put(mach_msg_type_name_t name, unsigned int size_bits, unsigned int number, const void * data)
+  {
+    mach_msg_type_t * type = reinterpret_cast<mach_msg_type_t *>(ptr);
+    unsigned int length = (size_bits * number + 7) / 8;
+
+    bzero(type, sizeof(mach_msg_type_t));
+    type->msgt_name = name;
+    type->msgt_size = size_bits;
+    type->msgt_number = number;
+    type->msgt_inline = TRUE;
+
+    ptr += sizeof(mach_msg_type_t);
+    memcpy(ptr, data, length);
+    ptr += ((length + sizeof(long) - 1) / sizeof(long)) * sizeof(long);
+
+    msg->msgh_size = ptr - reinterpret_cast<char *>(msg.msg);
+  }
+
+  void put_int(int value)
+  {
+    put(MACH_MSG_TYPE_INTEGER_32, 32, 1, &value);
+  }
+
+  void put_port(mach_msg_type_name_t disposition, mach_port_t port)
+  {
+    put(disposition, 32, 1, &port);
+    msg->msgh_bits |= MACH_MSGH_BITS_COMPLEX;
+  }
+
+  void put_ool(void * data, vm_size_t bytes, bool deallocate)
+  {
+    mach_msg_type_long_t * type = reinterpret_cast<mach_msg_type_long_t *>(ptr);
+
+    bzero(type, sizeof(mach_msg_type_long_t));
+    type->msgtl_header.msgt_inline = FALSE;
+    type->msgtl_header.msgt_longform = TRUE;
+    type->msgtl_header.msgt_deallocate = deallocate;
+    type->msgtl_name = MACH_MSG_TYPE_CHAR;
+    type->msgtl_size = 8;
+    type->msgtl_number = bytes;
+
+    ptr += sizeof(mach_msg_type_long_t);
+    * reinterpret_cast<void **>(ptr) = data;
+    ptr += sizeof(void *);
+
+    msg->msgh_size = ptr - reinterpret_cast<char *>(msg.msg);
+    msg->msgh_bits |= MACH_MSGH_BITS_COMPLEX;
+  }
+};
+
+static mach_msg_type_t *
+descriptor(mach_msg_iterator & ptr)
+{
+  char * data = ptr.is_inline() ? static_cast<char *>(ptr.data()) : reinterpret_cast<char *>(ptr.OOLptr());
+  return reinterpret_cast<mach_msg_type_t *>(data - ptr.header_size());
+}
+
+static void
+reply_error(mach_msg_header_t * in, mach_msg_header_t * out, kern_return_t err)
+{
+  mig_reply_header_t * reply = reinterpret_cast<mig_reply_header_t *>(out);
+
+  reply->Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(in->msgh_bits), 0);
+  reply->Head.msgh_size = sizeof(mig_reply_header_t);
+  reply->Head.msgh_remote_port = in->msgh_remote_port;
+  reply->Head.msgh_local_port = MACH_PORT_NULL;
+  reply->Head.msgh_seqno = 0;
+  reply->Head.msgh_id = in->msgh_id + 100;
+
+  bzero(&reply->RetCodeType, sizeof(mach_msg_type_t));
+  reply->RetCodeType.msgt_name = MACH_MSG_TYPE_INTEGER_32;
+  reply->RetCodeType.msgt_size = 32;
+  reply->RetCodeType.msgt_number = 1;
+  reply->RetCodeType.msgt_inline = TRUE;
+  reply->RetCode = err;
+}
+
+
+/***** ECHO SERVER *****/
+
+static void
+echo_server(unsigned int task, mach_port_t port)
+{
+  machMessage msg;
+
+  mach_emul_set_task(task);
+
+  while (1)
+    {
+      mach_call (mach_msg (msg, MACH_RCV_MSG, 0, msg.max_size, port,
+                           MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL));
+
+      if (msg->msgh_remote_port == MACH_PORT_NULL)
+        {
+          mach_msg_destroy(msg);
+          continue;
+        }
+
+      /* Everything we received was already converted into something
+       * we can move back out: port rights arrive as MOVE types, and
+       * the OOL memory is ours to deallocate.
+       */
+
+      msg->msgh_bits = MACH_MSGH_BITS_OTHER(msg->msgh_bits)
+        | MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(msg->msgh_bits), 0);
+      msg->msgh_local_port = MACH_PORT_NULL;
+      msg->msgh_id += 100;
+
+      if (msg->msgh_bits & MACH_MSGH_BITS_COMPLEX)
+        {
+          for (auto ptr = msg.data(); ptr; ++ ptr)
+            {
+              if (! ptr.is_inline())
+                {
+                  descriptor(ptr)->msgt_deallocate = TRUE;
+                }
+            }
+        }
+
+      if (mach_call (mach_msg (msg, MACH_SEND_MSG, msg->msgh_size, 0, MACH_PORT_NULL,
+                               MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL)) != MACH_MSG_SUCCESS)
+        {
+          mach_msg_destroy(msg);
+        }
+    }
+}
+
+extern "C" {
+
+file_t
+file_name_lookup (const char *file, int flags, mode_t mode)
+{
+  static unsigned int fs_task = mach_emul_new_task();
+  unsigned int self = mach_emul_set_task(fs_task);
+  mach_port_t port;
+
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &port));
+  mach_port_t node = mach_emul_give_right(port, MACH_MSG_TYPE_MAKE_SEND, self);
+
+  mach_emul_set_task(self);
+
+  (new std::thread(echo_server, fs_task, port))->detach();
+
+  return node;
+}
+
+kern_return_t
+file_set_translator (file_t file, int passive_flags, int active_flags,
+                     int oldtrans_flags, char *passive,
+                     mach_msg_type_number_t passiveCnt,
+                     mach_port_t active, mach_msg_type_name_t activePoly)
+{
+  return ESUCCESS;
+}
+
+process_t
+getproc (void)
+{
+  mach_port_t port;
+
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_DEAD_NAME, &port));
+
+  return port;
+}
+
+kern_return_t
+proc_mark_important (process_t proc)
+{
+  return ESUCCESS;
+}
+
+int
+hurd_safe_copyin (void *dest, const void *userbuf, size_t nbytes)
+{
+  memcpy(dest, userbuf, nbytes);
+  return 0;
+}
+
+
+/***** FSYS *****/
+
+kern_return_t
+fsys_getroot (fsys_t fsys, mach_port_t dotdot_node,
+              mach_msg_type_name_t dotdot_nodePoly,
+              uid_t *gen_uids, mach_msg_type_number_t gen_uidsCnt,
+              uid_t *gen_gids, mach_msg_type_number_t gen_gidsCnt,
+              int flags, retry_type *do_retry, char *retry_name,
+              file_t *file)
+{
+  machMessage msg;
+  msgBuilder request(msg, MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE),
+                     fsys, mig_get_reply_port(), FSYS_MSGID_GETROOT);
+
+  request.put_port(dotdot_nodePoly, dotdot_node);
+  request.put(MACH_MSG_TYPE_INTEGER_32, 32, gen_uidsCnt, gen_uids);
+  request.put(MACH_MSG_TYPE_INTEGER_32, 32, gen_gidsCnt, gen_gids);
+  request.put_int(flags);
+
+  kern_return_t err = mach_msg(msg, MACH_SEND_MSG | MACH_RCV_MSG, msg->msgh_size, msg.max_size,
+                               msg->msgh_local_port, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+  if (err != MACH_MSG_SUCCESS)
+    {
+      return err;
+    }
+
+  if (msg->msgh_id != FSYS_MSGID_GETROOT + 100)
+    {
+      mach_msg_destroy(msg);
+      return MIG_REPLY_MISMATCH;
+    }
+
+  auto ptr = msg.data();
+
+  if (ptr[0] != KERN_SUCCESS)
+    {
+      return ptr[0];
+    }
+
+  *do_retry = static_cast<retry_type>((++ ptr)[0]);
+  strcpy(retry_name, (++ ptr).data());
+  *file = (++ ptr)[0];
+
+  return KERN_SUCCESS;
+}
+
+/* Only fsys_getroot is served.  netmsg's own S_fsys_getroot does the
+ * work, as it would under the real MIG stub.
+ */
+
+int
+fsys_server (mach_msg_header_t *in, mach_msg_header_t *out)
+{
+  if (in->msgh_id != FSYS_MSGID_GETROOT)
+    {
+      reply_error(in, out, MIG_BAD_ID);
+      return FALSE;
+    }
+
+  auto ptr = mach_msg_iterator(in);
+
+  mach_port_t dotdot = ptr[0];
+
+  std::vector<uid_t> uids((++ ptr).nelems());
+  memcpy(uids.data(), static_cast<void *>(ptr.data()), uids.size() * sizeof(uid_t));
+
+  std::vector<uid_t> gids((++ ptr).nelems());
+  memcpy(gids.data(), static_cast<void *>(ptr.data()), gids.size() * sizeof(uid_t));
+
+  int flags = (++ ptr)[0];
+
+  retry_type do_retry;
+  string_t retry_name;
+  mach_port_t node;
+  mach_msg_type_name_t nodetype;
+
+  kern_return_t err = S_fsys_getroot(in->msgh_local_port, dotdot, uids.data(), uids.size(),
+                                     gids.data(), gids.size(), flags,
+                                     &do_retry, retry_name, &node, &nodetype);
+
+  if (err != KERN_SUCCESS)
+    {
+      reply_error(in, out, err);
+      return TRUE;
+    }
+
+  machMessage reply(out);
+  msgBuilder builder(reply, MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(in->msgh_bits), 0),
+                     in->msgh_remote_port, MACH_PORT_NULL, in->msgh_id + 100);
+
+  builder.put_int(KERN_SUCCESS);
+  builder.put_int(do_retry);
+  builder.put(MACH_MSG_TYPE_STRING, 8, sizeof(string_t), retry_name);
+  builder.put_port(nodetype, node);
+
+  return TRUE;
+}
+
+
+/***** PORT LOCATION *****/
+
+/* Hand-coded stand-in for the MIG server stub for netmsg-locate.defs.
+ * netmsg_location_changed goes the other way, and netmsg builds it
+ * itself.
+ */
+
+int
+netmsg_locate_server (mach_msg_header_t *in, mach_msg_header_t *out)
+{
+  auto ptr = mach_msg_iterator(in);
+  kern_return_t err;
+
+  switch (in->msgh_id)
+    {
+    case NETMSG_MSGID_LOCATE:
+      {
+        /* MIG always sends an unbounded array out-of-line, and the
+         * server routine deallocates it, so hand it a copy of its own.
+         */
+
+        mach_msg_type_number_t portsCnt = ptr.nelems();
+        vm_address_t ports;
+
+        mach_call (vm_allocate (mach_task_self (), &ports, portsCnt * sizeof(mach_port_t), TRUE));
+        memcpy(reinterpret_cast<void *>(ports), static_cast<void *>(ptr.data()), portsCnt * sizeof(mach_port_t));
+
+        std::vector<int> buffer(portsCnt);
+        intarray_t nodes = buffer.data();
+        mach_msg_type_number_t nodesCnt = buffer.size();
+
+        err = S_netmsg_locate(in->msgh_local_port, reinterpret_cast<mach_port_t *>(ports), portsCnt,
+                              &nodes, &nodesCnt);
+
+        if (err != KERN_SUCCESS)
+          {
+            mach_call (vm_deallocate (mach_task_self (), ports, portsCnt * sizeof(mach_port_t)));
+            reply_error(in, out, err);
+            return TRUE;
+          }
+
+        machMessage reply(out);
+        msgBuilder builder(reply, MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(in->msgh_bits), 0),
+                           in->msgh_remote_port, MACH_PORT_NULL, in->msgh_id + 100);
+
+        builder.put_int(KERN_SUCCESS);
+        builder.put(MACH_MSG_TYPE_INTEGER_32, 32, nodesCnt, nodes);
+
+        return TRUE;
+      }
+
+    case NETMSG_MSGID_REQUEST_LOCATION_NOTIFY:
+      {
+        mach_port_t port = ptr[0];
+        mach_port_t notify = (++ ptr)[0];
+
+        err = S_netmsg_request_location_notification(in->msgh_local_port, port, notify);
+        reply_error(in, out, err);
+        return TRUE;
+      }
+
+    default:
+      reply_error(in, out, MIG_BAD_ID);
+      return FALSE;
+    }
+}
+
+
+/***** LOOPBACK WORKLOAD *****/
+
+static unsigned int rpcs = 10000;
+static unsigned int clients = 1;
+static vm_size_t oolSize = 0;
+static bool withPort = false;
+
+#define OPT_RPCS        1001
+#define OPT_CLIENTS     1002
+#define OPT_OOL         1003
+#define OPT_WITH_PORT   1004
+
+static const struct argp_option loopback_options[] =
+  {
+    { 0, 0, 0, 0, "Loopback workload (Linux emulation, client only):" },
+    { "rpcs", OPT_RPCS, "N", 0, "RPCs sent by each client thread (default 10000)" },
+    { "clients", OPT_CLIENTS, "N", 0, "client threads, each with its own remote port (default 1)" },
+    { "ool", OPT_OOL, "BYTES", 0, "out-of-line data carried by each request and reply (default none)" },
+    { "with-port", OPT_WITH_PORT, 0, 0, "carry a send right in each request and reply" },
+    { 0 }
+  };
+
+static error_t
+parse_loopback_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case OPT_RPCS:
+      rpcs = atoi(arg);
+      break;
+
+    case OPT_CLIENTS:
+      clients = atoi(arg);
+      break;
+
+    case OPT_OOL:
+      oolSize = strtoul(arg, NULL, 0);
+      break;
+
+    case OPT_WITH_PORT:
+      withPort = true;
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return ESUCCESS;
+}
+
+struct argp loopback_argp = { loopback_options, parse_loopback_opt, 0, 0 };
+
+}
+
+/* An arbitrary message ID that doesn't collide with any Hurd RPC */
+
+const mach_msg_id_t LOOPBACK_MSGID = 50200;
+
+static unsigned int parent_task;
+static mach_port_t parent_control = MACH_PORT_NULL;
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+loopback_client(double * latency)
+{
+  mach_emul_set_task(parent_task);
+
+  mach_port_t node;
+  mach_port_t dotdot;
+  retry_type do_retry;
+  string_t retry_name;
+
+  /* The server drops its reference to dotdot, so give it a real one. */
+
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &dotdot));
+
+  kern_return_t err = fsys_getroot(parent_control, dotdot, MACH_MSG_TYPE_MAKE_SEND,
+                                   NULL, 0, NULL, 0, 0, &do_retry, retry_name, &node);
+
+  if (err != KERN_SUCCESS)
+    {
+      error (1, 0, "fsys_getroot: %s", mach_error_string(err));
+    }
+
+  mach_port_t reply_port = mach_reply_port();
+  mach_port_t handle = MACH_PORT_NULL;
+  void * data = NULL;
+
+  if (withPort)
+    {
+      mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &handle));
+    }
+
+  if (oolSize > 0)
+    {
+      data = malloc(oolSize);
+      memset(data, 0xaa, oolSize);
+    }
+
+  machMessage msg;
+
+  for (unsigned int i = 0; i < rpcs; i ++)
+    {
+      msgBuilder request(msg, MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE),
+                         node, reply_port, LOOPBACK_MSGID);
+
+      request.put_int(i);
+      if (withPort)
+        {
+          request.put_port(MACH_MSG_TYPE_MAKE_SEND, handle);
+        }
+      if (oolSize > 0)
+        {
+          request.put_ool(data, oolSize, false);
+        }
+
+      double start = now();
+
+      err = mach_msg(msg, MACH_SEND_MSG | MACH_RCV_MSG, msg->msgh_size, msg.max_size,
+                     reply_port, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+      latency[i] = (now() - start) * 1e6;
+
+      if (err != MACH_MSG_SUCCESS)
+        {
+          error (1, 0, "loopback RPC %u: %s", i, mach_error_string(err));
+        }
+
+      if ((msg->msgh_id != LOOPBACK_MSGID + 100) || (msg[0][0] != i))
+        {
+          error (1, 0, "loopback RPC %u: bad reply (msgid %d)", i, msg->msgh_id);
+        }
+
+      if ((oolSize > 0) && (memcmp(msg[withPort ? 2 : 1].data(), data, oolSize) != 0))
+        {
+          error (1, 0, "loopback RPC %u: OOL data corrupted", i);
+        }
+
+      mach_msg_destroy(msg);
+    }
+
+  free(data);
+}
+
+static void
+loopback_workload(void)
+{
+  std::vector<double> latency(rpcs * clients);
+  std::vector<std::thread *> threads;
+
+  double start = now();
+
+  for (unsigned int i = 0; i < clients; i ++)
+    {
+      threads.push_back(new std::thread(loopback_client, latency.data() + i * rpcs));
+    }
+
+  for (auto thread: threads)
+    {
+      thread->join();
+      delete thread;
+    }
+
+  double elapsed = now() - start;
+  unsigned int n = rpcs * clients;
+
+  std::sort(latency.begin(), latency.end());
+
+  printf("%u clients, %u RPCs, %lu bytes OOL%s: %.0f msgs/s %.2f MB/s   p50 %.1f us   p99 %.1f us   p999 %.1f us\n",
+         clients, n, static_cast<unsigned long>(oolSize), withPort ? ", with port" : "",
+         2 * n / elapsed,
+         2.0 * oolSize * n / elapsed / (1024 * 1024),
+         latency[(n - 1) * 50 / 100], latency[(n - 1) * 99 / 100], latency[(n - 1) * 999 / 1000]);
+
+  exit(0);
+}
+
+extern "C" {
+
+kern_return_t
+task_get_bootstrap_port (task_t task, mach_port_t *bootstrap)
+{
+  static mach_port_t port = MACH_PORT_NULL;
+
+  if (port == MACH_PORT_NULL)
+    {
+      parent_task = mach_emul_new_task();
+    }
+
+  unsigned int self = mach_emul_set_task(parent_task);
+
+  if (port == MACH_PORT_NULL)
+    {
+      mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &port));
+    }
+
+  *bootstrap = mach_emul_give_right(port, MACH_MSG_TYPE_MAKE_SEND, self);
+
+  mach_emul_set_task(self);
+
+  return KERN_SUCCESS;
+}
+
+/* The fake parent translator.  Take a send right on the control port
+ * into the parent's space, and start the workload, which will wait in the control port's queue
+ * until netmsg connects and starts relaying.
+ */
+
+kern_return_t
+fsys_startup (mach_port_t bootstrap, int openflags,
+              mach_port_t control_port, mach_msg_type_name_t control_portPoly,
+              mach_port_t *realnode)
+{
+  parent_control = mach_emul_give_right(control_port, control_portPoly, parent_task);
+
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_DEAD_NAME, realnode));
+
+  (new std::thread(loopback_workload))->detach();
+
+  return KERN_SUCCESS;
+}
+
+}
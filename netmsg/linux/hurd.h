@@ -0,0 +1,92 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   hurd.h - the few Hurd interfaces netmsg uses, emulated on Linux
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   See hurd-emul.cc.  There is no filesystem or proc server behind
+   these; file_name_lookup() hands out a send right to an in-process
+   echo server, file_set_translator() attaches nothing, and the
+   bootstrap port belongs to a fake parent translator that drives a
+   loopback workload through netmsg.
+*/
+
+#ifndef NETMSG_LINUX_HURD_H
+#define NETMSG_LINUX_HURD_H
+
+#include <errno.h>
+#include <mach.h>
+
+/* netmsg.cc undefines these to get at the Hurd's error_t enum, which
+ * Linux doesn't have, so put them back.
+ */
+
+#ifndef E2BIG
+#define E2BIG 7
+#endif
+#ifndef EINVAL
+#define EINVAL 22
+#endif
+#ifndef ENOMEM
+#define ENOMEM 12
+#endif
+#ifndef EIEIO
+#define EIEIO EIO
+#endif
+#ifndef EOPNOTSUPP
+#define EOPNOTSUPP 95
+#endif
+
+#define ESUCCESS 0
+#define EMIG_BAD_ID MIG_BAD_ID
+
+typedef mach_port_t file_t;
+typedef mach_port_t fsys_t;
+typedef mach_port_t auth_t;
+typedef mach_port_t process_t;
+
+typedef char string_t[1024];
+
+typedef mach_port_t *portarray_t;
+typedef int *intarray_t;
+
+enum retry_type
+{
+  FS_RETRY_NORMAL = 1,
+  FS_RETRY_REAUTH,
+  FS_RETRY_MAGICAL
+};
+typedef enum retry_type retry_type;
+
+#define FS_TRANS_FORCE          0x00000001
+#define FS_TRANS_EXCL           0x00000002
+#define FS_TRANS_SET            0x00000004
+
+#ifndef O_NOTRANS
+#define O_NOTRANS               0x0080
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+file_t file_name_lookup (const char *file, int flags, mode_t mode);
+kern_return_t file_set_translator (file_t file, int passive_flags, int active_flags,
+                                   int oldtrans_flags, char *passive,
+                                   mach_msg_type_number_t passiveCnt,
+                                   mach_port_t active, mach_msg_type_name_t activePoly);
+process_t getproc (void);
+kern_return_t proc_mark_important (process_t proc);
+int hurd_safe_copyin (void *dest, const void *userbuf, size_t nbytes);
+
+/* Options for the loopback workload, which netmsg adds to its own */
+
+extern struct argp loopback_argp;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,41 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   hurd/fsys.h - fsys RPC user stubs for the Linux emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   Only the two RPCs a translator needs to get going are provided.
+*/
+
+#ifndef NETMSG_LINUX_HURD_FSYS_H
+#define NETMSG_LINUX_HURD_FSYS_H
+
+#include <hurd.h>
+
+/* fsys.defs message IDs */
+
+#define FSYS_MSGID_STARTUP      22000
+#define FSYS_MSGID_GETROOT      22002
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+kern_return_t fsys_startup (mach_port_t bootstrap, int openflags,
+                            mach_port_t control_port, mach_msg_type_name_t control_portPoly,
+                            mach_port_t *realnode);
+
+kern_return_t fsys_getroot (fsys_t fsys, mach_port_t dotdot_node,
+                            mach_msg_type_name_t dotdot_nodePoly,
+                            uid_t *gen_uids, mach_msg_type_number_t gen_uidsCnt,
+                            uid_t *gen_gids, mach_msg_type_number_t gen_gidsCnt,
+                            int flags, retry_type *do_retry, char *retry_name,
+                            file_t *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   hurd/ihash.h - just enough of libihash for msgids.c on Linux
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   An open addressing table, keyed on integers, that only grows.
+   Locking is left to the caller, as in libihash.
+*/
+
+#ifndef NETMSG_LINUX_HURD_IHASH_H
+#define NETMSG_LINUX_HURD_IHASH_H
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+typedef uintptr_t hurd_ihash_key_t;
+typedef void *hurd_ihash_value_t;
+typedef void (*hurd_ihash_cleanup_t) (hurd_ihash_value_t value, void *arg);
+
+struct _hurd_ihash_item
+{
+  hurd_ihash_value_t value;
+  hurd_ihash_key_t key;
+};
+
+struct hurd_ihash
+{
+  size_t nr_items;
+  size_t size;
+  struct _hurd_ihash_item *items;
+  hurd_ihash_cleanup_t cleanup;
+  void *cleanup_data;
+};
+
+#define HURD_IHASH_NO_LOCP 0
+#define HURD_IHASH_INITIALIZER(locp_offs) { 0, 0, NULL, NULL, NULL }
+
+static inline void
+hurd_ihash_set_cleanup (struct hurd_ihash *ht, hurd_ihash_cleanup_t cleanup, void *arg)
+{
+  ht->cleanup = cleanup;
+  ht->cleanup_data = arg;
+}
+
+static inline struct _hurd_ihash_item *
+_hurd_ihash_slot (struct hurd_ihash *ht, hurd_ihash_key_t key)
+{
+  size_t i = key & (ht->size - 1);
+
+  while (ht->items[i].value != NULL && ht->items[i].key != key)
+    i = (i + 1) & (ht->size - 1);
+
+  return &ht->items[i];
+}
+
+static inline hurd_ihash_value_t
+hurd_ihash_find (struct hurd_ihash *ht, hurd_ihash_key_t key)
+{
+  if (ht->size == 0)
+    return NULL;
+
+  return _hurd_ihash_slot (ht, key)->value;
+}
+
+static inline int
+hurd_ihash_add (struct hurd_ihash *ht, hurd_ihash_key_t key, hurd_ihash_value_t value)
+{
+  struct _hurd_ihash_item *slot;
+
+  if (2 * (ht->nr_items + 1) > ht->size)
+    {
+      struct hurd_ihash old = *ht;
+      size_t i;
+
+      ht->size = old.size ? 2 * old.size : 64;
+      ht->items = calloc (ht->size, sizeof (struct _hurd_ihash_item));
+      if (ht->items == NULL)
+        {
+          *ht = old;
+          return ENOMEM;
+        }
+
+      for (i = 0; i < old.size; i ++)
+        if (old.items[i].value != NULL)
+          *_hurd_ihash_slot (ht, old.items[i].key) = old.items[i];
+
+      free (old.items);
+    }
+
+  slot = _hurd_ihash_slot (ht, key);
+
+  if (slot->value == NULL)
+    ht->nr_items ++;
+  else if (ht->cleanup)
+    ht->cleanup (slot->value, ht->cleanup_data);
+
+  slot->key = key;
+  slot->value = value;
+
+  return 0;
+}
+
+#endif
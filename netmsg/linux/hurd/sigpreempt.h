@@ -0,0 +1,6 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   hurd/sigpreempt.h - nothing to preempt on Linux
+
+   hurd_safe_copyin() is declared in <hurd.h>.
+*/
@@ -0,0 +1,2642 @@
+/* -*- mode: C++; indent-tabs-mode: nil -*-
+
+   mach-emul - Mach IPC emulated in userspace, to run netmsg on Linux
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   netmsg is normally only exercised on a Hurd VM, which makes it
+   awkward to profile with perf or to run under the sanitizers.  This
+   file, together with the headers in this directory, provides enough
+   of the Mach API for the relay core in netmsg.cc to build and run
+   unchanged on Linux.
+
+   netmsg has to see the same right movement it would see between
+   Hurd tasks, so there can be more than one IPC space.  There's no
+   task_create(); instead, mach_emul_new_task() makes a new space, and
+   threads that stand in for another task enter its space with
+   mach_emul_set_task().  Everything else -
+   port allocation and right transfer, send once rights, port sets,
+   NO SENDERS, DEAD NAME, PORT DELETED and SEND ONCE notifications,
+   queue limits and send timeouts, and out-of-line memory - works as
+   in Mach.  All the spaces share one address space, though.
+
+   OOL memory is copied at send time, just like a physical copy in
+   Mach, unless the sender deallocates a page aligned region, in which
+   case the pages are simply handed to the receiver.
+
+   Everything is protected by one lock, ipc_lock.  Each receive right
+   and port set has a condition variable that receivers wait on, and
+   each receive right has another that senders blocked on a full queue
+   wait on.
+
+   Message layout follows machMessage.h: inline data is padded to a
+   multiple of sizeof(long), and OOL descriptors hold a pointer.  We
+   use machMessage.h's iterator to walk message bodies so the two
+   can't disagree.
+
+   Memory objects can be mapped, but since we can't take page faults,
+   they're filled in completely by vm_map() (see MEMORY OBJECTS,
+   below).  mach_vm_region_info() and mach_vm_object_info() can tell
+   them apart from anonymous memory.
+
+   Not emulated: task ports, paging, PORT DESTROYED notifications,
+   MACH_RCV_NOTIFY, and MACH_SEND_NOTIFY.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+
+#include "../machMessage.h"
+
+extern "C" {
+#include <mach/notify.h>
+#include <mach_debug/mach_debug.h>
+#include "memory_object_S.h"
+}
+
+vm_size_t vm_page_size = sysconf(_SC_PAGESIZE);
+
+/* The task port is never used for anything, so it just needs a name
+ * that we never hand out for anything else.  The 'task' argument to
+ * the kernel calls is ignored; they always act on the calling
+ * thread's space.
+ */
+
+const mach_port_t task_self_name = 1;
+
+thread_local unsigned int current_task = 0;
+unsigned int task_count = 1;
+
+struct ipc_kmsg;
+struct ipc_pset;
+
+/* struct ipc_port - a port, i.e, a message queue
+ *
+ * 'names' holds, for each task, the name of the entry holding our
+ * receive right and/or send rights in that task, if there is one.
+ * name() returns it for the calling thread's task.  Send once rights
+ * each get their own name.
+ *
+ * 'srights' counts send rights: one for our entry if it holds any
+ * send rights (no matter how many user references it has), plus one
+ * for every send right in a message.  'sorights' counts send once
+ * rights, including those held by notification requests.
+ *
+ * A port whose receive right has been destroyed is inactive, and is
+ * deleted once the last right and the last waiting thread goes away.
+ */
+
+struct ipc_port
+{
+  std::map<unsigned int, mach_port_t> names;
+  std::set<mach_port_t> sonames;
+
+  bool active = true;
+  ipc_pset * pset = nullptr;
+
+  std::deque<ipc_kmsg *> messages;
+  mach_port_seqno_t seqno = 0;
+  mach_port_msgcount_t qlimit = MACH_PORT_QLIMIT_DEFAULT;
+
+  mach_port_mscount_t mscount = 0;
+  unsigned int srights = 0;
+  unsigned int sorights = 0;
+  ipc_port * nsrequest = nullptr;      /* send once right for our NO SENDERS notification */
+
+  unsigned int waiters = 0;
+  std::condition_variable receivers;
+  std::condition_variable senders;
+
+  mach_port_t & name(void)
+  {
+    return names[current_task];
+  }
+};
+
+struct ipc_pset
+{
+  mach_port_t name;
+  bool active = true;
+  std::vector<ipc_port *> members;
+  unsigned int rotor = 0;              /* members are searched round-robin */
+
+  unsigned int waiters = 0;
+  std::condition_variable receivers;
+};
+
+/* struct ipc_entry - a name in an IPC space
+ *
+ * Names are never reused, even across tasks, so all the spaces share
+ * one table and each entry records which task it belongs to.  'type'
+ * is some combination of MACH_PORT_TYPE_{SEND,RECEIVE} or a
+ * single MACH_PORT_TYPE_{SEND_ONCE,PORT_SET,DEAD_NAME}.  'urefs'
+ * counts user references on send rights and dead names.
+ */
+
+struct ipc_entry
+{
+  unsigned int task;
+  mach_port_type_t type = 0;
+  mach_port_urefs_t urefs = 0;
+  ipc_port * port = nullptr;
+  ipc_pset * pset = nullptr;
+  ipc_port * dnrequest = nullptr;      /* send once right for our DEAD NAME notification */
+};
+
+/* struct ipc_right - a port right held in a kernel message
+ *
+ * 'type' is MACH_MSG_TYPE_PORT_{SEND,SEND_ONCE,RECEIVE}.  If 'port'
+ * is NULL, the right was MACH_PORT_NULL or MACH_PORT_DEAD, and
+ * 'name' says which.
+ */
+
+struct ipc_right
+{
+  ipc_port * port = nullptr;
+  mach_msg_type_name_t type = 0;
+  mach_port_t name = MACH_PORT_NULL;
+};
+
+/* struct ipc_kmsg - a message in transit
+ *
+ * The header's port names and the port names in the body are
+ * replaced by the rights they carry, in 'dest', 'reply' and 'rights'
+ * (in the order they appear in the message).  OOL memory already
+ * belongs to the message.
+ */
+
+struct ipc_kmsg
+{
+  std::vector<char> buffer;
+  ipc_right dest;
+  ipc_right reply;
+  std::vector<ipc_right> rights;
+
+  mach_msg_header_t * header(void)
+  {
+    return reinterpret_cast<mach_msg_header_t *>(buffer.data());
+  }
+};
+
+std::mutex ipc_lock;
+std::unordered_map<mach_port_t, ipc_entry> space;
+mach_port_t next_name = task_self_name + 1;
+
+void destroy_kmsg(ipc_kmsg * kmsg);
+
+
+/***** PORT AND NAME MANAGEMENT *****/
+
+/* Everything from here down to mach_msg() is called with ipc_lock held */
+
+/* Look up a name in the calling thread's space */
+
+static ipc_entry *
+lookup(mach_port_t name)
+{
+  auto it = space.find(name);
+  return ((it == space.end()) || (it->second.task != current_task)) ? nullptr : &it->second;
+}
+
+/* Look up a name in whatever space it belongs to */
+
+static ipc_entry *
+lookup_any(mach_port_t name)
+{
+  auto it = space.find(name);
+  return (it == space.end()) ? nullptr : &it->second;
+}
+
+static ipc_entry &
+new_entry(mach_port_t name)
+{
+  ipc_entry & entry = space[name];
+  entry.task = current_task;
+  return entry;
+}
+
+static mach_port_t
+alloc_name(void)
+{
+  while (space.count(next_name) || (next_name == task_self_name))
+    {
+      next_name ++;
+    }
+  return next_name ++;
+}
+
+static void
+maybe_free(ipc_port * port)
+{
+  if (! port->active && (port->srights == 0) && (port->sorights == 0) && (port->waiters == 0))
+    {
+      assert(port->messages.empty());
+      delete port;
+    }
+}
+
+static void
+maybe_free(ipc_pset * pset)
+{
+  if (! pset->active && (pset->waiters == 0))
+    {
+      delete pset;
+    }
+}
+
+static void
+wake_receivers(ipc_port * port)
+{
+  if (port->pset)
+    {
+      port->pset->receivers.notify_one();
+    }
+  else
+    {
+      port->receivers.notify_one();
+    }
+}
+
+/* Queue a message on its destination port.  Never blocks; queue
+ * limits are checked by the sender before it builds the message.
+ */
+
+static void
+deliver(ipc_kmsg * kmsg)
+{
+  ipc_port * port = kmsg->dest.port;
+
+  if (! port->active)
+    {
+      destroy_kmsg(kmsg);
+      return;
+    }
+
+  port->messages.push_back(kmsg);
+  wake_receivers(port);
+}
+
+/* Generate a kernel notification.  'notify' is a send once right,
+ * which the notification consumes.
+ */
+
+static void
+send_notification(ipc_port * notify, mach_msg_id_t id, mach_msg_size_t size,
+                  mach_msg_type_name_t body_type, unsigned int body_value)
+{
+  ipc_kmsg * kmsg = new ipc_kmsg;
+
+  kmsg->buffer.resize(size);
+
+  mach_msg_header_t * hdr = kmsg->header();
+
+  hdr->msgh_bits = MACH_MSGH_BITS(0, MACH_MSG_TYPE_PORT_SEND_ONCE);
+  hdr->msgh_size = size;
+  hdr->msgh_id = id;
+
+  if (size > sizeof(mach_msg_header_t))
+    {
+      mach_msg_type_t * type = reinterpret_cast<mach_msg_type_t *>(hdr + 1);
+
+      type->msgt_name = body_type;
+      type->msgt_size = 32;
+      type->msgt_number = 1;
+      type->msgt_inline = TRUE;
+
+      * reinterpret_cast<unsigned int *>(type + 1) = body_value;
+    }
+
+  kmsg->dest.port = notify;
+  kmsg->dest.type = MACH_MSG_TYPE_PORT_SEND_ONCE;
+
+  deliver(kmsg);
+}
+
+static void
+notify_send_once(ipc_port * notify)
+{
+  send_notification(notify, MACH_NOTIFY_SEND_ONCE, sizeof(mach_send_once_notification_t), 0, 0);
+}
+
+static void
+notify_no_senders(ipc_port * notify, mach_port_mscount_t mscount)
+{
+  send_notification(notify, MACH_NOTIFY_NO_SENDERS, sizeof(mach_no_senders_notification_t),
+                    MACH_MSG_TYPE_INTEGER_32, mscount);
+}
+
+static void
+notify_dead_name(ipc_port * notify, mach_port_t name)
+{
+  send_notification(notify, MACH_NOTIFY_DEAD_NAME, sizeof(mach_dead_name_notification_t),
+                    MACH_MSG_TYPE_PORT_NAME, name);
+}
+
+static void
+notify_port_deleted(ipc_port * notify, mach_port_t name)
+{
+  send_notification(notify, MACH_NOTIFY_PORT_DELETED, sizeof(mach_port_deleted_notification_t),
+                    MACH_MSG_TYPE_PORT_NAME, name);
+}
+
+/* Release a send right.  If it was the last one, fire any NO SENDERS
+ * request.
+ */
+
+static void
+release_send(ipc_port * port)
+{
+  assert(port->srights > 0);
+  port->srights --;
+
+  if (port->active && (port->srights == 0) && port->nsrequest)
+    {
+      ipc_port * notify = port->nsrequest;
+      port->nsrequest = nullptr;
+      notify_no_senders(notify, port->mscount);
+    }
+
+  maybe_free(port);
+}
+
+/* Destroy a send once right without using it, which sends a SEND ONCE
+ * notification to the port itself.
+ */
+
+static void
+release_send_once(ipc_port * port)
+{
+  if (port->active)
+    {
+      notify_send_once(port);
+    }
+  else
+    {
+      assert(port->sorights > 0);
+      port->sorights --;
+      maybe_free(port);
+    }
+}
+
+/* A send once right has been used to deliver a message */
+
+static void
+consume_send_once(ipc_port * port)
+{
+  assert(port->sorights > 0);
+  port->sorights --;
+  maybe_free(port);
+}
+
+/* Remove a name from the space.  If anyone was waiting for it to die,
+ * tell them it's gone instead.
+ */
+
+static void
+remove_entry(mach_port_t name)
+{
+  ipc_entry * entry = lookup_any(name);
+  ipc_port * dnrequest = entry->dnrequest;
+
+  space.erase(name);
+
+  if (dnrequest)
+    {
+      notify_port_deleted(dnrequest, name);
+    }
+}
+
+/* A send right or send once right has just turned into a dead name */
+
+static void
+kill_entry(mach_port_t name, ipc_entry * entry)
+{
+  entry->type = MACH_PORT_TYPE_DEAD_NAME;
+  entry->port = nullptr;
+
+  if (entry->dnrequest)
+    {
+      ipc_port * notify = entry->dnrequest;
+      entry->dnrequest = nullptr;
+
+      /* the notification carries its own user reference */
+      entry->urefs ++;
+      notify_dead_name(notify, name);
+    }
+}
+
+static void destroy_pset(mach_port_t name, ipc_entry * entry);
+
+static void
+remove_member(ipc_port * port)
+{
+  ipc_pset * pset = port->pset;
+
+  if (pset)
+    {
+      for (auto it = pset->members.begin(); it != pset->members.end(); it ++)
+        {
+          if (*it == port)
+            {
+              pset->members.erase(it);
+              break;
+            }
+        }
+      port->pset = nullptr;
+      port->receivers.notify_all();
+    }
+}
+
+/* The receive right has been destroyed, either explicitly or because
+ * a message carrying it was destroyed.
+ */
+
+static void
+destroy_receive(ipc_port * port)
+{
+  assert(port->active);
+
+  /* Hold the port while the notifications below are delivered,
+   * since one of them might be to the port itself.
+   */
+
+  port->active = false;
+  port->waiters ++;
+  remove_member(port);
+
+  while (! port->messages.empty())
+    {
+      ipc_kmsg * kmsg = port->messages.front();
+      port->messages.pop_front();
+      destroy_kmsg(kmsg);
+    }
+
+  if (port->nsrequest)
+    {
+      release_send_once(port->nsrequest);
+      port->nsrequest = nullptr;
+    }
+
+  for (auto & it: port->names)
+    {
+      mach_port_t name = it.second;
+
+      if (name == MACH_PORT_NULL)
+        {
+          continue;
+        }
+
+      ipc_entry * entry = lookup_any(name);
+
+      entry->type &= ~MACH_PORT_TYPE_RECEIVE;
+
+      if (entry->type & MACH_PORT_TYPE_SEND)
+        {
+          port->srights --;
+          kill_entry(name, entry);
+        }
+      else
+        {
+          remove_entry(name);
+        }
+    }
+  port->names.clear();
+
+  for (auto name: port->sonames)
+    {
+      port->sorights --;
+      kill_entry(name, lookup_any(name));
+    }
+  port->sonames.clear();
+
+  port->receivers.notify_all();
+  port->senders.notify_all();
+
+  port->waiters --;
+  maybe_free(port);
+}
+
+static void
+release_right(ipc_right & right)
+{
+  if (right.port == nullptr)
+    {
+      return;
+    }
+
+  switch (right.type)
+    {
+    case MACH_MSG_TYPE_PORT_SEND:
+      release_send(right.port);
+      break;
+
+    case MACH_MSG_TYPE_PORT_SEND_ONCE:
+      release_send_once(right.port);
+      break;
+
+    case MACH_MSG_TYPE_PORT_RECEIVE:
+      destroy_receive(right.port);
+      break;
+    }
+
+  right.port = nullptr;
+}
+
+/* Walk the port arrays and OOL regions of a message body */
+
+template<typename PortFn, typename OOLFn>
+static void
+walk_body(mach_msg_header_t * hdr, PortFn port_fn, OOLFn ool_fn)
+{
+  if (! (hdr->msgh_bits & MACH_MSGH_BITS_COMPLEX))
+    {
+      return;
+    }
+
+  for (auto ptr = mach_msg_iterator(hdr); ptr; ++ ptr)
+    {
+      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()))
+        {
+          port_fn(ptr);
+        }
+      else if (! ptr.is_inline())
+        {
+          ool_fn(ptr);
+        }
+    }
+}
+
+static mach_msg_type_t *
+descriptor(mach_msg_iterator & ptr)
+{
+  char * data = ptr.is_inline() ? static_cast<char *>(ptr.data()) : reinterpret_cast<char *>(ptr.OOLptr());
+  return reinterpret_cast<mach_msg_type_t *>(data - ptr.header_size());
+}
+
+static void
+set_type_name(mach_msg_iterator & ptr, mach_msg_type_name_t name)
+{
+  mach_msg_type_t * type = descriptor(ptr);
+
+  if (type->msgt_longform)
+    {
+      reinterpret_cast<mach_msg_type_long_t *>(type)->msgtl_name = name;
+    }
+  else
+    {
+      type->msgt_name = name;
+    }
+}
+
+static vm_size_t
+ool_size(mach_msg_iterator & ptr)
+{
+  return (static_cast<vm_size_t>(ptr.nelems()) * ptr.elemsize_bits() + 7) / 8;
+}
+
+void
+destroy_kmsg(ipc_kmsg * kmsg)
+{
+  release_right(kmsg->dest);
+  release_right(kmsg->reply);
+
+  for (auto & right: kmsg->rights)
+    {
+      release_right(right);
+    }
+
+  walk_body(kmsg->header(),
+            [] (mach_msg_iterator & ptr)
+            {
+              if (! ptr.is_inline() && (*ptr.OOLptr() != 0))
+                {
+                  vm_deallocate(task_self_name, *ptr.OOLptr(), ool_size(ptr));
+                }
+            },
+            [] (mach_msg_iterator & ptr)
+            {
+              if (*ptr.OOLptr() != 0)
+                {
+                  vm_deallocate(task_self_name, *ptr.OOLptr(), ool_size(ptr));
+                }
+            });
+
+  delete kmsg;
+}
+
+
+/***** RIGHT TRANSFER *****/
+
+static mach_msg_type_name_t
+result_type(mach_msg_type_name_t disposition)
+{
+  switch (disposition)
+    {
+    case MACH_MSG_TYPE_MOVE_RECEIVE:
+      return MACH_MSG_TYPE_PORT_RECEIVE;
+
+    case MACH_MSG_TYPE_MOVE_SEND:
+    case MACH_MSG_TYPE_COPY_SEND:
+    case MACH_MSG_TYPE_MAKE_SEND:
+      return MACH_MSG_TYPE_PORT_SEND;
+
+    case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+      return MACH_MSG_TYPE_PORT_SEND_ONCE;
+
+    default:
+      return 0;
+    }
+}
+
+/* Can 'name' be copied in with 'disposition'?  This lets mach_msg()
+ * check the header before it changes anything.
+ */
+
+static bool
+copyin_ok(mach_port_t name, mach_msg_type_name_t disposition, bool allow_dead)
+{
+  if (! MACH_PORT_VALID(name))
+    {
+      return allow_dead && (result_type(disposition) != 0);
+    }
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return false;
+    }
+
+  if (allow_dead && (entry->type == MACH_PORT_TYPE_DEAD_NAME))
+    {
+      return (disposition == MACH_MSG_TYPE_MOVE_SEND) || (disposition == MACH_MSG_TYPE_COPY_SEND)
+        || (disposition == MACH_MSG_TYPE_MOVE_SEND_ONCE);
+    }
+
+  switch (disposition)
+    {
+    case MACH_MSG_TYPE_MOVE_RECEIVE:
+    case MACH_MSG_TYPE_MAKE_SEND:
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+      return entry->type & MACH_PORT_TYPE_RECEIVE;
+
+    case MACH_MSG_TYPE_MOVE_SEND:
+    case MACH_MSG_TYPE_COPY_SEND:
+      return entry->type & MACH_PORT_TYPE_SEND;
+
+    case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+      return entry->type & MACH_PORT_TYPE_SEND_ONCE;
+
+    default:
+      return false;
+    }
+}
+
+/* Take a right out of the space, according to 'disposition' */
+
+static kern_return_t
+copyin_right(mach_port_t name, mach_msg_type_name_t disposition, ipc_right & right)
+{
+  right.port = nullptr;
+  right.type = result_type(disposition);
+  right.name = name;
+
+  if (right.type == 0)
+    {
+      return KERN_INVALID_VALUE;
+    }
+
+  if (! MACH_PORT_VALID(name))
+    {
+      return KERN_SUCCESS;
+    }
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if (entry->type == MACH_PORT_TYPE_DEAD_NAME)
+    {
+      if ((disposition == MACH_MSG_TYPE_MOVE_SEND) || (disposition == MACH_MSG_TYPE_MOVE_SEND_ONCE))
+        {
+          if (-- entry->urefs == 0)
+            {
+              remove_entry(name);
+            }
+        }
+      else if (disposition != MACH_MSG_TYPE_COPY_SEND)
+        {
+          return KERN_INVALID_RIGHT;
+        }
+      right.name = MACH_PORT_DEAD;
+      return KERN_SUCCESS;
+    }
+
+  if (! copyin_ok(name, disposition, false))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  ipc_port * port = entry->port;
+  right.port = port;
+
+  switch (disposition)
+    {
+    case MACH_MSG_TYPE_MOVE_RECEIVE:
+      remove_member(port);
+      entry->type &= ~MACH_PORT_TYPE_RECEIVE;
+      port->receivers.notify_all();
+      if (entry->type == 0)
+        {
+          port->name() = MACH_PORT_NULL;
+          remove_entry(name);
+        }
+      break;
+
+    case MACH_MSG_TYPE_MOVE_SEND:
+      if (-- entry->urefs > 0)
+        {
+          port->srights ++;
+        }
+      else
+        {
+          entry->type &= ~MACH_PORT_TYPE_SEND;
+          if (entry->type == 0)
+            {
+              port->name() = MACH_PORT_NULL;
+              remove_entry(name);
+            }
+        }
+      break;
+
+    case MACH_MSG_TYPE_COPY_SEND:
+      port->srights ++;
+      break;
+
+    case MACH_MSG_TYPE_MAKE_SEND:
+      port->srights ++;
+      port->mscount ++;
+      break;
+
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+      port->sorights ++;
+      break;
+
+    case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+      port->sonames.erase(name);
+      remove_entry(name);
+      break;
+    }
+
+  return KERN_SUCCESS;
+}
+
+/* Put a right from a message back into the space, and return its name */
+
+static mach_port_t
+copyout_right(ipc_right & right)
+{
+  ipc_port * port = right.port;
+
+  if (port == nullptr)
+    {
+      return right.name;
+    }
+
+  right.port = nullptr;
+
+  if (! port->active)
+    {
+      right.port = port;
+      release_right(right);
+      return MACH_PORT_DEAD;
+    }
+
+  mach_port_t name;
+
+  switch (right.type)
+    {
+    case MACH_MSG_TYPE_PORT_SEND:
+      if (port->name() != MACH_PORT_NULL)
+        {
+          ipc_entry * entry = lookup(port->name());
+
+          if (entry->type & MACH_PORT_TYPE_SEND)
+            {
+              entry->urefs ++;
+              port->srights --;
+            }
+          else
+            {
+              entry->type |= MACH_PORT_TYPE_SEND;
+              entry->urefs = 1;
+            }
+          return port->name();
+        }
+
+      name = alloc_name();
+      new_entry(name).type = MACH_PORT_TYPE_SEND;
+      space[name].urefs = 1;
+      space[name].port = port;
+      port->name() = name;
+      return name;
+
+    case MACH_MSG_TYPE_PORT_SEND_ONCE:
+      name = alloc_name();
+      new_entry(name).type = MACH_PORT_TYPE_SEND_ONCE;
+      space[name].urefs = 1;
+      space[name].port = port;
+      port->sonames.insert(name);
+      return name;
+
+    case MACH_MSG_TYPE_PORT_RECEIVE:
+      if (port->name() != MACH_PORT_NULL)
+        {
+          lookup(port->name())->type |= MACH_PORT_TYPE_RECEIVE;
+          return port->name();
+        }
+
+      name = alloc_name();
+      new_entry(name).type = MACH_PORT_TYPE_RECEIVE;
+      space[name].port = port;
+      port->name() = name;
+      return name;
+    }
+
+  assert(0);
+  return MACH_PORT_NULL;
+}
+
+/* Give up one user reference on a send, send once, or dead name right */
+
+static kern_return_t
+deallocate_right(mach_port_t name, ipc_entry * entry)
+{
+  ipc_port * port = entry->port;
+
+  if (entry->type & MACH_PORT_TYPE_SEND)
+    {
+      if (-- entry->urefs == 0)
+        {
+          entry->type &= ~MACH_PORT_TYPE_SEND;
+          if (entry->type == 0)
+            {
+              port->name() = MACH_PORT_NULL;
+              remove_entry(name);
+            }
+          release_send(port);
+        }
+    }
+  else if (entry->type & MACH_PORT_TYPE_SEND_ONCE)
+    {
+      port->sonames.erase(name);
+      remove_entry(name);
+      release_send_once(port);
+    }
+  else if (entry->type & MACH_PORT_TYPE_DEAD_NAME)
+    {
+      if (-- entry->urefs == 0)
+        {
+          remove_entry(name);
+        }
+    }
+  else
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  return KERN_SUCCESS;
+}
+
+static void
+destroy_pset(mach_port_t name, ipc_entry * entry)
+{
+  ipc_pset * pset = entry->pset;
+
+  for (auto port: pset->members)
+    {
+      port->pset = nullptr;
+    }
+  pset->members.clear();
+  pset->active = false;
+  pset->receivers.notify_all();
+
+  remove_entry(name);
+  maybe_free(pset);
+}
+
+
+/***** MESSAGES *****/
+
+static mach_msg_return_t
+ipc_send(std::unique_lock<std::mutex> & lk, mach_msg_header_t * msg, mach_msg_option_t option,
+         mach_msg_size_t send_size, mach_msg_timeout_t timeout)
+{
+  mach_msg_type_name_t dest_type = MACH_MSGH_BITS_REMOTE(msg->msgh_bits);
+  mach_msg_type_name_t reply_type = MACH_MSGH_BITS_LOCAL(msg->msgh_bits);
+
+  if ((send_size < sizeof(mach_msg_header_t)) || (send_size % sizeof(natural_t) != 0))
+    {
+      return MACH_SEND_MSG_TOO_SMALL;
+    }
+
+  /* Wait for room on the destination queue.  Send once rights don't
+   * count against the queue limit.
+   */
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  bool timed_out = (option & MACH_SEND_TIMEOUT) && (timeout == 0);
+
+  while (1)
+    {
+      if (! copyin_ok(msg->msgh_remote_port, dest_type, false))
+        {
+          return MACH_SEND_INVALID_DEST;
+        }
+
+      ipc_port * port = lookup(msg->msgh_remote_port)->port;
+
+      if ((result_type(dest_type) == MACH_MSG_TYPE_PORT_SEND_ONCE)
+          || (port->messages.size() < port->qlimit))
+        {
+          break;
+        }
+
+      if (timed_out)
+        {
+          return MACH_SEND_TIMED_OUT;
+        }
+
+      port->waiters ++;
+
+      if (option & MACH_SEND_TIMEOUT)
+        {
+          timed_out = (port->senders.wait_until(lk, deadline) == std::cv_status::timeout);
+        }
+      else
+        {
+          port->senders.wait(lk);
+        }
+
+      port->waiters --;
+      maybe_free(port);
+    }
+
+  if ((msg->msgh_local_port != MACH_PORT_NULL)
+      && ! copyin_ok(msg->msgh_local_port, reply_type, true))
+    {
+      return MACH_SEND_INVALID_REPLY;
+    }
+
+  ipc_kmsg * kmsg = new ipc_kmsg;
+
+  kmsg->buffer.assign(reinterpret_cast<char *>(msg), reinterpret_cast<char *>(msg) + send_size);
+  kmsg->header()->msgh_size = send_size;
+
+  copyin_right(msg->msgh_remote_port, dest_type, kmsg->dest);
+  if (msg->msgh_local_port != MACH_PORT_NULL)
+    {
+      copyin_right(msg->msgh_local_port, reply_type, kmsg->reply);
+    }
+
+  mach_msg_return_t mr = MACH_MSG_SUCCESS;
+
+  walk_body(kmsg->header(),
+            [&] (mach_msg_iterator & ptr)
+            {
+              mach_msg_type_name_t disposition = ptr.name();
+              mach_port_t * ports = ptr.data();
+
+              if (! ptr.is_inline())
+                {
+                  /* Out-of-line port array - give the message its own copy */
+
+                  vm_size_t size = ool_size(ptr);
+                  vm_address_t copy = 0;
+
+                  if (size > 0)
+                    {
+                      vm_allocate(task_self_name, &copy, size, TRUE);
+                      memcpy(reinterpret_cast<void *>(copy), ports, size);
+                      if (descriptor(ptr)->msgt_deallocate)
+                        {
+                          vm_deallocate(task_self_name, *ptr.OOLptr(), size);
+                        }
+                    }
+                  *ptr.OOLptr() = copy;
+                  ports = reinterpret_cast<mach_port_t *>(copy);
+                }
+
+              for (unsigned int i = 0; i < ptr.nelems(); i ++)
+                {
+                  ipc_right right;
+
+                  if ((mr == MACH_MSG_SUCCESS)
+                      && (copyin_right(ports[i], disposition, right) != KERN_SUCCESS))
+                    {
+                      mr = MACH_SEND_INVALID_RIGHT;
+                    }
+                  kmsg->rights.push_back(right);
+                  ports[i] = MACH_PORT_NULL;
+                }
+
+              set_type_name(ptr, result_type(disposition));
+            },
+            [&] (mach_msg_iterator & ptr)
+            {
+              vm_size_t size = ool_size(ptr);
+              vm_address_t data = *ptr.OOLptr();
+
+              if (size == 0)
+                {
+                  *ptr.OOLptr() = 0;
+                }
+              else if (! descriptor(ptr)->msgt_deallocate || (data % vm_page_size != 0))
+                {
+                  vm_address_t copy = 0;
+
+                  if (vm_allocate(task_self_name, &copy, size, TRUE) != KERN_SUCCESS)
+                    {
+                      abort();
+                    }
+                  memcpy(reinterpret_cast<void *>(copy), reinterpret_cast<void *>(data), size);
+                  if (descriptor(ptr)->msgt_deallocate)
+                    {
+                      vm_deallocate(task_self_name, data, size);
+                    }
+                  *ptr.OOLptr() = copy;
+                }
+
+              /* otherwise the sender's pages simply move into the message */
+            });
+
+  if (mr != MACH_MSG_SUCCESS)
+    {
+      destroy_kmsg(kmsg);
+      return mr;
+    }
+
+  deliver(kmsg);
+
+  return MACH_MSG_SUCCESS;
+}
+
+/* Find the next message to receive on 'name', waiting if need be */
+
+static mach_msg_return_t
+ipc_dequeue(std::unique_lock<std::mutex> & lk, mach_port_t name, mach_msg_option_t option,
+            mach_msg_timeout_t timeout, ipc_port * & port)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  bool timed_out = false;
+
+  while (1)
+    {
+      ipc_entry * entry = lookup(name);
+      ipc_pset * pset = nullptr;
+      std::condition_variable * cv;
+
+      if (entry && (entry->type & MACH_PORT_TYPE_RECEIVE))
+        {
+          port = entry->port;
+
+          if (port->pset)
+            {
+              return MACH_RCV_IN_SET;
+            }
+
+          if (! port->messages.empty())
+            {
+              return MACH_MSG_SUCCESS;
+            }
+
+          if (timed_out)
+            {
+              return MACH_RCV_TIMED_OUT;
+            }
+
+          cv = & port->receivers;
+          port->waiters ++;
+        }
+      else if (entry && (entry->type & MACH_PORT_TYPE_PORT_SET))
+        {
+          pset = entry->pset;
+          unsigned int n = pset->members.size();
+
+          for (unsigned int i = 0; i < n; i ++)
+            {
+              port = pset->members[(pset->rotor + i) % n];
+
+              if (! port->messages.empty())
+                {
+                  pset->rotor = (pset->rotor + i + 1) % n;
+                  return MACH_MSG_SUCCESS;
+                }
+            }
+
+          if (timed_out)
+            {
+              return MACH_RCV_TIMED_OUT;
+            }
+
+          port = nullptr;
+          cv = & pset->receivers;
+          pset->waiters ++;
+        }
+      else
+        {
+          return MACH_RCV_INVALID_NAME;
+        }
+
+      if (option & MACH_RCV_TIMEOUT)
+        {
+          timed_out = (cv->wait_until(lk, deadline) == std::cv_status::timeout);
+        }
+      else
+        {
+          cv->wait(lk);
+        }
+
+      /* Whatever we were waiting on might have gone away while we slept */
+
+      ipc_entry * after = lookup(name);
+
+      if (port)
+        {
+          port->waiters --;
+          bool same = port->active && after && (after->type & MACH_PORT_TYPE_RECEIVE) && (after->port == port);
+          maybe_free(port);
+          if (! same)
+            {
+              return MACH_RCV_PORT_DIED;
+            }
+        }
+      else
+        {
+          pset->waiters --;
+          bool same = pset->active && after && (after->pset == pset);
+          maybe_free(pset);
+          if (! same)
+            {
+              return MACH_RCV_PORT_CHANGED;
+            }
+        }
+    }
+}
+
+static mach_msg_return_t
+ipc_receive(std::unique_lock<std::mutex> & lk, mach_msg_header_t * msg, mach_msg_option_t option,
+            mach_msg_size_t rcv_size, mach_port_t rcv_name, mach_msg_timeout_t timeout)
+{
+  ipc_port * port;
+  mach_msg_return_t mr = ipc_dequeue(lk, rcv_name, option, timeout, port);
+
+  if (mr != MACH_MSG_SUCCESS)
+    {
+      return mr;
+    }
+
+  ipc_kmsg * kmsg = port->messages.front();
+
+  if (kmsg->buffer.size() > rcv_size)
+    {
+      if (option & MACH_RCV_LARGE)
+        {
+          msg->msgh_size = kmsg->buffer.size();
+        }
+      else
+        {
+          port->messages.pop_front();
+          port->senders.notify_all();
+          destroy_kmsg(kmsg);
+        }
+      return MACH_RCV_TOO_LARGE;
+    }
+
+  port->messages.pop_front();
+  port->senders.notify_all();
+
+  memcpy(msg, kmsg->buffer.data(), kmsg->buffer.size());
+
+  /* The destination right is used up by the delivery */
+
+  if (kmsg->dest.type == MACH_MSG_TYPE_PORT_SEND_ONCE)
+    {
+      consume_send_once(port);
+    }
+  else
+    {
+      release_send(port);
+    }
+
+  msg->msgh_bits = MACH_MSGH_BITS_OTHER(msg->msgh_bits) | MACH_MSGH_BITS(kmsg->reply.type, kmsg->dest.type);
+  msg->msgh_local_port = port->name();
+  msg->msgh_remote_port = copyout_right(kmsg->reply);
+  msg->msgh_seqno = port->seqno ++;
+
+  auto right = kmsg->rights.begin();
+
+  walk_body(msg,
+            [&] (mach_msg_iterator & ptr)
+            {
+              mach_port_t * ports = ptr.data();
+
+              for (unsigned int i = 0; i < ptr.nelems(); i ++)
+                {
+                  ports[i] = copyout_right(* right ++);
+                }
+            },
+            [] (mach_msg_iterator & ptr) { });
+
+  /* OOL memory now belongs to the receiver */
+
+  delete kmsg;
+
+  return MACH_MSG_SUCCESS;
+}
+
+extern "C" {
+
+mach_msg_return_t
+mach_msg (mach_msg_header_t *msg, mach_msg_option_t option,
+          mach_msg_size_t send_size, mach_msg_size_t rcv_size,
+          mach_port_t rcv_name, mach_msg_timeout_t timeout,
+          mach_port_t notify)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  if (option & MACH_SEND_MSG)
+    {
+      mach_msg_return_t mr = ipc_send(lk, msg, option, send_size, timeout);
+      if (mr != MACH_MSG_SUCCESS)
+        {
+          return mr;
+        }
+    }
+
+  if (option & MACH_RCV_MSG)
+    {
+      return ipc_receive(lk, msg, option, rcv_size, rcv_name, timeout);
+    }
+
+  return MACH_MSG_SUCCESS;
+}
+
+static void
+destroy_port(mach_port_t name, mach_msg_type_name_t type)
+{
+  if (! MACH_PORT_VALID(name))
+    {
+      return;
+    }
+
+  switch (type)
+    {
+    case MACH_MSG_TYPE_MOVE_SEND:
+    case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+      mach_port_deallocate(task_self_name, name);
+      break;
+
+    case MACH_MSG_TYPE_MOVE_RECEIVE:
+      mach_port_mod_refs(task_self_name, name, MACH_PORT_RIGHT_RECEIVE, -1);
+      break;
+    }
+}
+
+/* Destroy the rights and OOL memory in a received message.  As in
+ * glibc, the local port isn't touched, since receiving the message
+ * already used up the destination right.
+ */
+
+void
+mach_msg_destroy (mach_msg_header_t *msg)
+{
+  destroy_port(msg->msgh_remote_port, MACH_MSGH_BITS_REMOTE(msg->msgh_bits));
+
+  walk_body(msg,
+            [] (mach_msg_iterator & ptr)
+            {
+              mach_port_t * ports = ptr.data();
+
+              for (unsigned int i = 0; i < ptr.nelems(); i ++)
+                {
+                  destroy_port(ports[i], ptr.name());
+                }
+
+              if (! ptr.is_inline() && (*ptr.OOLptr() != 0))
+                {
+                  vm_deallocate(task_self_name, *ptr.OOLptr(), ool_size(ptr));
+                }
+            },
+            [] (mach_msg_iterator & ptr)
+            {
+              if (*ptr.OOLptr() != 0)
+                {
+                  vm_deallocate(task_self_name, *ptr.OOLptr(), ool_size(ptr));
+                }
+            });
+}
+
+mach_msg_return_t
+mach_msg_server (int (*demux) (mach_msg_header_t *, mach_msg_header_t *),
+                 mach_msg_size_t max_size, mach_port_t rcv_name)
+{
+  if (max_size == 0)
+    {
+      max_size = machMessage::max_size;
+    }
+
+  std::vector<char> inbuf(max_size);
+  std::vector<char> outbuf(max_size);
+
+  mach_msg_header_t * in = reinterpret_cast<mach_msg_header_t *>(inbuf.data());
+  mig_reply_header_t * out = reinterpret_cast<mig_reply_header_t *>(outbuf.data());
+
+  while (1)
+    {
+      mach_msg_return_t mr = mach_msg(in, MACH_RCV_MSG, 0, max_size, rcv_name, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+      if (mr != MACH_MSG_SUCCESS)
+        {
+          return mr;
+        }
+
+      demux(in, &out->Head);
+
+      if (out->RetCode == MIG_NO_REPLY)
+        {
+          continue;
+        }
+
+      if ((out->RetCode != KERN_SUCCESS) && (in->msgh_bits & MACH_MSGH_BITS_COMPLEX))
+        {
+          in->msgh_remote_port = MACH_PORT_NULL;
+          mach_msg_destroy(in);
+        }
+
+      if (out->Head.msgh_remote_port == MACH_PORT_NULL)
+        {
+          mach_msg_destroy(&out->Head);
+          continue;
+        }
+
+      mr = mach_msg(&out->Head, MACH_SEND_MSG | MACH_SEND_TIMEOUT, out->Head.msgh_size, 0,
+                    MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+
+      if (mr != MACH_MSG_SUCCESS)
+        {
+          mach_msg_destroy(&out->Head);
+        }
+    }
+}
+
+
+/***** PORTS *****/
+
+mach_port_t
+mach_task_self (void)
+{
+  return task_self_name;
+}
+
+unsigned int
+mach_emul_new_task (void)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  return task_count ++;
+}
+
+unsigned int
+mach_emul_set_task (unsigned int task)
+{
+  unsigned int old = current_task;
+
+  current_task = task;
+  return old;
+}
+
+mach_port_t
+mach_emul_give_right (mach_port_t name, mach_msg_type_name_t disposition, unsigned int task)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+  ipc_right right;
+
+  if (copyin_right(name, disposition, right) != KERN_SUCCESS)
+    {
+      return MACH_PORT_NULL;
+    }
+
+  unsigned int self = current_task;
+
+  current_task = task;
+  name = copyout_right(right);
+  current_task = self;
+
+  return name;
+}
+
+kern_return_t
+mach_port_allocate (task_t task, mach_port_right_t right, mach_port_t *name)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  *name = alloc_name();
+  ipc_entry & entry = new_entry(*name);
+
+  switch (right)
+    {
+    case MACH_PORT_RIGHT_RECEIVE:
+      entry.type = MACH_PORT_TYPE_RECEIVE;
+      entry.port = new ipc_port;
+      entry.port->name() = *name;
+      break;
+
+    case MACH_PORT_RIGHT_PORT_SET:
+      entry.type = MACH_PORT_TYPE_PORT_SET;
+      entry.pset = new ipc_pset;
+      entry.pset->name = *name;
+      break;
+
+    case MACH_PORT_RIGHT_DEAD_NAME:
+      entry.type = MACH_PORT_TYPE_DEAD_NAME;
+      entry.urefs = 1;
+      break;
+
+    default:
+      space.erase(*name);
+      return KERN_INVALID_VALUE;
+    }
+
+  return KERN_SUCCESS;
+}
+
+mach_port_t
+mach_reply_port (void)
+{
+  mach_port_t port;
+
+  if (mach_port_allocate(task_self_name, MACH_PORT_RIGHT_RECEIVE, &port) != KERN_SUCCESS)
+    {
+      return MACH_PORT_NULL;
+    }
+  return port;
+}
+
+mach_port_t
+mig_get_reply_port (void)
+{
+  static thread_local mach_port_t reply_port = MACH_PORT_NULL;
+
+  if (reply_port == MACH_PORT_NULL)
+    {
+      reply_port = mach_reply_port();
+    }
+  return reply_port;
+}
+
+kern_return_t
+mach_port_deallocate (task_t task, mach_port_t name)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  if (! MACH_PORT_VALID(name))
+    {
+      return KERN_SUCCESS;
+    }
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  return deallocate_right(name, entry);
+}
+
+kern_return_t
+mach_port_mod_refs (task_t task, mach_port_t name,
+                    mach_port_right_t right, mach_port_delta_t delta)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if ((right >= MACH_PORT_RIGHT_NUMBER) || ! (entry->type & MACH_PORT_TYPE(right)))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  if (delta == 0)
+    {
+      return KERN_SUCCESS;
+    }
+
+  switch (right)
+    {
+    case MACH_PORT_RIGHT_SEND:
+    case MACH_PORT_RIGHT_DEAD_NAME:
+      if (static_cast<int>(entry->urefs) + delta < 0)
+        {
+          return KERN_INVALID_VALUE;
+        }
+      if (static_cast<int>(entry->urefs) + delta > 0)
+        {
+          entry->urefs += delta;
+          return KERN_SUCCESS;
+        }
+      entry->urefs = 1;
+      return deallocate_right(name, entry);
+
+    case MACH_PORT_RIGHT_SEND_ONCE:
+      if (delta != -1)
+        {
+          return KERN_INVALID_VALUE;
+        }
+      return deallocate_right(name, entry);
+
+    case MACH_PORT_RIGHT_RECEIVE:
+      if (delta != -1)
+        {
+          return KERN_INVALID_VALUE;
+        }
+      destroy_receive(entry->port);
+      return KERN_SUCCESS;
+
+    case MACH_PORT_RIGHT_PORT_SET:
+      if (delta != -1)
+        {
+          return KERN_INVALID_VALUE;
+        }
+      destroy_pset(name, entry);
+      return KERN_SUCCESS;
+    }
+
+  return KERN_INVALID_RIGHT;
+}
+
+kern_return_t
+mach_port_destroy (task_t task, mach_port_t name)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if (entry->type & MACH_PORT_TYPE_PORT_SET)
+    {
+      destroy_pset(name, entry);
+      return KERN_SUCCESS;
+    }
+
+  if (entry->type & MACH_PORT_TYPE_RECEIVE)
+    {
+      destroy_receive(entry->port);
+
+      /* any send rights are now a dead name */
+      entry = lookup(name);
+      if (entry == nullptr)
+        {
+          return KERN_SUCCESS;
+        }
+    }
+
+  entry->urefs = 1;
+  return deallocate_right(name, entry);
+}
+
+kern_return_t
+mach_port_get_refs (task_t task, mach_port_t name,
+                    mach_port_right_t right, mach_port_urefs_t *refs)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if (right >= MACH_PORT_RIGHT_NUMBER)
+    {
+      return KERN_INVALID_VALUE;
+    }
+
+  if (! (entry->type & MACH_PORT_TYPE(right)))
+    {
+      *refs = 0;
+    }
+  else if ((right == MACH_PORT_RIGHT_SEND) || (right == MACH_PORT_RIGHT_DEAD_NAME))
+    {
+      *refs = entry->urefs;
+    }
+  else
+    {
+      *refs = 1;
+    }
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_insert_right (task_t task, mach_port_t name,
+                        mach_port_t poly, mach_msg_type_name_t polyPoly)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  if (! MACH_PORT_VALID(name) || (name == task_self_name))
+    {
+      return KERN_INVALID_VALUE;
+    }
+
+  if (! copyin_ok(poly, polyPoly, false))
+    {
+      return KERN_INVALID_CAPABILITY;
+    }
+
+  ipc_port * port = lookup(poly)->port;
+  ipc_entry * entry = lookup(name);
+  mach_msg_type_name_t type = result_type(polyPoly);
+
+  /* The name has to be either unused, or already denote this port */
+
+  if (entry)
+    {
+      if ((type == MACH_MSG_TYPE_PORT_SEND_ONCE) || (port->name() != name))
+        {
+          return KERN_NAME_EXISTS;
+        }
+      if ((type == MACH_MSG_TYPE_PORT_RECEIVE) && (entry->type & MACH_PORT_TYPE_RECEIVE))
+        {
+          return KERN_RIGHT_EXISTS;
+        }
+    }
+  else if ((type != MACH_MSG_TYPE_PORT_SEND_ONCE) && (port->name() != MACH_PORT_NULL)
+           && ! ((type == MACH_MSG_TYPE_PORT_RECEIVE) && (port->name() == poly)))
+    {
+      return KERN_RIGHT_EXISTS;
+    }
+
+  ipc_right right;
+
+  copyin_right(poly, polyPoly, right);
+
+  switch (type)
+    {
+    case MACH_MSG_TYPE_PORT_SEND:
+      if (entry && (entry->type & MACH_PORT_TYPE_SEND))
+        {
+          entry->urefs ++;
+          port->srights --;
+        }
+      else
+        {
+          entry = &new_entry(name);
+          entry->type |= MACH_PORT_TYPE_SEND;
+          entry->urefs = 1;
+          entry->port = port;
+          port->name() = name;
+        }
+      break;
+
+    case MACH_MSG_TYPE_PORT_SEND_ONCE:
+      entry = &new_entry(name);
+      entry->type = MACH_PORT_TYPE_SEND_ONCE;
+      entry->urefs = 1;
+      entry->port = port;
+      port->sonames.insert(name);
+      break;
+
+    case MACH_MSG_TYPE_PORT_RECEIVE:
+      entry = &new_entry(name);
+      entry->type |= MACH_PORT_TYPE_RECEIVE;
+      entry->port = port;
+      port->name() = name;
+      break;
+    }
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_extract_right (task_t task, mach_port_t name,
+                         mach_msg_type_name_t desired,
+                         mach_port_t *poly, mach_msg_type_name_t *polyPoly)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  if (! copyin_ok(name, desired, false))
+    {
+      return lookup(name) ? KERN_INVALID_RIGHT : KERN_INVALID_NAME;
+    }
+
+  ipc_right right;
+
+  copyin_right(name, desired, right);
+
+  /* With only one task, extracting a right puts it right back */
+
+  *polyPoly = right.type;
+  *poly = copyout_right(right);
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_move_member (task_t task, mach_port_t member, mach_port_t after)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(member);
+  ipc_entry * set = (after == MACH_PORT_NULL) ? nullptr : lookup(after);
+
+  if ((entry == nullptr) || ((after != MACH_PORT_NULL) && (set == nullptr)))
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if (! (entry->type & MACH_PORT_TYPE_RECEIVE) || (set && ! (set->type & MACH_PORT_TYPE_PORT_SET)))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  ipc_port * port = entry->port;
+
+  if ((after == MACH_PORT_NULL) && (port->pset == nullptr))
+    {
+      return KERN_NOT_IN_SET;
+    }
+
+  remove_member(port);
+
+  if (set)
+    {
+      port->pset = set->pset;
+      set->pset->members.push_back(port);
+
+      if (! port->messages.empty())
+        {
+          set->pset->receivers.notify_all();
+        }
+    }
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_request_notification (task_t task, mach_port_t name,
+                                integer_t variant, mach_port_mscount_t sync,
+                                mach_port_t notify, mach_msg_type_name_t notifyPoly,
+                                mach_port_t *previous)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  if ((notify != MACH_PORT_NULL)
+      && ((result_type(notifyPoly) != MACH_MSG_TYPE_PORT_SEND_ONCE) || ! copyin_ok(notify, notifyPoly, false)))
+    {
+      return KERN_INVALID_CAPABILITY;
+    }
+
+  ipc_port ** request;
+
+  switch (variant)
+    {
+    case MACH_NOTIFY_NO_SENDERS:
+      if (! (entry->type & MACH_PORT_TYPE_RECEIVE))
+        {
+          return KERN_INVALID_RIGHT;
+        }
+      request = & entry->port->nsrequest;
+      break;
+
+    case MACH_NOTIFY_DEAD_NAME:
+      if (! (entry->type & (MACH_PORT_TYPE_SEND_RIGHTS | MACH_PORT_TYPE_RECEIVE | MACH_PORT_TYPE_DEAD_NAME)))
+        {
+          return KERN_INVALID_RIGHT;
+        }
+      if ((entry->type == MACH_PORT_TYPE_DEAD_NAME) && (notify != MACH_PORT_NULL) && (sync == 0))
+        {
+          return KERN_INVALID_ARGUMENT;
+        }
+      request = & entry->dnrequest;
+      break;
+
+    default:
+      return KERN_INVALID_VALUE;
+    }
+
+  ipc_right right;
+
+  if (notify != MACH_PORT_NULL)
+    {
+      copyin_right(notify, notifyPoly, right);
+
+      /* copyin might have removed a name, but it can't be this one,
+       * since a send once right's name holds nothing else
+       */
+      entry = lookup(name);
+    }
+
+  ipc_right prev;
+
+  prev.port = *request;
+  prev.type = MACH_MSG_TYPE_PORT_SEND_ONCE;
+  *request = right.port;
+
+  /* Some requests are satisfied immediately */
+
+  if (right.port && (variant == MACH_NOTIFY_NO_SENDERS)
+      && (entry->port->srights == 0) && (sync <= entry->port->mscount))
+    {
+      *request = nullptr;
+      notify_no_senders(right.port, entry->port->mscount);
+    }
+  else if (right.port && (variant == MACH_NOTIFY_DEAD_NAME) && (entry->type == MACH_PORT_TYPE_DEAD_NAME))
+    {
+      *request = nullptr;
+      entry->urefs ++;
+      notify_dead_name(right.port, name);
+    }
+
+  *previous = copyout_right(prev);
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_names (task_t task,
+                 mach_port_array_t *names, mach_msg_type_number_t *namesCnt,
+                 mach_port_type_array_t *types, mach_msg_type_number_t *typesCnt)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  vm_size_t size = std::max<vm_size_t>(space.size(), 1) * sizeof(mach_port_t);
+
+  vm_allocate(task_self_name, reinterpret_cast<vm_address_t *>(names), size, TRUE);
+  vm_allocate(task_self_name, reinterpret_cast<vm_address_t *>(types), size, TRUE);
+
+  unsigned int i = 0;
+
+  for (auto & it: space)
+    {
+      if (it.second.task != current_task)
+        {
+          continue;
+        }
+      (*names)[i] = it.first;
+      (*types)[i] = it.second.type | (it.second.dnrequest ? MACH_PORT_TYPE_DNREQUEST : 0);
+      i ++;
+    }
+
+  *namesCnt = *typesCnt = i;
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_type (task_t task, mach_port_t name, mach_port_type_t *ptype)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+
+  *ptype = entry->type | (entry->dnrequest ? MACH_PORT_TYPE_DNREQUEST : 0);
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_get_receive_status (task_t task, mach_port_t name, mach_port_status_t *status)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+  if (! (entry->type & MACH_PORT_TYPE_RECEIVE))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  ipc_port * port = entry->port;
+
+  status->mps_pset = port->pset ? port->pset->name : MACH_PORT_NULL;
+  status->mps_seqno = port->seqno;
+  status->mps_mscount = port->mscount;
+  status->mps_qlimit = port->qlimit;
+  status->mps_msgcount = port->messages.size();
+  status->mps_sorights = port->sorights;
+  status->mps_srights = (port->srights > 0);
+  status->mps_pdrequest = FALSE;
+  status->mps_nsrequest = (port->nsrequest != nullptr);
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_set_qlimit (task_t task, mach_port_t name, mach_port_msgcount_t qlimit)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+  if (! (entry->type & MACH_PORT_TYPE_RECEIVE))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+  if (qlimit > MACH_PORT_QLIMIT_MAX)
+    {
+      return KERN_INVALID_VALUE;
+    }
+
+  entry->port->qlimit = qlimit;
+  entry->port->senders.notify_all();
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_set_mscount (task_t task, mach_port_t name, mach_port_mscount_t mscount)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+
+  ipc_entry * entry = lookup(name);
+
+  if (entry == nullptr)
+    {
+      return KERN_INVALID_NAME;
+    }
+  if (! (entry->type & MACH_PORT_TYPE_RECEIVE))
+    {
+      return KERN_INVALID_RIGHT;
+    }
+
+  entry->port->mscount = mscount;
+
+  return KERN_SUCCESS;
+}
+
+
+/***** MEMORY OBJECTS *****/
+
+/* We can't take page faults, so memory objects are emulated eagerly.
+ * vm_map() sends memory_object_init and a single
+ * memory_object_data_request for the whole region, and doesn't return
+ * until all of it has been supplied, or a memory_object_data_error
+ * has left the rest zero-filled.  After that, it's ordinary memory,
+ * and when it's deallocated (wherever it has moved to by then), the
+ * manager gets memory_object_terminate.  Nothing is ever paged out,
+ * so there's no memory_object_data_return, and every object is
+ * mapped only once, so the name port is always MACH_PORT_NULL.
+ *
+ * The control ports, and our send rights to the memory objects,
+ * belong to a kernel task, and terminations are sent by a kernel
+ * thread, since vm_deallocate() can be called with ipc_lock held.
+ *
+ * The request messages are laid out by hand, with offsets and sizes
+ * as 32 bit integers; memory_object_server() decodes them.
+ */
+
+#define MEMORY_OBJECT_MSGID_INIT 2200
+#define MEMORY_OBJECT_MSGID_TERMINATE 2201
+#define MEMORY_OBJECT_MSGID_DATA_REQUEST 2203
+
+struct memory_mapping
+{
+  mach_port_t object;                   /* send right, in the kernel task */
+  mach_port_t control;                  /* receive right, in the kernel task */
+  vm_address_t address;
+  vm_size_t size;
+  vm_size_t filled = 0;                 /* bytes supplied, or given up on */
+  std::condition_variable ready;
+};
+
+static std::mutex mapping_lock;
+static std::map<vm_address_t, memory_mapping *> mappings_by_address;
+static std::map<ipc_port *, memory_mapping *> mappings_by_control;
+static unsigned int kernel_task;
+
+/* The kernel thread's queue is never destroyed, since the kernel
+ * thread is still using it at exit.
+ */
+
+static std::deque<memory_mapping *> & terminations = * new std::deque<memory_mapping *>;
+static std::condition_variable & terminations_ready = * new std::condition_variable;
+
+static void
+put_item(char * & ptr, mach_msg_type_name_t name, unsigned int value)
+{
+  mach_msg_type_t * type = reinterpret_cast<mach_msg_type_t *>(ptr);
+
+  bzero(type, sizeof(mach_msg_type_t));
+  type->msgt_name = name;
+  type->msgt_size = 32;
+  type->msgt_number = 1;
+  type->msgt_inline = TRUE;
+
+  ptr += sizeof(mach_msg_type_t);
+  * reinterpret_cast<unsigned int *>(ptr) = value;
+  ptr += sizeof(long);
+}
+
+/* Send a request to a memory manager from the kernel task.  'items'
+ * are the control port (with 'control_type'), then integers.
+ */
+
+static void
+send_memory_object_request(memory_mapping * mapping, mach_msg_type_name_t object_type, mach_msg_id_t id,
+                           mach_msg_type_name_t control_type, std::vector<unsigned int> items)
+{
+  machMessage msg;
+  char * ptr = reinterpret_cast<char *>(msg.msg + 1);
+
+  msg->msgh_bits = MACH_MSGH_BITS(object_type, 0) | MACH_MSGH_BITS_COMPLEX;
+  msg->msgh_remote_port = mapping->object;
+  msg->msgh_local_port = MACH_PORT_NULL;
+  msg->msgh_seqno = 0;
+  msg->msgh_id = id;
+
+  put_item(ptr, control_type, mapping->control);
+  for (auto item: items)
+    {
+      put_item(ptr, MACH_MSG_TYPE_INTEGER_32, item);
+    }
+
+  msg->msgh_size = ptr - reinterpret_cast<char *>(msg.msg);
+
+  unsigned int self = mach_emul_set_task(kernel_task);
+
+  if (mach_msg(msg, MACH_SEND_MSG, msg->msgh_size, 0, MACH_PORT_NULL,
+               MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL) != MACH_MSG_SUCCESS)
+    {
+      mach_msg_destroy(msg);
+    }
+
+  mach_emul_set_task(self);
+}
+
+static void
+kernel_thread(void)
+{
+  mach_emul_set_task(kernel_task);
+
+  std::unique_lock<std::mutex> lk(mapping_lock);
+
+  while (1)
+    {
+      while (terminations.empty())
+        {
+          terminations_ready.wait(lk);
+        }
+
+      memory_mapping * mapping = terminations.front();
+      terminations.pop_front();
+
+      lk.unlock();
+
+      send_memory_object_request(mapping, MACH_MSG_TYPE_MOVE_SEND, MEMORY_OBJECT_MSGID_TERMINATE,
+                                 MACH_MSG_TYPE_MOVE_RECEIVE, {MACH_PORT_NULL});
+      delete mapping;
+
+      lk.lock();
+    }
+}
+
+/* Find the mapping for a control port in the caller's space.  Call
+ * with mapping_lock held, and 'port' from control_port(), which has
+ * to be called first, since ipc_lock comes before mapping_lock.
+ */
+
+static ipc_port *
+control_port(memory_object_control_t control)
+{
+  std::unique_lock<std::mutex> lk(ipc_lock);
+  ipc_entry * entry = lookup(control);
+
+  return (entry && (entry->type & MACH_PORT_TYPE_SEND)) ? entry->port : nullptr;
+}
+
+static memory_mapping *
+lookup_mapping(ipc_port * port)
+{
+  auto it = mappings_by_control.find(port);
+
+  return (it == mappings_by_control.end()) ? nullptr : it->second;
+}
+
+static kern_return_t
+map_memory_object(vm_address_t *address, vm_size_t size, boolean_t anywhere, memory_object_t memory_object)
+{
+  static std::once_flag started;
+
+  std::call_once(started, [] {
+      kernel_task = mach_emul_new_task();
+      (new std::thread(kernel_thread))->detach();
+    });
+
+  kern_return_t kr = vm_allocate(task_self_name, address, size, anywhere);
+
+  if (kr != KERN_SUCCESS)
+    {
+      return kr;
+    }
+
+  memory_mapping * mapping = new memory_mapping;
+
+  mapping->address = *address;
+  mapping->size = round_page(size);
+  mapping->object = mach_emul_give_right(memory_object, MACH_MSG_TYPE_COPY_SEND, kernel_task);
+
+  if (mapping->object == MACH_PORT_NULL)
+    {
+      vm_deallocate(task_self_name, *address, size);
+      delete mapping;
+      return KERN_INVALID_ARGUMENT;
+    }
+
+  unsigned int self = mach_emul_set_task(kernel_task);
+
+  mach_port_allocate(task_self_name, MACH_PORT_RIGHT_RECEIVE, &mapping->control);
+
+  {
+    std::unique_lock<std::mutex> lk(ipc_lock);
+    ipc_port * port = lookup(mapping->control)->port;
+
+    std::unique_lock<std::mutex> mlk(mapping_lock);
+    mappings_by_control[port] = mapping;
+  }
+
+  mach_emul_set_task(self);
+
+  send_memory_object_request(mapping, MACH_MSG_TYPE_COPY_SEND, MEMORY_OBJECT_MSGID_INIT,
+                             MACH_MSG_TYPE_MAKE_SEND, {MACH_PORT_NULL, static_cast<unsigned int>(vm_page_size)});
+  send_memory_object_request(mapping, MACH_MSG_TYPE_COPY_SEND, MEMORY_OBJECT_MSGID_DATA_REQUEST,
+                             MACH_MSG_TYPE_MAKE_SEND, {0, static_cast<unsigned int>(mapping->size), VM_PROT_ALL});
+
+  std::unique_lock<std::mutex> lk(mapping_lock);
+
+  while (mapping->filled < mapping->size)
+    {
+      mapping->ready.wait(lk);
+    }
+
+  mappings_by_address[mapping->address] = mapping;
+
+  return KERN_SUCCESS;
+}
+
+/* Called from vm_deallocate(), possibly with ipc_lock held */
+
+static void
+unmap_memory_object(vm_address_t address)
+{
+  std::unique_lock<std::mutex> lk(mapping_lock);
+  auto it = mappings_by_address.find(address);
+
+  if (it != mappings_by_address.end())
+    {
+      memory_mapping * mapping = it->second;
+
+      mappings_by_address.erase(it);
+      for (auto & entry: mappings_by_control)
+        {
+          if (entry.second == mapping)
+            {
+              mappings_by_control.erase(entry.first);
+              break;
+            }
+        }
+
+      terminations.push_back(mapping);
+      terminations_ready.notify_one();
+    }
+}
+
+kern_return_t
+memory_object_ready (memory_object_control_t control, boolean_t may_cache,
+                     memory_object_copy_strategy_t copy_strategy)
+{
+  ipc_port * port = control_port(control);
+  std::unique_lock<std::mutex> lk(mapping_lock);
+
+  return lookup_mapping(port) ? KERN_SUCCESS : KERN_INVALID_ARGUMENT;
+}
+
+kern_return_t
+memory_object_data_supply (memory_object_control_t control, vm_offset_t offset,
+                           pointer_t data, mach_msg_type_number_t dataCnt, boolean_t dealloc_data,
+                           vm_prot_t lock_value, boolean_t precious, mach_port_t reply_to)
+{
+  kern_return_t kr = KERN_INVALID_ARGUMENT;
+  ipc_port * port = control_port(control);
+
+  {
+    std::unique_lock<std::mutex> lk(mapping_lock);
+    memory_mapping * mapping = lookup_mapping(port);
+
+    if (mapping && (offset < mapping->size))
+      {
+        memcpy(reinterpret_cast<void *>(mapping->address + offset), reinterpret_cast<void *>(data),
+               std::min<vm_size_t>(dataCnt, mapping->size - offset));
+        mapping->filled += dataCnt;
+        mapping->ready.notify_all();
+        kr = KERN_SUCCESS;
+      }
+  }
+
+  if (dealloc_data)
+    {
+      vm_deallocate(task_self_name, data, dataCnt);
+    }
+
+  return kr;
+}
+
+kern_return_t
+memory_object_data_error (memory_object_control_t control, vm_offset_t offset,
+                          vm_size_t size, kern_return_t error_value)
+{
+  ipc_port * port = control_port(control);
+  std::unique_lock<std::mutex> lk(mapping_lock);
+  memory_mapping * mapping = lookup_mapping(port);
+
+  if (mapping == nullptr)
+    {
+      return KERN_INVALID_ARGUMENT;
+    }
+
+  mapping->filled += size;
+  mapping->ready.notify_all();
+
+  return KERN_SUCCESS;
+}
+
+/* The MIG server side, for the three requests we send */
+
+int
+memory_object_server (mach_msg_header_t *in, mach_msg_header_t *out)
+{
+  mig_reply_header_t * reply = reinterpret_cast<mig_reply_header_t *>(out);
+  auto ptr = mach_msg_iterator(in);
+  mach_port_t control = ptr[0];
+  int handled = TRUE;
+
+  switch (in->msgh_id)
+    {
+    case MEMORY_OBJECT_MSGID_INIT:
+      {
+        mach_port_t name = (++ ptr)[0];
+        vm_size_t page_size = (++ ptr)[0];
+
+        reply->RetCode = S_memory_object_init(in->msgh_local_port, control, name, page_size);
+      }
+      break;
+
+    case MEMORY_OBJECT_MSGID_TERMINATE:
+      reply->RetCode = S_memory_object_terminate(in->msgh_local_port, control, (++ ptr)[0]);
+      break;
+
+    case MEMORY_OBJECT_MSGID_DATA_REQUEST:
+      {
+        vm_offset_t offset = (++ ptr)[0];
+        vm_size_t length = (++ ptr)[0];
+        vm_prot_t access = (++ ptr)[0];
+
+        reply->RetCode = S_memory_object_data_request(in->msgh_local_port, control, offset, length, access);
+      }
+      break;
+
+    default:
+      reply->RetCode = MIG_BAD_ID;
+      handled = FALSE;
+    }
+
+  /* These are all simpleroutines, so there's never a reply */
+
+  reply->Head.msgh_bits = 0;
+  reply->Head.msgh_size = sizeof(mig_reply_header_t);
+  reply->Head.msgh_remote_port = MACH_PORT_NULL;
+  reply->Head.msgh_local_port = MACH_PORT_NULL;
+  reply->Head.msgh_seqno = 0;
+  reply->Head.msgh_id = in->msgh_id + 100;
+
+  return handled;
+}
+
+
+/***** VIRTUAL MEMORY *****/
+
+/* These don't need ipc_lock; the Linux kernel serializes them. */
+
+kern_return_t
+vm_allocate (task_t task, vm_address_t *address, vm_size_t size, boolean_t anywhere)
+{
+  if (size == 0)
+    {
+      if (anywhere)
+        {
+          *address = 0;
+        }
+      return KERN_SUCCESS;
+    }
+
+  void * addr = mmap(anywhere ? nullptr : reinterpret_cast<void *>(trunc_page(*address)),
+                     round_page(size), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | (anywhere ? 0 : MAP_FIXED_NOREPLACE), -1, 0);
+
+  if (addr == MAP_FAILED)
+    {
+      return anywhere ? KERN_RESOURCE_SHORTAGE : KERN_NO_SPACE;
+    }
+
+  *address = reinterpret_cast<vm_address_t>(addr);
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_deallocate (task_t task, vm_address_t address, vm_size_t size)
+{
+  if (size == 0)
+    {
+      return KERN_SUCCESS;
+    }
+
+  vm_address_t start = trunc_page(address);
+
+  unmap_memory_object(start);
+
+  if (munmap(reinterpret_cast<void *>(start), round_page(address + size) - start) != 0)
+    {
+      return KERN_INVALID_ADDRESS;
+    }
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_copy (task_t task, vm_address_t source, vm_size_t count, vm_address_t dest)
+{
+  memmove(reinterpret_cast<void *>(dest), reinterpret_cast<void *>(source), count);
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_read (task_t task, vm_address_t address, vm_size_t size,
+         pointer_t *data, mach_msg_type_number_t *dataCnt)
+{
+  kern_return_t kr = vm_allocate(task, data, size, TRUE);
+
+  if (kr == KERN_SUCCESS)
+    {
+      memcpy(reinterpret_cast<void *>(*data), reinterpret_cast<void *>(address), size);
+      *dataCnt = size;
+    }
+
+  return kr;
+}
+
+kern_return_t
+vm_write (task_t task, vm_address_t address, pointer_t data, mach_msg_type_number_t dataCnt)
+{
+  memcpy(reinterpret_cast<void *>(address), reinterpret_cast<void *>(data), dataCnt);
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_protect (task_t task, vm_address_t address, vm_size_t size,
+            boolean_t set_maximum, vm_prot_t new_protection)
+{
+  vm_address_t start = trunc_page(address);
+  int prot = ((new_protection & VM_PROT_READ) ? PROT_READ : 0)
+    | ((new_protection & VM_PROT_WRITE) ? PROT_WRITE : 0)
+    | ((new_protection & VM_PROT_EXECUTE) ? PROT_EXEC : 0);
+
+  if (mprotect(reinterpret_cast<void *>(start), round_page(address + size) - start, prot) != 0)
+    {
+      return KERN_INVALID_ADDRESS;
+    }
+
+  return KERN_SUCCESS;
+}
+
+/* Memory objects are mapped by map_memory_object(), above, and
+ * always in their entirety.
+ */
+
+kern_return_t
+vm_map (task_t task, vm_address_t *address, vm_size_t size, vm_address_t mask,
+        boolean_t anywhere, memory_object_t memory_object, vm_offset_t offset,
+        boolean_t copy, vm_prot_t cur_protection, vm_prot_t max_protection,
+        vm_inherit_t inheritance)
+{
+  if (memory_object == MACH_PORT_NULL)
+    {
+      return vm_allocate(task, address, size, anywhere);
+    }
+
+  if (offset != 0)
+    {
+      return KERN_INVALID_ARGUMENT;
+    }
+
+  return map_memory_object(address, size, anywhere, memory_object);
+}
+
+/* Only memory objects mapped by vm_map() have names.  Anonymous
+ * memory has no object, as if it had never been touched in Mach,
+ * and we don't keep track of it, so it's reported as a region that
+ * runs up to the next mapped memory object.  The name we hand out is
+ * a send right to the memory object itself, and mach_vm_object_info()
+ * reports every named object as external, with no shadow.
+ */
+
+kern_return_t
+mach_vm_region_info (task_t task, vm_address_t address,
+                     vm_region_info_t *region, memory_object_name_t *object)
+{
+  mach_port_t name = MACH_PORT_NULL;
+
+  bzero(region, sizeof(vm_region_info_t));
+  region->vri_protection = VM_PROT_DEFAULT;
+  region->vri_max_protection = VM_PROT_ALL;
+  region->vri_inheritance = VM_INHERIT_DEFAULT;
+
+  {
+    std::unique_lock<std::mutex> lk(mapping_lock);
+    auto it = mappings_by_address.upper_bound(address);
+
+    region->vri_start = trunc_page(address);
+    region->vri_end = (it == mappings_by_address.end()) ? trunc_page(~ vm_offset_t(0)) : it->first;
+
+    if (it != mappings_by_address.begin())
+      {
+        memory_mapping * mapping = std::prev(it)->second;
+
+        if (address < mapping->address + mapping->size)
+          {
+            region->vri_start = mapping->address;
+            region->vri_end = mapping->address + mapping->size;
+            name = mapping->object;
+          }
+      }
+  }
+
+  *object = MACH_PORT_NULL;
+
+  if (name != MACH_PORT_NULL)
+    {
+      unsigned int self = mach_emul_set_task(kernel_task);
+
+      *object = mach_emul_give_right(name, MACH_MSG_TYPE_COPY_SEND, self);
+      mach_emul_set_task(self);
+
+      /* the object was terminated after we let go of mapping_lock */
+      if (*object == MACH_PORT_NULL)
+        {
+          return KERN_INVALID_ADDRESS;
+        }
+    }
+
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_vm_object_info (memory_object_name_t object, vm_object_info_t *info,
+                     memory_object_name_t *shadow, memory_object_name_t *copy)
+{
+  {
+    std::unique_lock<std::mutex> lk(ipc_lock);
+    ipc_entry * entry = lookup(object);
+
+    if (! entry || ! (entry->type & MACH_PORT_TYPE_SEND))
+      {
+        return KERN_INVALID_NAME;
+      }
+  }
+
+  bzero(info, sizeof(vm_object_info_t));
+  info->voi_pagesize = vm_page_size;
+  info->voi_state = VOI_STATE_PAGER_CREATED | VOI_STATE_PAGER_INITIALIZED
+    | VOI_STATE_PAGER_READY | VOI_STATE_ALIVE;
+
+  *shadow = MACH_PORT_NULL;
+  *copy = MACH_PORT_NULL;
+
+  return KERN_SUCCESS;
+}
+
+
+/***** ERRORS *****/
+
+const char *
+mach_error_string (mach_error_t error_value)
+{
+  static const std::unordered_map<int, const char *> strings =
+    {{KERN_SUCCESS, "(os/kern) successful"},
+     {KERN_INVALID_ADDRESS, "(os/kern) invalid address"},
+     {KERN_PROTECTION_FAILURE, "(os/kern) protection failure"},
+     {KERN_NO_SPACE, "(os/kern) no space available"},
+     {KERN_INVALID_ARGUMENT, "(os/kern) invalid argument"},
+     {KERN_FAILURE, "(os/kern) failure"},
+     {KERN_RESOURCE_SHORTAGE, "(os/kern) resource shortage"},
+     {KERN_NOT_RECEIVER, "(os/kern) not receiver"},
+     {KERN_NO_ACCESS, "(os/kern) no access"},
+     {KERN_NOT_IN_SET, "(os/kern) not in set"},
+     {KERN_NAME_EXISTS, "(os/kern) name exists"},
+     {KERN_INVALID_NAME, "(os/kern) invalid name"},
+     {KERN_INVALID_RIGHT, "(os/kern) invalid right"},
+     {KERN_INVALID_VALUE, "(os/kern) invalid value"},
+     {KERN_INVALID_CAPABILITY, "(os/kern) invalid capability"},
+     {KERN_RIGHT_EXISTS, "(os/kern) right exists"},
+     {MACH_SEND_INVALID_DATA, "(ipc/send) invalid data"},
+     {MACH_SEND_INVALID_DEST, "(ipc/send) invalid destination port"},
+     {MACH_SEND_TIMED_OUT, "(ipc/send) timed out"},
+     {MACH_SEND_INTERRUPTED, "(ipc/send) interrupted"},
+     {MACH_SEND_MSG_TOO_SMALL, "(ipc/send) message size changed while being copied"},
+     {MACH_SEND_INVALID_REPLY, "(ipc/send) invalid reply port"},
+     {MACH_SEND_INVALID_RIGHT, "(ipc/send) invalid port right"},
+     {MACH_SEND_INVALID_TYPE, "(ipc/send) invalid data type"},
+     {MACH_RCV_INVALID_NAME, "(ipc/rcv) invalid name"},
+     {MACH_RCV_TIMED_OUT, "(ipc/rcv) timed out"},
+     {MACH_RCV_TOO_LARGE, "(ipc/rcv) message too large"},
+     {MACH_RCV_INTERRUPTED, "(ipc/rcv) interrupted"},
+     {MACH_RCV_PORT_CHANGED, "(ipc/rcv) port moved into a set during the receive"},
+     {MACH_RCV_PORT_DIED, "(ipc/rcv) port has been destroyed"},
+     {MACH_RCV_IN_SET, "(ipc/rcv) port is a member of a port set"},
+     {MIG_TYPE_ERROR, "(ipc/mig) type check failure in message interface"},
+     {MIG_REPLY_MISMATCH, "(ipc/mig) wrong return message ID"},
+     {MIG_BAD_ID, "(ipc/mig) bad request message ID"},
+     {MIG_BAD_ARGUMENTS, "(ipc/mig) server type check failure"},
+     {MIG_NO_REPLY, "(ipc/mig) no reply should be sent"},
+     {MIG_SERVER_DIED, "(ipc/mig) server died"}};
+
+  auto it = strings.find(error_value);
+
+  if (it != strings.end())
+    {
+      return it->second;
+    }
+
+  /* Hurd servers return errno values */
+
+  return strerror(error_value);
+}
+
+void
+mach_error (const char * str, mach_error_t error_value)
+{
+  fprintf(stderr, "%s %s (%x)\n", str, mach_error_string(error_value), error_value);
+}
+
+}
@@ -0,0 +1,406 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   mach.h - the subset of the Mach API emulated on Linux
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   This header stands in for GNU Mach's <mach.h> when netmsg is built
+   for Linux (see mach-emul.cc).  Constants and message layouts are
+   the GNU Mach ones, so the relay core compiles unchanged.  Types
+   that hold addresses are pointer sized, so OOL descriptors and
+   inline data padding follow the host's long word, just as they do
+   in machMessage.h.
+
+   Only one task exists - the calling process - so every 'task'
+   argument is ignored.
+*/
+
+#ifndef NETMSG_LINUX_MACH_H
+#define NETMSG_LINUX_MACH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef unsigned int natural_t;
+typedef int integer_t;
+typedef int boolean_t;
+
+typedef natural_t mach_port_t;
+typedef mach_port_t *mach_port_array_t;
+typedef mach_port_t task_t;
+typedef mach_port_t thread_t;
+typedef mach_port_t memory_object_t;
+typedef mach_port_t memory_object_control_t;
+typedef mach_port_t memory_object_name_t;
+
+typedef int kern_return_t;
+typedef kern_return_t mach_msg_return_t;
+
+typedef uintptr_t vm_offset_t;
+typedef uintptr_t vm_address_t;
+typedef uintptr_t vm_size_t;
+typedef vm_offset_t pointer_t;
+typedef int vm_prot_t;
+typedef int vm_inherit_t;
+
+typedef natural_t mach_port_right_t;
+typedef natural_t mach_port_type_t;
+typedef mach_port_type_t *mach_port_type_array_t;
+typedef natural_t mach_port_urefs_t;
+typedef integer_t mach_port_delta_t;
+typedef natural_t mach_port_seqno_t;
+typedef natural_t mach_port_mscount_t;
+typedef natural_t mach_port_msgcount_t;
+typedef natural_t mach_port_rights_t;
+
+typedef natural_t mach_msg_bits_t;
+typedef natural_t mach_msg_size_t;
+typedef integer_t mach_msg_id_t;
+typedef natural_t mach_msg_timeout_t;
+typedef integer_t mach_msg_option_t;
+typedef unsigned int mach_msg_type_name_t;
+typedef unsigned int mach_msg_type_size_t;
+typedef natural_t mach_msg_type_number_t;
+
+#define TRUE 1
+#define FALSE 0
+
+/* Port names */
+
+#define MACH_PORT_NULL          ((mach_port_t) 0)
+#define MACH_PORT_DEAD          ((mach_port_t) ~0)
+#define MACH_PORT_VALID(name)   (((name) != MACH_PORT_NULL) && ((name) != MACH_PORT_DEAD))
+
+#define MACH_PORT_RIGHT_SEND            ((mach_port_right_t) 0)
+#define MACH_PORT_RIGHT_RECEIVE         ((mach_port_right_t) 1)
+#define MACH_PORT_RIGHT_SEND_ONCE       ((mach_port_right_t) 2)
+#define MACH_PORT_RIGHT_PORT_SET        ((mach_port_right_t) 3)
+#define MACH_PORT_RIGHT_DEAD_NAME       ((mach_port_right_t) 4)
+#define MACH_PORT_RIGHT_NUMBER          ((mach_port_right_t) 5)
+
+#define MACH_PORT_TYPE(right)           ((mach_port_type_t) (1 << ((right) + 16)))
+#define MACH_PORT_TYPE_NONE             ((mach_port_type_t) 0)
+#define MACH_PORT_TYPE_SEND             MACH_PORT_TYPE(MACH_PORT_RIGHT_SEND)
+#define MACH_PORT_TYPE_RECEIVE          MACH_PORT_TYPE(MACH_PORT_RIGHT_RECEIVE)
+#define MACH_PORT_TYPE_SEND_ONCE        MACH_PORT_TYPE(MACH_PORT_RIGHT_SEND_ONCE)
+#define MACH_PORT_TYPE_PORT_SET         MACH_PORT_TYPE(MACH_PORT_RIGHT_PORT_SET)
+#define MACH_PORT_TYPE_DEAD_NAME        MACH_PORT_TYPE(MACH_PORT_RIGHT_DEAD_NAME)
+
+#define MACH_PORT_TYPE_SEND_RECEIVE     (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_RECEIVE)
+#define MACH_PORT_TYPE_SEND_RIGHTS      (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_SEND_ONCE)
+#define MACH_PORT_TYPE_PORT_RIGHTS      (MACH_PORT_TYPE_SEND_RIGHTS | MACH_PORT_TYPE_RECEIVE)
+#define MACH_PORT_TYPE_PORT_OR_DEAD     (MACH_PORT_TYPE_PORT_RIGHTS | MACH_PORT_TYPE_DEAD_NAME)
+#define MACH_PORT_TYPE_ALL_RIGHTS       (MACH_PORT_TYPE_PORT_OR_DEAD | MACH_PORT_TYPE_PORT_SET)
+
+#define MACH_PORT_TYPE_DNREQUEST        0x80000000U
+#define MACH_PORT_TYPE_MAREQUEST        0x40000000U
+#define MACH_PORT_TYPE_COMPAT           0x20000000U
+
+#define MACH_PORT_QLIMIT_DEFAULT        ((mach_port_msgcount_t) 5)
+#define MACH_PORT_QLIMIT_MAX            ((mach_port_msgcount_t) 16)
+
+typedef struct mach_port_status {
+  mach_port_t mps_pset;
+  mach_port_seqno_t mps_seqno;
+  mach_port_mscount_t mps_mscount;
+  mach_port_msgcount_t mps_qlimit;
+  mach_port_msgcount_t mps_msgcount;
+  mach_port_rights_t mps_sorights;
+  boolean_t mps_srights;
+  boolean_t mps_pdrequest;
+  boolean_t mps_nsrequest;
+} mach_port_status_t;
+
+/* Messages */
+
+typedef struct {
+  mach_msg_bits_t msgh_bits;
+  mach_msg_size_t msgh_size;
+  mach_port_t msgh_remote_port;
+  mach_port_t msgh_local_port;
+  mach_port_seqno_t msgh_seqno;
+  mach_msg_id_t msgh_id;
+} mach_msg_header_t;
+
+typedef struct {
+  unsigned int msgt_name : 8,
+    msgt_size : 8,
+    msgt_number : 12,
+    msgt_inline : 1,
+    msgt_longform : 1,
+    msgt_deallocate : 1,
+    msgt_unused : 1;
+} mach_msg_type_t;
+
+typedef struct {
+  mach_msg_type_t msgtl_header;
+  unsigned short msgtl_name;
+  unsigned short msgtl_size;
+  natural_t msgtl_number;
+} mach_msg_type_long_t;
+
+#define MACH_MSGH_BITS_ZERO             0x00000000U
+#define MACH_MSGH_BITS_REMOTE_MASK      0x000000ffU
+#define MACH_MSGH_BITS_LOCAL_MASK       0x0000ff00U
+#define MACH_MSGH_BITS_COMPLEX          0x80000000U
+#define MACH_MSGH_BITS_CIRCULAR         0x40000000U
+#define MACH_MSGH_BITS_COMPLEX_PORTS    0x20000000U
+#define MACH_MSGH_BITS_COMPLEX_DATA     0x10000000U
+#define MACH_MSGH_BITS_MIGRATED         0x08000000U
+#define MACH_MSGH_BITS_UNUSED           0x07ff0000U
+
+#define MACH_MSGH_BITS(remote, local)   ((remote) | ((local) << 8))
+#define MACH_MSGH_BITS_REMOTE(bits)     ((bits) & MACH_MSGH_BITS_REMOTE_MASK)
+#define MACH_MSGH_BITS_LOCAL(bits)      (((bits) & MACH_MSGH_BITS_LOCAL_MASK) >> 8)
+#define MACH_MSGH_BITS_PORTS(bits)      ((bits) & (MACH_MSGH_BITS_REMOTE_MASK | MACH_MSGH_BITS_LOCAL_MASK))
+#define MACH_MSGH_BITS_OTHER(bits)      ((bits) & ~(MACH_MSGH_BITS_REMOTE_MASK | MACH_MSGH_BITS_LOCAL_MASK))
+
+#define MACH_MSG_TYPE_UNSTRUCTURED      0
+#define MACH_MSG_TYPE_BIT               0
+#define MACH_MSG_TYPE_BOOLEAN           0
+#define MACH_MSG_TYPE_INTEGER_16        1
+#define MACH_MSG_TYPE_INTEGER_32        2
+#define MACH_MSG_TYPE_CHAR              8
+#define MACH_MSG_TYPE_BYTE              9
+#define MACH_MSG_TYPE_INTEGER_8         9
+#define MACH_MSG_TYPE_REAL              10
+#define MACH_MSG_TYPE_INTEGER_64        11
+#define MACH_MSG_TYPE_STRING            12
+#define MACH_MSG_TYPE_STRING_C          12
+#define MACH_MSG_TYPE_PORT_NAME         15
+
+#define MACH_MSG_TYPE_MOVE_RECEIVE      16
+#define MACH_MSG_TYPE_MOVE_SEND         17
+#define MACH_MSG_TYPE_MOVE_SEND_ONCE    18
+#define MACH_MSG_TYPE_COPY_SEND         19
+#define MACH_MSG_TYPE_MAKE_SEND         20
+#define MACH_MSG_TYPE_MAKE_SEND_ONCE    21
+
+#define MACH_MSG_TYPE_PORT_RECEIVE      MACH_MSG_TYPE_MOVE_RECEIVE
+#define MACH_MSG_TYPE_PORT_SEND         MACH_MSG_TYPE_MOVE_SEND
+#define MACH_MSG_TYPE_PORT_SEND_ONCE    MACH_MSG_TYPE_MOVE_SEND_ONCE
+
+#define MACH_MSG_TYPE_POLYMORPHIC       ((mach_msg_type_name_t) -1)
+
+#define MACH_MSG_TYPE_PORT_ANY(x)       (((x) >= MACH_MSG_TYPE_MOVE_RECEIVE) && ((x) <= MACH_MSG_TYPE_MAKE_SEND_ONCE))
+#define MACH_MSG_TYPE_PORT_ANY_SEND(x)  (((x) >= MACH_MSG_TYPE_MOVE_SEND) && ((x) <= MACH_MSG_TYPE_MAKE_SEND_ONCE))
+#define MACH_MSG_TYPE_PORT_ANY_RIGHT(x) (((x) >= MACH_MSG_TYPE_MOVE_RECEIVE) && ((x) <= MACH_MSG_TYPE_MOVE_SEND_ONCE))
+
+#define MACH_MSG_OPTION_NONE            0x00000000
+#define MACH_SEND_MSG                   0x00000001
+#define MACH_RCV_MSG                    0x00000002
+#define MACH_SEND_TIMEOUT               0x00000010
+#define MACH_SEND_NOTIFY                0x00000020
+#define MACH_SEND_INTERRUPT             0x00000040
+#define MACH_SEND_CANCEL                0x00000080
+#define MACH_RCV_TIMEOUT                0x00000100
+#define MACH_RCV_NOTIFY                 0x00000200
+#define MACH_RCV_INTERRUPT              0x00000400
+#define MACH_RCV_LARGE                  0x00000800
+
+#define MACH_MSG_TIMEOUT_NONE           ((mach_msg_timeout_t) 0)
+
+#define MACH_MSG_SUCCESS                0x00000000
+
+#define MACH_SEND_IN_PROGRESS           0x10000001
+#define MACH_SEND_INVALID_DATA          0x10000002
+#define MACH_SEND_INVALID_DEST          0x10000003
+#define MACH_SEND_TIMED_OUT             0x10000004
+#define MACH_SEND_WILL_NOTIFY           0x10000005
+#define MACH_SEND_NOTIFY_IN_PROGRESS    0x10000006
+#define MACH_SEND_INTERRUPTED           0x10000007
+#define MACH_SEND_MSG_TOO_SMALL         0x10000008
+#define MACH_SEND_INVALID_REPLY         0x10000009
+#define MACH_SEND_INVALID_RIGHT         0x1000000a
+#define MACH_SEND_INVALID_NOTIFY        0x1000000b
+#define MACH_SEND_INVALID_MEMORY        0x1000000c
+#define MACH_SEND_NO_BUFFER             0x1000000d
+#define MACH_SEND_NO_NOTIFY             0x1000000e
+#define MACH_SEND_INVALID_TYPE          0x1000000f
+#define MACH_SEND_INVALID_HEADER        0x10000010
+
+#define MACH_RCV_IN_PROGRESS            0x10004001
+#define MACH_RCV_INVALID_NAME           0x10004002
+#define MACH_RCV_TIMED_OUT              0x10004003
+#define MACH_RCV_TOO_LARGE              0x10004004
+#define MACH_RCV_INTERRUPTED            0x10004005
+#define MACH_RCV_PORT_CHANGED           0x10004006
+#define MACH_RCV_INVALID_NOTIFY         0x10004007
+#define MACH_RCV_INVALID_DATA           0x10004008
+#define MACH_RCV_PORT_DIED              0x10004009
+#define MACH_RCV_IN_SET                 0x1000400a
+#define MACH_RCV_HEADER_ERROR           0x1000400b
+#define MACH_RCV_BODY_ERROR             0x1000400c
+
+/* Notifications */
+
+#define MACH_NOTIFY_FIRST               0100
+#define MACH_NOTIFY_PORT_DELETED        (MACH_NOTIFY_FIRST + 001)
+#define MACH_NOTIFY_MSG_ACCEPTED        (MACH_NOTIFY_FIRST + 002)
+#define MACH_NOTIFY_PORT_DESTROYED      (MACH_NOTIFY_FIRST + 005)
+#define MACH_NOTIFY_NO_SENDERS          (MACH_NOTIFY_FIRST + 006)
+#define MACH_NOTIFY_SEND_ONCE           (MACH_NOTIFY_FIRST + 007)
+#define MACH_NOTIFY_DEAD_NAME           (MACH_NOTIFY_FIRST + 010)
+#define MACH_NOTIFY_LAST                (MACH_NOTIFY_FIRST + 015)
+
+/* Kernel return codes */
+
+#define KERN_SUCCESS                    0
+#define KERN_INVALID_ADDRESS            1
+#define KERN_PROTECTION_FAILURE         2
+#define KERN_NO_SPACE                   3
+#define KERN_INVALID_ARGUMENT           4
+#define KERN_FAILURE                    5
+#define KERN_RESOURCE_SHORTAGE          6
+#define KERN_NOT_RECEIVER               7
+#define KERN_NO_ACCESS                  8
+#define KERN_MEMORY_FAILURE             9
+#define KERN_MEMORY_ERROR               10
+#define KERN_NOT_IN_SET                 12
+#define KERN_NAME_EXISTS                13
+#define KERN_ABORTED                    14
+#define KERN_INVALID_NAME               15
+#define KERN_INVALID_TASK               16
+#define KERN_INVALID_RIGHT              17
+#define KERN_INVALID_VALUE              18
+#define KERN_UREFS_OVERFLOW             19
+#define KERN_INVALID_CAPABILITY         20
+#define KERN_RIGHT_EXISTS               21
+
+/* MIG */
+
+#define MIG_TYPE_ERROR                  -300
+#define MIG_REPLY_MISMATCH              -301
+#define MIG_REMOTE_ERROR                -302
+#define MIG_BAD_ID                      -303
+#define MIG_BAD_ARGUMENTS               -304
+#define MIG_NO_REPLY                    -305
+#define MIG_EXCEPTION                   -306
+#define MIG_ARRAY_TOO_LARGE             -307
+#define MIG_SERVER_DIED                 -308
+#define MIG_DESTROY_REQUEST             -309
+
+typedef struct {
+  mach_msg_header_t Head;
+  mach_msg_type_t RetCodeType;
+  kern_return_t RetCode;
+} mig_reply_header_t;
+
+/* Virtual memory */
+
+#define VM_PROT_NONE            ((vm_prot_t) 0x00)
+#define VM_PROT_READ            ((vm_prot_t) 0x01)
+#define VM_PROT_WRITE           ((vm_prot_t) 0x02)
+#define VM_PROT_EXECUTE         ((vm_prot_t) 0x04)
+#define VM_PROT_DEFAULT         (VM_PROT_READ | VM_PROT_WRITE)
+#define VM_PROT_ALL             (VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXECUTE)
+
+#define VM_INHERIT_SHARE        ((vm_inherit_t) 0)
+#define VM_INHERIT_COPY         ((vm_inherit_t) 1)
+#define VM_INHERIT_NONE         ((vm_inherit_t) 2)
+#define VM_INHERIT_DEFAULT      VM_INHERIT_COPY
+
+/* Memory objects */
+
+typedef int memory_object_copy_strategy_t;
+
+#define MEMORY_OBJECT_COPY_NONE         0
+#define MEMORY_OBJECT_COPY_CALL         1
+#define MEMORY_OBJECT_COPY_DELAY        2
+#define MEMORY_OBJECT_COPY_TEMPORARY    3
+
+extern vm_size_t vm_page_size;
+#define __vm_page_size vm_page_size
+
+#define round_page(x)   ((((vm_offset_t) (x)) + vm_page_size - 1) & ~(vm_page_size - 1))
+#define trunc_page(x)   (((vm_offset_t) (x)) & ~(vm_page_size - 1))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+mach_port_t mach_task_self (void);
+mach_port_t mach_reply_port (void);
+mach_port_t mig_get_reply_port (void);
+
+mach_msg_return_t mach_msg (mach_msg_header_t *msg, mach_msg_option_t option,
+                            mach_msg_size_t send_size, mach_msg_size_t rcv_size,
+                            mach_port_t rcv_name, mach_msg_timeout_t timeout,
+                            mach_port_t notify);
+
+void mach_msg_destroy (mach_msg_header_t *msg);
+
+mach_msg_return_t mach_msg_server (int (*demux) (mach_msg_header_t *, mach_msg_header_t *),
+                                   mach_msg_size_t max_size, mach_port_t rcv_name);
+
+kern_return_t mach_port_allocate (task_t task, mach_port_right_t right, mach_port_t *name);
+kern_return_t mach_port_deallocate (task_t task, mach_port_t name);
+kern_return_t mach_port_destroy (task_t task, mach_port_t name);
+kern_return_t mach_port_mod_refs (task_t task, mach_port_t name,
+                                  mach_port_right_t right, mach_port_delta_t delta);
+kern_return_t mach_port_get_refs (task_t task, mach_port_t name,
+                                  mach_port_right_t right, mach_port_urefs_t *refs);
+kern_return_t mach_port_insert_right (task_t task, mach_port_t name,
+                                      mach_port_t poly, mach_msg_type_name_t polyPoly);
+kern_return_t mach_port_extract_right (task_t task, mach_port_t name,
+                                       mach_msg_type_name_t desired,
+                                       mach_port_t *poly, mach_msg_type_name_t *polyPoly);
+kern_return_t mach_port_move_member (task_t task, mach_port_t member, mach_port_t after);
+kern_return_t mach_port_request_notification (task_t task, mach_port_t name,
+                                              integer_t variant, mach_port_mscount_t sync,
+                                              mach_port_t notify, mach_msg_type_name_t notifyPoly,
+                                              mach_port_t *previous);
+kern_return_t mach_port_names (task_t task,
+                               mach_port_array_t *names, mach_msg_type_number_t *namesCnt,
+                               mach_port_type_array_t *types, mach_msg_type_number_t *typesCnt);
+kern_return_t mach_port_type (task_t task, mach_port_t name, mach_port_type_t *ptype);
+kern_return_t mach_port_get_receive_status (task_t task, mach_port_t name,
+                                            mach_port_status_t *status);
+kern_return_t mach_port_set_qlimit (task_t task, mach_port_t name, mach_port_msgcount_t qlimit);
+kern_return_t mach_port_set_mscount (task_t task, mach_port_t name, mach_port_mscount_t mscount);
+
+kern_return_t vm_allocate (task_t task, vm_address_t *address, vm_size_t size, boolean_t anywhere);
+kern_return_t vm_deallocate (task_t task, vm_address_t address, vm_size_t size);
+kern_return_t vm_copy (task_t task, vm_address_t source, vm_size_t count, vm_address_t dest);
+kern_return_t vm_read (task_t task, vm_address_t address, vm_size_t size,
+                       pointer_t *data, mach_msg_type_number_t *dataCnt);
+kern_return_t vm_write (task_t task, vm_address_t address, pointer_t data, mach_msg_type_number_t dataCnt);
+kern_return_t vm_protect (task_t task, vm_address_t address, vm_size_t size,
+                          boolean_t set_maximum, vm_prot_t new_protection);
+kern_return_t vm_map (task_t task, vm_address_t *address, vm_size_t size, vm_address_t mask,
+                      boolean_t anywhere, memory_object_t memory_object, vm_offset_t offset,
+                      boolean_t copy, vm_prot_t cur_protection, vm_prot_t max_protection,
+                      vm_inherit_t inheritance);
+
+kern_return_t memory_object_ready (memory_object_control_t control, boolean_t may_cache,
+                                   memory_object_copy_strategy_t copy_strategy);
+kern_return_t memory_object_data_supply (memory_object_control_t control, vm_offset_t offset,
+                                         pointer_t data, mach_msg_type_number_t dataCnt,
+                                         boolean_t dealloc_data, vm_prot_t lock_value,
+                                         boolean_t precious, mach_port_t reply_to);
+kern_return_t memory_object_data_error (memory_object_control_t control, vm_offset_t offset,
+                                        vm_size_t size, kern_return_t error_value);
+
+kern_return_t task_get_bootstrap_port (task_t task, mach_port_t *bootstrap);
+
+/* Emulator extensions (see mach-emul.cc).  Threads standing in for
+ * other tasks switch IPC spaces with the first two;
+ * mach_emul_set_task() returns the thread's previous task.
+ * mach_emul_give_right() moves a right from the caller's space into
+ * another one, as if it had been sent in a message, and returns its
+ * new name.
+ */
+
+unsigned int mach_emul_new_task (void);
+unsigned int mach_emul_set_task (unsigned int task);
+mach_port_t mach_emul_give_right (mach_port_t name, mach_msg_type_name_t disposition,
+                                  unsigned int task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   mach/notify.h - Mach notification messages for the Linux emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   The notification message IDs are in <mach.h>; these are the
+   message layouts the emulated kernel generates.
+*/
+
+#ifndef NETMSG_LINUX_MACH_NOTIFY_H
+#define NETMSG_LINUX_MACH_NOTIFY_H
+
+#include <mach.h>
+
+typedef struct {
+  mach_msg_header_t not_header;
+  mach_msg_type_t not_type;     /* MACH_MSG_TYPE_PORT_NAME */
+  mach_port_t not_port;
+} mach_port_deleted_notification_t;
+
+typedef struct {
+  mach_msg_header_t not_header;
+  mach_msg_type_t not_type;     /* MACH_MSG_TYPE_INTEGER_32 */
+  unsigned int not_count;
+} mach_no_senders_notification_t;
+
+typedef struct {
+  mach_msg_header_t not_header;
+} mach_send_once_notification_t;
+
+typedef struct {
+  mach_msg_header_t not_header;
+  mach_msg_type_t not_type;     /* MACH_MSG_TYPE_PORT_NAME */
+  mach_port_t not_port;
+} mach_dead_name_notification_t;
+
+#endif
@@ -0,0 +1,72 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   mach_debug/mach_debug.h - Mach VM debugging calls for the Linux emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   On the Hurd, the structures come from <mach_debug/vm_info.h> and
+   the calls from the MIG stubs for mach_debug.defs.  Only the two
+   calls that netmsg uses to find out what backs an OOL region are
+   emulated (see mach-emul.cc).
+*/
+
+#ifndef NETMSG_LINUX_MACH_DEBUG_H
+#define NETMSG_LINUX_MACH_DEBUG_H
+
+#include <mach.h>
+
+typedef struct vm_region_info {
+  vm_offset_t vri_start;
+  vm_offset_t vri_end;
+  vm_prot_t vri_protection;
+  vm_prot_t vri_max_protection;
+  vm_inherit_t vri_inheritance;
+  unsigned int vri_wired_count;
+  unsigned int vri_user_wired_count;
+  vm_offset_t vri_object;
+  vm_offset_t vri_offset;
+  integer_t vri_needs_copy;
+  unsigned int vri_sharing;
+} vm_region_info_t;
+
+typedef struct vm_object_info {
+  vm_offset_t voi_object;
+  vm_size_t voi_pagesize;
+  vm_size_t voi_size;
+  unsigned int voi_ref_count;
+  unsigned int voi_resident_page_count;
+  unsigned int voi_absent_count;
+  vm_offset_t voi_copy;
+  vm_offset_t voi_shadow;
+  vm_offset_t voi_shadow_offset;
+  vm_offset_t voi_paging_offset;
+  memory_object_copy_strategy_t voi_copy_strategy;
+  vm_offset_t voi_last_alloc;
+  unsigned int voi_paging_in_progress;
+  natural_t voi_state;
+} vm_object_info_t;
+
+#define VOI_STATE_PAGER_CREATED         0x00000001
+#define VOI_STATE_PAGER_INITIALIZED     0x00000002
+#define VOI_STATE_PAGER_READY           0x00000004
+#define VOI_STATE_CAN_PERSIST           0x00000008
+#define VOI_STATE_INTERNAL              0x00000010
+#define VOI_STATE_TEMPORARY             0x00000020
+#define VOI_STATE_ALIVE                 0x00000040
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+kern_return_t mach_vm_region_info (task_t task, vm_address_t address,
+                                   vm_region_info_t *region, memory_object_name_t *object);
+kern_return_t mach_vm_object_info (memory_object_name_t object, vm_object_info_t *info,
+                                   memory_object_name_t *shadow, memory_object_name_t *copy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
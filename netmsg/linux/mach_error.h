@@ -0,0 +1,28 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   mach_error.h - Mach error strings for the Linux emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+*/
+
+#ifndef NETMSG_LINUX_MACH_ERROR_H
+#define NETMSG_LINUX_MACH_ERROR_H
+
+#include <mach.h>
+
+typedef kern_return_t mach_error_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char * mach_error_string (mach_error_t error_value);
+void mach_error (const char * str, mach_error_t error_value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
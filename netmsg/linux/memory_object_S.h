@@ -0,0 +1,65 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   memory_object_S.h - memory object server routines, for the Linux
+   emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   On the Hurd, this file is generated by MIG from memory_object.defs.
+   The emulated kernel only ever sends memory_object_init,
+   memory_object_data_request and memory_object_terminate, and only
+   those are demultiplexed (by memory_object_server() in
+   mach-emul.cc).
+*/
+
+#ifndef NETMSG_LINUX_MEMORY_OBJECT_S_H
+#define NETMSG_LINUX_MEMORY_OBJECT_S_H
+
+#include <mach.h>
+
+kern_return_t S_memory_object_init (memory_object_t memory_object,
+                                    memory_object_control_t memory_control,
+                                    memory_object_name_t memory_object_name,
+                                    vm_size_t memory_object_page_size);
+
+kern_return_t S_memory_object_terminate (memory_object_t memory_object,
+                                         memory_object_control_t memory_control,
+                                         memory_object_name_t memory_object_name);
+
+kern_return_t S_memory_object_copy (memory_object_t old_memory_object,
+                                    memory_object_control_t old_memory_control,
+                                    vm_offset_t offset, vm_size_t length,
+                                    memory_object_t new_memory_object);
+
+kern_return_t S_memory_object_data_request (memory_object_t memory_object,
+                                            memory_object_control_t memory_control,
+                                            vm_offset_t offset, vm_size_t length,
+                                            vm_prot_t desired_access);
+
+kern_return_t S_memory_object_data_unlock (memory_object_t memory_object,
+                                           memory_object_control_t memory_control,
+                                           vm_offset_t offset, vm_size_t length,
+                                           vm_prot_t desired_access);
+
+kern_return_t S_memory_object_lock_completed (memory_object_t memory_object,
+                                              memory_object_control_t memory_control,
+                                              vm_offset_t offset, vm_size_t length);
+
+kern_return_t S_memory_object_supply_completed (memory_object_t memory_object,
+                                                memory_object_control_t memory_control,
+                                                vm_offset_t offset, vm_size_t length,
+                                                kern_return_t result, vm_offset_t error_offset);
+
+kern_return_t S_memory_object_data_return (memory_object_t memory_object,
+                                           memory_object_control_t memory_control,
+                                           vm_offset_t offset, pointer_t data,
+                                           mach_msg_type_number_t dataCnt,
+                                           boolean_t dirty, boolean_t kernel_copy);
+
+kern_return_t S_memory_object_change_completed (memory_object_t memory_object,
+                                                boolean_t may_cache,
+                                                memory_object_copy_strategy_t copy_strategy);
+
+#endif
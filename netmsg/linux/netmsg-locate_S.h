@@ -0,0 +1,32 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   netmsg-locate_S.h - port location server routines, for the Linux
+   emulation
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   On the Hurd, this file is generated by MIG from netmsg-locate.defs,
+   and netmsg_locate_server() comes from the MIG server stub.  Here,
+   netmsg_locate_server() is hand-coded in hurd-emul.cc.
+*/
+
+#ifndef NETMSG_LINUX_NETMSG_LOCATE_S_H
+#define NETMSG_LINUX_NETMSG_LOCATE_S_H
+
+#include <hurd.h>
+
+/* netmsg-locate.defs message IDs */
+
+#define NETMSG_MSGID_LOCATE                     50400
+#define NETMSG_MSGID_REQUEST_LOCATION_NOTIFY    50401
+
+kern_return_t S_netmsg_locate (mach_port_t server,
+                               portarray_t ports, mach_msg_type_number_t portsCnt,
+                               intarray_t *nodes, mach_msg_type_number_t *nodesCnt);
+
+kern_return_t S_netmsg_request_location_notification (mach_port_t server,
+                                                      mach_port_t port, mach_port_t notify);
+
+#endif
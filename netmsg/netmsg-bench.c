@@ -0,0 +1,486 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   netmsg-bench - a benchmark program for netmsg
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   Basic usage (to measure Mach itself, as a baseline):
+
+   settrans -ac bench-node netmsg-bench
+   netmsg-bench bench-node
+
+   Basic usage (to measure netmsg over loopback):
+
+   settrans -ac bench-node netmsg-bench
+   netmsg -s .
+   settrans -ac node netmsg localhost
+   netmsg-bench node/bench-node
+
+   Like netmsg-test, netmsg-bench listens as an active translator,
+   then connects to itself to run its benchmarks.
+*/
+
+/* BENCHMARKS
+
+   null - an RPC with no arguments and an empty reply
+
+   port - an RPC carrying a send right, which the server deallocates.
+      Each client thread sends the same port every time, so after the
+      first RPC netmsg finds it already mapped.
+
+   write - an RPC carrying SIZE bytes of out-of-line data
+
+   read - an RPC whose reply carries SIZE bytes of out-of-line data,
+      like a large io_read
+
+   Each benchmark runs COUNT RPCs on each of PORTS client threads.
+   Every thread looks the node up separately, so it gets its own
+   server port, and netmsg sees PORTS independent run queues.
+
+   For every benchmark we report messages per second (counting each
+   RPC as two messages), megabytes per second of OOL data, and the
+   50th, 99th, and 99.9th percentile RPC latencies.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <error.h>
+#include <argp.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <mach_error.h>
+
+#include <hurd/trivfs.h>
+#include <hurd/hurd_types.h>
+
+#include "netmsg-bench-server.h"
+#include "netmsg-bench-user.h"
+
+/* trivfs stuff */
+
+int trivfs_fstype = FSTYPE_MISC;
+int trivfs_fsid = 0;               /* 0 = use translator pid as filesystem id */
+int trivfs_allow_open = O_RDWR;
+
+int trivfs_support_read = 0;
+int trivfs_support_write = 0;
+int trivfs_support_execute = 0;
+
+void trivfs_modify_stat (struct trivfs_protid *CRED, io_statbuf_t *STBUF)
+{
+}
+
+error_t trivfs_goaway (struct trivfs_control *CNTL, int FLAGS)
+{
+  exit(0);
+}
+
+
+const char * targetPath = NULL;
+
+/* mach_call - print a warning message if anything is returned other
+ * than KERN_SUCCESS, and include the line number in the error message
+ */
+
+void
+_mach_call(int line, kern_return_t err)
+{
+  if (err != KERN_SUCCESS)
+    {
+      while (fprintf(stderr, "%s:%d %s\n", __FILE__, line, mach_error_string(err)) == -1);
+    }
+}
+
+#define mach_call(...) _mach_call(__LINE__, __VA_ARGS__)
+
+/***** COMMAND-LINE OPTIONS *****/
+
+#define MAX_SIZES 16
+
+int count = 10000;
+int nports = 1;
+
+const char * tests = "null,port,write,read";
+
+int nsizes = 0;
+size_t sizes[MAX_SIZES];
+
+const size_t default_sizes[] = { 4096, 65536, 1048576 };
+
+static const struct argp_option options[] =
+  {
+    { "count", 'c', "N", 0, "RPCs per thread for each benchmark (default 10000)" },
+    { "ports", 'p', "N", 0, "number of concurrent client threads, each with its own port (default 1)" },
+    { "tests", 't', "LIST", 0, "comma separated benchmarks to run: null, port, write, read (default all)" },
+    { "size", 's', "BYTES", 0, "OOL transfer size for write and read (can be repeated; default 4096, 65536, 1048576)" },
+    { 0 }
+  };
+
+static const char args_doc[] = "PATHNAME";
+static const char doc[] = "netmsg benchmark program.";
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case 'c':
+      count = atoi(arg);
+      break;
+
+    case 'p':
+      nports = atoi(arg);
+      break;
+
+    case 't':
+      tests = arg;
+      break;
+
+    case 's':
+      if (nsizes == MAX_SIZES)
+        {
+          argp_error (state, "at most %d sizes can be specified", MAX_SIZES);
+        }
+      sizes[nsizes ++] = strtoul(arg, NULL, 0);
+      break;
+
+    case ARGP_KEY_ARG:
+      if (state->arg_num == 0)
+        {
+          targetPath = arg;
+        }
+      else
+        {
+          argp_usage (state);
+          return ARGP_ERR_UNKNOWN;
+        }
+      break;
+
+    case ARGP_KEY_NO_ARGS:
+      break;
+    }
+
+  return ESUCCESS;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, NULL };
+
+
+/***** SERVER *****/
+
+/* XXX why isn't netmsg_bench_server() declared in netmsg-bench-server.h? */
+
+boolean_t netmsg_bench_server (mach_msg_header_t *InHeadP, mach_msg_header_t *OutHeadP);
+
+int netmsg_bench_demuxer (mach_msg_header_t *in, mach_msg_header_t *out)
+{
+  return trivfs_demuxer (in, out) || netmsg_bench_server(in, out);
+}
+
+void
+startAsTranslator(void)
+{
+  mach_port_t bootstrap;
+  trivfs_control_t fsys;
+
+  task_get_bootstrap_port (mach_task_self (), &bootstrap);
+  if (bootstrap == MACH_PORT_NULL)
+    error (1, 0, "Must be started as a translator");
+
+  mach_call (trivfs_startup(bootstrap, O_RDWR,
+                            NULL, NULL, NULL, NULL,
+                            &fsys));
+
+  ports_manage_port_operations_multithread (fsys->pi.bucket, netmsg_bench_demuxer, 0, 0, NULL);
+}
+
+kern_return_t
+S_bench_null(mach_port_t server)
+{
+  return ESUCCESS;
+}
+
+kern_return_t
+S_bench_port(mach_port_t server, mach_port_t handle)
+{
+  mach_call (mach_port_deallocate (mach_task_self (), handle));
+  return ESUCCESS;
+}
+
+kern_return_t
+S_bench_write(mach_port_t server, data_t data, mach_msg_type_number_t dataCnt)
+{
+  mach_call (vm_deallocate (mach_task_self (), (vm_address_t) data, dataCnt));
+  return ESUCCESS;
+}
+
+kern_return_t
+S_bench_read(mach_port_t server, int size, data_t *data, mach_msg_type_number_t *dataCnt)
+{
+  vm_address_t buffer;
+
+  mach_call (vm_allocate (mach_task_self (), &buffer, size, 1));
+
+  /* Touch every page, so the reply carries real memory and not just
+   * a zero-fill region.
+   */
+
+  memset((void *) buffer, 0x55, size);
+
+  *data = (data_t) buffer;
+  *dataCnt = size;
+
+  return ESUCCESS;
+}
+
+
+/***** CLIENT *****/
+
+enum { BENCH_NULL, BENCH_PORT, BENCH_WRITE, BENCH_READ };
+
+const char * bench_names[] = { "null", "port", "write", "read" };
+
+struct bench_thread
+{
+  pthread_t thread;
+  int test;
+  size_t size;
+  mach_port_t node;
+  double * latency;     /* count entries, in microseconds */
+  int errors;
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_thread_func(void * arg)
+{
+  struct bench_thread * bt = arg;
+  mach_port_t handle = MACH_PORT_NULL;
+  char * buffer = NULL;
+
+  if (bt->test == BENCH_PORT)
+    {
+      mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &handle));
+    }
+
+  if (bt->test == BENCH_WRITE)
+    {
+      buffer = malloc(bt->size);
+      memset(buffer, 0xaa, bt->size);
+    }
+
+  for (int i = 0; i < count; i ++)
+    {
+      kern_return_t err = KERN_SUCCESS;
+      double start = now();
+
+      switch (bt->test)
+        {
+        case BENCH_NULL:
+          err = U_bench_null(bt->node);
+          break;
+
+        case BENCH_PORT:
+          err = U_bench_port(bt->node, handle, MACH_MSG_TYPE_MAKE_SEND);
+          break;
+
+        case BENCH_WRITE:
+          err = U_bench_write(bt->node, buffer, bt->size);
+          break;
+
+        case BENCH_READ:
+          {
+            data_t data = NULL;
+            mach_msg_type_number_t dataCnt = 0;
+
+            err = U_bench_read(bt->node, bt->size, &data, &dataCnt);
+            if (err == KERN_SUCCESS)
+              {
+                assert(dataCnt == bt->size);
+                mach_call (vm_deallocate (mach_task_self (), (vm_address_t) data, dataCnt));
+              }
+          }
+          break;
+        }
+
+      bt->latency[i] = (now() - start) * 1e6;
+
+      if (err != KERN_SUCCESS)
+        {
+          bt->errors ++;
+        }
+    }
+
+  if (handle != MACH_PORT_NULL)
+    {
+      mach_call (mach_port_mod_refs (mach_task_self (), handle, MACH_PORT_RIGHT_RECEIVE, -1));
+    }
+
+  free(buffer);
+
+  return NULL;
+}
+
+static int
+compare_doubles(const void * a, const void * b)
+{
+  double x = * (const double *) a;
+  double y = * (const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(double * sorted, int n, double p)
+{
+  return sorted[(int) ((n - 1) * p)];
+}
+
+void
+run_benchmark(mach_port_t * nodes, int test, size_t size)
+{
+  struct bench_thread * threads = calloc(nports, sizeof(struct bench_thread));
+  double * latency = malloc(nports * count * sizeof(double));
+  int errors = 0;
+
+  for (int i = 0; i < nports; i ++)
+    {
+      threads[i].test = test;
+      threads[i].size = size;
+      threads[i].node = nodes[i];
+      threads[i].latency = latency + i * count;
+    }
+
+  double start = now();
+
+  for (int i = 0; i < nports; i ++)
+    {
+      if (pthread_create(&threads[i].thread, NULL, bench_thread_func, &threads[i]) != 0)
+        {
+          error (1, errno, "pthread_create");
+        }
+    }
+
+  for (int i = 0; i < nports; i ++)
+    {
+      pthread_join(threads[i].thread, NULL);
+      errors += threads[i].errors;
+    }
+
+  double elapsed = now() - start;
+  int n = nports * count;
+
+  qsort(latency, n, sizeof(double), compare_doubles);
+
+  printf("%-6s %8zu %10.0f msgs/s %9.2f MB/s   p50 %8.1f us   p99 %8.1f us   p999 %8.1f us",
+         bench_names[test], size,
+         2 * n / elapsed,
+         (double) size * n / elapsed / (1024 * 1024),
+         percentile(latency, n, 0.50), percentile(latency, n, 0.99), percentile(latency, n, 0.999));
+
+  if (errors > 0)
+    {
+      printf("   (%d errors)", errors);
+    }
+
+  printf("\n");
+
+  free(latency);
+  free(threads);
+}
+
+int
+run_benchmarks(void)
+{
+  mach_port_t * nodes = malloc(nports * sizeof(mach_port_t));
+
+  for (int i = 0; i < nports; i ++)
+    {
+      nodes[i] = file_name_lookup (targetPath, O_RDWR, 0);
+
+      if (nodes[i] == MACH_PORT_NULL)
+        {
+          error (2, errno, "file_name_lookup: %s", targetPath);
+        }
+    }
+
+  if (nsizes == 0)
+    {
+      nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+      memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+  char * list = strdupa(tests);
+  char * saveptr;
+
+  for (char * name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr))
+    {
+      if (strcmp(name, "null") == 0)
+        {
+          run_benchmark(nodes, BENCH_NULL, 0);
+        }
+      else if (strcmp(name, "port") == 0)
+        {
+          run_benchmark(nodes, BENCH_PORT, 0);
+        }
+      else if (strcmp(name, "write") == 0)
+        {
+          for (int i = 0; i < nsizes; i ++)
+            {
+              run_benchmark(nodes, BENCH_WRITE, sizes[i]);
+            }
+        }
+      else if (strcmp(name, "read") == 0)
+        {
+          for (int i = 0; i < nsizes; i ++)
+            {
+              run_benchmark(nodes, BENCH_READ, sizes[i]);
+            }
+        }
+      else
+        {
+          error (1, 0, "unknown benchmark: %s", name);
+        }
+    }
+
+  for (int i = 0; i < nports; i ++)
+    {
+      mach_call (mach_port_deallocate (mach_task_self (), nodes[i]));
+    }
+
+  free(nodes);
+
+  return 0;
+}
+
+/* MAIN ROUTINE */
+
+int
+main (int argc, char **argv)
+{
+  /* Parse our options...  */
+  argp_parse (&argp, argc, argv, 0, 0, 0);
+
+  if (targetPath == NULL)
+    {
+      startAsTranslator();
+    }
+  else
+    {
+      return run_benchmarks();
+    }
+}
@@ -0,0 +1,662 @@
+/* -*- mode: C++; indent-tabs-mode: nil -*-
+
+   netmsg-replay - play captured network traffic into a netmsg server
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   Basic usage:
+
+   netmsg --capture=/tmp/netmsg.capture -s
+     (run the real workload through it, then stop it)
+   netmsg -s
+   netmsg-replay /tmp/netmsg.capture localhost
+   netmsg-replay --speed=0 --connections=8 /tmp/netmsg.capture localhost
+
+   netmsg-replay connects to a netmsg server and takes the place of
+   the netmsg client in the captured session, sending everything the
+   client sent, with its original timing (--speed=1, the default),
+   faster or slower (--speed=N), or as fast as the server will take
+   it (--speed=0).  Each of --connections=N runs a complete copy of
+   the session on its own connection, to scale the load up.
+
+   Only a server side capture (netmsg -s --capture) can be replayed,
+   and the server should be exporting the same directory as the one
+   the capture was made on.
+
+   The captured messages contain two kinds of port names.  Names in
+   the client's space (like reply ports) are just numbers to the
+   server, and since we play the part of the client, we can use them
+   as captured.  Names in the server's space, flagged by the high bit
+   in the message body, were given to the client by the server, and
+   will be different this time around.  We learn the new names by
+   matching each message the server sends us to the message it sent
+   at the same point in the captured session, which is the one with
+   the same msgid and destination.  If a message names a server port
+   we haven't learned yet (usually because the reply carrying it
+   hasn't arrived), we hold it for up to --wait milliseconds, then
+   drop it.
+
+   This program doesn't use any Mach calls, just the Mach message
+   layout, so it can run on any machine with the same architecture
+   as the one the capture was made on.  Off the Hurd, build it with
+   "make netmsg-replay-linux", which uses the headers in linux/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <argp.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+#include <vector>
+#include <map>
+#include <deque>
+#include <utility>
+#include <functional>
+
+#include "machMessage.h"
+#include "capture.h"
+
+/* These have to agree with netmsg.cc */
+
+#define MACH_MSGH_BITS_REMOTE_TRANSLATE 0x04000000
+const mach_port_t MACH_PORT_CONTROL = (~ 1);
+#define MSGID_DEAD_NAME 72
+
+const char * targetPort = "2345";
+const char * targetHost = nullptr;
+const char * captureFileName = nullptr;
+
+double speed = 1.0;
+unsigned int connections = 1;
+int sessionNumber = -1;
+unsigned int waitTime = 1000;   /* milliseconds */
+
+static const struct argp_option options[] =
+  {
+    { "port", 'p', "N", 0, "TCP port number" },
+    { "speed", 'S', "X", 0, "replay at X times the captured rate (default 1; 0 means as fast as possible)" },
+    { "connections", 'c', "N", 0, "replay the session on N connections at once (default 1)" },
+    { "session", 'n', "N", 0, "replay session N from the capture (default is the first one)" },
+    { "wait", 'w', "MS", 0, "how long to hold a message that names a server port we haven't learned yet (default 1000)" },
+    { 0 }
+  };
+
+static const char args_doc[] = "CAPTUREFILE HOSTNAME";
+static const char doc[] = "Replay captured netmsg traffic into a netmsg server.";
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case 'p':
+      targetPort = arg;
+      break;
+
+    case 'S':
+      speed = atof(arg);
+      break;
+
+    case 'c':
+      connections = atoi(arg);
+      break;
+
+    case 'n':
+      sessionNumber = atoi(arg);
+      break;
+
+    case 'w':
+      waitTime = atoi(arg);
+      break;
+
+    case ARGP_KEY_ARG:
+      if (state->arg_num == 0)
+        {
+          captureFileName = arg;
+        }
+      else if (state->arg_num == 1)
+        {
+          targetHost = arg;
+        }
+      else
+        {
+          argp_usage (state);
+        }
+      break;
+
+    case ARGP_KEY_END:
+      if (state->arg_num != 2)
+        {
+          argp_usage (state);
+        }
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+
+/***** CAPTURE FILE *****/
+
+struct capturedMessage
+{
+  uint64_t timestamp;
+  unsigned int direction;
+  std::vector<char> data;      /* the message, followed by its OOL data */
+
+  mach_msg_header_t * header(void)
+  {
+    return reinterpret_cast<mach_msg_header_t *>(data.data());
+  }
+};
+
+std::vector<capturedMessage> captured;
+
+void
+readCapture(void)
+{
+  FILE * fp = fopen(captureFileName, "r");
+  if (fp == NULL)
+    {
+      error (1, errno, "%s", captureFileName);
+    }
+
+  struct capture_file_header header;
+
+  if ((fread(&header, sizeof(header), 1, fp) != 1)
+      || (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+      || (header.record_size != sizeof(struct capture_record)))
+    {
+      error (1, 0, "%s: not a netmsg capture file", captureFileName);
+    }
+
+  if (! header.server)
+    {
+      error (1, 0, "%s: not captured in server mode", captureFileName);
+    }
+
+  struct capture_record record;
+
+  while (fread(&record, sizeof(record), 1, fp) == 1)
+    {
+      capturedMessage msg;
+
+      msg.timestamp = record.timestamp;
+      msg.direction = record.direction;
+      msg.data.resize(record.length);
+
+      if (fread(msg.data.data(), 1, record.length, fp) != record.length)
+        {
+          error (0, 0, "%s: truncated", captureFileName);
+          break;
+        }
+
+      if ((record.length < sizeof(mach_msg_header_t)) || (msg.header()->msgh_size > record.length)
+          || (msg.header()->msgh_size > machMessage::max_size))
+        {
+          error (1, 0, "%s: corrupt record", captureFileName);
+        }
+
+      if (sessionNumber == -1)
+        {
+          sessionNumber = record.session;
+        }
+
+      if (record.session == static_cast<unsigned int>(sessionNumber))
+        {
+          captured.push_back(std::move(msg));
+        }
+    }
+
+  fclose(fp);
+}
+
+
+/***** PORT NAMES *****/
+
+/* Call 'f' on a reference to every port name in a message that the
+ * receiver will translate, which is the header ports and every port
+ * right in the body.  PORT_NAME items are only translated in DEAD
+ * NAME notifications to the control port (see tcpBufferHandler()).
+ * 'ool' points to the OOL data that follows the message.
+ */
+
+void
+forEachPort(mach_msg_header_t * hdr, char * ool, std::function<void (mach_port_t &, bool)> f)
+{
+  f(hdr->msgh_local_port, true);
+  f(hdr->msgh_remote_port, false);
+
+  bool portNames = (hdr->msgh_local_port == MACH_PORT_CONTROL) && (hdr->msgh_id == MSGID_DEAD_NAME);
+
+  for (auto ptr = mach_msg_iterator(hdr); ptr; ++ ptr)
+    {
+      char * data = ptr.is_inline() ? static_cast<char *>(ptr.data()) : ool;
+
+      if (! ptr.is_inline() && ! ptr.is_lazy())
+        {
+          ool += ptr.data_size();
+        }
+
+      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()) || (portNames && (ptr.name() == MACH_MSG_TYPE_PORT_NAME)))
+        {
+          mach_port_t * ports = reinterpret_cast<mach_port_t *>(data);
+
+          for (unsigned int i = 0; i < ptr.nelems(); i ++)
+            {
+              f(ports[i], false);
+            }
+        }
+    }
+}
+
+/* Is 'port' in the receiver's name space?  The destination is, unless
+ * it's flagged for translation; the others are if their high bit is
+ * set.  See translatePort2() in netmsg.cc.
+ */
+
+bool
+receiverName(mach_msg_header_t * hdr, mach_port_t port, bool dest)
+{
+  if ((port == MACH_PORT_NULL) || (port == MACH_PORT_DEAD) || (port == MACH_PORT_CONTROL))
+    {
+      return false;
+    }
+  else if (dest)
+    {
+      return ! (hdr->msgh_bits & MACH_MSGH_BITS_REMOTE_TRANSLATE);
+    }
+  else
+    {
+      return port & 0x80000000;
+    }
+}
+
+
+/***** REPLAY *****/
+
+double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+writeAll(int fd, const char * data, size_t length)
+{
+  while (length > 0)
+    {
+      ssize_t n = write(fd, data, length);
+      if (n <= 0)
+        {
+          error (1, errno, "TCP write");
+        }
+      data += n;
+      length -= n;
+    }
+}
+
+bool
+readAll(int fd, char * data, size_t length)
+{
+  while (length > 0)
+    {
+      ssize_t n = read(fd, data, length);
+      if (n <= 0)
+        {
+          return false;
+        }
+      data += n;
+      length -= n;
+    }
+  return true;
+}
+
+int
+tcpConnect(void)
+{
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int errorCode = getaddrinfo(targetHost, targetPort, &hints, &result);
+  if (errorCode != 0)
+    {
+      error (2, 0, "getaddrinfo: %s", gai_strerror(errorCode));
+    }
+
+  int fd = socket(result[0].ai_family, result[0].ai_socktype, result[0].ai_protocol);
+  if (fd < 0)
+    {
+      error (2, errno, "TCP socket");
+    }
+
+  if (connect(fd, result[0].ai_addr, result[0].ai_addrlen) < 0)
+    {
+      error (2, errno, "TCP connect");
+    }
+
+  freeaddrinfo(result);
+
+  return fd;
+}
+
+/* class replay - one connection replaying the captured session */
+
+class replay
+{
+  int fd;
+
+  /* captured server port names -> the names the server is using now */
+  std::map<mach_port_t, mach_port_t> names;
+  std::mutex lock;
+  std::condition_variable learned;
+
+  /* Captured messages from the server, not yet matched, by msgid and destination */
+  std::map<std::pair<mach_msg_id_t, mach_port_t>, std::deque<capturedMessage *>> expected;
+
+  std::thread * receiver;
+
+  void learn(mach_msg_header_t * live, char * liveOOL);
+  bool translate(mach_msg_header_t * hdr, char * ool);
+  void receive(void);
+
+  static std::pair<mach_msg_id_t, mach_port_t> key(mach_msg_header_t * hdr)
+  {
+    return {hdr->msgh_id, (hdr->msgh_bits & MACH_MSGH_BITS_REMOTE_TRANSLATE) ? MACH_PORT_NULL : hdr->msgh_local_port};
+  }
+
+public:
+
+  unsigned long sent = 0;
+  unsigned long sentBytes = 0;
+  unsigned long dropped = 0;
+  std::atomic<unsigned long> received {0};
+  std::atomic<unsigned long> unexpected {0};
+  double maxLag = 0;
+  double elapsed = 0;
+
+  void run(void);
+};
+
+/* The server sent us a message.  Find the message it sent at the same
+ * point in the capture, and learn the server port names in it.
+ */
+
+void
+replay::learn(mach_msg_header_t * live, char * liveOOL)
+{
+  std::unique_lock<std::mutex> lk(lock);
+
+  auto & queue = expected[key(live)];
+
+  if (queue.empty())
+    {
+      unexpected ++;
+      return;
+    }
+
+  mach_msg_header_t * old = queue.front()->header();
+  char * oldOOL = queue.front()->data.data() + old->msgh_size;
+  queue.pop_front();
+
+  /* Collect the names from both messages, then pair them up if the
+   * messages have the same layout.
+   */
+
+  std::vector<mach_port_t> oldNames;
+  std::vector<mach_port_t> liveNames;
+
+  forEachPort(old, oldOOL, [&] (mach_port_t & port, bool dest) { oldNames.push_back(port); });
+  forEachPort(live, liveOOL, [&] (mach_port_t & port, bool dest) { liveNames.push_back(port); });
+
+  if (oldNames.size() != liveNames.size())
+    {
+      unexpected ++;
+      return;
+    }
+
+  /* A name in the server's space is unflagged in a message coming
+   * from the server, which is the opposite of receiverName().
+   */
+
+  for (unsigned int i = 0; i < oldNames.size(); i ++)
+    {
+      bool dest = (i == 0);
+      mach_port_t port = oldNames[i];
+
+      if ((port == MACH_PORT_NULL) || (port == MACH_PORT_DEAD) || (port == MACH_PORT_CONTROL))
+        {
+          continue;
+        }
+      if (dest ? (old->msgh_bits & MACH_MSGH_BITS_REMOTE_TRANSLATE) : ! (port & 0x80000000))
+        {
+          names[port] = liveNames[i];
+        }
+    }
+
+  learned.notify_all();
+}
+
+/* Translate the server port names in a message we're about to send.
+ * Returns false if one of them couldn't be learned in time.
+ */
+
+bool
+replay::translate(mach_msg_header_t * hdr, char * ool)
+{
+  std::unique_lock<std::mutex> lk(lock);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitTime);
+  bool ok = true;
+
+  forEachPort(hdr, ool, [&] (mach_port_t & port, bool dest)
+    {
+      if (! ok || ! receiverName(hdr, port, dest))
+        {
+          return;
+        }
+
+      mach_port_t name = dest ? port : ~ port;
+
+      while (names.count(name) == 0)
+        {
+          if (learned.wait_until(lk, deadline) == std::cv_status::timeout)
+            {
+              ok = (names.count(name) != 0);
+              if (! ok) return;
+            }
+        }
+
+      port = dest ? names[name] : ~ names[name];
+    });
+
+  return ok;
+}
+
+void
+replay::receive(void)
+{
+  machMessage msg;
+  std::vector<char> ool;
+
+  while (readAll(fd, msg.buffer, sizeof(mach_msg_header_t)))
+    {
+      if ((msg->msgh_size > msg.max_size)
+          || ! readAll(fd, msg.buffer + sizeof(mach_msg_header_t), msg->msgh_size - sizeof(mach_msg_header_t)))
+        {
+          break;
+        }
+
+      ool.clear();
+
+      for (auto ptr = msg.data(); ptr; ++ ptr)
+        {
+          if (! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0))
+            {
+              size_t offset = ool.size();
+              ool.resize(offset + ptr.data_size());
+              if (! readAll(fd, ool.data() + offset, ptr.data_size()))
+                {
+                  return;
+                }
+            }
+        }
+
+      received ++;
+      learn(msg, ool.data());
+    }
+}
+
+void
+replay::run(void)
+{
+  for (auto & msg: captured)
+    {
+      if (msg.direction == CAPTURE_NET_SEND)
+        {
+          expected[key(msg.header())].push_back(&msg);
+        }
+    }
+
+  fd = tcpConnect();
+
+  receiver = new std::thread(&replay::receive, this);
+
+  double start = now();
+  uint64_t first = captured.empty() ? 0 : captured.front().timestamp;
+  std::vector<char> buffer;
+
+  for (auto & msg: captured)
+    {
+      if (msg.direction != CAPTURE_NET_RECEIVE)
+        {
+          continue;
+        }
+
+      if (speed > 0)
+        {
+          double due = start + (msg.timestamp - first) / 1e9 / speed;
+          double lag = now() - due;
+
+          if (lag < 0)
+            {
+              std::this_thread::sleep_for(std::chrono::duration<double>(-lag));
+            }
+          else if (lag > maxLag)
+            {
+              maxLag = lag;
+            }
+        }
+
+      buffer = msg.data;
+
+      mach_msg_header_t * hdr = reinterpret_cast<mach_msg_header_t *>(buffer.data());
+
+      if (! translate(hdr, buffer.data() + hdr->msgh_size))
+        {
+          dropped ++;
+          continue;
+        }
+
+      writeAll(fd, buffer.data(), buffer.size());
+
+      sent ++;
+      sentBytes += buffer.size();
+    }
+
+  elapsed = now() - start;
+
+  /* Give the server a chance to send everything it sent in the
+   * capture, then hang up.
+   */
+
+  unsigned long last;
+
+  do
+    {
+      last = received;
+      std::this_thread::sleep_for(std::chrono::milliseconds(waitTime));
+    }
+  while (received != last);
+
+  shutdown(fd, SHUT_RDWR);
+  receiver->join();
+  delete receiver;
+  close(fd);
+}
+
+int
+main (int argc, char **argv)
+{
+  argp_parse (&argp, argc, argv, 0, 0, 0);
+
+  readCapture();
+
+  if (captured.empty())
+    {
+      error (1, 0, "%s: no messages to replay", captureFileName);
+    }
+
+  std::vector<replay> replays(connections);
+  std::vector<std::thread> threads;
+
+  for (auto & r: replays)
+    {
+      threads.emplace_back(&replay::run, &r);
+    }
+
+  for (auto & thread: threads)
+    {
+      thread.join();
+    }
+
+  unsigned long sent = 0, sentBytes = 0, dropped = 0, received = 0, unexpected = 0;
+  double maxLag = 0;
+  double elapsed = 0;
+
+  for (auto & r: replays)
+    {
+      sent += r.sent;
+      sentBytes += r.sentBytes;
+      dropped += r.dropped;
+      received += r.received;
+      unexpected += r.unexpected;
+      maxLag = std::max(maxLag, r.maxLag);
+      elapsed = std::max(elapsed, r.elapsed);
+    }
+
+  printf("session %d, %u connection%s: sent %lu messages (%.2f MB) in %.3f s: %.0f msgs/s %.2f MB/s\n",
+         sessionNumber, connections, connections == 1 ? "" : "s", sent, sentBytes / (1024.0 * 1024),
+         elapsed, sent / elapsed, sentBytes / elapsed / (1024 * 1024));
+  printf("received %lu messages (%lu not in the capture), dropped %lu with unknown ports", received, unexpected, dropped);
+  if (speed > 0)
+    {
+      printf(", fell behind schedule by up to %.1f ms", maxLag * 1000);
+    }
+  printf("\n");
+}
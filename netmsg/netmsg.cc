@@ -52,7 +52,8 @@
    problems with certain programs (libpager) that are limited in the
    number of clients they can handle.
 
-   No attempt to made to detect loops involving more than two parties.
+   Loops involving more than two parties are only detected with
+   --node-id (see PORT IDENTITIES).
 
    The other case when the receiver's port space might be used is the
    destination port of the message itself.  The destination port
@@ -83,6 +84,27 @@
    remote port number because that's what came in earlier over the
    network.
 
+   NO SENDERS ACCOUNTING
+
+   Every send right we relay leaves us holding a send right for our
+   peer (transmitted_send_rights counts them), and our peer makes one
+   on its proxy.  When the proxy's last send right goes away, the
+   peer relays the proxy's NO SENDERS notification, whose count is
+   every send right ever made on it, and destroys the proxy.  We drop
+   that many of our send rights, and forget the port only if that's
+   all of them; the rest belong to rights still on their way to a
+   new proxy.  The peer doesn't destroy the proxy if it picked up a
+   send right after its notification was generated; it waits for the
+   next one.
+
+   A proxy's send right that comes back to us arrives in our own name
+   space, and we relay a copy of one of our send rights.  Its message
+   may be on a different run queue from the proxy's NO SENDERS
+   notification, which the peer sent after it.  So the network thread
+   counts such rights as they're read (returning_send_rights), and a
+   NO SENDERS notification that overtakes one waits, in
+   deferred_no_senders, until the last one has been translated.
+
    BUFFERING
 
    In order to preserve ordering of Mach messages, each destination
@@ -92,11 +114,143 @@
    netmsg's memory utilization to grow without bound.  This is
    obviously a problem, as it defeats Mach's queue limits.
 
+   OOL COPY-IN
+
+   OOL data has to be copied into our own address space before it's
+   transmitted (see copyOOLdata), and if it's backed by a slow memory
+   manager, that copy can take a long time.  So, as soon as a message
+   is received via IPC, its OOL data is handed to a small pool of
+   copy-in threads (--copyin-threads), while the message waits in its
+   run queue and then has its ports translated.  The run queue thread
+   only waits for the copy right before it transmits the message, so
+   page-ins for one message overlap network sends for the ones ahead
+   of it, and messages to each port still go out in order.
+
+   In the other direction, OOL data is read off the network into
+   page-aligned buffers that each connection keeps ready, already
+   faulted in (--ool-pool), and the buffers are handed to the kernel
+   along with the message.  A background thread replaces them, so
+   the network thread doesn't wait on vm_allocate or page faults.
+
+   PRIORITIES
+
+   Each port's messages are handled by their own thread, but all of
+   a connection's messages share one TCP stream, and OOL data waits
+   for the copy-in threads.  A memory manager's reply stuck behind a
+   bulk io_read there holds up a page fault on the far side, and
+   everything waiting on it.  So messages fall into three priority
+   classes: paging (memory object RPCs), notifications and our own
+   control messages are high, io_read and io_write are low, and
+   everything else is in between.  Higher priority messages get the
+   network stream and the copy-in threads first.  A message that's
+   already being written finishes first, though, since the wire
+   format doesn't let us interleave messages.
+
+   PORT IDENTITIES
+
+   If Alice passes a send right to Bob, Bob passes it to Carol, and
+   Carol passes it back to Alice, then Alice's messages to her own
+   port go around the loop through Bob and Carol, since Carol doesn't
+   know where the port came from, only that Bob gave it to her.
+
+   With --node-id=N, which every netmsg in a cluster has to be given
+   (each a different N), a port's identity is the node holding its
+   receive right and its name there.  A message carrying send rights
+   gets one more data item, flagged with a spare header bit, listing
+   each right's identity, and the receiver strips it off before the
+   message goes any further.  A right to a port on our own node, if
+   it's one we identified ourselves and it's still alive, is
+   delivered as a right to the port itself; we still create the usual
+   proxy and drop its send right right away, so its no senders
+   notification tells the peer to release its send right, just as if
+   the proxy had been used.  Otherwise, the identity is remembered
+   with the proxy, so it goes along the next time the right is
+   passed on.
+
+   MESH
+
+   Even knowing where a port lives, a node only talks to the nodes
+   it's connected to, so if Bob got a right from Alice to one of
+   Carol's ports, his messages to it still go through Alice.  With
+   --mesh, netmsg peers introduce themselves (MESH_HELLO) when they
+   connect, and tell each other how to reach every node they know
+   that's listening for connections (MESH_ROUTE).  When a right
+   arrives whose identity is on a node other than the peer that sent
+   it, and we have a direct connection to that node, we tell it which
+   of its ports we want (MESH_IMPORT), and relay a right to a proxy on
+   the direct connection instead.  If we don't have one, but know a
+   route there, we start connecting in the background, and relay this
+   right the long way.  A node only honors MESH_IMPORT for ports it
+   has identified itself.  The proxy on the connection the right
+   came in on loses its send right, so the node that sent it to us
+   gets to release its own right, and drops out of the path.
+
+   PORT LOCATION
+
+   A memory manager serving several nodes wants to know which of its
+   clients is the kernel on its own node, and netmsg's tables already
+   say where every port it relays lives.  With --locator, netmsg
+   attaches itself to /servers/netmsg (or another node) and answers
+   netmsg_locate (see netmsg-locate.defs) there, which takes any
+   number of send rights and returns the --node-id of the node holding
+   each one's receive right.  netmsg_request_location_notification
+   asks for a netmsg_location_changed the next time a port's receive
+   right moves to another node, or dies over there.
+
+   PIPELINING
+
+   A run queue thread normally blocks in mach_msg until the
+   destination port has room for its message, and everything behind
+   it waits, too.  For a multithreaded server with a full queue, that
+   means RPCs from different clients wait on each other in netmsg,
+   instead of on the server's port, where the kernel would let them
+   in as fast as the server's threads can take them.
+
+   With --pipeline, RPC requests (messages carrying a send-once reply
+   port) are sent with a zero timeout.  If the destination's queue is
+   full, the message is copied onto a deferred queue for that port,
+   and the run queue moves on.  One thread per port drains its
+   deferred queue, waiting for room on the destination; if more than
+   maxDeferredSends pile up, the run queue waits too.  Mach only orders
+   messages from a single sender, and a thread doing ordinary RPCs
+   never has two requests outstanding, so RPC requests are free to
+   overtake each other.  Anything else (a one-way message, say) first
+   waits for all of the port's deferred requests to be delivered, so
+   it never overtakes one sent ahead of it.
+
+   This doesn't help with sends that block for other reasons, like a
+   vm_map on a flaky memory manager (see tcpBufferHandler), which
+   can block in the kernel even with a zero timeout.
+
+   LAZY OOL TRANSFER
+
+   With --lazy-ool=BYTES, OOL data at least BYTES long isn't copied
+   when it's received via IPC, and isn't transmitted after the
+   message.  Instead, we keep the region in an export table, replace
+   its pointer in the network message with an export id, and flag its
+   type descriptor with the descriptor's unused bit.
+
+   The receiving netmsg backs each such region with a memory object
+   of its own, maps it, and relays the mapping in place of the data.
+   When the recipient touches a page, the kernel asks that memory
+   object for it, and netmsg asks its peer with a LAZY_OOL_REQUEST.
+   The peer answers with LAZY_OOL_DATA, or with an error code if its
+   own copy of the page couldn't be read, which becomes a memory
+   error on the recipient's side, just like it would have locally.
+   When the memory object is terminated, LAZY_OOL_RELEASE tells the
+   peer it can deallocate the region.  These three messages are only
+   exchanged between netmsg peers and are never relayed via IPC.
+
+   Only the sending side needs --lazy-ool; receivers always accept
+   regions sent by reference.  A recipient that only reads part of a
+   large region (a partially consumed io_read reply, say) only costs
+   the pages it touches.
+
 
    XXX known issues XXX
 
    - no byte order swapping
-   - can't detect three party loops
+   - can't detect three party loops without --node-id
    - no Hurd authentication (it runs with the server's permissions)
    - no checks made if Mach produces ports with the highest bit set
    - NO SENDERS notifications are sent to the port itself, not to a control port
@@ -108,16 +262,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <error.h>
 #include <argp.h>
 #include <assert.h>
+#include <signal.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include <iostream>
@@ -127,11 +287,17 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <atomic>
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <deque>
 #include <set>
+#include <algorithm>
 
 #include <ext/stdio_filebuf.h>
 
@@ -149,18 +315,25 @@
 
 extern "C" {
 #include <mach/notify.h>
+#include <mach_debug/mach_debug.h>
 
 #include <hurd.h>
 #include <hurd/fsys.h>
 #include <hurd/sigpreempt.h>
 #include "fsys_S.h"
+#include "memory_object_S.h"
+#include "netmsg-locate_S.h"
 
   extern int fsys_server (mach_msg_header_t *, mach_msg_header_t *);
+  extern int memory_object_server (mach_msg_header_t *, mach_msg_header_t *);
+  extern int netmsg_locate_server (mach_msg_header_t *, mach_msg_header_t *);
 
 #include "msgids.h"
 };
 
 #include "version.h"
+#include "trace.h"
+#include "capture.h"
 
 /* mach_error()'s first argument isn't declared const, and we usually pass it a string */
 #pragma GCC diagnostic ignored "-Wwrite-strings"
@@ -175,6 +348,26 @@ const char * targetHost;   /* required argument */
 
 const char * exportedPath = "/";   /* server presents this path to its clients */
 
+const char * locatorPath = nullptr;   /* --locator answers port location queries here */
+
+const char * traceFile = nullptr;   /* --trace writes message timestamps here */
+
+const char * captureFile = nullptr;   /* --capture writes network traffic here */
+
+vm_size_t lazyOOLthreshold = 0;   /* --lazy-ool sends OOL regions this big by reference; 0 never does */
+
+unsigned int copyinThreads = 4;   /* --copyin-threads copy OOL data off the relay path; 0 copies it inline */
+
+vm_size_t OOLpoolSize = 8 << 20;   /* --ool-pool keeps this much ready for each connection's OOL data; 0 doesn't */
+
+natural_t nodeId = 0;   /* --node-id identifies our ports to the rest of the cluster; 0 doesn't */
+
+bool meshMode = false;   /* --mesh connects directly to the nodes our ports live on */
+
+bool pipelining = false;   /* --pipeline lets RPC requests to a busy port overtake each other */
+
+const unsigned int maxDeferredSends = 16;   /* per port, before its run queue waits too */
+
 bool serverMode = false;
 
 /* Normally, we run multi threaded, with each port given a separate
@@ -193,20 +386,47 @@ bool serverMode = false;
 
 const bool multi_threaded = true;
 
+/* Debugging output is selected at runtime with -d, but the highest
+ * level that can be selected is fixed at compile time.  Building with
+ * -DNETMSG_MAX_DEBUG=0 makes debugging() a constant false, so every
+ * debug print (and its argument evaluation, when guarded by
+ * debugging()) is compiled out of the relay path.
+ */
+
+#ifndef NETMSG_MAX_DEBUG
+#define NETMSG_MAX_DEBUG 2
+#endif
+
+const unsigned int maxDebugLevel = NETMSG_MAX_DEBUG;
+
 unsigned int debugLevel = 0;
 
+inline bool debugging(unsigned int level)
+{
+  return (level <= maxDebugLevel) && (debugLevel >= level);
+}
+
 template<typename... Args>
 void dprintf(Args... rest)
 {
-  if (debugLevel >= 1) while (fprintf(stderr, rest...) == -1);
+  if (debugging(1)) while (fprintf(stderr, rest...) == -1);
 }
 
 template<typename... Args>
 void ddprintf(Args... rest)
 {
-  if (debugLevel >= 2) while (fprintf(stderr, rest...) == -1);
+  if (debugging(2)) while (fprintf(stderr, rest...) == -1);
 }
 
+/* Port auditing walks every port we hold and checks it against our
+ * maps.  It's far too expensive to run on the relay path, so it only
+ * runs if requested with --audit, and then on its own thread, every
+ * auditInterval milliseconds (if nonzero) and on SIGUSR2.
+ */
+
+bool auditing = false;
+unsigned int auditInterval = 1000;
+
 /* wassert - like assert, but only print a warning.  Used in server code
  * where we don't want to terminate the process.
  */
@@ -245,11 +465,110 @@ class synchronized : public T, public std::mutex
   using T::T;    // this picks up T's constructors
 };
 
+/* Message priority classes (see PRIORITIES, above) */
+
+const unsigned int PRIORITY_HIGH = 0;
+const unsigned int PRIORITY_NORMAL = 1;
+const unsigned int PRIORITY_LOW = 2;
+const unsigned int PRIORITY_CLASSES = 3;
+
+/* class priorityMutex
+ *
+ * A mutex that, when it's released, goes to a waiter of the highest
+ * priority class waiting for it.  Use it with a priorityLock, the way
+ * you'd use a std::mutex with a std::unique_lock.
+ */
+
+class priorityMutex
+{
+  std::mutex mutex;
+  std::condition_variable released;
+  bool held = false;
+  unsigned int waiting[PRIORITY_CLASSES] = { 0 };
+
+  bool
+    mustWait(unsigned int priority)
+  {
+    if (held)
+      {
+        return true;
+      }
+
+    for (unsigned int i = 0; i < priority; i ++)
+      {
+        if (waiting[i] > 0)
+          {
+            return true;
+          }
+      }
+
+    return false;
+  }
+
+ public:
+
+  void
+    lock(unsigned int priority)
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+
+    waiting[priority] ++;
+    released.wait(lk, [&] { return ! mustWait(priority); });
+    waiting[priority] --;
+
+    held = true;
+  }
+
+  void
+    unlock(void)
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+
+    held = false;
+    released.notify_all();
+  }
+};
+
+class priorityLock
+{
+  priorityMutex & mutex;
+
+ public:
+
+  priorityLock(priorityMutex & mutex, unsigned int priority) : mutex(mutex)
+  {
+    mutex.lock(priority);
+  }
+
+  ~priorityLock()
+  {
+    mutex.unlock();
+  }
+};
+
+/* Like synchronized, but locked with a priorityLock */
+
+template <class T>
+class prioritized : public T, public priorityMutex
+{
+  using T::T;
+};
+
 static const struct argp_option options[] =
   {
     { "port", 'p', "N", 0, "TCP port number" },
     { "server", 's', 0, 0, "server mode" },
     { "debug", 'd', 0, 0, "debug messages (can be specified twice for more verbosity)" },
+    { "trace", 't', "FILE", 0, "timestamp every message and write the trace to FILE on SIGUSR1 and at exit" },
+    { "capture", 'c', "FILE", 0, "record all network traffic to FILE, for netmsg-replay" },
+    { "audit", 'a', "MSEC", OPTION_ARG_OPTIONAL, "audit our ports every MSEC milliseconds (default 1000; 0 for never) and on SIGUSR2" },
+    { "lazy-ool", 'l', "BYTES", 0, "send OOL data of at least BYTES by reference, and let the receiver fault in the pages it uses" },
+    { "copyin-threads", 'i', "N", 0, "copy OOL data in with N background threads (default 4; 0 copies it on the relay thread)" },
+    { "ool-pool", 'b', "BYTES", 0, "keep up to BYTES of buffers ready for each connection's incoming OOL data (default 8 MB; 0 disables)" },
+    { "node-id", 'n', "N", 0, "identify our ports to the rest of the cluster as node N, and deliver our own ports locally when they come back" },
+    { "mesh", 'm', 0, 0, "connect directly to the nodes that hold our ports' receive rights, instead of relaying (requires --node-id)" },
+    { "locator", 'L', "PATH", OPTION_ARG_OPTIONAL, "answer port location queries on PATH (default /servers/netmsg)" },
+    { "pipeline", 'P', 0, 0, "don't hold up a port's run queue while an RPC request waits for room on its destination" },
     { 0 }
   };
 
@@ -285,6 +604,47 @@ parse_opt (int key, char *arg, struct argp_state *state)
       debugLevel ++;
       break;
 
+    case 't':
+      traceFile = arg;
+      break;
+
+    case 'c':
+      captureFile = arg;
+      break;
+
+    case 'a':
+      auditing = true;
+      if (arg) auditInterval = atoi(arg);
+      break;
+
+    case 'l':
+      lazyOOLthreshold = strtoul(arg, NULL, 0);
+      break;
+
+    case 'i':
+      copyinThreads = atoi(arg);
+      break;
+
+    case 'b':
+      OOLpoolSize = strtoul(arg, NULL, 0);
+      break;
+
+    case 'n':
+      nodeId = strtoul(arg, NULL, 0);
+      break;
+
+    case 'm':
+      meshMode = true;
+      break;
+
+    case 'L':
+      locatorPath = arg ? arg : "/servers/netmsg";
+      break;
+
+    case 'P':
+      pipelining = true;
+      break;
+
     case ARGP_KEY_ARG:
       if (state->arg_num == 0)
         {
@@ -318,6 +678,9 @@ parse_opt (int key, char *arg, struct argp_state *state)
 const struct argp_child children[] =
   {
     { .argp=&msgid_argp, },
+#ifdef NETMSG_LINUX
+    { .argp=&loopback_argp, },
+#endif
     { 0 }
   };
 
@@ -329,6 +692,45 @@ static struct argp argp = { options, parse_opt, args_doc, doc, children };
 #define MSGID_SEND_ONCE 71
 #define MSGID_DEAD_NAME 72
 
+/* Messages between netmsg peers for lazy OOL transfer (see LAZY OOL
+ * TRANSFER, above) and for the mesh (see MESH).  They're addressed to
+ * MACH_PORT_CONTROL and use negative msgids, which no MIG interface
+ * does.  The arguments are:
+ *
+ * LAZY_OOL_REQUEST: export id, offset, length, memory object
+ * LAZY_OOL_DATA:    memory object, offset, length, error code; the
+ *                   data follows, unless there's an error
+ * LAZY_OOL_RELEASE: export id
+ *
+ * MESH_HELLO:       node id, TCP port we listen on (0 if we don't)
+ * MESH_ROUTE:       node id, IPv4 address (network order), TCP port
+ * MESH_IMPORT:      port name, in the recipient's name space
+ */
+
+#define MSGID_LAZY_OOL_REQUEST -1001
+#define MSGID_LAZY_OOL_DATA -1002
+#define MSGID_LAZY_OOL_RELEASE -1003
+
+/* netmsg_location_changed, from netmsg-locate.defs */
+
+#define MSGID_LOCATION_CHANGED 50402
+
+#define MSGID_MESH_HELLO -1101
+#define MSGID_MESH_ROUTE -1102
+#define MSGID_MESH_IMPORT -1103
+
+struct peerMessage
+{
+  mach_msg_header_t header;
+  mach_msg_type_t argsType;
+  natural_t args[4];
+  mach_msg_type_long_t dataType;
+  vm_address_t data;
+};
+
+static_assert(offsetof(peerMessage, data) == offsetof(peerMessage, dataType) + sizeof(mach_msg_type_long_t),
+              "peerMessage must be laid out the way mach_msg_iterator expects");
+
 static const char *
 msgid_name (mach_msg_id_t msgid)
 {
@@ -345,558 +747,2326 @@ msgid_name (mach_msg_id_t msgid)
     }
 }
 
-/* We use this unused bit in the Mach message header to indicate that
- * the receiver should translate the message's destination port.
+/* Which priority class does a message belong to?  We go by the RPC
+ * names, if we've got the msgids database, and otherwise by a few
+ * msgids that aren't likely to change.  msgid_info isn't thread safe
+ * (it caches reply names), so we cache its answers ourselves.
  */
 
-#define MACH_MSGH_BITS_REMOTE_TRANSLATE 0x04000000
+unsigned int
+messagePriority(mach_msg_id_t msgid)
+{
+  static synchronized<std::map<mach_msg_id_t, unsigned int>> cache;
 
-#if (MACH_MSGH_BITS_UNUSED & MACH_MSGH_BITS_REMOTE_TRANSLATE) != MACH_MSGH_BITS_REMOTE_TRANSLATE
-#error MACH_MSGH_BITS_REMOTE_TRANSLATE seems to be in use!
-#endif
+  std::unique_lock<std::mutex> lk(cache);
 
-/* Reserved port used to identify the server's initial control port */
+  auto it = cache.find(msgid);
 
-/* XXX reserved by us; not necessarily by Mach! */
+  if (it != cache.end())
+    {
+      return it->second;
+    }
 
-const mach_port_t MACH_PORT_CONTROL = (~ 1);
+  const struct msgid_info *info = msgid_info (msgid);
+  std::string name = info ? info->name : "";
+  mach_msg_id_t request = ((msgid / 100) % 2 == 1) ? msgid - 100 : msgid;
+  unsigned int priority = PRIORITY_NORMAL;
+
+  if ((msgid < 0)                                       /* our own control messages */
+      || ((msgid >= MSGID_PORT_DELETED) && (msgid <= MSGID_DEAD_NAME))
+      || (name.compare(0, 13, "memory_object") == 0)
+      || ((request >= 2200) && (request < 2300)))      /* memory_object.defs, memory_object_default.defs */
+    {
+      priority = PRIORITY_HIGH;
+    }
+  else if ((name == "io_read") || (name == "io_write")
+           || (name == "io_read-reply") || (name == "io_write-reply")
+           || (request == 21000) || (request == 21001))    /* io_write, io_read */
+    {
+      priority = PRIORITY_LOW;
+    }
 
-/* translator (network client) sets 'control' to a receive right that
- * it passes back on its bootstrap port in an fsys_startup call;
- * server leaves it MACH_PORT_NULL
- */
+  cache[msgid] = priority;
 
-mach_port_t control = MACH_PORT_NULL;
+  return priority;
+}
 
-/* class netmsg - a single netmsg session
+/* class traceBuffer
  *
- * translator/client will only have a single instance of this class
+ * Per-RPC latency tracing, enabled with --trace.  Each relayed
+ * message is timestamped when it's received via IPC, written to the
+ * network, read from the network, and delivered via IPC.  Records go
+ * into a fixed-size ring buffer; writers claim a slot with an atomic
+ * increment and never block, so old records are silently overwritten
+ * if the buffer isn't dumped often enough.
  *
- * servers will have an instance for every client that connects to them
+ * Each slot carries a sequence number, zeroed while the record is
+ * being written, that lets dump() skip slots that are half-written
+ * or that were overwritten while it was reading them.
  *
- * We need to define a few more things before we're ready to define
- * class netmsg itself.
+ * A message gets its token at its first event, and carries it in
+ * msgh_seqno, which the kernel only sets when a message is received.
+ * So the token stays with the message even when it's copied, like
+ * deferSend does, and a new message in a freed buffer gets its own.
+ *
+ * The file format is described in trace.h.
  */
 
-class netmsg;
+class traceBuffer
+{
+  static const unsigned long size = 1 << 16;    /* must be a power of two */
 
-void auditPorts(void);
+  struct slot
+  {
+    std::atomic<unsigned long> sequence {0};
+    struct trace_record record;
+  };
 
-/* class RunQueues
- *
- * To ensure in-order delivery of messages, we keep run queues,
- * organized by the original destination port number as it appeared in
- * the network message (not the translated port number).  Each
- * RunQueues has a handler function, the same of all its run queues,
- * set when it's constructed.  When you push onto a run queue, if it's
- * empty, the message you've pushed starts processing.  As each
- * message completes processing, if there's anything left in the run
- * queue, the top item starts processing.  It's all protected by a
- * mutex lock.
- *
- * XXX could use a thread pool.  Instead we create and destroy threads
- * pretty liberally as we get work and run out of it.
- */
+  slot * const ring = new slot[size];
+  std::atomic<unsigned long> next {0};
+  std::atomic<mach_port_seqno_t> next_token {1};
 
-class RunQueues : synchronized<std::map<mach_port_t, std::deque<machMessage *>>>
-{
-  netmsg * const parent;
+  std::mutex dump_lock;
 
-  typedef void (netmsg::* handlerType) (machMessage &);
-  handlerType handler;
+public:
 
-  void
-    run(mach_port_t port)
+  void record(unsigned int event, machMessage & msg, mach_port_t dest, mach_port_t reply)
   {
-    bool empty = false;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    do
+    unsigned long n = next.fetch_add(1, std::memory_order_relaxed);
+    slot & s = ring[n & (size - 1)];
+
+    if ((event == TRACE_IPC_RECEIVE) || (event == TRACE_NET_RECEIVE))
       {
-        machMessage * netmsg;
+        msg->msgh_seqno = next_token.fetch_add(1, std::memory_order_relaxed);
+      }
 
-        {
-          std::unique_lock<std::mutex> lk;
+    s.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 
-          assert(! at(port).empty());
-          netmsg = at(port).front();
-        }
+    s.record.timestamp = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    s.record.message = msg->msgh_seqno;
+    s.record.msgid = msg->msgh_id;
+    s.record.dest = dest;
+    s.record.reply = reply;
+    s.record.event = event;
+    s.record.size = msg->msgh_size;
+    s.record.reserved = 0;
 
-        ddprintf("%x processing\n", netmsg);
+    s.sequence.store(n + 1, std::memory_order_release);
+  }
 
-        (parent->*handler)(*netmsg);
+  void dump(const char * filename)
+  {
+    std::unique_lock<std::mutex> lk(dump_lock);
 
-        /* for debugging purposes - audit our ports to make sure all of our invariants are still satisfied */
-        auditPorts();
+    unsigned long end = next.load(std::memory_order_acquire);
+    unsigned long start = (end > size) ? end - size : 0;
 
-        {
-          std::unique_lock<std::mutex> lk;
+    std::vector<struct trace_record> records;
+    std::map<int32_t, std::string> names;
 
-          at(port).pop_front();
+    records.reserve(end - start);
 
-          delete netmsg;
+    for (unsigned long n = start; n < end; n ++)
+      {
+        slot & s = ring[n & (size - 1)];
 
-          empty = at(port).empty();
-        }
+        if (s.sequence.load(std::memory_order_acquire) != n + 1) continue;
+        struct trace_record r = s.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.sequence.load(std::memory_order_relaxed) != n + 1) continue;
+
+        records.push_back(r);
+        if (names.count(r.msgid) == 0)
+          {
+            names[r.msgid] = msgid_name(r.msgid);
+          }
       }
-    while (! empty);
-  }
 
- public:
+    FILE * fp = fopen(filename, "w");
+    if (fp == NULL)
+      {
+        error (0, errno, "%s", filename);
+        return;
+      }
 
- void
-   push_back(mach_port_t port, machMessage * netmsg)
- {
-   std::unique_lock<std::mutex> lk;
+    struct trace_file_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct trace_record);
+    header.nrecords = records.size();
+    header.nnames = names.size();
+    header.dropped = start + (end - start - records.size());
 
-   bool empty = (*this)[port].empty();
-   (*this)[port].push_back(netmsg);
-   if (empty)
-     {
-       // XXX nothing is done to reap this thread
-       new std::thread {&RunQueues::run, this, port};
-     }
- }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(records.data(), sizeof(struct trace_record), records.size(), fp);
 
-  RunQueues(netmsg * const parent, handlerType handler) : parent(parent), handler(handler) { }
+    for (auto & name: names)
+      {
+        struct trace_name tn = {name.first, static_cast<uint32_t>(name.second.size())};
+        fwrite(&tn, sizeof(tn), 1, fp);
+        fwrite(name.second.data(), 1, name.second.size(), fp);
+      }
+
+    if (fclose(fp) != 0)
+      {
+        error (0, errno, "%s", filename);
+      }
+  }
 };
 
-class netmsg
-{
-  friend void auditPorts(void);
+traceBuffer * tracer = nullptr;
 
-  mach_port_t first_port = MACH_PORT_NULL;    /* server sets this to a send right on underlying node; client leaves it MACH_PORT_NULL */
-  mach_port_t portset = MACH_PORT_NULL;
-  mach_port_t notification_port = MACH_PORT_NULL;
+/* trace() is called on the relay path; it costs a single test when
+ * tracing is disabled.
+ */
 
-  /* These next two maps are used for RECEIVE and SEND rights, but not SEND ONCE rights. */
+inline void
+trace(unsigned int event, machMessage & msg, mach_port_t dest, mach_port_t reply)
+{
+  if (tracer) tracer->record(event, msg, dest, reply);
+}
 
-  std::map<mach_port_t, mach_port_t> local_ports_by_remote;
-  std::map<mach_port_t, mach_port_t> remote_ports_by_local;
+/* The trace is dumped from its own thread on SIGUSR1, so the dump
+ * doesn't have to be async-signal safe, and again at exit.
+ */
 
-  std::map<mach_port_t, unsigned int> local_port_type;         /* MACH_MSG_TYPE_PORT_RECEIVE or MACH_MSG_TYPE_PORT_SEND */
+void
+traceDumpOnSignal(sigset_t sigset)
+{
+  while (1)
+    {
+      int sig;
+      if (sigwait(&sigset, &sig) == 0)
+        {
+          tracer->dump(traceFile);
+        }
+    }
+}
 
-  std::map<mach_port_t, mach_port_t> send_once_ports_by_remote;    /* map remote send-once port to local receive port */
-  std::map<mach_port_t, mach_port_t> send_once_ports_by_local;    /* map local receive port to remote send once port */
+void
+traceDumpAtExit(void)
+{
+  tracer->dump(traceFile);
+}
 
-  /* Use a non-standard GNU extension to wrap the network socket in a
-   * C++ iostream that will provide buffering.
-   *
-   * XXX alternative to GNU - use boost?
-   *
-   * Error handling can be done with exception (upon request), or by
-   * testing fs to see if it's false.
+void
+startTracing(void)
+{
+  tracer = new traceBuffer;
+
+  /* Block SIGUSR1 before any other threads are created, so they all
+   * inherit the mask and only traceDumpOnSignal() ever sees it.
    */
 
-  __gnu_cxx::stdio_filebuf<char> filebuf_in;
-  __gnu_cxx::stdio_filebuf<char> filebuf_out;
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-  std::istream is;
-  synchronized<std::ostream> os;
+  new std::thread(traceDumpOnSignal, sigset);
 
-  std::thread * ipcThread;
-  std::thread * tcpThread;
-  std::thread * fsysThread;
+  atexit(traceDumpAtExit);
+}
 
-  void transmitOOLdata(machMessage & msg);
-  void receiveOOLdata(machMessage & msg);
+/* class captureWriter
+ *
+ * Network traffic capture, enabled with --capture.  Each message is
+ * written together with its OOL data in a single writev() under a
+ * lock, so records from different threads don't interleave, and
+ * nothing is lost if netmsg is killed.  This isn't cheap, but unlike
+ * tracing, it's not meant to be left on.
+ *
+ * The file format is described in capture.h.
+ */
 
-  void translateForTransmission(machMessage & msg, bool translatePortNames);
-  void ipcBufferHandler(machMessage & netmsg);
-  void ipcHandler(void);
+class captureWriter
+{
+  int fd;
+  std::mutex lock;
 
-  mach_port_t translatePort2(const mach_port_t port, const unsigned int type);
-  mach_port_t translatePort(const mach_port_t port, const unsigned int type);
-  void swapHeader(machMessage & msg);
-  bool translateHeader(machMessage & msg);
-  void translateMessage(machMessage & msg, bool translatePortNames);
-  void tcpHandler(void);
-  void tcpBufferHandler(machMessage & netmsg);
+public:
 
-  RunQueues tcp_run_queue {this, &netmsg::tcpBufferHandler};
-  RunQueues ipc_run_queue {this, &netmsg::ipcBufferHandler};
+  captureWriter(const char * filename)
+  {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+      {
+        error (1, errno, "%s", filename);
+      }
 
-public:
+    struct capture_file_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct capture_record);
+    header.server = serverMode;
 
-  netmsg(int networkSocket);
-  ~netmsg();
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+      {
+        error (1, errno, "%s", filename);
+      }
+  }
+
+  void record(unsigned int direction, unsigned int session, machMessage & msg)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct capture_record record;
+    record.timestamp = static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    record.length = msg->msgh_size;
+    record.direction = direction;
+    record.session = session;
+
+    std::vector<struct iovec> iov;
+    iov.push_back({&record, sizeof(record)});
+    iov.push_back({msg.buffer, msg->msgh_size});
+
+    for (auto ptr = msg.data(); ptr; ++ ptr)
+      {
+        if (! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0))
+          {
+            iov.push_back({ptr.data(), ptr.data_size()});
+            record.length += ptr.data_size();
+          }
+      }
+
+    std::unique_lock<std::mutex> lk(lock);
+
+    if (writev(fd, iov.data(), iov.size()) != static_cast<ssize_t>(sizeof(record) + record.length))
+      {
+        error (0, errno, "%s", captureFile);
+      }
+  }
 };
 
-/* For debugging purposes, we keep a list of all netmsg instances and
- * can use them to audit our ports to ensure that all ports are
- * accounted for and all our invarients are maintained.
+captureWriter * capture = nullptr;
+
+inline void
+captureMessage(unsigned int direction, unsigned int session, machMessage & msg)
+{
+  if (capture) capture->record(direction, session, msg);
+}
+
+/* We use this unused bit in the Mach message header to indicate that
+ * the receiver should translate the message's destination port.
+ */
+
+#define MACH_MSGH_BITS_REMOTE_TRANSLATE 0x04000000
+
+#if (MACH_MSGH_BITS_UNUSED & MACH_MSGH_BITS_REMOTE_TRANSLATE) != MACH_MSGH_BITS_REMOTE_TRANSLATE
+#error MACH_MSGH_BITS_REMOTE_TRANSLATE seems to be in use!
+#endif
+
+/* ...and this one to flag a message whose last data item lists the
+ * identities of its send rights (see PORT IDENTITIES).
  */
 
-std::set<netmsg *> active_netmsg_classes;
+#define MACH_MSGH_BITS_PORT_IDENTITIES 0x02000000
 
-std::string porttype2str(mach_port_type_t type)
+#if (MACH_MSGH_BITS_UNUSED & MACH_MSGH_BITS_PORT_IDENTITIES) != MACH_MSGH_BITS_PORT_IDENTITIES
+#error MACH_MSGH_BITS_PORT_IDENTITIES seems to be in use!
+#endif
+
+/* A port's identity is the node holding its receive right and its
+ * name there.  On the wire, each send right's identity is three
+ * integers: its index among the message's send rights, then node and
+ * name.  portIdentities remembers the identities of our proxies (the
+ * receive rights we hold for send rights we got over the network),
+ * by local name, for all connections.  A proxy that isn't listed
+ * stands for a port on the peer it came from.
+ *
+ * exportedPorts holds the names we've given out as our own node's
+ * identities.  An identity naming our node is only honored if it's
+ * one of these, so a peer can't get a right to any port of ours just
+ * by guessing its name.  A name is forgotten when its port dies or we
+ * let go of it, since it can then be reused for some other port.
+ */
+
+struct portIdentity
 {
-  std::vector<std::pair<mach_port_t, std::string>> port_types
-    = {{MACH_PORT_TYPE_RECEIVE, "RECEIVE"},
-       {MACH_PORT_TYPE_SEND, "SEND"},
-       {MACH_PORT_TYPE_SEND_ONCE, "SEND-ONCE"},
-       {MACH_PORT_TYPE_PORT_SET, "PORTSET"},
-       {MACH_PORT_TYPE_DEAD_NAME, "DEADNAME"},
-       {MACH_PORT_TYPE_DNREQUEST, "DNREQUEST"},
-       {MACH_PORT_TYPE_MAREQUEST, "MAREQUEST"},
-       {MACH_PORT_TYPE_COMPAT, "COMPACT"}};
+  natural_t node;
+  mach_port_t name;
+};
+
+synchronized<std::map<mach_port_t, portIdentity>> portIdentities;
+synchronized<std::set<mach_port_t>> exportedPorts;
+
+portIdentity
+lookupPortIdentity(mach_port_t port)
+{
+  std::unique_lock<std::mutex> lk(portIdentities);
+
+  if (portIdentities.count(port) > 0)
+    {
+      return portIdentities.at(port);
+    }
+  else
+    {
+      return {nodeId, port};
+    }
+}
+
+void
+forgetPortIdentity(mach_port_t port)
+{
+  {
+    std::unique_lock<std::mutex> lk(portIdentities);
+    portIdentities.erase(port);
+  }
+
+  std::unique_lock<std::mutex> lk(exportedPorts);
+  exportedPorts.erase(port);
+}
+
+/* Note that we've sent an identity for 'port', and if it's one of our
+ * own, that it can come back.
+ */
+
+void
+exportPortIdentity(mach_port_t port, portIdentity id)
+{
+  if (id.node == nodeId)
+    {
+      std::unique_lock<std::mutex> lk(exportedPorts);
+      exportedPorts.insert(port);
+    }
+}
+
+bool
+isExportedPort(mach_port_t port)
+{
+  std::unique_lock<std::mutex> lk(exportedPorts);
+
+  return exportedPorts.count(port) > 0;
+}
+
+/* Add the identity list to a message that's about to be transmitted.
+ * If it doesn't fit, we leave it off, and the rights go the long way
+ * around, like they always used to.
+ */
+
+void
+appendPortIdentities(machMessage & msg, const std::vector<natural_t> & identities)
+{
+  mach_msg_type_t * type = reinterpret_cast<mach_msg_type_t *>(reinterpret_cast<char *>(msg.msg) + msg->msgh_size);
+  mach_msg_size_t data_size = identities.size() * sizeof(natural_t);
+
+  data_size = ((data_size + sizeof(long) - 1) / sizeof(long)) * sizeof(long);
+
+  if ((identities.size() >= (1 << 12)) || (msg->msgh_size + sizeof(mach_msg_type_t) + data_size > msg.max_size))
+    {
+      return;
+    }
+
+  bzero(type, sizeof(mach_msg_type_t) + data_size);
+
+  type->msgt_name = MACH_MSG_TYPE_INTEGER_32;
+  type->msgt_size = 32;
+  type->msgt_number = identities.size();
+  type->msgt_inline = true;
+
+  memcpy(type + 1, identities.data(), identities.size() * sizeof(natural_t));
+
+  msg->msgh_size += sizeof(mach_msg_type_t) + data_size;
+  msg->msgh_bits |= MACH_MSGH_BITS_PORT_IDENTITIES;
+}
+
+/* Strip the identity list off a message we've received, and return
+ * the identities by send right index.
+ */
+
+std::map<unsigned int, portIdentity>
+stripPortIdentities(machMessage & msg)
+{
+  std::map<unsigned int, portIdentity> identities;
+
+  if (! (msg->msgh_bits & MACH_MSGH_BITS_PORT_IDENTITIES))
+    {
+      return identities;
+    }
+
+  unsigned int items = 0;
+
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      items ++;
+    }
+
+  assert(items > 0);
+
+  auto ptr = msg[items - 1];
+  natural_t * data = reinterpret_cast<natural_t *>(static_cast<char *>(ptr.data()));
+
+  assert(ptr.is_inline() && (ptr.name() == MACH_MSG_TYPE_INTEGER_32) && (ptr.nelems() % 3 == 0));
+
+  for (unsigned int i = 0; i < ptr.nelems(); i += 3)
+    {
+      identities[data[i]] = {data[i+1], data[i+2]};
+    }
+
+  msg->msgh_size = static_cast<char *>(ptr.data()) - ptr.header_size() - reinterpret_cast<char *>(msg.msg);
+  msg->msgh_bits &= ~MACH_MSGH_BITS_PORT_IDENTITIES;
+
+  return identities;
+}
+
+/* Reserved port used to identify the server's initial control port */
+
+/* XXX reserved by us; not necessarily by Mach! */
+
+const mach_port_t MACH_PORT_CONTROL = (~ 1);
+
+/* translator (network client) sets 'control' to a receive right that
+ * it passes back on its bootstrap port in an fsys_startup call;
+ * server leaves it MACH_PORT_NULL
+ */
+
+mach_port_t control = MACH_PORT_NULL;
+
+/* class netmsg - a single netmsg session
+ *
+ * translator/client will only have a single instance of this class
+ *
+ * servers will have an instance for every client that connects to them
+ *
+ * We need to define a few more things before we're ready to define
+ * class netmsg itself.
+ */
+
+class netmsg;
+
+void auditPorts(void);
+
+/* class RunQueues
+ *
+ * To ensure in-order delivery of messages, we keep run queues,
+ * organized by the original destination port number as it appeared in
+ * the network message (not the translated port number).  Each
+ * RunQueues has a handler function, the same of all its run queues,
+ * set when it's constructed.  When you push onto a run queue, if it's
+ * empty, the message you've pushed starts processing.  As each
+ * message completes processing, if there's anything left in the run
+ * queue, the top item starts processing.  It's all protected by a
+ * mutex lock.
+ *
+ * XXX could use a thread pool.  Instead we create and destroy threads
+ * pretty liberally as we get work and run out of it.
+ */
+
+class RunQueues : synchronized<std::map<mach_port_t, std::deque<machMessage *>>>
+{
+  netmsg * const parent;
+
+  typedef void (netmsg::* handlerType) (machMessage &);
+  handlerType handler;
+
+  void
+    run(mach_port_t port)
+  {
+    bool empty = false;
+
+    do
+      {
+        machMessage * netmsg;
+
+        {
+          std::unique_lock<std::mutex> lk(*this);
+
+          assert(! at(port).empty());
+          netmsg = at(port).front();
+        }
+
+        ddprintf("%x processing\n", netmsg);
+
+        (parent->*handler)(*netmsg);
+
+        {
+          std::unique_lock<std::mutex> lk(*this);
+
+          at(port).pop_front();
+
+          delete netmsg;
+
+          empty = at(port).empty();
+        }
+      }
+    while (! empty);
+  }
+
+ public:
+
+ void
+   push_back(mach_port_t port, machMessage * netmsg)
+ {
+   std::unique_lock<std::mutex> lk(*this);
+
+   bool empty = (*this)[port].empty();
+   (*this)[port].push_back(netmsg);
+   if (empty)
+     {
+       /* Detached, so its resources go back when it runs out of work */
+       std::thread {&RunQueues::run, this, port}.detach();
+     }
+ }
+
+  RunQueues(netmsg * const parent, handlerType handler) : parent(parent), handler(handler) { }
+};
+
+/* class OOLbufferPool
+ *
+ * Buffers to read incoming OOL data into, page-aligned and already
+ * faulted in, kept by (page rounded) size.  The buffers go out with
+ * the message and the kernel takes the pages, so they never come
+ * back; instead, every get() asks a background thread to allocate
+ * and touch a replacement, keeping 'depth' of each size ready.
+ * Sizes that stop showing up get evicted to make room for new ones
+ * once 'limit' bytes are in use.  A get() that finds nothing ready
+ * just allocates, like we always used to, and returns 0 if even that
+ * fails.  When the session ends, stop() collects the thread and
+ * releases whatever's still ready.
+ */
+
+class OOLbufferPool : std::mutex
+{
+  static const unsigned int depth = 4;
+
+  const vm_size_t limit;
+  vm_size_t pooled = 0;      /* bytes ready or being allocated */
+
+  std::map<vm_size_t, std::deque<vm_address_t>> ready;
+  std::map<vm_size_t, unsigned int> pending;
+  std::deque<vm_size_t> lastUsed;     /* sizes, most recently used last */
+
+  std::condition_variable wakeup;
+  std::once_flag started;
+  std::thread * refiller = nullptr;
+  bool stopping = false;
+
+  static vm_address_t
+    allocate(vm_size_t size)
+  {
+    vm_address_t buffer;
+
+    if (mach_call (vm_allocate(mach_task_self(), &buffer, size, 1)) != KERN_SUCCESS)
+      {
+        return 0;
+      }
+
+    return buffer;
+  }
+
+  void
+    evict(vm_size_t size)
+  {
+    for (auto it = lastUsed.begin(); (pooled + size > limit) && (it != lastUsed.end()); ++ it)
+      {
+        if (*it == size)
+          {
+            continue;
+          }
+
+        for (auto & buffer : ready[*it])
+          {
+            mach_call (vm_deallocate(mach_task_self(), buffer, *it));
+            pooled -= *it;
+          }
+        ready[*it].clear();
+      }
+  }
+
+  void
+    refill(void)
+  {
+    std::unique_lock<std::mutex> lk(*this);
+
+    while (! stopping)
+      {
+        auto it = pending.begin();
+
+        if (it == pending.end())
+          {
+            wakeup.wait(lk);
+            continue;
+          }
+
+        vm_size_t size = it->first;
+
+        if (-- it->second == 0)
+          {
+            pending.erase(it);
+          }
+
+        lk.unlock();
+
+        vm_address_t buffer = allocate(size);
+
+        if (! buffer)
+          {
+            /* get() will try again itself when it finds the pool empty */
+            lk.lock();
+            pooled -= size;
+            continue;
+          }
+
+        for (vm_offset_t offset = 0; offset < size; offset += vm_page_size)
+          {
+            reinterpret_cast<volatile char *>(buffer)[offset] = 0;
+          }
+
+        lk.lock();
+
+        ready[size].push_back(buffer);
+      }
+  }
+
+ public:
+
+  vm_address_t
+    get(vm_size_t size)
+  {
+    vm_address_t buffer = 0;
+
+    size = round_page(size);
+
+    if (size > limit / depth)
+      {
+        return allocate(size);
+      }
+
+    std::unique_lock<std::mutex> lk(*this);
+
+    if (stopping)
+      {
+        lk.unlock();
+        return allocate(size);
+      }
+
+    std::call_once(started, [this] {
+        refiller = new std::thread {&OOLbufferPool::refill, this};
+      });
+
+    lastUsed.erase(std::remove(lastUsed.begin(), lastUsed.end(), size), lastUsed.end());
+    lastUsed.push_back(size);
+
+    auto & buffers = ready[size];
+
+    if (! buffers.empty())
+      {
+        buffer = buffers.front();
+        buffers.pop_front();
+        pooled -= size;
+      }
+
+    if (buffers.size() + pending[size] < depth)
+      {
+        evict(size);
+
+        if (pooled + size <= limit)
+          {
+            pending[size] ++;
+            pooled += size;
+            wakeup.notify_one();
+          }
+      }
+
+    if (pending[size] == 0)
+      {
+        pending.erase(size);
+      }
+
+    lk.unlock();
+
+    if (! buffer)
+      {
+        buffer = allocate(size);
+      }
+
+    return buffer;
+  }
+
+  void
+    stop(void)
+  {
+    std::unique_lock<std::mutex> lk(*this);
+
+    stopping = true;
+    wakeup.notify_one();
+
+    if (refiller)
+      {
+        lk.unlock();
+        refiller->join();
+        delete refiller;
+        refiller = nullptr;
+        lk.lock();
+      }
+
+    for (auto & buffers : ready)
+      {
+        for (auto buffer : buffers.second)
+          {
+            mach_call (vm_deallocate(mach_task_self(), buffer, buffers.first));
+          }
+      }
+
+    ready.clear();
+    pending.clear();
+    lastUsed.clear();
+    pooled = 0;
+  }
+
+  OOLbufferPool(vm_size_t limit) : limit(limit) { }
+  ~OOLbufferPool() { stop(); }
+};
+
+/* class replyPortPool
+ *
+ * Send-once rights that come in over the network are nearly always
+ * RPC reply ports.  We relay each one as a send-once right to a
+ * local receive right, and when the reply arrives there, we forward
+ * it to the remote send-once right.  Rather than allocate a receive
+ * right for every RPC, move it into our portset, and destroy it when
+ * the reply arrives, we keep the receive rights and reuse them.
+ *
+ * Each receive right has a slot that records the remote send-once
+ * right it currently stands for, or MACH_PORT_NULL if it's free.
+ * Only one send-once right to it is ever outstanding, and the kernel
+ * always delivers exactly one message on it (the reply, or a SEND
+ * ONCE notification if the right is destroyed), so the slot is freed
+ * when that message arrives.  The pool grows to the largest number
+ * of RPCs we've had outstanding at once, and never shrinks.
+ */
+
+class replyPortPool : std::mutex
+{
+  struct slot
+  {
+    mach_port_t local;
+    mach_port_t remote;
+  };
+
+  std::vector<slot> slots;
+  std::vector<unsigned int> freeSlots;
+  std::unordered_map<mach_port_t, unsigned int> slotsByLocal;
+
+ public:
+
+  /* Returns a receive right in 'portset' that stands for 'remote' */
+
+  mach_port_t
+    get(mach_port_t remote, mach_port_t portset)
+  {
+    std::unique_lock<std::mutex> lk(*this);
+
+    unsigned int i;
+
+    if (freeSlots.empty())
+      {
+        mach_port_t newport;
+
+        mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &newport));
+
+        /* move the receive right into the portset so we'll be listening on it */
+        mach_call (mach_port_move_member (mach_task_self (), newport, portset));
+
+        i = slots.size();
+        slots.push_back({newport, MACH_PORT_NULL});
+        slotsByLocal[newport] = i;
+      }
+    else
+      {
+        i = freeSlots.back();
+        freeSlots.pop_back();
+      }
+
+    assert(slots[i].remote == MACH_PORT_NULL);
+    slots[i].remote = remote;
+
+    return slots[i].local;
+  }
+
+  /* If 'local' is a reply port we handed out, free it, and return
+   * the remote send-once right it stood for.  Otherwise, return
+   * MACH_PORT_NULL.
+   */
+
+  mach_port_t
+    release(mach_port_t local)
+  {
+    std::unique_lock<std::mutex> lk(*this);
+
+    auto it = slotsByLocal.find(local);
+
+    if ((it == slotsByLocal.end()) || (slots[it->second].remote == MACH_PORT_NULL))
+      {
+        return MACH_PORT_NULL;
+      }
+
+    mach_port_t remote = slots[it->second].remote;
+
+    slots[it->second].remote = MACH_PORT_NULL;
+    freeSlots.push_back(it->second);
+
+    return remote;
+  }
+};
+
+std::atomic<unsigned int> sessionCounter {0};
+
+class netmsg
+{
+  friend void auditPorts(void);
+
+  const unsigned int session = sessionCounter ++;    /* identifies us in a --capture file */
+
+  const bool meshConnection;    /* we connected to a mesh peer ourselves (see MESH) */
+  std::atomic<natural_t> peerNode {0};    /* its --node-id, once it's said hello */
+
+  mach_port_t first_port = MACH_PORT_NULL;    /* server sets this to a send right on underlying node; client leaves it MACH_PORT_NULL */
+  mach_port_t portset = MACH_PORT_NULL;
+  mach_port_t notification_port = MACH_PORT_NULL;
+
+  /* These next two maps are used for RECEIVE and SEND rights, but not SEND ONCE rights. */
+
+  std::map<mach_port_t, mach_port_t> local_ports_by_remote;
+  std::map<mach_port_t, mach_port_t> remote_ports_by_local;
+
+  std::map<mach_port_t, unsigned int> local_port_type;         /* MACH_MSG_TYPE_PORT_RECEIVE or MACH_MSG_TYPE_PORT_SEND */
+
+  /* See NO SENDERS ACCOUNTING */
+
+  std::map<mach_port_t, unsigned int> transmitted_send_rights;
+  std::map<mach_port_t, unsigned int> returning_send_rights;
+  std::map<mach_port_t, unsigned int> deferred_no_senders;
+
+  /* Protects the maps above.  They're used by every run queue
+   * thread, and by other connections (importPort) and the locator.
+   * Recursive, since the translation functions call each other.  It's
+   * never held across a network write or an IPC send, or while taking
+   * another connection's portMaps.
+   */
+
+  std::recursive_mutex portMaps;
+
+  replyPortPool reply_ports;    /* local receive rights standing in for remote send-once rights */
+
+  /* Use a non-standard GNU extension to wrap the network socket in a
+   * C++ iostream that will provide buffering.
+   *
+   * XXX alternative to GNU - use boost?
+   *
+   * Error handling can be done with exception (upon request), or by
+   * testing fs to see if it's false.
+   */
+
+  __gnu_cxx::stdio_filebuf<char> filebuf_in;
+  __gnu_cxx::stdio_filebuf<char> filebuf_out;
+
+  std::istream is;
+  prioritized<std::ostream> os;
+
+  std::thread * ipcThread;
+  std::thread * tcpThread;
+  std::thread * fsysThread;
+
+  void transmitOOLdata(machMessage & msg);
+  void receiveOOLdata(machMessage & msg);
+
+  OOLbufferPool ool_buffers {OOLpoolSize};
+
+  /* OOL regions we've sent by reference (--lazy-ool), by export id */
+
+  synchronized<std::map<natural_t, std::pair<vm_address_t, vm_size_t>>> lazy_exports;
+  natural_t next_lazy_export = 1;
+
+  void exportOOLdata(machMessage & msg);
+  void importOOLdata(machMessage & msg);
+  void serveLazyPages(natural_t id, vm_offset_t offset, vm_size_t length, natural_t object);
+  void lazyBufferHandler(machMessage & msg);
+
+  void translateForTransmission(machMessage & msg, bool translatePortNames,
+                                std::vector<mach_port_t> & returnedRights);
+  void ipcBufferHandler(machMessage & netmsg);
+  void ipcHandler(void);
+
+  mach_port_t translatePort2(const mach_port_t port, const unsigned int type);
+  mach_port_t translatePort(const mach_port_t port, const unsigned int type);
+  void swapHeader(machMessage & msg);
+  bool translateHeader(machMessage & msg);
+  void releaseSendRights(mach_port_t local_port, unsigned int count);
+  void noteReturningSendRights(machMessage & msg);
+  void translateMessage(machMessage & msg, bool translatePortNames);
+  mach_port_t resolvePortIdentity(mach_port_t port, portIdentity id);
+  void tcpHandler(void);
+  void tcpBufferHandler(machMessage & netmsg);
+
+  /* RPC requests waiting for room on their destinations (--pipeline), counted by port */
+
+  synchronized<std::map<mach_port_t, unsigned int>> deferred_sends;
+  std::condition_variable deferred_sends_done;
+
+  void deferSend(machMessage & msg);
+  void deferredSendHandler(machMessage & msg);
+  void waitForDeferredSends(mach_port_t port);
+
+  RunQueues tcp_run_queue {this, &netmsg::tcpBufferHandler};
+  RunQueues ipc_run_queue {this, &netmsg::ipcBufferHandler};
+  RunQueues lazy_run_queue {this, &netmsg::lazyBufferHandler};
+  RunQueues deferred_run_queue {this, &netmsg::deferredSendHandler};
+
+  void meshBufferHandler(machMessage & msg);
+
+  friend netmsg * meshConnect(natural_t node);
+  friend int locatePort(mach_port_t port);
+
+public:
+
+  void sendPeerMessage(mach_msg_id_t msgid, natural_t arg0, natural_t offset, natural_t length,
+                       natural_t arg3, vm_address_t data = 0);
+
+  mach_port_t importPort(mach_port_t port);
+
+  netmsg(int networkSocket, bool meshConnection = false);
+  ~netmsg();
+};
+
+/* For debugging purposes, we keep a list of all netmsg instances and
+ * can use them to audit our ports to ensure that all ports are
+ * accounted for and all our invarients are maintained.
+ */
+
+synchronized<std::set<netmsg *>> active_netmsg_classes;
+
+/* How to reach each node we've heard of that listens for connections,
+ * and our connections to other nodes, by node id (see MESH).
+ */
+
+struct meshRoute
+{
+  natural_t addr;     /* IPv4 address, network byte order */
+  natural_t port;
+};
+
+synchronized<std::map<natural_t, meshRoute>> meshRoutes;
+synchronized<std::map<natural_t, netmsg *>> meshPeers;
+std::set<natural_t> meshConnecting;     /* nodes we're connecting to; under meshPeers' lock */
+
+/* Remember a route, and if it's news, pass it on to all our peers */
+
+void
+learnRoute(natural_t node, meshRoute route)
+{
+  {
+    std::unique_lock<std::mutex> lk(meshRoutes);
+
+    if ((meshRoutes.count(node) > 0) && (meshRoutes.at(node).addr == route.addr)
+        && (meshRoutes.at(node).port == route.port))
+      {
+        return;
+      }
+
+    meshRoutes[node] = route;
+  }
+
+  ddprintf("route to node %d: %s port %d\n", node, inet_ntoa(in_addr {route.addr}), route.port);
+
+  /* Don't hold meshPeers across the network writes, or two nodes
+   * whose socket buffers fill up could wait on each other forever.
+   * Sessions are never deleted, so the pointers stay good.
+   */
+
+  std::vector<netmsg *> peers;
+
+  {
+    std::unique_lock<std::mutex> lk(meshPeers);
+
+    for (auto & peer : meshPeers)
+      {
+        if (peer.first != node)
+          {
+            peers.push_back(peer.second);
+          }
+      }
+  }
+
+  for (auto peer : peers)
+    {
+      peer->sendPeerMessage(MSGID_MESH_ROUTE, node, route.addr, route.port, 0);
+    }
+}
+
+/* Find our connection to a node.  If we don't have one yet, but know
+ * how to reach the node, start connecting to it in the background, so
+ * the next right to one of its ports can go direct; connect() can
+ * take a while, and we're called on a run queue.  Returns nullptr
+ * until the connection is up.
+ */
+
+netmsg *
+meshConnect(natural_t node)
+{
+  meshRoute route;
+
+  {
+    std::unique_lock<std::mutex> lk(meshPeers);
+
+    if (meshPeers.count(node) > 0)
+      {
+        return meshPeers.at(node);
+      }
+
+    if (meshConnecting.count(node) > 0)
+      {
+        return nullptr;
+      }
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(meshRoutes);
+
+    if (meshRoutes.count(node) == 0)
+      {
+        return nullptr;
+      }
+
+    route = meshRoutes.at(node);
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(meshPeers);
+
+    if ((meshPeers.count(node) > 0) || ! meshConnecting.insert(node).second)
+      {
+        return nullptr;
+      }
+  }
+
+  std::thread([node, route]
+    {
+      struct sockaddr_in addr;
+
+      bzero(&addr, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = route.addr;
+      addr.sin_port = htons(route.port);
+
+      int newSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+      if ((newSocket >= 0)
+          && (connect(newSocket, reinterpret_cast<struct sockaddr *> (&addr), sizeof(addr)) < 0))
+        {
+          ddprintf("can't connect to node %d: %s\n", node, strerror(errno));
+          close(newSocket);
+          newSocket = -1;
+        }
+
+      netmsg * direct = (newSocket >= 0) ? new netmsg(newSocket, true) : nullptr;
+
+      std::unique_lock<std::mutex> lk(meshPeers);
+
+      /* If the node connected to us in the meantime, use theirs;
+       * ours stays open, and the node might still use it.
+       */
+
+      if (direct)
+        {
+          direct->peerNode = node;
+          meshPeers.emplace(node, direct);
+        }
+
+      meshConnecting.erase(node);
+    }).detach();
+
+  return nullptr;
+}
+
+/* Port location (see PORT LOCATION).  A port's receive right is on
+ * the node its identity says, if it's one of our proxies with an
+ * identity; or on our peer, if we hold its receive right on behalf
+ * of a connection; or else it's here.  Node ids are the --node-id's,
+ * and a peer that hasn't told us its node id is NETMSG_NODE_UNKNOWN.
+ */
+
+#define NETMSG_NODE_UNKNOWN (-1)
+
+int
+locatePort(mach_port_t port)
+{
+  {
+    std::unique_lock<std::mutex> lk(portIdentities);
+
+    if (portIdentities.count(port) > 0)
+      {
+        return portIdentities.at(port).node;
+      }
+  }
+
+  /* Callers mustn't hold any connection's portMaps */
+
+  std::unique_lock<std::mutex> lk(active_netmsg_classes);
+
+  for (auto & netmsgptr: active_netmsg_classes)
+    {
+      std::unique_lock<std::recursive_mutex> maps_lk(netmsgptr->portMaps);
+
+      if ((netmsgptr->local_port_type.count(port) > 0)
+          && (netmsgptr->local_port_type.at(port) == MACH_MSG_TYPE_PORT_RECEIVE))
+        {
+          return (netmsgptr->peerNode != 0) ? static_cast<int>(netmsgptr->peerNode) : NETMSG_NODE_UNKNOWN;
+        }
+    }
+
+  return nodeId;
+}
+
+/* Outstanding netmsg_request_location_notification's, by our name
+ * for the port.  Each one holds a send right to the port, which keeps
+ * the name from changing, and the send-once right to notify.
+ */
+
+synchronized<std::multimap<mach_port_t, mach_port_t>> locationRequests;
+
+/* Has anyone asked to hear when this port's receive right moves? */
+
+bool
+locationWatched(mach_port_t port)
+{
+  std::unique_lock<std::mutex> lk(locationRequests);
+  return locationRequests.count(port) > 0;
+}
+
+/* A port's receive right has moved to 'node', or died.  Tell anyone
+ * who asked, passing along the send right their request held.
+ */
+
+void
+locationChanged(mach_port_t port, int node)
+{
+  std::vector<mach_port_t> notifies;
+
+  {
+    std::unique_lock<std::mutex> lk(locationRequests);
+    auto range = locationRequests.equal_range(port);
+
+    for (auto it = range.first; it != range.second; ++ it)
+      {
+        notifies.push_back(it->second);
+      }
+    locationRequests.erase(range.first, range.second);
+  }
+
+  for (auto notify : notifies)
+    {
+      machMessage msg;
+      char * ptr = msg.buffer + sizeof(mach_msg_header_t);
+
+      auto put = [&ptr] (mach_msg_type_name_t name, natural_t value)
+        {
+          mach_msg_type_t * type = reinterpret_cast<mach_msg_type_t *>(ptr);
+
+          bzero(type, sizeof(mach_msg_type_t));
+          type->msgt_name = name;
+          type->msgt_size = 32;
+          type->msgt_number = 1;
+          type->msgt_inline = TRUE;
+
+          ptr += sizeof(mach_msg_type_t);
+          * reinterpret_cast<natural_t *>(ptr) = value;
+          ptr += ((sizeof(natural_t) + sizeof(long) - 1) / sizeof(long)) * sizeof(long);
+        };
+
+      msg->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MOVE_SEND_ONCE, 0) | MACH_MSGH_BITS_COMPLEX;
+      msg->msgh_remote_port = notify;
+      msg->msgh_local_port = MACH_PORT_NULL;
+      msg->msgh_seqno = 0;
+      msg->msgh_id = MSGID_LOCATION_CHANGED;
+
+      put(MACH_MSG_TYPE_MOVE_SEND, port);
+      put(MACH_MSG_TYPE_INTEGER_32, node);
+
+      msg->msgh_size = ptr - msg.buffer;
+
+      ddprintf("port %ld has moved to node %d\n", port, node);
+
+      /* A send-once right never waits for room in the queue */
+
+      if (mach_call (mach_msg (msg, MACH_SEND_MSG | MACH_SEND_TIMEOUT, msg->msgh_size, 0,
+                               MACH_PORT_NULL, 0, MACH_PORT_NULL),
+                     MACH_SEND_INVALID_DEST) != MACH_MSG_SUCCESS)
+        {
+          mach_call (mach_port_mod_refs (mach_task_self(), port,
+                                         MACH_PORT_RIGHT_SEND, -1),
+                     KERN_INVALID_RIGHT);
+        }
+    }
+}
+
+std::string porttype2str(mach_port_type_t type)
+{
+  std::vector<std::pair<mach_port_t, std::string>> port_types
+    = {{MACH_PORT_TYPE_RECEIVE, "RECEIVE"},
+       {MACH_PORT_TYPE_SEND, "SEND"},
+       {MACH_PORT_TYPE_SEND_ONCE, "SEND-ONCE"},
+       {MACH_PORT_TYPE_PORT_SET, "PORTSET"},
+       {MACH_PORT_TYPE_DEAD_NAME, "DEADNAME"},
+       {MACH_PORT_TYPE_DNREQUEST, "DNREQUEST"},
+       {MACH_PORT_TYPE_MAREQUEST, "MAREQUEST"},
+       {MACH_PORT_TYPE_COMPAT, "COMPACT"}};
+
+  std::string result;
+
+  for (auto & t: port_types)
+    {
+      if (type & t.first) {
+        //fprintf(stderr, "%s ", t.second.c_str());
+        result += t.second + " ";
+        type &= ~(t.first);
+      }
+    }
+
+  if (type)
+    {
+      //fprintf(stderr, "UNDECODED(0x%x) ", type);
+      result += "UNDECODED";
+    }
+
+  return result;
+}
+
+/* auditPorts
+ *
+ * examine our ports to insure that our invariants are satisfied
+ *
+ * Specifically, for each active netmsg class, ensure that:
+ *
+ * - portset is actually a port set
+ * - every port in local_port_type exists and is of the correct type
+ *
+ * Every connection's portMaps is held throughout, so the maps can't
+ * change under us, but a message being received can still add a
+ * right we haven't recorded yet, which may show up as a warning.
+ */
+
+void auditPorts(void)
+{
+  std::unique_lock<std::mutex> lk(active_netmsg_classes);
+  std::vector<std::unique_lock<std::recursive_mutex>> maps_locks;
+
+  for (auto & netmsgptr: active_netmsg_classes)
+    {
+      maps_locks.emplace_back(netmsgptr->portMaps);
+    }
+
+  mach_port_array_t names;
+  mach_port_type_array_t types;
+  mach_msg_type_number_t ncount;
+  mach_msg_type_number_t tcount;
+
+  mach_call (mach_port_names(mach_task_self(), &names, &ncount, &types, &tcount));
+
+  assert(ncount == tcount);
+
+  /* Convert to a C++ map; it's easier to handle */
+
+  std::map<mach_port_t, mach_port_type_t> ports;
+
+  for (unsigned int i = 0; i < ncount; i ++)
+    {
+      ports[names[i]] = types[i];
+      // fprintf(stderr, "auditPorts: %ld %s\n", names[i], porttype2str(types[i]).c_str());
+    }
+
+  for (auto & netmsgptr: active_netmsg_classes)
+    {
+      assert(ports[netmsgptr->portset] == MACH_PORT_TYPE_PORT_SET);
+
+      for (auto & pair: netmsgptr->local_port_type)
+        {
+          if (ports.count(pair.first) == 0)
+            {
+              fprintf(stderr, "auditPorts: port %ld doesn't exist, but is recorded as %s\n",
+                      pair.first,
+                      pair.second == MACH_MSG_TYPE_PORT_RECEIVE ? "RECEIVE" :
+                      pair.second == MACH_MSG_TYPE_PORT_SEND ? "SEND" :
+                      std::to_string(pair.second).c_str());
+            }
+          else if (pair.second == MACH_MSG_TYPE_PORT_RECEIVE)
+            {
+              /* We hold a send right on a proxy for a moment while
+               * relaying it, or until a message that gave it back to
+               * our peer has been written (see NO SENDERS ACCOUNTING).
+               */
+              if ((ports[pair.first] != MACH_PORT_TYPE_RECEIVE)
+                  && ((ports[pair.first] != (MACH_PORT_TYPE_RECEIVE | MACH_PORT_TYPE_SEND))
+                      || (netmsgptr->remote_ports_by_local.count(pair.first) == 0)))
+                {
+                  fprintf(stderr, "auditPorts: port %ld is %s, not RECEIVE\n",
+                          pair.first, porttype2str(ports[pair.first]).c_str());
+                }
+
+              /* check to make sure we've got a NO SENDERS notification outstanding */
+
+#if 0
+              mach_port_t old;
+              mach_call (mach_port_request_notification (mach_task_self (), pair.first,
+                                                         MACH_NOTIFY_NO_SENDERS, 0,
+                                                         pair.first,
+                                                         MACH_MSG_TYPE_MAKE_SEND_ONCE, &old));
+              /* this assert doesn't work because pair.first is a
+               * RECEIVE right, but old will give us back a SEND ONCE
+               * right
+               */
+              // assert(old == pair.first);
+#endif
+            }
+          else if (pair.first == netmsgptr->first_port)
+            {
+              if (ports[pair.first] != (MACH_PORT_TYPE_RECEIVE | MACH_PORT_TYPE_SEND))
+                {
+                  fprintf(stderr, "auditPorts: first_port %ld is %s, not RECEIVE SEND\n",
+                          pair.first, porttype2str(ports[pair.first]).c_str());
+                }
+            }
+          else
+            {
+              /* Two possibilities here, since a port recorded as SEND
+               * might have already died, but we haven't processed the
+               * dead name notification yet.
+               */
+              if ((ports[pair.first] != (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_DNREQUEST))
+                  && (ports[pair.first] != MACH_PORT_TYPE_DEAD_NAME))
+                {
+                  fprintf(stderr, "auditPorts: port %ld is %s, not SEND DNREQUEST (or DEADNAME)\n",
+                          pair.first, porttype2str(ports[pair.first]).c_str());
+                }
+            }
+        }
+    }
+
+  mach_call (vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(names), ncount * sizeof(* names)));
+  mach_call (vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(types), tcount * sizeof(* types)));
+
+}
+
+/* With --audit, the audit runs from its own thread, so it never holds
+ * up a message.  SIGUSR2 runs one right away.
+ */
+
+void
+auditOnTimerOrSignal(sigset_t sigset)
+{
+  struct timespec interval = { auditInterval / 1000, (auditInterval % 1000) * 1000000 };
+
+  while (1)
+    {
+      int sig;
+      bool audit;
+
+      if (auditInterval == 0)
+        {
+          audit = (sigwait(&sigset, &sig) == 0);
+        }
+      else
+        {
+          /* EAGAIN is the timer running out */
+          audit = (sigtimedwait(&sigset, NULL, &interval) != -1) || (errno == EAGAIN);
+        }
+
+      if (audit)
+        {
+          auditPorts();
+        }
+    }
+}
+
+void
+startAuditing(void)
+{
+  /* Block SIGUSR2 before any other threads are created, like SIGUSR1
+   * for tracing.
+   */
+
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+  new std::thread(auditOnTimerOrSignal, sigset);
+}
+
+
+// XXX should be const...
+// dprintMessage(const machMessage & msg)
+// ... but we need a const mach_msg_iterator to make that work
+
+void
+printMessage(const char * prefix, machMessage & msg)
+{
+  /* Print everything to a buffer, then dump it to stderr, to avoid
+   * interspersed output if two threads are printing at once.
+   */
+
+  std::stringstream buffer;
+
+  buffer << prefix;
+
+  buffer << msg->msgh_local_port;
+
+  if (msg->msgh_remote_port)
+    {
+      buffer << "(" << msg->msgh_remote_port << ")";
+    }
+
+  buffer << " " << msgid_name(msg->msgh_id);
+
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      buffer << " ";
+
+      /* OOL data sent by reference isn't in our address space */
+      if (ptr.is_lazy())
+        {
+          buffer << "lazy(" << ptr.data_size() << ")";
+          continue;
+        }
+
+      /* MACH_MSG_TYPE_STRING is special.  elemsize will be 1 byte and
+       * nelems() will be the size of the buffer, which might be bigger
+       * than the NUL-terminated string that starts it.
+       */
+      if (ptr.name() == MACH_MSG_TYPE_STRING)
+        {
+          buffer << "\"" << ptr.data().operator char *() << "\" ";
+          continue;
+        }
+
+      if (ptr.name() == MACH_MSG_TYPE_BIT)
+        {
+          assert(ptr.nelems() <= 8 * sizeof(long));
+          buffer << std::hex << * reinterpret_cast<long *>(static_cast<vm_address_t>(ptr.data())) << std::dec;
+          continue;
+        }
+
+      if (ptr.nelems() > 32)
+        {
+          buffer << ptr.nelems();
+        }
+
+      switch (ptr.name())
+        {
+        case MACH_MSG_TYPE_PORT_NAME:
+          buffer << "pn";
+          break;
+
+        case MACH_MSG_TYPE_MOVE_RECEIVE:
+          buffer << "r";
+          break;
+
+        case MACH_MSG_TYPE_MOVE_SEND:
+          buffer << "s";
+          break;
+
+        case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+          buffer << "so";
+          break;
+
+        case MACH_MSG_TYPE_COPY_SEND:
+          buffer << "cs";
+          break;
+
+        case MACH_MSG_TYPE_MAKE_SEND:
+          buffer << "ms";
+          break;
+
+        case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+          buffer << "mso";
+          break;
+
+        default:
+          ;
+        }
+
+      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()) || (ptr.name() == MACH_MSG_TYPE_PORT_NAME) || (ptr.nelems() > 1))
+        {
+          buffer << "{";
+        }
+
+      /* Save stream format flags because we'll change it from decimal
+       * to hex if we're printing a character string, to handle
+       * non-printing characters.
+       */
+
+      std::ios::fmtflags f( buffer.flags() );
+
+      if (ptr.name() == MACH_MSG_TYPE_CHAR)
+        {
+          /* I'd like to setw(2) here, but the width gets reset to
+           * zero everytime you print a string (like "\x"), so it's
+           * pointless...
+           */
+          buffer << std::hex << std::setfill('0');
+        }
+
+      for (unsigned int i = 0; i < ptr.nelems() && i < 32; i ++)
+        {
+          if ((i > 0) && (ptr.name() != MACH_MSG_TYPE_CHAR))
+            {
+              buffer << " ";
+            }
+          switch (ptr.name())
+            {
+
+            case MACH_MSG_TYPE_BIT:
+              assert(0);
+
+            case MACH_MSG_TYPE_CHAR:
+              {
+                char c = ptr[i];
+                if (std::isprint(c))
+                  {
+                    buffer << c;
+                  }
+                else
+                  {
+                    // XXX why is this AND needed?
+                    buffer << "\\x" << std::setw(2) << (ptr[i] & 0xff);
+                  }
+              }
+              break;
+
+            case MACH_MSG_TYPE_INTEGER_8:
+            case MACH_MSG_TYPE_INTEGER_16:
+            case MACH_MSG_TYPE_INTEGER_32:
+            case MACH_MSG_TYPE_INTEGER_64:
+
+            case MACH_MSG_TYPE_PORT_NAME:
+
+            case MACH_MSG_TYPE_MOVE_RECEIVE:
+            case MACH_MSG_TYPE_MOVE_SEND:
+            case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+            case MACH_MSG_TYPE_COPY_SEND:
+            case MACH_MSG_TYPE_MAKE_SEND:
+            case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+
+              buffer << ptr[i];
+              break;
+
+            case MACH_MSG_TYPE_STRING:
+            case MACH_MSG_TYPE_REAL:
+              assert(0);
+            }
+        }
+
+      buffer.flags(f);
+
+      if (ptr.nelems() > 32)
+        {
+          buffer << "...";
+        }
+      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()) || (ptr.name() == MACH_MSG_TYPE_PORT_NAME) || (ptr.nelems() > 1))
+        {
+          buffer << "}";
+        }
+    }
+
+  buffer << "\n";
+  std::cerr << buffer.str();
+}
+
+/* dprintMessage is called on the relay path, so it's inline and
+ * checks the debug level before doing any work at all.
+ */
+
+inline void
+dprintMessage(const char * prefix, machMessage & msg)
+{
+  if (debugging(1)) printMessage(prefix, msg);
+}
+
+void
+netmsg::transmitOOLdata(machMessage & msg)
+{
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0))
+        {
+          os.write(ptr.data(), ptr.data_size());
+          vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size());
+        }
+    }
+}
+
+void
+netmsg::receiveOOLdata(machMessage & msg)
+{
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0))
+        {
+          if (OOLpoolSize > 0)
+            {
+              * ptr.OOLptr() = ool_buffers.get(ptr.data_size());
+            }
+          else if (mach_call (vm_allocate(mach_task_self(), ptr.OOLptr(), ptr.data_size(), 1)) != KERN_SUCCESS)
+            {
+              * ptr.OOLptr() = 0;
+            }
+
+          if (! * ptr.OOLptr())
+            {
+              /* No memory for it.  Skip over the data, and let
+               * tcpBufferHandler drop the message.
+               */
+              is.ignore(ptr.data_size());
+              continue;
+            }
+
+          is.read(ptr.data(), ptr.data_size());
+
+          /* The buffer is ours, and we've no further use for it once it's sent */
+          ptr.set_deallocate(true);
+        }
+    }
+}
+
+/* OOL data can point to a memory region backed by an unreliable
+ * memory manager.  In this case, we don't want to wait until we're
+ * trying to transmit over the network before finding this out, so we
+ * copy it now into our own address space.
+ *
+ * What should we do if this fails?  Most precisely, we should mimic
+ * this behavior on the remote by arranging for it to have a faulting
+ * memory manager (presumably implemented by netmsg)!  That's what
+ * happens to regions sent by reference with --lazy-ool, which we
+ * skip here.  Otherwise, I just ignore the return value from
+ * hurd_safe_copyin, so we just get zero-filled memory from
+ * vm_allocate passed on to the recipient.
+ *
+ * None of this is needed if the region is only backed by memory the
+ * kernel manages itself (anonymous memory, or memory paged to the
+ * default pager), which is the common case.  What the kernel gave
+ * us is already a copy-on-write copy of the sender's data, so we
+ * just keep it, and skip the copy.  Checking costs a few RPCs per
+ * region, so we only bother for big regions.
+ */
+
+const vm_size_t trustedOOLthreshold = 65536;
+
+/* Is every page of a region backed by a chain of internal objects?
+ * This uses the Mach VM debugging calls, and if they fail (they're
+ * optional in the kernel), we assume the worst.
+ */
+
+bool
+isTrustedOOLregion(vm_address_t data, vm_size_t size)
+{
+  vm_address_t address = trunc_page(data);
+
+  while (address < data + size)
+    {
+      vm_region_info_t region;
+      memory_object_name_t object;
+
+      if ((mach_vm_region_info(mach_task_self(), address, &region, &object) != KERN_SUCCESS)
+          || (region.vri_start > address))
+        {
+          return false;
+        }
+
+      bool trusted = true;
+
+      /* An entry without an object has never been touched, so it's zero fill */
+
+      while (MACH_PORT_VALID(object))
+        {
+          vm_object_info_t info;
+          memory_object_name_t shadow;
+          memory_object_name_t copy;
+
+          kern_return_t kr = mach_vm_object_info(object, &info, &shadow, &copy);
+
+          mach_call (mach_port_deallocate(mach_task_self(), object));
+          object = MACH_PORT_NULL;
+
+          if (kr != KERN_SUCCESS)
+            {
+              trusted = false;
+              break;
+            }
+
+          if (MACH_PORT_VALID(copy))
+            {
+              mach_call (mach_port_deallocate(mach_task_self(), copy));
+            }
+
+          if (! (info.voi_state & VOI_STATE_INTERNAL))
+            {
+              trusted = false;
+              if (MACH_PORT_VALID(shadow))
+                {
+                  mach_call (mach_port_deallocate(mach_task_self(), shadow));
+                }
+              break;
+            }
+
+          object = shadow;
+        }
+
+      if (! trusted)
+        {
+          return false;
+        }
+
+      address = region.vri_end;
+    }
+
+  return true;
+}
 
-  std::string result;
+/* Returns 'data' itself if we can keep the region as it is. */
 
-  for (auto & t: port_types)
+vm_address_t
+copyOOLregion(vm_address_t data, vm_size_t size)
+{
+  if ((size >= trustedOOLthreshold) && isTrustedOOLregion(data, size))
     {
-      if (type & t.first) {
-        //fprintf(stderr, "%s ", t.second.c_str());
-        result += t.second + " ";
-        type &= ~(t.first);
-      }
+      return data;
     }
 
-  if (type)
+  vm_address_t new_location;
+
+  /* If we can't get memory for a copy, relay the region as it is */
+
+  if (mach_call (vm_allocate(mach_task_self(), &new_location, size, 1)) != KERN_SUCCESS)
     {
-      //fprintf(stderr, "UNDECODED(0x%x) ", type);
-      result += "UNDECODED";
+      return data;
     }
 
-  return result;
+  hurd_safe_copyin(reinterpret_cast<void *>(new_location), reinterpret_cast<void *>(data), size);
+
+  return new_location;
 }
 
-/* auditPorts
- *
- * examine our ports to insure that our invariants are satisfied
- *
- * Specifically, for each active netmsg class, ensure that:
- *
- * - portset is actually a port set
- * - every port in local_port_type exists and is of the correct type
- *
- * XXX add some locking here so this works multi-threaded
+/* OOL data items that the copy-in threads handle.  Port arrays are
+ * always copied by copyOOLdata, because translateForTransmission
+ * rewrites them in place, and they're in memory the kernel just
+ * gave us, so they never page in from a memory manager anyway.
  */
 
-void auditPorts(void)
+bool
+isPrefetchable(mach_msg_iterator & ptr)
 {
-  if (multi_threaded) return;
+  return ! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0)
+    && ! MACH_MSG_TYPE_PORT_ANY(ptr.name()) && (ptr.name() != MACH_MSG_TYPE_PORT_NAME);
+}
 
-  mach_port_array_t names;
-  mach_port_type_array_t types;
-  mach_msg_type_number_t ncount;
-  mach_msg_type_number_t tcount;
+/* If 'prefetched' is true, the copy-in threads are taking care of
+ * everything but port arrays (see prefetchOOLdata).
+ */
 
-  mach_call (mach_port_names(mach_task_self(), &names, &ncount, &types, &tcount));
+void
+copyOOLdata(machMessage & msg, bool prefetched = false)
+{
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (! ptr.is_inline() && ! ptr.is_lazy() && (ptr.data_size() > 0)
+          && ! (prefetched && isPrefetchable(ptr)))
+        {
+          vm_address_t new_location = copyOOLregion(ptr.data(), ptr.data_size());
 
-  assert(ncount == tcount);
+          if (new_location != ptr.data())
+            {
+              mach_call (vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size()));
 
-  /* Convert to a C++ map; it's easier to handle */
+              /* XXX perhaps ptr.data() should return a reference to facilitate this step */
+              * ptr.OOLptr() = new_location;
+            }
+        }
+    }
+}
 
-  std::map<mach_port_t, mach_port_type_t> ports;
+/* class copyinPool
+ *
+ * A fixed pool of threads that copy OOL data into our address space
+ * in the background (see OOL COPY-IN, above).  copy() queues a list
+ * of regions and returns a future for their new locations.  Work is
+ * taken in priority order, but the pool doesn't otherwise care about
+ * ordering; run queues take care of that by waiting for their own
+ * copies.
+ */
 
-  for (unsigned int i = 0; i < ncount; i ++)
-    {
-      ports[names[i]] = types[i];
-      // fprintf(stderr, "auditPorts: %ld %s\n", names[i], porttype2str(types[i]).c_str());
-    }
+class copyinPool : std::mutex
+{
+  typedef std::vector<std::pair<vm_address_t, vm_size_t>> regionList;
+  typedef std::packaged_task<std::vector<vm_address_t> ()> copyTask;
 
-  for (auto & netmsgptr: active_netmsg_classes)
-    {
-      assert(ports[netmsgptr->portset] == MACH_PORT_TYPE_PORT_SET);
+  std::condition_variable wakeup;
+  std::deque<copyTask> work[PRIORITY_CLASSES];
+
+  bool
+    haveWork(void)
+  {
+    for (auto & queue : work)
+      {
+        if (! queue.empty())
+          {
+            return true;
+          }
+      }
+    return false;
+  }
+
+  void
+    run(void)
+  {
+    while (1)
+      {
+        copyTask task;
 
-      for (auto & pair: netmsgptr->local_port_type)
         {
-          if (ports.count(pair.first) == 0)
-            {
-              fprintf(stderr, "auditPorts: port %ld doesn't exist, but is recorded as %s\n",
-                      pair.first,
-                      pair.second == MACH_MSG_TYPE_PORT_RECEIVE ? "RECEIVE" :
-                      pair.second == MACH_MSG_TYPE_PORT_SEND ? "SEND" :
-                      std::to_string(pair.second).c_str());
-            }
-          else if (pair.second == MACH_MSG_TYPE_PORT_RECEIVE)
-            {
-              if (ports[pair.first] != MACH_PORT_TYPE_RECEIVE)
-                {
-                  fprintf(stderr, "auditPorts: port %ld is %s, not RECEIVE\n",
-                          pair.first, porttype2str(ports[pair.first]).c_str());
-                }
+          std::unique_lock<std::mutex> lk(*this);
 
-              /* check to make sure we've got a NO SENDERS notification outstanding */
+          wakeup.wait(lk, [this] { return haveWork(); });
 
-#if 0
-              mach_port_t old;
-              mach_call (mach_port_request_notification (mach_task_self (), pair.first,
-                                                         MACH_NOTIFY_NO_SENDERS, 0,
-                                                         pair.first,
-                                                         MACH_MSG_TYPE_MAKE_SEND_ONCE, &old));
-              /* this assert doesn't work because pair.first is a
-               * RECEIVE right, but old will give us back a SEND ONCE
-               * right
-               */
-              // assert(old == pair.first);
-#endif
-            }
-          else if (pair.first == netmsgptr->first_port)
-            {
-              if (ports[pair.first] != (MACH_PORT_TYPE_RECEIVE | MACH_PORT_TYPE_SEND))
-                {
-                  fprintf(stderr, "auditPorts: first_port %ld is %s, not RECEIVE SEND\n",
-                          pair.first, porttype2str(ports[pair.first]).c_str());
-                }
-            }
-          else
+          for (auto & queue : work)
             {
-              /* Two possibilities here, since a port recorded as SEND
-               * might have already died, but we haven't processed the
-               * dead name notification yet.
-               */
-              if ((ports[pair.first] != (MACH_PORT_TYPE_SEND | MACH_PORT_TYPE_DNREQUEST))
-                  && (ports[pair.first] != MACH_PORT_TYPE_DEAD_NAME))
+              if (! queue.empty())
                 {
-                  fprintf(stderr, "auditPorts: port %ld is %s, not SEND DNREQUEST (or DEADNAME)\n",
-                          pair.first, porttype2str(ports[pair.first]).c_str());
+                  task = std::move(queue.front());
+                  queue.pop_front();
+                  break;
                 }
             }
         }
-    }
 
-  mach_call (vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(names), ncount * sizeof(* names)));
-  mach_call (vm_deallocate(mach_task_self(), reinterpret_cast<vm_address_t>(types), tcount * sizeof(* types)));
+        task();
+      }
+  }
 
-}
+ public:
 
+  std::future<std::vector<vm_address_t>>
+    copy(regionList regions, unsigned int priority)
+  {
+    copyTask task([regions] {
+        std::vector<vm_address_t> copies;
+        for (auto & region : regions)
+          {
+            copies.push_back(copyOOLregion(region.first, region.second));
+          }
+        return copies;
+      });
 
-// XXX should be const...
-// dprintMessage(const machMessage & msg)
-// ... but we need a const mach_msg_iterator to make that work
+    std::future<std::vector<vm_address_t>> result = task.get_future();
 
-void
-dprintMessage(std::string prefix, machMessage & msg)
-{
-  if (debugLevel == 0) return;
+    {
+      std::unique_lock<std::mutex> lk(*this);
+      work[priority].push_back(std::move(task));
+    }
 
-  /* Print everything to a buffer, then dump it to stderr, to avoid
-   * interspersed output if two threads are printing at once.
-   */
+    wakeup.notify_one();
 
-  std::stringstream buffer;
+    return result;
+  }
 
-  buffer << prefix;
+  copyinPool(unsigned int threads)
+  {
+    for (unsigned int i = 0; i < threads; i ++)
+      {
+        // XXX nothing is done to reap these threads
+        new std::thread {&copyinPool::run, this};
+      }
+  }
+};
 
-  buffer << msg->msgh_local_port;
+copyinPool * copyin = nullptr;
 
-  if (msg->msgh_remote_port)
-    {
-      buffer << "(" << msg->msgh_remote_port << ")";
-    }
+/* Copies started by prefetchOOLdata, waiting to be picked up by
+ * collectOOLdata, indexed by message buffer.
+ */
 
-  buffer << " " << msgid_name(msg->msgh_id);
+synchronized<std::map<machMessage *, std::future<std::vector<vm_address_t>>>> OOLprefetches;
+
+void
+prefetchOOLdata(machMessage & msg)
+{
+  std::vector<std::pair<vm_address_t, vm_size_t>> regions;
 
   for (auto ptr = msg.data(); ptr; ++ ptr)
     {
-      buffer << " ";
-
-      /* MACH_MSG_TYPE_STRING is special.  elemsize will be 1 byte and
-       * nelems() will be the size of the buffer, which might be bigger
-       * than the NUL-terminated string that starts it.
-       */
-      if (ptr.name() == MACH_MSG_TYPE_STRING)
+      if (isPrefetchable(ptr))
         {
-          buffer << "\"" << ptr.data().operator char *() << "\" ";
-          continue;
+          regions.emplace_back(ptr.data(), ptr.data_size());
         }
+    }
 
-      if (ptr.name() == MACH_MSG_TYPE_BIT)
-        {
-          assert(ptr.nelems() <= 8 * sizeof(long));
-          buffer << std::hex << * reinterpret_cast<long *>(static_cast<vm_address_t>(ptr.data())) << std::dec;
-          continue;
-        }
+  if (! regions.empty())
+    {
+      std::unique_lock<std::mutex> lk(OOLprefetches);
+      OOLprefetches[&msg] = copyin->copy(regions, messagePriority(msg->msgh_id));
+    }
+}
 
-      if (ptr.nelems() > 32)
-        {
-          buffer << ptr.nelems();
-        }
+/* Wait for the copy-in threads to finish with a message, then swap
+ * their copies in for the original OOL regions, just like
+ * copyOOLdata would have.
+ */
 
-      switch (ptr.name())
-        {
-        case MACH_MSG_TYPE_PORT_NAME:
-          buffer << "pn";
-          break;
+void
+collectOOLdata(machMessage & msg)
+{
+  std::future<std::vector<vm_address_t>> prefetch;
 
-        case MACH_MSG_TYPE_MOVE_RECEIVE:
-          buffer << "r";
-          break;
+  {
+    std::unique_lock<std::mutex> lk(OOLprefetches);
 
-        case MACH_MSG_TYPE_MOVE_SEND:
-          buffer << "s";
-          break;
+    auto it = OOLprefetches.find(&msg);
 
-        case MACH_MSG_TYPE_MOVE_SEND_ONCE:
-          buffer << "so";
-          break;
+    if (it == OOLprefetches.end())
+      {
+        return;
+      }
 
-        case MACH_MSG_TYPE_COPY_SEND:
-          buffer << "cs";
-          break;
+    prefetch = std::move(it->second);
+    OOLprefetches.erase(it);
+  }
 
-        case MACH_MSG_TYPE_MAKE_SEND:
-          buffer << "ms";
-          break;
+  std::vector<vm_address_t> copies = prefetch.get();
+  auto copy = copies.begin();
 
-        case MACH_MSG_TYPE_MAKE_SEND_ONCE:
-          buffer << "mso";
-          break;
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (isPrefetchable(ptr))
+        {
+          assert(copy != copies.end());
 
-        default:
-          ;
+          if (* copy != ptr.data())
+            {
+              mach_call (vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size()));
+              * ptr.OOLptr() = * copy;
+            }
+
+          copy ++;
         }
+    }
+}
 
-      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()) || (ptr.name() == MACH_MSG_TYPE_PORT_NAME) || (ptr.nelems() > 1))
+/* With --lazy-ool, big OOL regions are sent by reference instead of
+ * being copied (see LAZY OOL TRANSFER, above).  We keep the region
+ * that the kernel gave us, just as it is, until our peer releases it.
+ * Port arrays are always copied, since we have to translate them.
+ */
+
+void
+netmsg::exportOOLdata(machMessage & msg)
+{
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (! ptr.is_inline() && (ptr.data_size() >= lazyOOLthreshold)
+          && ! MACH_MSG_TYPE_PORT_ANY(ptr.name()) && (ptr.name() != MACH_MSG_TYPE_PORT_NAME))
         {
-          buffer << "{";
-        }
+          std::unique_lock<std::mutex> lk(lazy_exports);
 
-      /* Save stream format flags because we'll change it from decimal
-       * to hex if we're printing a character string, to handle
-       * non-printing characters.
-       */
+          natural_t id = next_lazy_export ++;
 
-      std::ios::fmtflags f( buffer.flags() );
+          lazy_exports[id] = std::make_pair(static_cast<vm_address_t>(ptr.data()), ptr.data_size());
 
-      if (ptr.name() == MACH_MSG_TYPE_CHAR)
-        {
-          /* I'd like to setw(2) here, but the width gets reset to
-           * zero everytime you print a string (like "\x"), so it's
-           * pointless...
-           */
-          buffer << std::hex << std::setfill('0');
+          * ptr.OOLptr() = id;
+          ptr.set_lazy(true);
         }
+    }
+}
 
-      for (unsigned int i = 0; i < ptr.nelems() && i < 32; i ++)
-        {
-          if ((i > 0) && (ptr.name() != MACH_MSG_TYPE_CHAR))
-            {
-              buffer << " ";
-            }
-          switch (ptr.name())
-            {
+void
+netmsg::sendPeerMessage(mach_msg_id_t msgid, natural_t arg0, natural_t offset, natural_t length,
+                        natural_t arg3, vm_address_t data)
+{
+  machMessage msg;
+  peerMessage * peermsg = reinterpret_cast<peerMessage *>(msg.buffer);
+
+  bzero(peermsg, sizeof(peerMessage));
+
+  /* On the network, msgh_local_port is the destination */
+
+  peermsg->header.msgh_local_port = MACH_PORT_CONTROL;
+  peermsg->header.msgh_id = msgid;
+  peermsg->header.msgh_size = offsetof(peerMessage, dataType);
+
+  peermsg->argsType.msgt_name = MACH_MSG_TYPE_INTEGER_32;
+  peermsg->argsType.msgt_size = 32;
+  peermsg->argsType.msgt_number = 4;
+  peermsg->argsType.msgt_inline = TRUE;
+
+  peermsg->args[0] = arg0;
+  peermsg->args[1] = offset;
+  peermsg->args[2] = length;
+  peermsg->args[3] = arg3;
+
+  if (data)
+    {
+      peermsg->header.msgh_bits = MACH_MSGH_BITS_COMPLEX;
+      peermsg->header.msgh_size = sizeof(peerMessage);
+
+      peermsg->dataType.msgtl_header.msgt_longform = TRUE;
+      peermsg->dataType.msgtl_header.msgt_deallocate = TRUE;
+      peermsg->dataType.msgtl_name = MACH_MSG_TYPE_INTEGER_8;
+      peermsg->dataType.msgtl_size = 8;
+      peermsg->dataType.msgtl_number = length;
+      peermsg->data = data;
+    }
 
-            case MACH_MSG_TYPE_BIT:
-              assert(0);
+  priorityLock lk(os, PRIORITY_HIGH);
+  os.write(msg.buffer, msg->msgh_size);
+  transmitOOLdata(msg);
+  os.flush();
+}
 
-            case MACH_MSG_TYPE_CHAR:
-              {
-                char c = ptr[i];
-                if (std::isprint(c))
-                  {
-                    buffer << c;
-                  }
-                else
-                  {
-                    // XXX why is this AND needed?
-                    buffer << "\\x" << std::setw(2) << (ptr[i] & 0xff);
-                  }
-              }
-              break;
+/* Our peer wants some pages of a region we exported.  Copy them
+ * safely, in case the region is backed by a memory manager that's
+ * gone away, and if we can't, pass the error along.  Pages past the
+ * end of the region are zero-filled.
+ */
 
-            case MACH_MSG_TYPE_INTEGER_8:
-            case MACH_MSG_TYPE_INTEGER_16:
-            case MACH_MSG_TYPE_INTEGER_32:
-            case MACH_MSG_TYPE_INTEGER_64:
+void
+netmsg::serveLazyPages(natural_t id, vm_offset_t offset, vm_size_t length, natural_t object)
+{
+  vm_address_t region = 0;
+  vm_size_t size = 0;
 
-            case MACH_MSG_TYPE_PORT_NAME:
+  {
+    std::unique_lock<std::mutex> lk(lazy_exports);
+    auto it = lazy_exports.find(id);
 
-            case MACH_MSG_TYPE_MOVE_RECEIVE:
-            case MACH_MSG_TYPE_MOVE_SEND:
-            case MACH_MSG_TYPE_MOVE_SEND_ONCE:
-            case MACH_MSG_TYPE_COPY_SEND:
-            case MACH_MSG_TYPE_MAKE_SEND:
-            case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+    if (it != lazy_exports.end())
+      {
+        region = it->second.first;
+        size = it->second.second;
+      }
+  }
 
-              buffer << ptr[i];
-              break;
+  if (region == 0)
+    {
+      dprintf("lazy OOL request for unknown region %d\n", id);
+      sendPeerMessage(MSGID_LAZY_OOL_DATA, object, offset, length, KERN_MEMORY_ERROR);
+      return;
+    }
 
-            case MACH_MSG_TYPE_STRING:
-            case MACH_MSG_TYPE_REAL:
-              assert(0);
-            }
-        }
+  /* The offset and length come from our peer; don't let them reach
+   * past the pages the region occupies.
+   */
 
-      buffer.flags(f);
+  if (offset >= round_page(size))
+    {
+      sendPeerMessage(MSGID_LAZY_OOL_DATA, object, offset, length, KERN_MEMORY_ERROR);
+      return;
+    }
 
-      if (ptr.nelems() > 32)
-        {
-          buffer << "...";
-        }
-      if (MACH_MSG_TYPE_PORT_ANY(ptr.name()) || (ptr.name() == MACH_MSG_TYPE_PORT_NAME) || (ptr.nelems() > 1))
-        {
-          buffer << "}";
-        }
+  length = std::min(length, round_page(size) - offset);
+
+  vm_address_t data;
+  kern_return_t err = mach_call (vm_allocate(mach_task_self(), &data, length, 1));
+
+  if (err)
+    {
+      sendPeerMessage(MSGID_LAZY_OOL_DATA, object, offset, length, KERN_MEMORY_ERROR);
+      return;
     }
 
-  buffer << "\n";
-  std::cerr << buffer.str();
+  if (offset < size)
+    {
+      err = hurd_safe_copyin(reinterpret_cast<void *>(data), reinterpret_cast<void *>(region + offset),
+                             std::min(length, size - offset));
+    }
+
+  if (err)
+    {
+      mach_call (vm_deallocate(mach_task_self(), data, length));
+      sendPeerMessage(MSGID_LAZY_OOL_DATA, object, offset, length, err);
+    }
+  else
+    {
+      sendPeerMessage(MSGID_LAZY_OOL_DATA, object, offset, length, ESUCCESS, data);
+    }
 }
 
+/* struct lazyObject - a memory object backing a region that our peer
+ * sent us by reference.  They're all served by a single thread,
+ * running memory_object_server on lazyObjectPortset; the server
+ * routines are at the end of this file.
+ *
+ * 'pages' holds any pages the kernel has paged out to us, which we
+ * have to give back instead of fetching the original from our peer.
+ */
+
+struct lazyObject
+{
+  netmsg * session;
+  natural_t id;                         /* our peer's export id */
+  memory_object_control_t control;
+  std::map<vm_offset_t, vm_address_t> pages;
+};
+
+synchronized<std::map<memory_object_t, lazyObject>> lazyObjects;
+
+mach_port_t lazyObjectPortset = MACH_PORT_NULL;
+
 void
-netmsg::transmitOOLdata(machMessage & msg)
+run_memory_object_server(void)
 {
-  for (auto ptr = msg.data(); ptr; ++ ptr)
+  while (1)
     {
-      if ((! ptr.is_inline()) && (ptr.data_size() > 0))
-        {
-          os.write(ptr.data(), ptr.data_size());
-          vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size());
-        }
+      mach_call (mach_msg_server (memory_object_server, 0, lazyObjectPortset));
     }
 }
 
 void
-netmsg::receiveOOLdata(machMessage & msg)
+startLazyObjectServer(void)
+{
+  static std::once_flag started;
+
+  std::call_once(started, [] {
+      mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_PORT_SET, &lazyObjectPortset));
+      new std::thread(run_memory_object_server);
+    });
+}
+
+/* Replace each region sent by reference with a mapping of a new
+ * memory object, which we'll relay in its place.  The mapping is
+ * deallocated when the message is sent, so the memory object will be
+ * terminated once the recipient is done with it.
+ *
+ * If we can't map it, the recipient gets zero-filled memory, just as
+ * in copyOOLdata().
+ */
+
+void
+netmsg::importOOLdata(machMessage & msg)
 {
   for (auto ptr = msg.data(); ptr; ++ ptr)
     {
-      if (! ptr.is_inline() && (ptr.data_size() > 0))
+      if (! ptr.is_inline() && ptr.is_lazy())
         {
-          mach_call (vm_allocate(mach_task_self(), ptr.OOLptr(), ptr.data_size(), 1));
-          is.read(ptr.data(), ptr.data_size());
+          natural_t id = * ptr.OOLptr();
+          vm_size_t size = round_page(ptr.data_size());
+          memory_object_t object;
+          vm_address_t address = 0;
+
+          startLazyObjectServer();
+
+          mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &object));
+
+          {
+            std::unique_lock<std::mutex> lk(lazyObjects);
+            lazyObject & lazy = lazyObjects[object];
+
+            lazy.session = this;
+            lazy.id = id;
+            lazy.control = MACH_PORT_NULL;
+          }
+
+          mach_call (mach_port_move_member (mach_task_self (), object, lazyObjectPortset));
+          mach_call (mach_port_insert_right (mach_task_self (), object, object, MACH_MSG_TYPE_MAKE_SEND));
+
+          kern_return_t err = mach_call (vm_map (mach_task_self (), &address, size, 0, TRUE,
+                                                 object, 0, FALSE, VM_PROT_ALL, VM_PROT_ALL,
+                                                 VM_INHERIT_COPY));
+
+          /* The kernel holds its own send right if the vm_map succeeded */
+
+          mach_call (mach_port_deallocate (mach_task_self (), object));
+
+          if (err != KERN_SUCCESS)
+            {
+              {
+                std::unique_lock<std::mutex> lk(lazyObjects);
+                lazyObjects.erase(object);
+              }
+              mach_call (mach_port_mod_refs (mach_task_self (), object, MACH_PORT_RIGHT_RECEIVE, -1));
+              sendPeerMessage(MSGID_LAZY_OOL_RELEASE, id, 0, 0, 0);
+              if (mach_call (vm_allocate (mach_task_self (), &address, size, 1)) != KERN_SUCCESS)
+                {
+                  address = 0;
+                }
+            }
+
+          * ptr.OOLptr() = address;
+          ptr.set_lazy(false);
+          ptr.set_deallocate(true);
         }
     }
 }
 
-/* OOL data can point to a memory region backed by an unreliable
- * memory manager.  In this case, we don't want to wait until we're
- * trying to transmit over the network before finding this out, so we
- * copy it now into our own address space.
- *
- * What should we do if this fails?  Most precisely, we should mimic
- * this behavior on the remote by arranging for it to have a faulting
- * memory manager (presumably implemented by netmsg)!  Instead, I just
- * ignore the return value from hurd_safe_copyin, so we just get
- * zero-filled memory from vm_allocate passed on to the recipient.
+/* Handle a message from our peer about lazy OOL transfer.  Requests
+ * and releases are queued by export id, and data by memory object, so
+ * a region is never released while we're still copying from it.
  */
 
 void
-copyOOLdata(machMessage & msg)
+netmsg::lazyBufferHandler(machMessage & msg)
 {
-  for (auto ptr = msg.data(); ptr; ++ ptr)
+  peerMessage * lazymsg = reinterpret_cast<peerMessage *>(msg.buffer);
+
+  switch (msg->msgh_id)
     {
-      if (! ptr.is_inline() && (ptr.data_size() > 0))
-        {
-          vm_address_t new_location;
+    case MSGID_LAZY_OOL_REQUEST:
+      serveLazyPages(lazymsg->args[0], lazymsg->args[1], lazymsg->args[2], lazymsg->args[3]);
+      break;
 
-          mach_call (vm_allocate(mach_task_self(), &new_location, ptr.data_size(), 1));
+    case MSGID_LAZY_OOL_DATA:
+      {
+        vm_address_t data = (msg->msgh_bits & MACH_MSGH_BITS_COMPLEX) ? lazymsg->data : 0;
+        std::unique_lock<std::mutex> lk(lazyObjects);
+        auto it = lazyObjects.find(lazymsg->args[0]);
+
+        /* The memory object may have been terminated while our request was in flight */
 
-          hurd_safe_copyin(reinterpret_cast<void *>(new_location), ptr.data().operator void *(), ptr.data_size());
+        if ((it == lazyObjects.end()) || (it->second.control == MACH_PORT_NULL))
+          {
+            if (data)
+              {
+                mach_call (vm_deallocate (mach_task_self (), data, lazymsg->args[2]));
+              }
+          }
+        else if (data)
+          {
+            mach_call (memory_object_data_supply (it->second.control, lazymsg->args[1], data, lazymsg->args[2],
+                                                  TRUE, VM_PROT_NONE, FALSE, MACH_PORT_NULL));
+          }
+        else
+          {
+            mach_call (memory_object_data_error (it->second.control, lazymsg->args[1], lazymsg->args[2],
+                                                 lazymsg->args[3]));
+          }
+      }
+      break;
 
-          mach_call (vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size()));
+    case MSGID_LAZY_OOL_RELEASE:
+      {
+        std::unique_lock<std::mutex> lk(lazy_exports);
+        auto it = lazy_exports.find(lazymsg->args[0]);
 
-          /* XXX perhaps ptr.data() should return a reference to facilitate this step */
-          * ptr.OOLptr() = new_location;
-        }
+        if (it != lazy_exports.end())
+          {
+            mach_call (vm_deallocate (mach_task_self (), it->second.first, it->second.second));
+            lazy_exports.erase(it);
+          }
+      }
+      break;
     }
 }
 
 void
-netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
+netmsg::translateForTransmission(machMessage & msg, bool translatePortNames,
+                                 std::vector<mach_port_t> & returnedRights)
 {
+  std::vector<natural_t> identities;   /* see PORT IDENTITIES */
+  std::vector<mach_port_t> movedReceiveRights;
+  unsigned int sendRights = 0;
+
+  std::unique_lock<std::recursive_mutex> lk(portMaps);
+
   for (auto ptr = msg.data(); ptr; ++ ptr)
     {
       switch (ptr.name())
@@ -907,6 +3077,8 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
 
             for (unsigned int i = 0; i < ptr.nelems(); i ++)
               {
+                unsigned int index = sendRights ++;
+
                 if ((ports[i] == MACH_PORT_NULL) || (ports[i] == MACH_PORT_DEAD))
                   {
                     continue;
@@ -923,12 +3095,14 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
                      * right to ourself!  If it's the port's last send
                      * right, then we'll get a no senders notification
                      * and deallocate the receive right then, so all
-                     * we destroy here is the send right.
+                     * we destroy here is the send right.  Our caller
+                     * does that once the message has been written, so
+                     * the notification can't get there first (see NO
+                     * SENDERS ACCOUNTING).
                      */
 
                     assert(local_port_type.at(ports[i]) == MACH_MSG_TYPE_PORT_RECEIVE);
-                    mach_call (mach_port_mod_refs (mach_task_self(), ports[i],
-                                                   MACH_PORT_RIGHT_SEND, -1));
+                    returnedRights.push_back(ports[i]);
 
                     ports[i] = (~ remote_ports_by_local[ports[i]]);
                   }
@@ -936,10 +3110,20 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
                   {
                     /* We've got a send right (note it), but no
                      * mapping to a remote port (the remote takes care
-                     * of that).
+                     * of that).  Tell the remote where its receive
+                     * right really is, in case it's on the remote's
+                     * own node.
                      */
 
+                    if (nodeId != 0)
+                      {
+                        portIdentity id = lookupPortIdentity(ports[i]);
+                        exportPortIdentity(ports[i], id);
+                        identities.insert(identities.end(), {index, id.node, id.name});
+                      }
+
                     local_port_type[ports[i]] = MACH_MSG_TYPE_PORT_SEND;
+                    transmitted_send_rights[ports[i]] ++;
 
                     /* request a DEAD NAME notification */
 
@@ -970,6 +3154,8 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
                     continue;
                   }
 
+                mach_port_t name = ports[i];
+
                 /* We're transmitting a receive right over the
                  * network.  Add it to our port set, and request a
                  * NO SENDERS notification on it.
@@ -1051,6 +3237,8 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
                   {
                     local_port_type[ports[i]] = MACH_MSG_TYPE_PORT_RECEIVE;
                   }
+
+                movedReceiveRights.push_back(name);
               }
           }
 
@@ -1080,6 +3268,25 @@ netmsg::translateForTransmission(machMessage & msg, bool translatePortNames)
         }
 
     }
+
+  lk.unlock();
+
+  /* locatePort looks through every connection's maps, so only call
+   * it for ports someone is waiting to hear about.
+   */
+
+  for (auto name : movedReceiveRights)
+    {
+      if (locatorPath && locationWatched(name))
+        {
+          locationChanged(name, locatePort(name));
+        }
+    }
+
+  if (! identities.empty())
+    {
+      appendPortIdentities(msg, identities);
+    }
 }
 
 void
@@ -1089,7 +3296,14 @@ netmsg::ipcBufferHandler(machMessage & msg)
 
   mach_port_t dead_name = MACH_PORT_NULL;
 
-  copyOOLdata(msg);
+  mach_port_t remote_port;
+
+  /* If we've got copy-in threads, they're already copying the OOL
+   * data (see ipcHandler), and we wait for them just before we
+   * transmit.  In the meantime, translate the message.
+   */
+
+  copyOOLdata(msg, copyin != nullptr);
 
   /* Print debugging messages in our local port space, before translation */
 
@@ -1125,6 +3339,8 @@ netmsg::ipcBufferHandler(machMessage & msg)
    * 3. distinguish between them based on C++ maps
    */
 
+  std::unique_lock<std::recursive_mutex> lk(portMaps);
+
   if (msg->msgh_local_port == control)
     {
       msg->msgh_local_port = MACH_PORT_CONTROL;
@@ -1159,11 +3375,21 @@ netmsg::ipcBufferHandler(machMessage & msg)
 
             /* The send right has turned into a dead name, plus the
              * dead name notification incremented the user ref, so we
-             * have two dead name refs to deallocate.
+             * have two dead name refs to deallocate, or more if we
+             * were holding several send rights for our peer.
              */
 
+            mach_port_delta_t refs = 1;
+
+            if (transmitted_send_rights.count(dead_name) > 0)
+              {
+                refs = transmitted_send_rights.at(dead_name);
+                transmitted_send_rights.erase(dead_name);
+              }
+            deferred_no_senders.erase(dead_name);
+
             mach_call (mach_port_mod_refs (mach_task_self(), dead_name,
-                                           MACH_PORT_RIGHT_DEAD_NAME, -2));
+                                           MACH_PORT_RIGHT_DEAD_NAME, - (refs + 1)));
 
             if (local_port_type.count(dead_name) > 0)
               {
@@ -1171,6 +3397,8 @@ netmsg::ipcBufferHandler(machMessage & msg)
                 local_port_type.erase(dead_name);
               }
 
+            forgetPortIdentity(dead_name);
+
             /* We still have to erase any remote-local mapping, but
              * let's wait until later in this function, because we
              * still have to use the mapping to translate the message!
@@ -1203,18 +3431,12 @@ netmsg::ipcBufferHandler(machMessage & msg)
       assert(local_port_type.at(msg->msgh_local_port) == MACH_MSG_TYPE_PORT_RECEIVE);
       msg->msgh_local_port = remote_ports_by_local[msg->msgh_local_port];
     }
-  else if (send_once_ports_by_local.count(msg->msgh_local_port) == 1)
+  else if ((remote_port = reply_ports.release(msg->msgh_local_port)) != MACH_PORT_NULL)
     {
-      /* it's a send-once right we got via the network.  translate it */
-      mach_port_t remote_port = send_once_ports_by_local[msg->msgh_local_port];
-
-      /* Since it's a send-once right, we'll never see it again, so forget its mappings */
-      send_once_ports_by_local.erase(msg->msgh_local_port);
-      send_once_ports_by_remote.erase(remote_port);
-
-      /* Also, we can deallocate the receive right now */
-      mach_call (mach_port_mod_refs (mach_task_self(), msg->msgh_local_port,
-                                     MACH_PORT_RIGHT_RECEIVE, -1));
+      /* It's a send-once right we got via the network.  Translate
+       * it.  The send-once right has been used up, so the receive
+       * right has gone back into reply_ports for the next RPC.
+       */
 
       ddprintf("Translating dest port %ld to %ld\n", msg->msgh_local_port, remote_port);
 
@@ -1230,6 +3452,11 @@ netmsg::ipcBufferHandler(machMessage & msg)
        * the messages to be processed in the opposite direction, i.e,
        * NO SENDERS first, then DEAD NAME.
        */
+      lk.unlock();
+      if (copyin)
+        {
+          collectOOLdata(msg);
+        }
       return;
     }
   else if (local_port_type.at(msg->msgh_local_port) == MACH_MSG_TYPE_PORT_RECEIVE)
@@ -1263,13 +3490,37 @@ netmsg::ipcBufferHandler(machMessage & msg)
   if (msg->msgh_id == MSGID_NO_SENDERS)
     {
       assert(local_port_type.at(original_local_port) == MACH_MSG_TYPE_PORT_RECEIVE);
+
+      /* If we've relayed a send right on the port since the
+       * notification was generated, it's stale.  Ask for the next one
+       * instead (see NO SENDERS ACCOUNTING).  We make our send rights
+       * with portMaps held, so none can sneak in after this check.
+       */
+
+      mach_port_status_t status;
+      mach_call (mach_port_get_receive_status (mach_task_self (), original_local_port, &status));
+
+      if (status.mps_srights)
+        {
+          mach_port_t old;
+          mach_call (mach_port_request_notification (mach_task_self (), original_local_port,
+                                                     MACH_NOTIFY_NO_SENDERS, status.mps_mscount,
+                                                     original_local_port,
+                                                     MACH_MSG_TYPE_MAKE_SEND_ONCE, &old));
+          assert(old == MACH_PORT_NULL);
+          return;
+        }
+
       mach_call (mach_port_mod_refs (mach_task_self(), original_local_port,
                                      MACH_PORT_RIGHT_RECEIVE, -1));
       local_port_type.erase(original_local_port);
       local_ports_by_remote.erase(remote_ports_by_local[original_local_port]);
       remote_ports_by_local.erase(original_local_port);
+      forgetPortIdentity(original_local_port);
     }
 
+  lk.unlock();
+
   /* If dead_name isn't MACH_PORT_NULL, then this is a DEAD NAME
    * notification targeted at our notification port, so the port name
    * in the message is one of our own, and we want to translate it.
@@ -1277,7 +3528,9 @@ netmsg::ipcBufferHandler(machMessage & msg)
    * task, so we don't translate them.
    */
 
-  translateForTransmission(msg, dead_name != MACH_PORT_NULL);
+  std::vector<mach_port_t> returnedRights;
+
+  translateForTransmission(msg, dead_name != MACH_PORT_NULL, returnedRights);
 
   /* Deferred handling of DEAD NAME mappings until after
    * translateForTransmission()
@@ -1285,6 +3538,8 @@ netmsg::ipcBufferHandler(machMessage & msg)
 
   if (dead_name != MACH_PORT_NULL)
     {
+      lk.lock();
+
       if (remote_ports_by_local.count(dead_name) > 0)
         {
           /* This is the case where we got a receive right over
@@ -1295,33 +3550,39 @@ netmsg::ipcBufferHandler(machMessage & msg)
           local_ports_by_remote.erase(remote_ports_by_local[dead_name]);
           remote_ports_by_local.erase(dead_name);
         }
+
+      lk.unlock();
+    }
+
+  if (copyin)
+    {
+      collectOOLdata(msg);
     }
 
   /* Lock the network output stream and transmit the message on it. */
 
   {
-    std::unique_lock<std::mutex> lk(os);
+    priorityLock lk(os, messagePriority(msg->msgh_id));
+    trace(TRACE_NET_SEND, msg, msg->msgh_local_port, msg->msgh_remote_port);
+    captureMessage(CAPTURE_NET_SEND, session, msg);
     os.write(msg.buffer, msg->msgh_size);
     transmitOOLdata(msg);
     os.flush();
   }
 
   ddprintf("sent network message\n");
+
+  for (auto port : returnedRights)
+    {
+      mach_call (mach_port_mod_refs (mach_task_self(), port,
+                                     MACH_PORT_RIGHT_SEND, -1));
+    }
 }
 
 void
 netmsg::ipcHandler(void)
 {
-  mach_call (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &portset));
-
-  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &notification_port));
-
-  ddprintf("notification_port = %ld\n", notification_port);
-
-  /* move the receive right into the portset so we'll be listening on it */
-  mach_call (mach_port_move_member (mach_task_self (), notification_port, portset));
-
-  if (control != MACH_PORT_NULL)
+  if ((control != MACH_PORT_NULL) && ! meshConnection)
     {
       mach_call (mach_port_move_member (mach_task_self (), control, portset));
     }
@@ -1348,7 +3609,27 @@ netmsg::ipcHandler(void)
                            0, msg.max_size, portset,
                            MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL));
 
-      ddprintf("received IPC message (%s) on port %ld\n", msgid_name(msg->msgh_id), msg->msgh_local_port);
+      trace(TRACE_IPC_RECEIVE, msg, msg->msgh_local_port, msg->msgh_remote_port);
+
+      if (debugging(2))
+        {
+          ddprintf("received IPC message (%s) on port %ld\n", msgid_name(msg->msgh_id), msg->msgh_local_port);
+        }
+
+      /* Start copying OOL data now, so it can page in while the
+       * message waits behind others in its run queue.  Regions sent
+       * by reference don't need copying, so export them first.
+       */
+
+      if (lazyOOLthreshold > 0)
+        {
+          exportOOLdata(msg);
+        }
+
+      if (copyin)
+        {
+          prefetchOOLdata(msg);
+        }
 
       if (multi_threaded)
         {
@@ -1358,7 +3639,6 @@ netmsg::ipcHandler(void)
         {
           ipcBufferHandler(msg);
           delete &msg;
-          auditPorts();
         }
     }
 
@@ -1607,7 +3887,7 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
       if (type == MACH_MSG_TYPE_MOVE_SEND)
         {
           // we do need to create an extra send right, because we'll lose one when we transmit this message
-          if (local_port_type[newport] == MACH_MSG_TYPE_PORT_RECEIVE)
+          if ((local_port_type.count(newport) > 0) && (local_port_type.at(newport) == MACH_MSG_TYPE_PORT_RECEIVE))
             {
               mach_call (mach_port_insert_right (mach_task_self (), newport, newport,
                                                  MACH_MSG_TYPE_MAKE_SEND));
@@ -1617,6 +3897,25 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
               mach_call (mach_port_insert_right (mach_task_self (), newport, newport,
                                                  MACH_MSG_TYPE_COPY_SEND));
             }
+
+          /* If a NO SENDERS notification was waiting for this right
+           * to be relayed (see NO SENDERS ACCOUNTING), it can go now.
+           */
+
+          if ((returning_send_rights.count(newport) > 0) && (-- returning_send_rights.at(newport) == 0))
+            {
+              returning_send_rights.erase(newport);
+
+              if (deferred_no_senders.count(newport) > 0)
+                {
+                  unsigned int count = deferred_no_senders.at(newport);
+                  deferred_no_senders.erase(newport);
+                  if (local_port_type.count(newport) > 0)
+                    {
+                      releaseSendRights(newport, count);
+                    }
+                }
+            }
         }
       else if (type == MACH_MSG_TYPE_MOVE_RECEIVE)
         {
@@ -1642,6 +3941,8 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
 
           // our local port type is flipping from RECEIVE to SEND
           local_port_type[newport] = MACH_MSG_TYPE_PORT_SEND;
+          forgetPortIdentity(newport);
+          locationChanged(newport, nodeId);
 
           /* request a DEAD NAME notification */
 
@@ -1694,6 +3995,8 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
 
               // our local port type is flipping from RECEIVE to SEND
               local_port_type[localport] = MACH_MSG_TYPE_PORT_SEND;
+              forgetPortIdentity(localport);
+              locationChanged(localport, nodeId);
 
               /* request a DEAD NAME notification */
 
@@ -1787,28 +4090,19 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
       // fallthrough
 
     case MACH_MSG_TYPE_MOVE_SEND_ONCE:
-      assert (send_once_ports_by_remote.count(port) == 0);
-
       mach_port_t newport;
       mach_port_t sendonce_port;
       mach_msg_type_name_t acquired_type;
 
-      /* create new receive port and a new send once right that will be moved to the recipient */
-      mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &newport));
+      /* get a receive port from the pool, and a new send once right
+       * to it that will be moved to the recipient.  reply_ports
+       * remembers which remote send-once right it stands for, so when
+       * we get the message on it, we can translate it.
+       */
+      newport = reply_ports.get(port, portset);
       mach_call (mach_port_extract_right (mach_task_self (), newport, MACH_MSG_TYPE_MAKE_SEND_ONCE, &sendonce_port, &acquired_type));
       assert (acquired_type == MACH_MSG_TYPE_PORT_SEND_ONCE);
 
-      /* move the receive right into the portset so we'll be listening on it */
-      mach_call (mach_port_move_member (mach_task_self (), newport, portset));
-
-      /* don't need to remember sendonce_port; it'll be used once and
-       * then forgotten.  remember the port number of the receive
-       * right so when we get the message on it, we can translate it
-       * into the remote send-once right.
-       */
-      send_once_ports_by_remote[port] = newport;
-      send_once_ports_by_local[newport] = port;
-
       ddprintf("translating port %ld (SEND ONCE) ---> %ld (recv %ld)\n", port, sendonce_port, newport);
 
       return sendonce_port;
@@ -1836,9 +4130,13 @@ netmsg::translatePort2(const mach_port_t port, const unsigned int type)
 mach_port_t
 netmsg::translatePort(const mach_port_t port, const unsigned int type)
 {
+  std::unique_lock<std::recursive_mutex> lk(portMaps);
   mach_port_t result = translatePort2(port, type);
 
-  ddprintf("translating port %ld (%s) ---> %ld\n", port, mach_port_type_to_str[type], result);
+  if (debugging(2))
+    {
+      ddprintf("translating port %ld (%s) ---> %ld\n", port, mach_port_type_to_str[type], result);
+    }
 
   return result;
 }
@@ -1872,10 +4170,14 @@ netmsg::swapHeader(machMessage & msg)
    * instead of whatever the remote supplied.
    */
 
-  if (local_port_type.count(this_port) > 0)
-    {
-      this_type = MACH_MSG_TYPE_COPY_SEND;
-    }
+  {
+    std::unique_lock<std::recursive_mutex> lk(portMaps);
+
+    if (local_port_type.count(this_port) > 0)
+      {
+        this_type = MACH_MSG_TYPE_COPY_SEND;
+      }
+  }
 
   msg->msgh_local_port = reply_port;
   msg->msgh_remote_port = this_port;
@@ -1900,6 +4202,8 @@ netmsg::translateHeader(machMessage & msg)
   mach_port_t & local_port = msg->msgh_local_port;
   mach_port_t & remote_port = msg->msgh_remote_port;
 
+  std::unique_lock<std::recursive_mutex> lk(portMaps);
+
   if ((local_type != MACH_MSG_TYPE_PORT_SEND) && (local_type != MACH_MSG_TYPE_PORT_SEND_ONCE))
     {
       error (1, 0, "local_type (%d) != MACH_MSG_TYPE_PORT_SEND{_ONCE}", local_type);
@@ -1947,8 +4251,8 @@ netmsg::translateHeader(machMessage & msg)
       /* We earlier got a send right via IPC and relayed it across the
        * network, or got a receive right over the network.  Now we've
        * got a notification from the other side that there are no more
-       * senders (there).  Destroy our local send right.  If it's the
-       * last send right, this call will trigger another no senders
+       * senders (there).  Destroy our local send rights (see NO SENDERS
+       * ACCOUNTING).  If it's the last send right, this call will trigger another no senders
        * notification if one was requested, but there might be other
        * local send rights.  All we know for sure is that there are no
        * more remote send rights.
@@ -1973,58 +4277,26 @@ netmsg::translateHeader(machMessage & msg)
           return false;
         }
 
-      assert(local_port_type.at(local_port) == MACH_MSG_TYPE_PORT_SEND);
-
-      /* Destroy outstanding DEAD NAME request.
-       *
-       * KERN_INVALID_ARGUMENT will be returned if local_port is
-       * already dead.
-       */
-
-      mach_port_t old = MACH_PORT_NULL;
-      mach_call (mach_port_request_notification (mach_task_self (), local_port,
-                                                 MACH_NOTIFY_DEAD_NAME, 0,
-                                                 MACH_PORT_NULL,
-                                                 MACH_MSG_TYPE_MAKE_SEND_ONCE, &old),
-                 KERN_INVALID_ARGUMENT);
-      if (old != MACH_PORT_NULL)
-        {
-          mach_call (mach_port_mod_refs (mach_task_self(), old,
-                                         MACH_PORT_RIGHT_SEND_ONCE, -1));
-        }
-
-      /* this assert doesn't work because notification_port is a
-       * RECEIVE right, but old will give us back a SEND ONCE right
-       */
-      // assert(old == notification_port);
-
-      /* Destroy the send right itself.
-       *
-       * KERN_INVALID_RIGHT will be returned if local_port is already
-       * dead, in which case we expect to have at least one dead name
-       * ref (from the send right), along with a second dead name ref
-       * due to the DEAD NAME notification.  If the name died since
-       * the last block of code, we'll only have one dead name ref.
-       */
+      assert(local_port_type.at(local_port) == MACH_MSG_TYPE_PORT_SEND);
 
-      mach_call (mach_port_mod_refs (mach_task_self(), local_port,
-                                     MACH_PORT_RIGHT_SEND, -1),
-                 KERN_INVALID_RIGHT);
+      auto data = msg.data();
 
-      /* XXX destroy the dead name refs if that last mach_call failed */
+      assert(data.nelems() == 1);
 
-      local_port_type.erase(local_port);
+      unsigned int count = data[0];
 
-      if (remote_ports_by_local.count(local_port) > 0)
+      if (returning_send_rights.count(local_port) > 0)
         {
-          /* This is the case where we got a receive right over the
-           * network, so we have a remote/local mapping.  If we
-           * transmitted a send right, then we have no mapping.
+          /* A send right that the proxy gave back to us is still
+           * waiting on another run queue to be translated (see NO
+           * SENDERS ACCOUNTING).
            */
-          local_ports_by_remote.erase(remote_ports_by_local[local_port]);
-          remote_ports_by_local.erase(local_port);
+          deferred_no_senders[local_port] += count;
+          return false;
         }
 
+      releaseSendRights(local_port, count);
+
       return false;
     }
 
@@ -2064,6 +4336,8 @@ netmsg::translateHeader(machMessage & msg)
       mach_call (mach_port_mod_refs (mach_task_self(), dead_name,
                                      MACH_PORT_RIGHT_RECEIVE, -1));
       local_port_type.erase(dead_name);
+      forgetPortIdentity(dead_name);
+      locationChanged(dead_name, NETMSG_NODE_UNKNOWN);
 
       /* XXX should destroy outstanding NO SENDERS request */
 
@@ -2102,9 +4376,134 @@ netmsg::translateHeader(machMessage & msg)
   return true;
 }
 
+/* Our peer's proxy for local_port got a NO SENDERS notification,
+ * after 'count' send rights were made on it.  Drop that many of the
+ * send rights we've been holding for it, and if that's all of them,
+ * forget the port (see NO SENDERS ACCOUNTING).  Called with portMaps
+ * held.
+ */
+
+void
+netmsg::releaseSendRights(mach_port_t local_port, unsigned int count)
+{
+  /* A send right we got with a receive right over the network isn't
+   * counted; there's only the one.
+   */
+
+  mach_port_delta_t refs = 1;
+
+  if (transmitted_send_rights.count(local_port) > 0)
+    {
+      unsigned int & held = transmitted_send_rights.at(local_port);
+
+      if (held > count)
+        {
+          mach_call (mach_port_mod_refs (mach_task_self(), local_port,
+                                         MACH_PORT_RIGHT_SEND, - count),
+                     KERN_INVALID_RIGHT);
+          held -= count;
+          return;
+        }
+
+      refs = held;
+      transmitted_send_rights.erase(local_port);
+    }
+
+  /* Destroy outstanding DEAD NAME request.
+   *
+   * KERN_INVALID_ARGUMENT will be returned if local_port is
+   * already dead.
+   */
+
+  mach_port_t old = MACH_PORT_NULL;
+  mach_call (mach_port_request_notification (mach_task_self (), local_port,
+                                             MACH_NOTIFY_DEAD_NAME, 0,
+                                             MACH_PORT_NULL,
+                                             MACH_MSG_TYPE_MAKE_SEND_ONCE, &old),
+             KERN_INVALID_ARGUMENT);
+  if (old != MACH_PORT_NULL)
+    {
+      mach_call (mach_port_mod_refs (mach_task_self(), old,
+                                     MACH_PORT_RIGHT_SEND_ONCE, -1));
+    }
+
+  /* this assert doesn't work because notification_port is a
+   * RECEIVE right, but old will give us back a SEND ONCE right
+   */
+  // assert(old == notification_port);
+
+  /* Destroy the send right itself.
+   *
+   * KERN_INVALID_RIGHT will be returned if local_port is already
+   * dead, in which case we expect to have at least one dead name
+   * ref (from the send right), along with a second dead name ref
+   * due to the DEAD NAME notification.  If the name died since
+   * the last block of code, we'll only have one dead name ref.
+   */
+
+  mach_call (mach_port_mod_refs (mach_task_self(), local_port,
+                                 MACH_PORT_RIGHT_SEND, - refs),
+             KERN_INVALID_RIGHT);
+
+  /* XXX destroy the dead name refs if that last mach_call failed */
+
+  local_port_type.erase(local_port);
+
+  /* If that was our last right, the name can be reused */
+
+  mach_port_type_t type;
+
+  if (mach_port_type (mach_task_self (), local_port, &type) != KERN_SUCCESS)
+    {
+      forgetPortIdentity(local_port);
+    }
+
+  if (remote_ports_by_local.count(local_port) > 0)
+    {
+      /* This is the case where we got a receive right over the
+       * network, so we have a remote/local mapping.  If we
+       * transmitted a send right, then we have no mapping.
+       */
+      local_ports_by_remote.erase(remote_ports_by_local[local_port]);
+      remote_ports_by_local.erase(local_port);
+    }
+}
+
+/* Called on the network thread, in stream order, for each message
+ * before it goes on its run queue.  Count the send rights in it that
+ * are coming back to us in our own name space, so a NO SENDERS
+ * notification for one, read after this message but run first, waits
+ * for it (see NO SENDERS ACCOUNTING).
+ */
+
+void
+netmsg::noteReturningSendRights(machMessage & msg)
+{
+  std::unique_lock<std::recursive_mutex> lk(portMaps);
+
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (ptr.name() == MACH_MSG_TYPE_MOVE_SEND)
+        {
+          mach_port_t * ports = ptr.data();
+
+          for (unsigned int i = 0; i < ptr.nelems(); i ++)
+            {
+              if ((ports[i] != MACH_PORT_DEAD) && (ports[i] & 0x80000000))
+                {
+                  returning_send_rights[~ ports[i]] ++;
+                }
+            }
+        }
+    }
+}
+
 void
 netmsg::translateMessage(machMessage & msg, bool translatePortNames)
 {
+  std::map<unsigned int, portIdentity> identities = stripPortIdentities(msg);
+  unsigned int sendRights = 0;
+
   for (auto ptr = msg.data(); ptr; ++ ptr)
     {
       switch (ptr.name())
@@ -2126,6 +4525,15 @@ netmsg::translateMessage(machMessage & msg, bool translatePortNames)
             for (unsigned int i = 0; i < ptr.nelems(); i ++)
               {
                 ports[i] = translatePort(ports[i], ptr.name());
+
+                if (ptr.name() == MACH_MSG_TYPE_MOVE_SEND)
+                  {
+                    if (identities.count(sendRights) > 0)
+                      {
+                        ports[i] = resolvePortIdentity(ports[i], identities.at(sendRights));
+                      }
+                    sendRights ++;
+                  }
               }
 
           }
@@ -2139,6 +4547,234 @@ netmsg::translateMessage(machMessage & msg, bool translatePortNames)
     }
 }
 
+/* We've translated a send right that came with an identity (see PORT
+ * IDENTITIES) into 'port', a send right to our proxy.  If the
+ * identity names a port on our own node, relay a right to that port
+ * instead, and drop the one to the proxy.  With --mesh, do the same
+ * with a proxy on our direct connection to the port's node.
+ * Otherwise, remember the identity for the proxy.
+ */
+
+mach_port_t
+netmsg::resolvePortIdentity(mach_port_t port, portIdentity id)
+{
+  {
+    std::unique_lock<std::recursive_mutex> lk(portMaps);
+
+    if ((port == MACH_PORT_NULL) || (port == MACH_PORT_DEAD)
+        || (local_port_type.count(port) == 0) || (local_port_type.at(port) != MACH_MSG_TYPE_PORT_RECEIVE))
+      {
+        return port;
+      }
+  }
+
+  if (id.node != nodeId)
+    {
+      netmsg * direct = (meshMode && (id.node != peerNode)) ? meshConnect(id.node) : nullptr;
+
+      if (direct == nullptr)
+        {
+          std::unique_lock<std::mutex> lk(portIdentities);
+          portIdentities.emplace(port, id);
+          return port;
+        }
+
+      /* Use a proxy on our direct connection to the port's node (see MESH) */
+
+      mach_port_t newport = direct->importPort(id.name);
+
+      {
+        std::unique_lock<std::mutex> lk(portIdentities);
+        portIdentities.emplace(newport, id);
+      }
+
+      ddprintf("port %ld goes direct to node %d as %ld\n", port, id.node, newport);
+
+      mach_call (mach_port_mod_refs (mach_task_self(), port,
+                                     MACH_PORT_RIGHT_SEND, -1));
+
+      return newport;
+    }
+
+  /* Only a name we gave out ourselves, and whose port is still around */
+
+  mach_port_type_t type;
+
+  if (! isExportedPort(id.name)
+      || (mach_port_type (mach_task_self (), id.name, &type) != KERN_SUCCESS))
+    {
+      return port;
+    }
+
+  if (type & MACH_PORT_TYPE_RECEIVE)
+    {
+      mach_call (mach_port_insert_right (mach_task_self (), id.name, id.name,
+                                         MACH_MSG_TYPE_MAKE_SEND));
+    }
+  else if (type & MACH_PORT_TYPE_SEND)
+    {
+      mach_call (mach_port_insert_right (mach_task_self (), id.name, id.name,
+                                         MACH_MSG_TYPE_COPY_SEND));
+    }
+  else
+    {
+      /* it died while the right was on its way back to us */
+      return port;
+    }
+
+  ddprintf("port %ld came home as %ld\n", port, id.name);
+
+  /* If that was the proxy's last send right, its no senders
+   * notification will release the peer's send right.
+   */
+
+  mach_call (mach_port_mod_refs (mach_task_self(), port,
+                                 MACH_PORT_RIGHT_SEND, -1));
+
+  return id.name;
+}
+
+/* Give our peer (a mesh connection) a send right to one of its own
+ * ports, by name, that we got from some other node.  We get a proxy
+ * just like the one we'd have made if the peer had sent us the right
+ * itself, and MESH_IMPORT asks the peer to hold a send right for it,
+ * like it would have when it sent it.  That's one per send right we
+ * make on the proxy, so the proxy's NO SENDERS count matches (see NO
+ * SENDERS ACCOUNTING).
+ */
+
+mach_port_t
+netmsg::importPort(mach_port_t port)
+{
+  mach_port_t newport = translatePort(port, MACH_MSG_TYPE_MOVE_SEND);
+
+  sendPeerMessage(MSGID_MESH_IMPORT, port, 0, 0, 0);
+
+  return newport;
+}
+
+/* Handle a mesh message from our peer (see MESH) */
+
+void
+netmsg::meshBufferHandler(machMessage & msg)
+{
+  natural_t * args = reinterpret_cast<peerMessage *>(msg.buffer)->args;
+
+  switch (msg->msgh_id)
+    {
+    case MSGID_MESH_HELLO:
+      {
+        peerNode = args[0];
+
+        {
+          std::unique_lock<std::mutex> lk(meshPeers);
+          meshPeers.emplace(peerNode, this);
+        }
+
+        /* As in learnRoute, don't write to the network under the lock */
+
+        std::map<natural_t, meshRoute> routes;
+
+        {
+          std::unique_lock<std::mutex> lk(meshRoutes);
+          routes = meshRoutes;
+        }
+
+        for (auto & route : routes)
+          {
+            sendPeerMessage(MSGID_MESH_ROUTE, route.first, route.second.addr, route.second.port, 0);
+          }
+
+        /* The peer only knows its port number; we know where it's calling from */
+
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+
+        if ((args[1] != 0)
+            && (getpeername(filebuf_in.fd(), reinterpret_cast<struct sockaddr *> (&addr), &addrLen) == 0))
+          {
+            learnRoute(peerNode, {addr.sin_addr.s_addr, args[1]});
+          }
+      }
+      break;
+
+    case MSGID_MESH_ROUTE:
+      if (args[0] != nodeId)
+        {
+          learnRoute(args[0], {args[1], args[2]});
+        }
+      break;
+
+    case MSGID_MESH_IMPORT:
+      {
+        mach_port_t port = args[0];
+        mach_port_type_t type;
+
+        /* Only ports we've identified as ours can be asked for by
+         * name (see PORT IDENTITIES).
+         */
+
+        if (! isExportedPort(port))
+          {
+            ddprintf("refusing MESH_IMPORT of port %ld\n", port);
+            break;
+          }
+
+        std::unique_lock<std::recursive_mutex> lk(portMaps);
+
+        /* Our peer made a send right on its proxy, just as if we'd
+         * transmitted one, so we hold one more for it (see NO SENDERS
+         * ACCOUNTING).
+         */
+
+        if (local_port_type.count(port) > 0)
+          {
+            if (local_port_type.at(port) == MACH_MSG_TYPE_PORT_SEND)
+              {
+                mach_call (mach_port_insert_right (mach_task_self (), port, port,
+                                                   MACH_MSG_TYPE_COPY_SEND));
+                transmitted_send_rights[port] ++;
+              }
+            break;
+          }
+
+        // XXX if the port's gone, our peer's proxy never hears about it
+
+        if (mach_port_type (mach_task_self (), port, &type) != KERN_SUCCESS)
+          {
+            break;
+          }
+
+        if (type & MACH_PORT_TYPE_RECEIVE)
+          {
+            mach_call (mach_port_insert_right (mach_task_self (), port, port,
+                                               MACH_MSG_TYPE_MAKE_SEND));
+          }
+        else if (type & MACH_PORT_TYPE_SEND)
+          {
+            mach_call (mach_port_insert_right (mach_task_self (), port, port,
+                                               MACH_MSG_TYPE_COPY_SEND));
+          }
+        else
+          {
+            break;
+          }
+
+        /* From here on, it's just like a send right we transmitted */
+
+        local_port_type[port] = MACH_MSG_TYPE_PORT_SEND;
+        transmitted_send_rights[port] ++;
+
+        mach_port_t old;
+        mach_call (mach_port_request_notification (mach_task_self (), port,
+                                                   MACH_NOTIFY_DEAD_NAME, 0,
+                                                   notification_port,
+                                                   MACH_MSG_TYPE_MAKE_SEND_ONCE, &old));
+      }
+      break;
+    }
+}
+
 void
 netmsg::tcpBufferHandler(machMessage & msg)
 {
@@ -2153,7 +4789,36 @@ netmsg::tcpBufferHandler(machMessage & msg)
 
   // dprintMessage("!!>", msg);
 
-  // XXX these translation functions now need some kind of locking
+  importOOLdata(msg);
+
+  /* If we couldn't get memory for some of its OOL data (mach_call has
+   * already said why), we can't deliver the message.  Drop it, like
+   * a message to a dead port, before its rights are translated.
+   */
+
+  bool missing = false;
+
+  for (auto ptr = msg.data(); ptr; ++ ptr)
+    {
+      if (! ptr.is_inline() && (ptr.data_size() > 0) && ! * ptr.OOLptr())
+        {
+          missing = true;
+        }
+    }
+
+  if (missing)
+    {
+      fprintf(stderr, "dropping network message (msgid %d): no memory for its OOL data\n", msg->msgh_id);
+
+      for (auto ptr = msg.data(); ptr; ++ ptr)
+        {
+          if (! ptr.is_inline() && (ptr.data_size() > 0) && * ptr.OOLptr())
+            {
+              mach_call (vm_deallocate(mach_task_self(), ptr.data(), ptr.data_size()));
+            }
+        }
+      return;
+    }
 
   /* If the message is a DEAD NAME notification targeted at our
    * control port, we translate the port name in the message, because
@@ -2196,12 +4861,114 @@ netmsg::tcpBufferHandler(machMessage & msg)
        * actually died
        */
 
-      mach_call (mach_msg(msg, MACH_SEND_MSG, msg->msgh_size,
-                          0, msg->msgh_remote_port,
-                          MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL),
-                 MACH_SEND_INVALID_DEST);
+      mach_msg_type_name_t reply_type = MACH_MSGH_BITS_LOCAL(msg->msgh_bits);
+
+      if (pipelining && (msg->msgh_local_port != MACH_PORT_NULL)
+          && ((reply_type == MACH_MSG_TYPE_MOVE_SEND_ONCE) || (reply_type == MACH_MSG_TYPE_MAKE_SEND_ONCE)))
+        {
+          /* An RPC request (see PIPELINING).  If the send times out,
+           * the message is unchanged, except on the Hurd, where the
+           * kernel has copied its rights and OOL data back out to us
+           * as if we'd received it, and it's ready to send again.
+           */
+
+          mach_msg_return_t mr = mach_msg(msg, MACH_SEND_MSG | MACH_SEND_TIMEOUT, msg->msgh_size,
+                                          0, msg->msgh_remote_port,
+                                          0, MACH_PORT_NULL);
+
+          if (mr == MACH_SEND_TIMED_OUT)
+            {
+              deferSend(msg);
+              return;
+            }
+
+          mach_call (mr, MACH_SEND_INVALID_DEST);
+        }
+      else
+        {
+          if (pipelining)
+            {
+              waitForDeferredSends(msg->msgh_remote_port);
+            }
+
+          mach_call (mach_msg(msg, MACH_SEND_MSG, msg->msgh_size,
+                              0, msg->msgh_remote_port,
+                              MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL),
+                     MACH_SEND_INVALID_DEST);
+        }
+
+      /* The header has been swapped, so the destination is now msgh_remote_port */
+
+      trace(TRACE_IPC_DELIVER, msg, msg->msgh_remote_port, msg->msgh_local_port);
+
+      ddprintf("sent IPC message to port %ld\n", msg->msgh_remote_port);
+    }
+}
+
+/* Finish sending an RPC request whose destination was full, on the
+ * port's deferred queue, so its run queue can move on (see
+ * PIPELINING).  The run queue frees its message when we return, so we
+ * queue a copy, which keeps the message's trace token (see
+ * traceBuffer).  If the port already has maxDeferredSends waiting,
+ * wait for one of them to go.
+ */
+
+void
+netmsg::deferSend(machMessage & msg)
+{
+  machMessage * copy = new machMessage;
+  mach_port_t dest = msg->msgh_remote_port;
+
+  memcpy(copy->buffer, static_cast<mach_msg_header_t *>(msg), msg->msgh_size);
+
+  {
+    std::unique_lock<std::mutex> lk(deferred_sends);
+
+    while ((deferred_sends.count(dest) > 0) && (deferred_sends.at(dest) >= maxDeferredSends))
+      {
+        deferred_sends_done.wait(lk);
+      }
+
+    deferred_sends[dest] ++;
+  }
+
+  ddprintf("deferring IPC message (msgid %d) to port %ld\n", msg->msgh_id, dest);
+
+  deferred_run_queue.push_back(dest, copy);
+}
+
+void
+netmsg::deferredSendHandler(machMessage & msg)
+{
+  mach_port_t dest = msg->msgh_remote_port;
+
+  mach_call (mach_msg(msg, MACH_SEND_MSG, msg->msgh_size,
+                      0, dest,
+                      MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL),
+             MACH_SEND_INVALID_DEST);
+
+  trace(TRACE_IPC_DELIVER, msg, dest, msg->msgh_local_port);
+
+  ddprintf("sent deferred IPC message to port %ld\n", dest);
+
+  std::unique_lock<std::mutex> lk(deferred_sends);
+
+  if (-- deferred_sends[dest] == 0)
+    {
+      deferred_sends.erase(dest);
+    }
+
+  deferred_sends_done.notify_all();
+}
+
+void
+netmsg::waitForDeferredSends(mach_port_t port)
+{
+  std::unique_lock<std::mutex> lk(deferred_sends);
 
-      ddprintf("sent IPC message to port %ld\n", msg->msgh_remote_port);
+  while (deferred_sends.count(port) > 0)
+    {
+      deferred_sends_done.wait(lk);
     }
 }
 
@@ -2245,6 +5012,10 @@ netmsg::tcpHandler(void)
             }
           // XXX will this do a close() or a shutdown(SHUT_RD)?  We want shutdown(SHUT_RD).
           filebuf_in.close();
+
+          /* Nothing else will arrive to use our OOL buffers */
+
+          ool_buffers.stop();
           //close(inSocket);
           //delete ipcThread;
           //std::terminate();
@@ -2256,23 +5027,77 @@ netmsg::tcpHandler(void)
 
           /* XXX signal ipcHandler that the network socket died */
 
-          if (serverMode)
+          if (peerNode != 0)
+            {
+              std::unique_lock<std::mutex> lk(meshPeers);
+
+              if ((meshPeers.count(peerNode) > 0) && (meshPeers.at(peerNode) == this))
+                {
+                  meshPeers.erase(peerNode);
+                }
+            }
+
+          if (serverMode || meshConnection)
             {
               ddprintf("TCP server thread exiting\n");
               return;
             }
           else
             {
-              exit(0);
+              /* Our only connection is gone, and with it every port
+               * we were relaying, so the translator can't carry on.
+               */
+              error (1, is.eof() ? 0 : errno, "lost the connection to the netmsg server");
             }
         }
 
-      ddprintf("received network message (%s) for port %ld%s\n",
-               msgid_name(msg->msgh_id), msg->msgh_local_port,
-               msg->msgh_bits & MACH_MSGH_BITS_REMOTE_TRANSLATE ? "" : " (local)");
+      if (debugging(2))
+        {
+          ddprintf("received network message (%s) for port %ld%s\n",
+                   msgid_name(msg->msgh_id), msg->msgh_local_port,
+                   msg->msgh_bits & MACH_MSGH_BITS_REMOTE_TRANSLATE ? "" : " (local)");
+        }
 
       receiveOOLdata(msg);
 
+      /* Lazy OOL transfer messages are between us and our peer; they
+       * aren't traced or captured, and they have their own run queues.
+       */
+
+      if ((msg->msgh_local_port == MACH_PORT_CONTROL)
+          && ((msg->msgh_id == MSGID_LAZY_OOL_REQUEST) || (msg->msgh_id == MSGID_LAZY_OOL_DATA)
+              || (msg->msgh_id == MSGID_LAZY_OOL_RELEASE)))
+        {
+          if (multi_threaded)
+            {
+              lazy_run_queue.push_back(reinterpret_cast<peerMessage *>(msg.buffer)->args[0], &msg);
+            }
+          else
+            {
+              lazyBufferHandler(msg);
+              delete &msg;
+            }
+          continue;
+        }
+
+      /* So are mesh messages, and we handle them right here, so a
+       * MESH_IMPORT is done before we look at anything sent after it.
+       */
+
+      if ((msg->msgh_local_port == MACH_PORT_CONTROL)
+          && ((msg->msgh_id == MSGID_MESH_HELLO) || (msg->msgh_id == MSGID_MESH_ROUTE)
+              || (msg->msgh_id == MSGID_MESH_IMPORT)))
+        {
+          meshBufferHandler(msg);
+          delete &msg;
+          continue;
+        }
+
+      trace(TRACE_NET_RECEIVE, msg, msg->msgh_local_port, msg->msgh_remote_port);
+      captureMessage(CAPTURE_NET_RECEIVE, session, msg);
+
+      noteReturningSendRights(msg);
+
       /* Put ourselves on the run queue and, if we're the only message there, this will start delivery. */
 
       if (multi_threaded)
@@ -2283,7 +5108,6 @@ netmsg::tcpHandler(void)
         {
           tcpBufferHandler(msg);
           delete &msg;
-          auditPorts();
         }
 
     }
@@ -2298,15 +5122,75 @@ run_fsysServer_on_port(mach_port_t control)
     }
 }
 
-netmsg::netmsg(int networkSocket) :
+/* --locator (see PORT LOCATION).  We attach ourselves to locatorPath
+ * as a translator; fsys_getroot on its control port hands out send
+ * rights to 'locator', which answers netmsg-locate.defs.
+ */
+
+mach_port_t locatorControl = MACH_PORT_NULL;
+mach_port_t locator = MACH_PORT_NULL;
+
+void
+startLocator(void)
+{
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &locatorControl));
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &locator));
+
+  file_t node = file_name_lookup (locatorPath, O_CREAT | O_NOTRANS, 0666);
+
+  if (node == MACH_PORT_NULL)
+    error (1, errno, "%s", locatorPath);
+
+  error_t err = file_set_translator (node, 0, FS_TRANS_SET, 0, NULL, 0,
+                                     locatorControl, MACH_MSG_TYPE_MAKE_SEND);
+
+  if (err)
+    error (1, err, "Attaching to %s", locatorPath);
+
+  mach_call (mach_port_deallocate (mach_task_self (), node));
+
+  new std::thread(run_fsysServer_on_port, locatorControl);
+  new std::thread([] {
+      while (1)
+        {
+          mach_call (mach_msg_server (netmsg_locate_server, 0, locator));
+        }
+    });
+}
+
+netmsg::netmsg(int networkSocket, bool meshConnection) :
+  meshConnection(meshConnection),
   filebuf_in(networkSocket, std::ios::in | std::ios::binary),
   filebuf_out(networkSocket, std::ios::out | std::ios::binary),
   is(&filebuf_in),
   os(&filebuf_out)
 {
-  active_netmsg_classes.insert(this);
+  {
+    std::unique_lock<std::mutex> lk(active_netmsg_classes);
+    active_netmsg_classes.insert(this);
+  }
 
-  if (serverMode)
+  /* We flush every message as soon as it's written, so Nagle's
+   * algorithm can only delay us.
+   */
+
+  int one = 1;
+  setsockopt(networkSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  /* Our ports have to exist before anything can translate a port
+   * for us, which a mesh connection might be asked to do right away.
+   */
+
+  mach_call (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &portset));
+
+  mach_call (mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_RECEIVE, &notification_port));
+
+  ddprintf("notification_port = %ld\n", notification_port);
+
+  /* move the receive right into the portset so we'll be listening on it */
+  mach_call (mach_port_move_member (mach_task_self (), notification_port, portset));
+
+  if (serverMode && ! meshConnection)
     {
       /* Spawn an fsys server on a newly created first_port.
        *
@@ -2334,6 +5218,11 @@ netmsg::netmsg(int networkSocket) :
 
   tcpThread = new std::thread(&netmsg::tcpHandler, this);
   ipcThread = new std::thread(&netmsg::ipcHandler, this);
+
+  if (meshMode)
+    {
+      sendPeerMessage(MSGID_MESH_HELLO, nodeId, serverMode ? atoi(targetPort) : 0, 0, 0);
+    }
 }
 
 /* netmsg class destructor - collect our threads */
@@ -2342,10 +5231,11 @@ netmsg::~netmsg()
 {
   tcpThread->join();
   ipcThread->join();
-  if (serverMode)
+  if (serverMode && ! meshConnection)
     {
       fsysThread->join();
     }
+  std::unique_lock<std::mutex> lk(active_netmsg_classes);
   active_netmsg_classes.erase(this);
 }
 
@@ -2540,6 +5430,41 @@ main (int argc, char **argv)
   /* Parse our options...  */
   argp_parse (&argp, argc, argv, 0, 0, 0);
 
+  /* A peer that goes away shows up as EOF on its socket; don't let a
+   * write that races with it kill us first.
+   */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (traceFile)
+    {
+      startTracing();
+    }
+
+  if (auditing)
+    {
+      startAuditing();
+    }
+
+  if (captureFile)
+    {
+      capture = new captureWriter(captureFile);
+    }
+
+  if (copyinThreads > 0)
+    {
+      copyin = new copyinPool(copyinThreads);
+    }
+
+  if (locatorPath)
+    {
+      startLocator();
+    }
+
+  if (meshMode && (nodeId == 0))
+    {
+      error (1, 0, "--mesh requires --node-id");
+    }
+
   if (serverMode)
     {
       tcpServer();
@@ -2577,6 +5502,20 @@ S_fsys_getroot (mach_port_t fsys_t,
 		mach_port_t *ret,
 		mach_msg_type_name_t *rettype)
 {
+  if (fsys_t == locatorControl)
+    {
+      *ret = locator;
+      *rettype = MACH_MSG_TYPE_MAKE_SEND;
+
+      mach_call (mach_port_mod_refs (mach_task_self(), dotdotnode,
+                                     MACH_PORT_RIGHT_SEND, -1));
+
+      *do_retry = FS_RETRY_NORMAL;
+      retry_name[0] = '\0';
+
+      return ESUCCESS;
+    }
+
   file_t node = file_name_lookup (exportedPath, flags, 0);
 
   if (node == MACH_PORT_NULL)
@@ -2675,3 +5614,316 @@ S_fsys_forward (mach_port_t server, mach_port_t requestor,
 }
 
 }
+
+/*********** memory object server  ***********
+
+ These routines implement the memory objects that back OOL regions
+ our peers sent us by reference (see LAZY OOL TRANSFER, above, and
+ struct lazyObject).  They're called by a MIG-generated server, so
+ they need "C" linkage too.
+
+ Every request carries another send right on the memory object's
+ control port.  We keep the one from memory_object_init, and drop the
+ others.
+
+ */
+
+extern "C" {
+
+kern_return_t
+S_memory_object_init (memory_object_t object,
+                      memory_object_control_t control,
+                      memory_object_name_t name,
+                      vm_size_t page_size)
+{
+  std::unique_lock<std::mutex> lk(lazyObjects);
+  auto it = lazyObjects.find(object);
+
+  if ((it == lazyObjects.end()) || (it->second.control != MACH_PORT_NULL))
+    {
+      return EOPNOTSUPP;
+    }
+
+  it->second.control = control;
+
+  if (MACH_PORT_VALID(name))
+    {
+      mach_call (mach_port_deallocate (mach_task_self (), name));
+    }
+
+  /* Don't let the kernel cache the object, so it gets terminated (and
+   * our peer can free the region) as soon as the last mapping is gone.
+   */
+
+  mach_call (memory_object_ready (control, FALSE, MEMORY_OBJECT_COPY_DELAY));
+
+  return ESUCCESS;
+}
+
+/* Supply any pages that were paged out to us, and ask our peer for
+ * each run of pages that weren't.
+ */
+
+kern_return_t
+S_memory_object_data_request (memory_object_t object,
+                              memory_object_control_t control,
+                              vm_offset_t offset,
+                              vm_size_t length,
+                              vm_prot_t desired_access)
+{
+  netmsg * session;
+  natural_t id;
+  std::vector<std::pair<vm_offset_t, vm_address_t>> returned;
+
+  {
+    std::unique_lock<std::mutex> lk(lazyObjects);
+    auto it = lazyObjects.find(object);
+
+    if (it == lazyObjects.end())
+      {
+        return EOPNOTSUPP;
+      }
+
+    session = it->second.session;
+    id = it->second.id;
+
+    for (vm_offset_t page = offset; page < offset + length; page += vm_page_size)
+      {
+        auto page_it = it->second.pages.find(page);
+
+        if (page_it != it->second.pages.end())
+          {
+            returned.push_back(*page_it);
+            it->second.pages.erase(page_it);
+          }
+      }
+  }
+
+  vm_offset_t start = offset;
+
+  for (auto & page: returned)
+    {
+      if (page.first > start)
+        {
+          session->sendPeerMessage(MSGID_LAZY_OOL_REQUEST, id, start, page.first - start, object);
+        }
+      mach_call (memory_object_data_supply (control, page.first, page.second, vm_page_size,
+                                            TRUE, VM_PROT_NONE, FALSE, MACH_PORT_NULL));
+      start = page.first + vm_page_size;
+    }
+
+  if (offset + length > start)
+    {
+      session->sendPeerMessage(MSGID_LAZY_OOL_REQUEST, id, start, offset + length - start, object);
+    }
+
+  mach_call (mach_port_deallocate (mach_task_self (), control));
+
+  return ESUCCESS;
+}
+
+/* The recipient may have written to its pages, so anything paged out
+ * has to be kept until the kernel asks for it again.
+ */
+
+kern_return_t
+S_memory_object_data_return (memory_object_t object,
+                             memory_object_control_t control,
+                             vm_offset_t offset,
+                             pointer_t data,
+                             mach_msg_type_number_t length,
+                             boolean_t dirty,
+                             boolean_t kernel_copy)
+{
+  {
+    std::unique_lock<std::mutex> lk(lazyObjects);
+    auto it = lazyObjects.find(object);
+
+    if (it == lazyObjects.end())
+      {
+        mach_call (vm_deallocate (mach_task_self (), data, length));
+      }
+    else
+      {
+        for (vm_offset_t page = 0; page < length; page += vm_page_size)
+          {
+            auto & saved = it->second.pages[offset + page];
+
+            if (saved)
+              {
+                mach_call (vm_deallocate (mach_task_self (), saved, vm_page_size));
+              }
+            saved = data + page;
+          }
+      }
+  }
+
+  mach_call (mach_port_deallocate (mach_task_self (), control));
+
+  return ESUCCESS;
+}
+
+/* The last mapping is gone.  We get the receive rights for the
+ * control and name ports, which we destroy along with our memory
+ * object, and our peer can deallocate the region.
+ */
+
+kern_return_t
+S_memory_object_terminate (memory_object_t object,
+                           memory_object_control_t control,
+                           memory_object_name_t name)
+{
+  lazyObject lazy;
+
+  {
+    std::unique_lock<std::mutex> lk(lazyObjects);
+    auto it = lazyObjects.find(object);
+
+    if (it == lazyObjects.end())
+      {
+        return EOPNOTSUPP;
+      }
+
+    lazy = it->second;
+    lazyObjects.erase(it);
+  }
+
+  for (auto & page: lazy.pages)
+    {
+      mach_call (vm_deallocate (mach_task_self (), page.second, vm_page_size));
+    }
+
+  mach_call (mach_port_destroy (mach_task_self (), control));
+  if (MACH_PORT_VALID(name))
+    {
+      mach_call (mach_port_destroy (mach_task_self (), name));
+    }
+  mach_call (mach_port_mod_refs (mach_task_self (), object, MACH_PORT_RIGHT_RECEIVE, -1));
+
+  lazy.session->sendPeerMessage(MSGID_LAZY_OOL_RELEASE, lazy.id, 0, 0, 0);
+
+  return ESUCCESS;
+}
+
+/* We never lock pages or ask for anything to be cleaned, and
+ * MEMORY_OBJECT_COPY_DELAY means we never get memory_object_copy, so
+ * none of these should ever be called.
+ */
+
+kern_return_t
+S_memory_object_copy (memory_object_t object,
+                      memory_object_control_t control,
+                      vm_offset_t offset,
+                      vm_size_t length,
+                      memory_object_t new_object)
+{
+  return EOPNOTSUPP;
+}
+
+kern_return_t
+S_memory_object_data_unlock (memory_object_t object,
+                             memory_object_control_t control,
+                             vm_offset_t offset,
+                             vm_size_t length,
+                             vm_prot_t desired_access)
+{
+  return EOPNOTSUPP;
+}
+
+kern_return_t
+S_memory_object_lock_completed (memory_object_t object,
+                                memory_object_control_t control,
+                                vm_offset_t offset,
+                                vm_size_t length)
+{
+  return EOPNOTSUPP;
+}
+
+kern_return_t
+S_memory_object_supply_completed (memory_object_t object,
+                                  memory_object_control_t control,
+                                  vm_offset_t offset,
+                                  vm_size_t length,
+                                  kern_return_t result,
+                                  vm_offset_t error_offset)
+{
+  return EOPNOTSUPP;
+}
+
+kern_return_t
+S_memory_object_change_completed (memory_object_t object,
+                                  boolean_t may_cache,
+                                  memory_object_copy_strategy_t copy_strategy)
+{
+  return EOPNOTSUPP;
+}
+
+}
+
+/*********** port location server  ***********
+
+ These routines answer netmsg-locate.defs on the port that --locator
+ hands out (see PORT LOCATION, above, and locatePort()).
+
+ */
+
+extern "C" {
+
+kern_return_t
+S_netmsg_locate (mach_port_t server,
+                 portarray_t ports, mach_msg_type_number_t portsCnt,
+                 intarray_t *nodes, mach_msg_type_number_t *nodesCnt)
+{
+  if (server != locator)
+    {
+      return EOPNOTSUPP;
+    }
+
+  if (*nodesCnt < portsCnt)
+    {
+      kern_return_t err = mach_call (vm_allocate (mach_task_self(), (vm_address_t *) nodes,
+                                                  portsCnt * sizeof(int), TRUE));
+      if (err)
+        {
+          return err;
+        }
+    }
+
+  for (unsigned int i = 0; i < portsCnt; i ++)
+    {
+      (*nodes)[i] = locatePort(ports[i]);
+
+      mach_call (mach_port_mod_refs (mach_task_self(), ports[i],
+                                     MACH_PORT_RIGHT_SEND, -1),
+                 KERN_INVALID_RIGHT);
+    }
+
+  /* An unbounded array always arrives out-of-line, and it's ours */
+
+  mach_call (vm_deallocate (mach_task_self(), reinterpret_cast<vm_address_t>(ports),
+                            portsCnt * sizeof(mach_port_t)));
+
+  *nodesCnt = portsCnt;
+
+  return ESUCCESS;
+}
+
+kern_return_t
+S_netmsg_request_location_notification (mach_port_t server,
+                                        mach_port_t port,
+                                        mach_port_t notify)
+{
+  if (server != locator)
+    {
+      return EOPNOTSUPP;
+    }
+
+  /* We keep the send right on 'port' until the notification goes out */
+
+  std::unique_lock<std::mutex> lk(locationRequests);
+  locationRequests.emplace(port, notify);
+
+  return ESUCCESS;
+}
+
+}
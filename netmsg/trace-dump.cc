@@ -0,0 +1,157 @@
+/* -*- mode: C++; indent-tabs-mode: nil -*-
+
+   trace-dump - print a netmsg trace file
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   Basic usage:
+
+   netmsg --trace=/tmp/netmsg.trace -s
+   kill -USR1 `pidof netmsg`
+   trace-dump /tmp/netmsg.trace
+
+   Prints one line per record, followed by the time each message spent
+   inside netmsg on each side of the network connection, which is the
+   IPC receive to network send interval for outbound messages, and the
+   network receive to IPC delivery interval for inbound messages.
+
+   Replies are matched to their requests (see trace.h), and their lines
+   also show the RPC's round trip time across the network, for a
+   request that went out, or how long the server took to answer it,
+   for a request that came in.
+
+   This program doesn't need any Hurd headers, so trace files can be
+   examined on any machine with the same byte order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <inttypes.h>
+
+#include <vector>
+#include <map>
+#include <string>
+
+#include "trace.h"
+
+const char * event_name[] = { "?", "ipc-recv", "net-send", "net-recv", "ipc-deliver" };
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "Usage: %s TRACEFILE\n", argv[0]);
+      exit(1);
+    }
+
+  FILE * fp = fopen(argv[1], "r");
+  if (fp == NULL)
+    {
+      error (1, errno, "%s", argv[1]);
+    }
+
+  struct trace_file_header header;
+
+  if ((fread(&header, sizeof(header), 1, fp) != 1)
+      || (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+      || (header.record_size != sizeof(struct trace_record)))
+    {
+      error (1, 0, "%s: not a netmsg trace file", argv[1]);
+    }
+
+  std::vector<struct trace_record> records(header.nrecords);
+
+  if (fread(records.data(), sizeof(struct trace_record), header.nrecords, fp) != header.nrecords)
+    {
+      error (1, 0, "%s: truncated", argv[1]);
+    }
+
+  std::map<int32_t, std::string> names;
+
+  for (uint32_t i = 0; i < header.nnames; i ++)
+    {
+      struct trace_name tn;
+      if (fread(&tn, sizeof(tn), 1, fp) != 1)
+        {
+          error (1, 0, "%s: truncated", argv[1]);
+        }
+      std::string name(tn.length, '\0');
+      if (fread(&name[0], 1, tn.length, fp) != tn.length)
+        {
+          error (1, 0, "%s: truncated", argv[1]);
+        }
+      names[tn.msgid] = name;
+    }
+
+  fclose(fp);
+
+  if (header.dropped > 0)
+    {
+      printf("# %u earlier records were overwritten\n", header.dropped);
+    }
+
+  /* Records are written oldest first, so each message's first event
+   * comes before its second.
+   */
+
+  std::map<uint64_t, const struct trace_record *> pending;
+
+  /* Requests waiting for their replies, by wire form reply port: the
+   * ones we sent out, and the ones that came in.
+   */
+
+  std::map<uint32_t, const struct trace_record *> sent_requests;
+  std::map<uint32_t, const struct trace_record *> received_requests;
+
+  for (auto & r: records)
+    {
+      printf("%" PRIu64 ".%09" PRIu64 " %-11s %-30s dest %u reply %u size %u",
+             r.timestamp / 1000000000, r.timestamp % 1000000000,
+             event_name[r.event <= TRACE_IPC_DELIVER ? r.event : 0],
+             names.count(r.msgid) ? names[r.msgid].c_str() : std::to_string(r.msgid).c_str(),
+             r.dest, r.reply, r.size);
+
+      if ((r.event == TRACE_IPC_RECEIVE) || (r.event == TRACE_NET_RECEIVE))
+        {
+          pending[r.message] = &r;
+        }
+      else if (pending.count(r.message) && (pending[r.message]->event == r.event - 1))
+        {
+          printf(" (%" PRIu64 " us)", (r.timestamp - pending[r.message]->timestamp) / 1000);
+          pending.erase(r.message);
+        }
+
+      if (r.event == TRACE_NET_RECEIVE)
+        {
+          if (sent_requests.count(r.dest))
+            {
+              printf(" [round trip %" PRIu64 " us]", (r.timestamp - sent_requests[r.dest]->timestamp) / 1000);
+              sent_requests.erase(r.dest);
+            }
+          if (r.reply)
+            {
+              received_requests[r.reply] = &r;
+            }
+        }
+      else if (r.event == TRACE_NET_SEND)
+        {
+          if (received_requests.count(r.dest))
+            {
+              printf(" [served in %" PRIu64 " us]", (r.timestamp - received_requests[r.dest]->timestamp) / 1000);
+              received_requests.erase(r.dest);
+            }
+          if (r.reply)
+            {
+              sent_requests[r.reply] = &r;
+            }
+        }
+
+      printf("\n");
+    }
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C; indent-tabs-mode: nil -*-
+
+   netmsg trace file format
+
+   Copyright (C) 2017 Brent Baccala <cosine@freesoft.org>
+
+   GNU General Public License version 2 or later (your option)
+
+   When run with --trace=FILE, netmsg timestamps every message at four
+   points along its path and records them in a ring buffer, which is
+   written to FILE on SIGUSR1 and at exit.
+
+   The file is a trace_file_header, followed by 'nrecords'
+   trace_record's (oldest first), followed by 'nnames' name entries,
+   each a trace_name followed by 'length' bytes of message name (not
+   NUL terminated).  Everything is in the host's byte order.
+
+   Within one netmsg process, all of the records for a single message
+   carry the same 'message' token, a counter assigned at its first
+   event.  A request and its reply can be matched because the reply is
+   addressed to the request's reply port, and we record both ports in
+   their network (wire) form at the two network events.  So in one
+   trace, a request written to the network with reply port R is
+   answered by the next message read from the network for R, and a
+   request read from the network with reply port R by the next one
+   written for R.
+*/
+
+#ifndef NETMSG_TRACE_H
+#define NETMSG_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "NMTRACE2"
+
+/* The four timestamped events, in the order a message passes them */
+
+#define TRACE_IPC_RECEIVE   1   /* mach_msg receive in ipcHandler */
+#define TRACE_NET_SEND      2   /* written to the TCP stream in ipcBufferHandler */
+#define TRACE_NET_RECEIVE   3   /* read from the TCP stream (with OOL data) in tcpHandler */
+#define TRACE_IPC_DELIVER   4   /* mach_msg send returned in tcpBufferHandler */
+
+struct trace_file_header
+{
+  char magic[8];
+  uint32_t record_size;
+  uint32_t nrecords;
+  uint32_t nnames;
+  uint32_t dropped;             /* records overwritten before the dump */
+};
+
+struct trace_record
+{
+  uint64_t timestamp;           /* CLOCK_REALTIME, nanoseconds */
+  uint64_t message;             /* per-process token identifying one message */
+  int32_t msgid;
+  uint32_t dest;                /* destination port */
+  uint32_t reply;               /* reply port */
+  uint32_t event;               /* TRACE_* */
+  uint32_t size;                /* msgh_size, not including OOL data */
+  uint32_t reserved;
+};
+
+struct trace_name
+{
+  int32_t msgid;
+  uint32_t length;
+};
+
+#endif